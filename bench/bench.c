@@ -0,0 +1,606 @@
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/focal.h"
+#include "src/wav_pipeline.h"
+#include "src/wav_sampling.h"
+
+// Micro and macro benchmarks, run with 'make bench'
+//
+// Every benchmark runs its loop for a growing amount of iterations until one
+// run takes at least --min-time seconds, like Google Benchmark does. Results
+// are written as JSON with the time per iteration and the samples, bytes and
+// allocations per second of that last run.
+//
+// Allocations are counted by linking with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,
+// only the allocations of this program are seen, not those inside libc.
+
+#define BENCH_MIN_TIME 0.5        // In seconds
+#define BENCH_MAX_ITERATIONS 1e9  // Upper bound for benchmarks that do (almost) nothing
+#define BENCH_CHUNK_SAMPLES 4096  // Samples per chunk for the synthesized files
+#define BENCH_MICRO_SECONDS 10    // Duration of the file the micro benchmarks read
+#define BENCH_PATH_SIZE 4096
+
+static volatile size_t bench_allocations;
+static volatile int32_t bench_sink;  // Keeps results of the read benchmarks alive
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* pointer, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    __atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    __atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* pointer, size_t size) {
+    __atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+    return __real_realloc(pointer, size);
+}
+
+typedef struct {
+    uint32_t sample_rate;
+    uint16_t bits_per_sample;
+    uint16_t num_of_channels;
+    uint32_t seconds;
+} BenchFormat;
+
+typedef struct {
+    uint64_t iterations;
+    uint64_t items;  // Samples (frames) processed by all iterations
+    uint64_t bytes;  // Bytes processed by all iterations
+
+    double m_start;
+    double m_seconds;
+    size_t m_allocations;
+} BenchState;
+
+typedef int (*BenchFunction)(BenchState* state, const BenchFormat* format);
+
+typedef struct {
+    const char* name;
+    BenchFunction function;
+    BenchFormat format;
+} Benchmark;
+
+static char bench_directory[BENCH_PATH_SIZE];
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Called by a benchmark right before and after its timed loop
+static void bench_start(BenchState* state) {
+    state->m_allocations = bench_allocations;
+    state->m_start = bench_now();
+}
+
+static void bench_stop(BenchState* state) {
+    state->m_seconds = bench_now() - state->m_start;
+    state->m_allocations = bench_allocations - state->m_allocations;
+}
+
+// Path of the synthesized file for the given format, it is written on first use
+static const char* bench_file(const BenchFormat* format) {
+    static char path[BENCH_PATH_SIZE + 64];
+    snprintf(path, sizeof(path), "%s/%u_%u_%u_%u.wav", bench_directory, format->sample_rate, format->bits_per_sample,
+             format->num_of_channels, format->seconds);
+    if (access(path, F_OK) == 0) {
+        return path;
+    }
+
+    WavEncoder encoder;
+    if (wav_encoder_init(&encoder, path)) {
+        wav_encoder_close(&encoder);
+        return NULL;
+    }
+    wav_encoder_set_header(&encoder, format->sample_rate, format->bits_per_sample, AUDIO_FORMAT_PCM, format->num_of_channels,
+                           format->seconds);
+
+    int failed = wav_encoder_write_header(&encoder);
+
+    // A chord with a little noise, so neither the kernels nor the resampler see silence
+    const size_t total = (size_t)format->sample_rate * format->seconds;
+    uint32_t seed = 1;
+    for (size_t start = 0; start < total && !failed; start += BENCH_CHUNK_SAMPLES) {
+        size_t samples = total - start < BENCH_CHUNK_SAMPLES ? total - start : BENCH_CHUNK_SAMPLES;
+        failed = wav_data_reserve(encoder.data, samples, (uint8_t)format->num_of_channels);
+
+        for (size_t i = 0; i < samples && !failed; i++) {
+            double t = (double)(start + i) / format->sample_rate;
+            for (uint16_t c = 0; c < format->num_of_channels; c++) {
+                seed = seed * 1664525u + 1013904223u;
+                double noise = (seed >> 8) / 16777216.0 - 0.5;
+                double value = 0.3 * sin(2 * M_PI * (220.0 + 110.0 * c) * t) + 0.2 * sin(2 * M_PI * 1318.5 * t) + 0.05 * noise;
+                encoder.data->m_data[i * format->num_of_channels + c] = (float)value;
+            }
+        }
+        encoder.data->nr_of_samples = samples;
+        failed = failed || wav_encoder_write_data(&encoder);
+    }
+
+    wav_encoder_close(&encoder);
+    return failed ? NULL : path;
+}
+
+static int bench_open(WavDecoder* decoder, const BenchFormat* format) {
+    const char* path = bench_file(format);
+    if (path == NULL || wav_decoder_init_mmap(decoder, path)) {
+        return 1;
+    }
+    if (wav_decoder_get_header(decoder)) {
+        wav_decoder_close(decoder);
+        return 1;
+    }
+    return 0;
+}
+
+// Micro benchmarks
+
+static int bench_read_int16(BenchState* state, const BenchFormat* format) {
+    WavDecoder decoder;
+    if (bench_open(&decoder, format)) {
+        return 1;
+    }
+
+    ByteBuffer* buffer = decoder.buffer;
+    const size_t values = (buffer->m_size - buffer->m_offset) / 2;
+    const size_t start = buffer->m_offset;
+    int32_t sum = 0;
+
+    bench_start(state);
+    for (uint64_t i = 0; i < state->iterations; i++) {
+        buffer->m_offset = start;
+        for (size_t v = 0; v < values; v++) {
+            sum += byte_buffer_read_int16(buffer, LE);
+        }
+    }
+    bench_stop(state);
+
+    state->items = state->iterations * values;
+    state->bytes = state->items * 2;
+    wav_decoder_close(&decoder);
+    bench_sink = sum;
+    return 0;
+}
+
+static int bench_read_int32(BenchState* state, const BenchFormat* format) {
+    WavDecoder decoder;
+    if (bench_open(&decoder, format)) {
+        return 1;
+    }
+
+    ByteBuffer* buffer = decoder.buffer;
+    const size_t values = (buffer->m_size - buffer->m_offset) / 4;
+    const size_t start = buffer->m_offset;
+    int32_t sum = 0;
+
+    bench_start(state);
+    for (uint64_t i = 0; i < state->iterations; i++) {
+        buffer->m_offset = start;
+        for (size_t v = 0; v < values; v++) {
+            sum ^= byte_buffer_read_int32(buffer, LE);
+        }
+    }
+    bench_stop(state);
+
+    state->items = state->iterations * values;
+    state->bytes = state->items * 4;
+    wav_decoder_close(&decoder);
+    bench_sink = sum;
+    return 0;
+}
+
+static int bench_header(BenchState* state, const BenchFormat* format) {
+    WavDecoder decoder;
+    if (bench_open(&decoder, format)) {
+        return 1;
+    }
+
+    int failed = 0;
+    bench_start(state);
+    for (uint64_t i = 0; i < state->iterations && !failed; i++) {
+        decoder.buffer->m_offset = 0;
+        failed = wav_decoder_get_header(&decoder);
+    }
+    bench_stop(state);
+
+    state->items = state->iterations;
+    state->bytes = state->iterations * decoder.buffer->m_offset;
+    wav_decoder_close(&decoder);
+    return failed;
+}
+
+static int bench_decode(BenchState* state, const BenchFormat* format) {
+    WavDecoder decoder;
+    if (bench_open(&decoder, format)) {
+        return 1;
+    }
+
+    const size_t start = decoder.buffer->m_offset;
+    int failed = 0;
+
+    bench_start(state);
+    for (uint64_t i = 0; i < state->iterations && !failed; i++) {
+        decoder.buffer->m_offset = start;
+        decoder.remaining_samples = decoder.nr_of_samples;
+        int samples;
+        while ((samples = wav_decoder_get_next_samples(&decoder)) > 0) {
+        }
+        failed = samples < 0;
+    }
+    bench_stop(state);
+
+    state->items = state->iterations * decoder.nr_of_samples;
+    state->bytes = state->items * decoder.header->block_align;
+    wav_decoder_close(&decoder);
+    return failed;
+}
+
+// One decoded chunk of the file, converted by the legacy fixed ratio paths
+static int bench_sampling(BenchState* state, const BenchFormat* format, int upsample) {
+    WavDecoder decoder;
+    WavEncoder encoder;
+    if (bench_open(&decoder, format)) {
+        return 1;
+    }
+    if (wav_encoder_init(&encoder, "/dev/null") ||
+        wav_encoder_set_header(&encoder, format->sample_rate, BITS_PER_SAMPLE_16, AUDIO_FORMAT_PCM, format->num_of_channels, 0) ||
+        wav_decoder_get_next_samples(&decoder) <= 0) {
+        wav_encoder_close(&encoder);
+        wav_decoder_close(&decoder);
+        return 1;
+    }
+
+    const size_t samples = decoder.data->nr_of_samples;
+    if (!upsample && wav_data_reserve(encoder.data, samples, (uint8_t)format->num_of_channels) == 0) {
+        memcpy(encoder.data->m_data, decoder.data->m_data, sizeof(float) * samples * format->num_of_channels);
+    }
+
+    bench_start(state);
+    for (uint64_t i = 0; i < state->iterations; i++) {
+        if (upsample) {
+            wav_upsample(&decoder, &encoder, 2);
+        } else {
+            // Downsampling works in place, only the amount of samples has to be restored
+            encoder.data->nr_of_samples = samples;
+            wav_downsample(&decoder, &encoder, 8, DOWNSAMPLE_AVERAGE);
+        }
+    }
+    bench_stop(state);
+
+    state->items = state->iterations * samples;
+    state->bytes = state->items * sizeof(float) * format->num_of_channels;
+    wav_encoder_close(&encoder);
+    wav_decoder_close(&decoder);
+    return 0;
+}
+
+static int bench_upsample(BenchState* state, const BenchFormat* format) {
+    return bench_sampling(state, format, 1);
+}
+
+static int bench_downsample(BenchState* state, const BenchFormat* format) {
+    return bench_sampling(state, format, 0);
+}
+
+static int bench_encode(BenchState* state, const BenchFormat* format) {
+    WavEncoder encoder;
+    const uint16_t bits = format->bits_per_sample;
+    const uint8_t channels = (uint8_t)format->num_of_channels;
+    if (wav_encoder_init(&encoder, "/dev/null") ||
+        wav_encoder_set_header(&encoder, format->sample_rate, bits, AUDIO_FORMAT_PCM, channels, 0) ||
+        wav_encoder_write_header(&encoder) || wav_data_reserve(encoder.data, BENCH_CHUNK_SAMPLES, channels)) {
+        wav_encoder_close(&encoder);
+        return 1;
+    }
+
+    const size_t values = BENCH_CHUNK_SAMPLES * format->num_of_channels;
+    for (size_t i = 0; i < values; i++) {
+        encoder.data->m_data[i] = (float)sin(i * 0.01) * 0.5f;
+    }
+
+    int failed = 0;
+    bench_start(state);
+    for (uint64_t i = 0; i < state->iterations && !failed; i++) {
+        encoder.data->nr_of_samples = BENCH_CHUNK_SAMPLES;
+        failed = wav_encoder_write_data(&encoder);
+    }
+    bench_stop(state);
+
+    state->items = state->iterations * BENCH_CHUNK_SAMPLES;
+    state->bytes = state->items * encoder.header->block_align;
+    wav_encoder_close(&encoder);
+    return failed;
+}
+
+// The whole file pulled through the library API to 16 kHz, 'frames' at a time.
+// Buffers of a whole chunk are resampled into directly, smaller ones are copied
+static int bench_focal_read(BenchState* state, const BenchFormat* format, size_t frames, enum WavDataLayout layout) {
+    const char* path = bench_file(format);
+    FocalConfig config;
+    focal_config_init(&config);
+    config.sample_rate = 16000;
+
+    FocalStream stream;
+    if (path == NULL || focal_open(&stream, path, &config) != FOCAL_OK) {
+        return 1;
+    }
+
+    float* out = (float*)malloc(sizeof(float) * frames * stream.num_of_channels);
+    long result = out ? 0 : FOCAL_ERROR_MEMORY;
+    uint64_t total = 0;
+
+    bench_start(state);
+    for (uint64_t i = 0; i < state->iterations && result >= 0; i++) {
+        result = focal_seek(&stream, 0);
+        while (result >= 0 && (result = focal_read(&stream, out, frames, layout)) > 0) {
+            total += result;
+            bench_sink = (int32_t)out[0];
+        }
+    }
+    bench_stop(state);
+
+    state->items = total;
+    state->bytes = total * sizeof(float) * stream.num_of_channels;
+    free(out);
+    focal_close(&stream);
+    return result < 0;
+}
+
+static int bench_focal_read_small(BenchState* state, const BenchFormat* format) {
+    return bench_focal_read(state, format, 256, LAYOUT_INTERLEAVED);
+}
+
+static int bench_focal_read_large(BenchState* state, const BenchFormat* format) {
+    return bench_focal_read(state, format, 8192, LAYOUT_INTERLEAVED);
+}
+
+static int bench_focal_read_planar(BenchState* state, const BenchFormat* format) {
+    return bench_focal_read(state, format, 8192, LAYOUT_PLANAR);
+}
+
+// Macro benchmark, the whole conversion of a file to 5512 Hz mono 16 bit like
+// the command line does it
+
+static size_t bench_threads = 1;
+
+static int bench_convert(BenchState* state, const BenchFormat* format) {
+    const char* input = bench_file(format);
+    if (input == NULL) {
+        return 1;
+    }
+    char output[BENCH_PATH_SIZE + 8];
+    snprintf(output, sizeof(output), "%s/out.wav", bench_directory);
+
+    int failed = 0;
+    size_t samples = 0, block_align = 0;
+
+    bench_start(state);
+    for (uint64_t i = 0; i < state->iterations && !failed; i++) {
+        WavDecoder decoder;
+        WavEncoder encoder;
+        failed = wav_decoder_init_mmap(&decoder, input) || wav_decoder_get_header(&decoder);
+        if (!failed) {
+            samples = decoder.nr_of_samples;
+            block_align = decoder.header->block_align;
+            failed = wav_encoder_init(&encoder, output) ||
+                     wav_encoder_set_header(&encoder, 5512, BITS_PER_SAMPLE_16, AUDIO_FORMAT_PCM, MONO, 0) ||
+                     wav_resample_parallel(&decoder, &encoder, NULL, bench_threads);
+            wav_encoder_close(&encoder);
+        }
+        wav_decoder_close(&decoder);
+    }
+    bench_stop(state);
+
+    state->items = state->iterations * samples;
+    state->bytes = state->items * block_align;
+    return failed;
+}
+
+// Run a benchmark with growing iteration counts until it takes long enough
+static int bench_run(const Benchmark* benchmark, double min_time, BenchState* state) {
+    state->iterations = 1;
+
+    for (;;) {
+        state->items = 0;
+        state->bytes = 0;
+        if (benchmark->function(state, &benchmark->format)) {
+            return 1;
+        }
+        if (state->m_seconds >= min_time || state->iterations >= BENCH_MAX_ITERATIONS) {
+            return 0;
+        }
+
+        // Aim a bit past the minimum time, but grow at most 10 times per run
+        double factor = state->m_seconds > 0 ? min_time * 1.4 / state->m_seconds : 10;
+        if (factor > 10) {
+            factor = 10;
+        }
+        uint64_t next = (uint64_t)(state->iterations * factor);
+        state->iterations = next > state->iterations ? next : state->iterations + 1;
+    }
+}
+
+static void bench_remove_files(void) {
+    DIR* directory = opendir(bench_directory);
+    if (directory == NULL) {
+        return;
+    }
+
+    char path[2 * BENCH_PATH_SIZE];
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", bench_directory, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(directory);
+    rmdir(bench_directory);
+}
+
+static const char* bench_cpu_level(void) {
+#ifdef PCM_X86
+    enum PcmCpuLevel level = pcm_cpu_level();
+    return level == PCM_CPU_AVX2 ? "avx2" : level == PCM_CPU_SSE2 ? "sse2" : "scalar";
+#else
+    return "scalar";
+#endif
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [--out <file.json>] [--filter <text>] [--min-time <seconds>] [--threads <n>]\n"
+            "\n"
+            "Runs the benchmarks whose name contains the filter text and writes the\n"
+            "results as JSON to the given file (default: standard output).\n",
+            program);
+}
+
+int main(int argc, char** argv) {
+    const char* output = NULL;
+    const char* filter = NULL;
+    double min_time = BENCH_MIN_TIME;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        int has_value = i + 1 < argc;
+
+        if (strcmp(arg, "--out") == 0 && has_value) {
+            output = argv[++i];
+        } else if (strcmp(arg, "--filter") == 0 && has_value) {
+            filter = argv[++i];
+        } else if (strcmp(arg, "--min-time") == 0 && has_value) {
+            min_time = atof(argv[++i]);
+        } else if (strcmp(arg, "--threads") == 0 && has_value) {
+            bench_threads = (size_t)atol(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    const BenchFormat micro = {48000, BITS_PER_SAMPLE_16, STEREO, BENCH_MICRO_SECONDS};
+    const BenchFormat micro_24 = {48000, 24, STEREO, BENCH_MICRO_SECONDS};
+    const BenchFormat micro_mono = {48000, BITS_PER_SAMPLE_16, MONO, BENCH_MICRO_SECONDS};
+
+    Benchmark benchmarks[64] = {
+        {"byte_buffer_read_int16", bench_read_int16, micro},
+        {"byte_buffer_read_int32", bench_read_int32, micro},
+        {"wav_decoder_get_header", bench_header, micro},
+        {"wav_decoder_get_next_samples/16bit/2ch", bench_decode, micro},
+        {"wav_decoder_get_next_samples/24bit/2ch", bench_decode, micro_24},
+        {"wav_decoder_get_next_samples/16bit/1ch", bench_decode, micro_mono},
+        {"wav_upsample/x2/2ch", bench_upsample, micro},
+        {"wav_downsample/8/2ch", bench_downsample, micro},
+        {"wav_encoder_write_data/16bit/2ch", bench_encode, micro},
+        {"wav_encoder_write_data/24bit/2ch", bench_encode, micro_24},
+        {"focal_read/256/interleaved/2ch", bench_focal_read_small, micro},
+        {"focal_read/8192/interleaved/2ch", bench_focal_read_large, micro},
+        {"focal_read/8192/planar/2ch", bench_focal_read_planar, micro},
+    };
+    size_t count = 13;
+
+    // Macro benchmarks over every combination of rate, bit depth, channels and duration
+    static const uint32_t rates[] = {8000, 44100, 48000};
+    static const uint16_t bits[] = {16, 24};
+    static const uint16_t channels[] = {1, 2};
+    static const uint32_t durations[] = {1, 30};
+    static char names[64][64];
+
+    for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+        for (size_t b = 0; b < sizeof(bits) / sizeof(bits[0]); b++) {
+            for (size_t c = 0; c < sizeof(channels) / sizeof(channels[0]); c++) {
+                for (size_t d = 0; d < sizeof(durations) / sizeof(durations[0]); d++) {
+                    snprintf(names[count], sizeof(names[count]), "convert/%uHz/%ubit/%uch/%us", rates[r], bits[b], channels[c],
+                             durations[d]);
+                    Benchmark* benchmark = &benchmarks[count];
+                    benchmark->name = names[count++];
+                    benchmark->function = bench_convert;
+                    benchmark->format = (BenchFormat){rates[r], bits[b], channels[c], durations[d]};
+                }
+            }
+        }
+    }
+
+    const char* tmp = getenv("TMPDIR");
+    snprintf(bench_directory, sizeof(bench_directory), "%s/focal_bench.XXXXXX", tmp ? tmp : "/tmp");
+    if (mkdtemp(bench_directory) == NULL) {
+        fprintf(stderr, "Unable to create a directory in %s\n", tmp ? tmp : "/tmp");
+        return 1;
+    }
+
+    FILE* out = stdout;
+    if (output && (out = fopen(output, "w")) == NULL) {
+        fprintf(stderr, "Unable to open file %s for writing\n", output);
+        rmdir(bench_directory);
+        return 1;
+    }
+
+    // The library reports progress on standard output, keep it out of the results
+    fflush(stdout);
+    if (out == stdout) {
+        out = fdopen(dup(fileno(stdout)), "w");
+    }
+    if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        fprintf(stderr, "Unable to redirect standard output\n");
+        rmdir(bench_directory);
+        return 1;
+    }
+
+    time_t now = time(NULL);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+    fprintf(out, "{\n  \"context\": {\"date\": \"%s\", \"num_cpus\": %ld, \"cpu_level\": \"%s\", ", date,
+            sysconf(_SC_NPROCESSORS_ONLN), bench_cpu_level());
+    fprintf(out, "\"threads\": %zu, \"min_time\": %g},\n", bench_threads, min_time);
+    fprintf(out, "  \"benchmarks\": [");
+
+    int failed = 0;
+    int first = 1;
+    for (size_t i = 0; i < count; i++) {
+        const Benchmark* benchmark = &benchmarks[i];
+        if (filter && strstr(benchmark->name, filter) == NULL) {
+            continue;
+        }
+
+        BenchState state;
+        memset(&state, 0, sizeof(BenchState));
+        fprintf(stderr, "%-48s", benchmark->name);
+        if (bench_run(benchmark, min_time, &state)) {
+            fprintf(stderr, " failed\n");
+            failed = 1;
+            continue;
+        }
+
+        double seconds = state.m_seconds > 0 ? state.m_seconds : 1e-9;
+        fprintf(stderr, " %12.1f ns %14.0f samples/s %8.1f MB/s\n", seconds * 1e9 / state.iterations, state.items / seconds,
+                state.bytes / seconds / 1e6);
+
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"iterations\": %llu, \"real_time_ns\": %.1f, \"samples_per_second\": %.0f, ",
+                first ? "" : ",", benchmark->name, (unsigned long long)state.iterations, seconds * 1e9 / state.iterations,
+                state.items / seconds);
+        fprintf(out, "\"bytes_per_second\": %.0f, \"allocations_per_second\": %.0f, \"allocations_per_iteration\": %.2f}",
+                state.bytes / seconds, state.m_allocations / seconds, (double)state.m_allocations / state.iterations);
+        first = 0;
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    bench_remove_files();
+    if (fclose(out)) {
+        failed = 1;
+    }
+
+    return failed;
+}
@@ -0,0 +1,719 @@
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "src/focal.h"
+#include "src/wav_pipeline.h"
+#include "src/wav_sampling.h"
+
+// Equivalence checks, run with 'make check'
+//
+// Every check synthesizes its input and runs it through two paths that have
+// to agree: bit for bit where the paths promise the same output, within a
+// bound where they only promise to be close. A check that fails describes the
+// first difference on standard error.
+
+#define CHECK_CHUNK_SAMPLES 4096  // Samples per chunk for the synthesized files
+#define CHECK_PATH_SIZE 4096
+#define CHECK_FIXED_SNR 72.0  // Least SNR in dB of the Q15 path against float
+#define CHECK_FIXED_ERROR 8   // Largest difference in LSB of the Q15 path against float
+
+typedef int (*CheckFunction)(void);
+
+typedef struct {
+    const char* name;
+    CheckFunction function;
+} Check;
+
+// Input and output formats of the conversions that are checked
+typedef struct {
+    uint32_t in_rate;
+    uint16_t in_channels;
+    uint32_t out_rate;
+    uint16_t out_channels;
+} CheckConversion;
+
+static const CheckConversion check_conversions[] = {
+    {44100, STEREO, 5512, MONO},
+    {48000, STEREO, 44100, STEREO},
+    {8000, MONO, 48000, MONO},
+    {22050, MONO, 16000, STEREO},
+};
+
+#define CHECK_NR_OF_CONVERSIONS (sizeof(check_conversions) / sizeof(check_conversions[0]))
+
+// Resampled frames, interleaved
+typedef struct {
+    float* samples;
+    size_t frames;
+    size_t capacity;
+    uint16_t channels;
+} CheckOutput;
+
+static char check_directory[CHECK_PATH_SIZE];
+
+static void check_output_init(CheckOutput* output, uint16_t channels) {
+    output->samples = NULL;
+    output->frames = 0;
+    output->capacity = 0;
+    output->channels = channels;
+}
+
+static void check_output_free(CheckOutput* output) {
+    free(output->samples);
+    check_output_init(output, output->channels);
+}
+
+static int check_output_append(CheckOutput* output, const float* samples, size_t frames) {
+    if (frames == 0) {
+        return 0;
+    }
+    if (output->frames + frames > output->capacity) {
+        size_t capacity = output->capacity ? output->capacity : CHECK_CHUNK_SAMPLES;
+        while (capacity < output->frames + frames) {
+            capacity *= 2;
+        }
+        float* grown = (float*)realloc(output->samples, sizeof(float) * capacity * output->channels);
+        if (grown == NULL) {
+            fprintf(stderr, "Unable to allocate memory for %zu frames\n", capacity);
+            return 1;
+        }
+        output->samples = grown;
+        output->capacity = capacity;
+    }
+
+    memcpy(output->samples + output->frames * output->channels, samples, sizeof(float) * frames * output->channels);
+    output->frames += frames;
+    return 0;
+}
+
+// Returns 0 when 'b' holds exactly the frames of 'a' from frame 'offset' on
+static int check_same(const char* what, const CheckOutput* a, size_t offset, const CheckOutput* b) {
+    if (a->channels != b->channels || offset + b->frames != a->frames) {
+        fprintf(stderr, "%s: expected %zu frames of %u channels, got %zu of %u\n", what, a->frames - offset, a->channels, b->frames,
+                b->channels);
+        return 1;
+    }
+
+    const float* expected = a->samples + offset * a->channels;
+    for (size_t i = 0; i < b->frames * b->channels; i++) {
+        if (memcmp(&expected[i], &b->samples[i], sizeof(float)) != 0) {
+            fprintf(stderr, "%s: frame %zu channel %zu is %.9g instead of %.9g\n", what, i / b->channels, i % b->channels,
+                    b->samples[i], expected[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Path of a synthesized 16 bit file, it is written on first use
+static const char* check_file(uint32_t sample_rate, uint16_t channels, size_t frames) {
+    static char path[CHECK_PATH_SIZE + 64];
+    snprintf(path, sizeof(path), "%s/%u_%u_%zu.wav", check_directory, sample_rate, channels, frames);
+    if (access(path, F_OK) == 0) {
+        return path;
+    }
+
+    WavEncoder encoder;
+    if (wav_encoder_init(&encoder, path)) {
+        wav_encoder_close(&encoder);
+        return NULL;
+    }
+    wav_encoder_set_header(&encoder, sample_rate, BITS_PER_SAMPLE_16, AUDIO_FORMAT_PCM, channels, 0);
+
+    int failed = wav_encoder_write_header(&encoder);
+
+    // A chord with a little noise that starts and ends loud, so the edges of
+    // the stream and of every chunk matter
+    uint32_t seed = 1;
+    for (size_t start = 0; start < frames && !failed; start += CHECK_CHUNK_SAMPLES) {
+        size_t samples = frames - start < CHECK_CHUNK_SAMPLES ? frames - start : CHECK_CHUNK_SAMPLES;
+        failed = wav_data_reserve(encoder.data, samples, (uint8_t)channels);
+
+        for (size_t i = 0; i < samples && !failed; i++) {
+            double t = (double)(start + i) / sample_rate;
+            for (uint16_t c = 0; c < channels; c++) {
+                seed = seed * 1664525u + 1013904223u;
+                double noise = (seed >> 8) / 16777216.0 - 0.5;
+                double value = 0.4 * sin(2 * M_PI * (220.0 + 110.0 * c) * t + 1.0) + 0.3 * sin(2 * M_PI * 1318.5 * t) + 0.1 * noise;
+                encoder.data->m_data[i * channels + c] = (float)value;
+            }
+        }
+        encoder.data->nr_of_samples = samples;
+        failed = failed || wav_encoder_write_data(&encoder);
+    }
+
+    failed |= wav_encoder_close(&encoder);
+    return failed ? NULL : path;
+}
+
+static int check_open(WavDecoder* decoder, const char* path) {
+    if (path == NULL || wav_decoder_init_mmap(decoder, path) || wav_decoder_get_header(decoder)) {
+        wav_decoder_close(decoder);
+        return 1;
+    }
+    return 0;
+}
+
+// A pipe that a child process fills with the contents of 'path', so the file
+// is read as a stream. Returns the read end or -1, the child is reaped with wait
+static int check_pipe(const char* path) {
+    int fds[2];
+    if (path == NULL || pipe(fds)) {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        FILE* fp = fopen(path, "rb");
+        char buffer[64 * 1024];
+        size_t length;
+        int failed = fp == NULL;
+        while (!failed && (length = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+            failed = write(fds[1], buffer, length) != (ssize_t)length;
+        }
+        _exit(failed);
+    }
+
+    close(fds[1]);
+    return fds[0];
+}
+
+// Returns 0 when the files at 'a' and 'b' have the same bytes
+static int check_same_file(const char* what, const char* a, const char* b) {
+    FILE* fa = fopen(a, "rb");
+    FILE* fb = fopen(b, "rb");
+    int failed = fa == NULL || fb == NULL;
+    if (failed) {
+        fprintf(stderr, "%s: unable to open the outputs\n", what);
+    }
+
+    uint8_t ba[64 * 1024], bb[64 * 1024];
+    size_t offset = 0;
+    while (!failed) {
+        size_t la = fread(ba, 1, sizeof(ba), fa);
+        size_t lb = fread(bb, 1, sizeof(bb), fb);
+        size_t length = la < lb ? la : lb;
+        for (size_t i = 0; i < length && !failed; i++) {
+            if (ba[i] != bb[i]) {
+                fprintf(stderr, "%s: byte %zu differs\n", what, offset + i);
+                failed = 1;
+            }
+        }
+        if (!failed && la != lb) {
+            fprintf(stderr, "%s: one output ends at byte %zu\n", what, offset + length);
+            failed = 1;
+        }
+        if (la == 0 || la != lb) {
+            break;
+        }
+        offset += length;
+    }
+
+    if (fa) {
+        fclose(fa);
+    }
+    if (fb) {
+        fclose(fb);
+    }
+    return failed;
+}
+
+static int check_output_sink(WavData* data, void* context) {
+    CheckOutput* output = (CheckOutput*)context;
+    return check_output_append(output, data->m_data, data->nr_of_samples) ? -1 : 0;
+}
+
+// The whole file resampled in float by wav_resample_to, which every other path is compared to
+static int check_reference(const char* path, uint32_t out_rate, uint16_t out_channels, CheckOutput* output) {
+    WavDecoder decoder;
+    check_output_init(output, out_channels);
+    if (check_open(&decoder, path)) {
+        return 1;
+    }
+
+    WavResampler resampler;
+    if (wav_resampler_init(&resampler, decoder.header->sample_rate, out_rate, (uint8_t)out_channels)) {
+        wav_decoder_close(&decoder);
+        return 1;
+    }
+
+    WavData out;
+    wav_data_init(&out);
+
+    size_t total_samples;
+    long result = wav_resample_to(&decoder, &resampler, &out, check_output_sink, output, &total_samples);
+
+    wav_data_free(&out);
+    wav_resampler_close(&resampler);
+    wav_decoder_close(&decoder);
+    return result < 0;
+}
+
+// The whole input of a file, decoded once
+static int check_decode(const char* path, CheckOutput* input) {
+    WavDecoder decoder;
+    check_output_init(input, 0);
+    if (check_open(&decoder, path)) {
+        return 1;
+    }
+    input->channels = decoder.header->num_of_channels;
+
+    int samples;
+    int failed = 0;
+    while (!failed && (samples = wav_decoder_get_next_samples(&decoder)) > 0) {
+        failed = check_output_append(input, decoder.data->m_data, decoder.data->nr_of_samples);
+    }
+
+    wav_decoder_close(&decoder);
+    return failed || samples < 0;
+}
+
+// Feed 'input' to the resampler in chunks of 'chunk_size' frames and flush it
+static int check_resample_chunks(WavResampler* resampler, const CheckOutput* input, size_t chunk_size, CheckOutput* output) {
+    WavData out;
+    wav_data_init(&out);
+    wav_resampler_reset(resampler);
+
+    int failed = 0;
+    for (size_t start = 0; start < input->frames && !failed; start += chunk_size) {
+        WavData chunk;
+        wav_data_init(&chunk);
+        chunk.nr_of_samples = input->frames - start < chunk_size ? input->frames - start : chunk_size;
+        chunk.capacity = chunk.nr_of_samples;
+        chunk.nr_of_channels = (uint8_t)input->channels;
+        chunk.m_data = input->samples + start * input->channels;
+        chunk.m_borrowed = 1;
+
+        failed = wav_resampler_process(resampler, &chunk, &out) < 0 || check_output_append(output, out.m_data, out.nr_of_samples);
+    }
+    failed = failed || wav_resampler_flush(resampler, &out) < 0 || check_output_append(output, out.m_data, out.nr_of_samples);
+
+    wav_data_free(&out);
+    return failed;
+}
+
+// Resampling carries its history across chunks, so feeding the same input in
+// chunks of any size gives the output of the whole file
+static int check_chunks(void) {
+    static const size_t chunk_sizes[] = {1, 7, 1000, 4099, SIZE_MAX};
+    int failed = 0;
+
+    for (size_t i = 0; i < CHECK_NR_OF_CONVERSIONS && !failed; i++) {
+        const CheckConversion* conversion = &check_conversions[i];
+        const char* path = check_file(conversion->in_rate, conversion->in_channels, conversion->in_rate + 123);
+
+        CheckOutput reference, input;
+        if (path == NULL) {
+            return 1;
+        }
+        if (check_reference(path, conversion->out_rate, conversion->out_channels, &reference)) {
+            check_output_free(&reference);
+            return 1;
+        }
+        if (check_decode(path, &input)) {
+            check_output_free(&input);
+            check_output_free(&reference);
+            return 1;
+        }
+
+        WavResampler resampler;
+        failed = wav_resampler_init(&resampler, conversion->in_rate, conversion->out_rate, (uint8_t)conversion->out_channels);
+
+        for (size_t s = 0; s < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]) && !failed; s++) {
+            CheckOutput output;
+            check_output_init(&output, conversion->out_channels);
+
+            char what[128];
+            snprintf(what, sizeof(what), "%u Hz to %u Hz in chunks of %zu", conversion->in_rate, conversion->out_rate, chunk_sizes[s]);
+            failed = check_resample_chunks(&resampler, &input, chunk_sizes[s], &output) || check_same(what, &reference, 0, &output);
+
+            check_output_free(&output);
+        }
+
+        wav_resampler_close(&resampler);
+        check_output_free(&input);
+        check_output_free(&reference);
+    }
+
+    return failed;
+}
+
+// Convert 'input' to 32 bit float in 'output', on 'workers' threads with the
+// pipeline or with wav_resample when it is 0. With 'stream' the input is read
+// from a pipe
+static int check_convert(const char* input, int stream, const char* output, const CheckConversion* conversion, size_t workers) {
+    WavDecoder decoder;
+    if (stream) {
+        int fd = check_pipe(input);
+        if (fd < 0 || wav_decoder_init_fd(&decoder, fd) || wav_decoder_get_header(&decoder)) {
+            wav_decoder_close(&decoder);
+            wait(NULL);
+            return 1;
+        }
+    } else if (check_open(&decoder, input)) {
+        return 1;
+    }
+
+    WavEncoder encoder;
+    int failed = wav_encoder_init(&encoder, output) ||
+                 wav_encoder_set_header(&encoder, conversion->out_rate, 32, AUDIO_FORMAT_IEEE_FLOAT, conversion->out_channels, 0);
+    if (!failed) {
+        failed = workers ? wav_resample_parallel(&decoder, &encoder, NULL, workers) : wav_resample(&decoder, &encoder, RESAMPLE_POLYPHASE);
+    }
+
+    failed |= wav_encoder_close(&encoder);
+    wav_decoder_close(&decoder);
+    if (stream) {
+        wait(NULL);
+    }
+    return failed;
+}
+
+// The pipeline cuts the input into segments that are resampled independently,
+// its output is byte for byte the one of the serial path for any amount of workers
+static int check_pipeline(void) {
+    static const size_t workers[] = {1, 2, 3, 8};
+    char serial[CHECK_PATH_SIZE + 16], parallel[CHECK_PATH_SIZE + 16];
+    snprintf(serial, sizeof(serial), "%s/serial.wav", check_directory);
+    snprintf(parallel, sizeof(parallel), "%s/parallel.wav", check_directory);
+
+    int failed = 0;
+    for (size_t i = 0; i < CHECK_NR_OF_CONVERSIONS && !failed; i++) {
+        const CheckConversion* conversion = &check_conversions[i];
+        const char* path = check_file(conversion->in_rate, conversion->in_channels, 2 * PIPELINE_SEGMENT_SIZE + 12345);
+        if (path == NULL) {
+            return 1;
+        }
+        char input[CHECK_PATH_SIZE + 64];
+        snprintf(input, sizeof(input), "%s", path);
+
+        failed = check_convert(input, 0, serial, conversion, 0);
+        for (size_t w = 0; w < sizeof(workers) / sizeof(workers[0]) && !failed; w++) {
+            char what[128];
+            snprintf(what, sizeof(what), "%u Hz to %u Hz on %zu workers", conversion->in_rate, conversion->out_rate, workers[w]);
+            failed = check_convert(input, 0, parallel, conversion, workers[w]) || check_same_file(what, serial, parallel);
+        }
+
+        // A stream reaches the reader in pieces of whatever size the pipe hands out
+        if (!failed) {
+            char what[128];
+            snprintf(what, sizeof(what), "%u Hz to %u Hz from a pipe", conversion->in_rate, conversion->out_rate);
+            failed = check_convert(input, 1, parallel, conversion, 4) || check_same_file(what, serial, parallel);
+        }
+    }
+
+    return failed;
+}
+
+// Extract [start, start + duration) seconds of 'input' into 'output' as 16 bit
+// PCM like the command line does, in Q15 with 'fixed_point'
+static int check_extract(const char* input, const char* output, const CheckConversion* conversion, double start, double duration,
+                         int fixed_point) {
+    WavDecoder decoder;
+    if (check_open(&decoder, input)) {
+        return 1;
+    }
+
+    WavEncoder encoder;
+    int failed = wav_encoder_init(&encoder, output) ||
+                 wav_encoder_set_header(&encoder, conversion->out_rate, BITS_PER_SAMPLE_16, AUDIO_FORMAT_PCM, conversion->out_channels, 0) ||
+                 wav_extract(&decoder, &encoder, NULL, start, duration, fixed_point);
+
+    failed |= wav_encoder_close(&encoder);
+    wav_decoder_close(&decoder);
+    return failed;
+}
+
+// The Q15 path stays within a few LSB of the float resampler, and a range of
+// it is the same slice of a run over the whole file
+static int check_fixed(void) {
+    char fixed[CHECK_PATH_SIZE + 16], range[CHECK_PATH_SIZE + 16];
+    snprintf(fixed, sizeof(fixed), "%s/fixed.wav", check_directory);
+    snprintf(range, sizeof(range), "%s/range.wav", check_directory);
+
+    int failed = 0;
+    for (size_t i = 0; i < CHECK_NR_OF_CONVERSIONS && !failed; i++) {
+        const CheckConversion* conversion = &check_conversions[i];
+        const char* path = check_file(conversion->in_rate, conversion->in_channels, 2 * conversion->in_rate + 123);
+        if (path == NULL) {
+            return 1;
+        }
+        char input[CHECK_PATH_SIZE + 64];
+        snprintf(input, sizeof(input), "%s", path);
+
+        CheckOutput reference, output, slice;
+        check_output_init(&output, 0);
+        check_output_init(&slice, 0);
+        failed = check_reference(input, conversion->out_rate, conversion->out_channels, &reference) ||
+                 check_extract(input, fixed, conversion, 0, 0, 1) || check_decode(fixed, &output);
+
+        if (!failed && output.frames != reference.frames) {
+            fprintf(stderr, "%u Hz to %u Hz in Q15: %zu frames instead of %zu\n", conversion->in_rate, conversion->out_rate,
+                    output.frames, reference.frames);
+            failed = 1;
+        }
+
+        // Both sides in LSB of the 16 bit output
+        double signal = 0, noise = 0, error = 0;
+        for (size_t s = 0; s < output.frames * output.channels && !failed; s++) {
+            double expected = reference.samples[s] * 32768.0;
+            double difference = output.samples[s] * 32768.0 - expected;
+            signal += expected * expected;
+            noise += difference * difference;
+            error = fabs(difference) > error ? fabs(difference) : error;
+        }
+        double snr = noise > 0 ? 10 * log10(signal / noise) : INFINITY;
+        if (!failed && (snr < CHECK_FIXED_SNR || error > CHECK_FIXED_ERROR)) {
+            fprintf(stderr, "%u Hz to %u Hz in Q15: %.1f dB SNR and %.2f LSB against float, expected %.0f dB and %d LSB\n",
+                    conversion->in_rate, conversion->out_rate, snr, error, CHECK_FIXED_SNR, CHECK_FIXED_ERROR);
+            failed = 1;
+        }
+
+        // The range is rounded to output samples like wav_extract_range does
+        const double start = 0.5, duration = 0.7;
+        const size_t first = (size_t)llround(start * conversion->out_rate);
+        if (!failed) {
+            char what[128];
+            snprintf(what, sizeof(what), "%u Hz to %u Hz in Q15 from %.1f s", conversion->in_rate, conversion->out_rate, start);
+            failed = check_extract(input, range, conversion, start, duration, 1) || check_decode(range, &slice);
+
+            // Only the frames of the range are compared
+            output.frames = first + (size_t)llround(duration * conversion->out_rate);
+            failed = failed || check_same(what, &output, first, &slice);
+        }
+
+        check_output_free(&reference);
+        check_output_free(&output);
+        check_output_free(&slice);
+    }
+
+    return failed;
+}
+
+// Read the rest of the stream 'frames' at a time in 'layout' and append it interleaved to 'output'
+static int check_read(FocalStream* stream, size_t frames, enum WavDataLayout layout, CheckOutput* output) {
+    const uint16_t channels = stream->num_of_channels;
+    float* buffer = (float*)malloc(sizeof(float) * frames * channels);
+    float* interleaved = (float*)malloc(sizeof(float) * frames * channels);
+    if (buffer == NULL || interleaved == NULL) {
+        free(buffer);
+        free(interleaved);
+        return 1;
+    }
+
+    long result;
+    int failed = 0;
+    while (!failed && (result = focal_read(stream, buffer, frames, layout)) > 0) {
+        if (layout == LAYOUT_PLANAR) {
+            for (long i = 0; i < result; i++) {
+                for (uint16_t c = 0; c < channels; c++) {
+                    interleaved[i * channels + c] = buffer[c * frames + i];
+                }
+            }
+        }
+        failed = check_output_append(output, layout == LAYOUT_PLANAR ? interleaved : buffer, (size_t)result);
+    }
+    if (!failed && result < 0) {
+        fprintf(stderr, "Reading the stream failed: %s\n", focal_error_string((int)result));
+        failed = 1;
+    }
+
+    free(buffer);
+    free(interleaved);
+    return failed;
+}
+
+static int check_focal_open(FocalStream* stream, const char* path, int fd, const CheckConversion* conversion) {
+    FocalConfig config;
+    focal_config_init(&config);
+    config.sample_rate = conversion->out_rate;
+    config.num_of_channels = conversion->out_channels;
+
+    int result = fd >= 0 ? focal_open_fd(stream, fd, &config) : focal_open(stream, path, &config);
+    if (result != FOCAL_OK) {
+        fprintf(stderr, "Opening the stream failed: %s\n", focal_error_string(result));
+        return 1;
+    }
+    return 0;
+}
+
+// The library API pulls the same frames as the float resampler for every
+// buffer size and layout, after a seek and from a descriptor
+static int check_focal(void) {
+    static const size_t sizes[] = {1, 100, 1000, 4096, 1 << 20};
+    static const enum WavDataLayout layouts[] = {LAYOUT_INTERLEAVED, LAYOUT_PLANAR};
+
+    int failed = 0;
+    for (size_t i = 0; i < CHECK_NR_OF_CONVERSIONS && !failed; i++) {
+        const CheckConversion* conversion = &check_conversions[i];
+        const char* path = check_file(conversion->in_rate, conversion->in_channels, 2 * conversion->in_rate + 777);
+        if (path == NULL) {
+            return 1;
+        }
+        char input[CHECK_PATH_SIZE + 64];
+        snprintf(input, sizeof(input), "%s", path);
+
+        CheckOutput reference;
+        failed = check_reference(input, conversion->out_rate, conversion->out_channels, &reference);
+
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && !failed; s++) {
+            for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]) && !failed; l++) {
+                FocalStream stream;
+                if (check_focal_open(&stream, input, -1, conversion)) {
+                    failed = 1;
+                    break;
+                }
+
+                char what[128];
+                snprintf(what, sizeof(what), "%u Hz to %u Hz read %zu %s frames at a time", conversion->in_rate, conversion->out_rate,
+                         sizes[s], layouts[l] == LAYOUT_PLANAR ? "planar" : "interleaved");
+                if (stream.frames != reference.frames) {
+                    fprintf(stderr, "%s: the stream announces %llu frames instead of %zu\n", what, (unsigned long long)stream.frames,
+                            reference.frames);
+                    failed = 1;
+                }
+
+                CheckOutput output;
+                check_output_init(&output, conversion->out_channels);
+                failed = failed || check_read(&stream, sizes[s], layouts[l], &output) || check_same(what, &reference, 0, &output);
+                check_output_free(&output);
+                focal_close(&stream);
+            }
+        }
+
+        // Seeks only move forward, the first frames are read before the seek
+        const size_t seeks[] = {0, 1, 333, reference.frames / 3, reference.frames - 1, reference.frames};
+        for (size_t s = 0; s < sizeof(seeks) / sizeof(seeks[0]) && !failed; s++) {
+            FocalStream stream;
+            if (check_focal_open(&stream, input, -1, conversion)) {
+                failed = 1;
+                break;
+            }
+
+            CheckOutput output;
+            check_output_init(&output, conversion->out_channels);
+            size_t before = seeks[s] < 333 ? seeks[s] : 333;
+            float* skipped = (float*)malloc(sizeof(float) * (before + 1) * conversion->out_channels);
+            failed = skipped == NULL || focal_read(&stream, skipped, before, LAYOUT_INTERLEAVED) != (long)before ||
+                     focal_seek(&stream, seeks[s]) != FOCAL_OK;
+            free(skipped);
+
+            char what[128];
+            snprintf(what, sizeof(what), "%u Hz to %u Hz after a seek to %zu", conversion->in_rate, conversion->out_rate, seeks[s]);
+            if (failed) {
+                fprintf(stderr, "%s: the stream could not be read up to the seek or seeked\n", what);
+            }
+            failed = failed || check_read(&stream, 1000, LAYOUT_INTERLEAVED, &output) || check_same(what, &reference, seeks[s], &output);
+            check_output_free(&output);
+            focal_close(&stream);
+        }
+
+        // A pipe hands out the file in pieces of whatever size it has at hand
+        if (!failed) {
+            FocalStream stream;
+            int fd = check_pipe(input);
+            failed = fd < 0 || check_focal_open(&stream, NULL, fd, conversion);
+            if (!failed) {
+                char what[128];
+                snprintf(what, sizeof(what), "%u Hz to %u Hz from a pipe", conversion->in_rate, conversion->out_rate);
+
+                CheckOutput output;
+                check_output_init(&output, conversion->out_channels);
+                failed = check_read(&stream, 4096, LAYOUT_INTERLEAVED, &output) || check_same(what, &reference, 0, &output);
+                check_output_free(&output);
+                focal_close(&stream);
+            }
+            if (fd >= 0) {
+                wait(NULL);
+            }
+        }
+
+        check_output_free(&reference);
+    }
+
+    return failed;
+}
+
+static void check_remove_files(void) {
+    DIR* directory = opendir(check_directory);
+    if (directory == NULL) {
+        return;
+    }
+
+    char path[2 * CHECK_PATH_SIZE];
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", check_directory, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(directory);
+    rmdir(check_directory);
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [--filter <text>]\n"
+            "\n"
+            "Runs the checks whose name contains the filter text, the exit status is\n"
+            "non-zero when any of them fails.\n",
+            program);
+}
+
+int main(int argc, char** argv) {
+    const char* filter = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    static const Check checks[] = {
+        {"resampler/chunks", check_chunks},
+        {"pipeline/serial", check_pipeline},
+        {"fixed/float", check_fixed},
+        {"focal_read/float", check_focal},
+    };
+
+    const char* tmp = getenv("TMPDIR");
+    snprintf(check_directory, sizeof(check_directory), "%s/focal_check.XXXXXX", tmp ? tmp : "/tmp");
+    if (mkdtemp(check_directory) == NULL) {
+        fprintf(stderr, "Unable to create a directory in %s\n", tmp ? tmp : "/tmp");
+        return 1;
+    }
+
+    // The library reports progress on standard output, keep it out of the results
+    if (freopen("/dev/null", "w", stdout) == NULL) {
+        fprintf(stderr, "Unable to redirect standard output\n");
+        rmdir(check_directory);
+        return 1;
+    }
+
+    size_t failed = 0;
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        if (filter && strstr(checks[i].name, filter) == NULL) {
+            continue;
+        }
+
+        int result = checks[i].function();
+        fprintf(stderr, "%-40s %s\n", checks[i].name, result ? "failed" : "ok");
+        failed += result != 0;
+    }
+
+    check_remove_files();
+    return failed != 0;
+}
@@ -0,0 +1,597 @@
+#pragma once
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "instrument.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define ASYNC_IO_HAS_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#define ASYNC_IO_DEPTH 4                     // Requests in flight per file
+#define ASYNC_IO_BLOCK_SIZE (1024 * 1024)    // Bytes per read request
+
+// Asynchronous reads and writes of a regular file
+//
+// Reads are prefetched: ASYNC_IO_DEPTH blocks after the current position are
+// always in flight, a block is requested again as soon as it was handed out.
+// Writes are queued: the caller hands over its filled buffer, gets a free one
+// back and only waits when all requests are still in flight.
+//
+// Requests go through io_uring where the kernel supports it, the syscalls are
+// made directly so there is no library dependency. Otherwise a thread per file
+// runs them with pread and pwrite. A request that transferred less than it
+// asked for (or failed in the ring) is finished synchronously.
+//
+// A request that is in the submission queue can still be taken by the kernel
+// on any later io_uring_enter, so its slot is only done once its completion
+// arrived. When entering the ring fails for good the ring is not entered
+// again: requests the kernel did not take are finished synchronously, the ones
+// it took are waited for.
+
+enum AsyncIoBackend {
+    ASYNC_IO_NONE,    // Synchronous I/O, no AsyncIo is used
+    ASYNC_IO_AUTO,    // io_uring, the thread when the ring can not be set up
+    ASYNC_IO_URING,
+    ASYNC_IO_THREAD
+};
+
+enum AsyncIoSlotState {
+    SLOT_IDLE,     // Not in use
+    SLOT_PENDING,  // Submitted
+    SLOT_DONE,     // Completed, the result was not checked yet
+    SLOT_READY     // Completed and checked
+};
+
+typedef struct {
+    uint8_t* data;
+    size_t capacity;
+    size_t length;    // Bytes requested
+    uint64_t offset;  // In the file
+    ssize_t result;   // Bytes transferred or -errno
+    enum AsyncIoSlotState state;
+    uint32_t m_sq_position;  // Of the request in the submission queue, io_uring only
+} AsyncIoSlot;
+
+typedef struct {
+    int fd;
+    int is_write;
+    enum AsyncIoBackend backend;
+
+    // Used in order: for reads m_next holds the next bytes of the file, for
+    // writes it is the next one to fill
+    AsyncIoSlot m_slots[ASYNC_IO_DEPTH];
+    size_t m_next;
+    size_t m_consumed;      // Bytes of the next read slot that were handed out
+    uint64_t m_position;    // File offset of the next byte handed out or written
+    uint64_t m_submitted;   // File offset the next prefetch starts at
+    int m_eof;
+    int m_failed;
+
+#ifdef ASYNC_IO_HAS_URING
+    int m_ring_fd;
+    uint8_t* m_sq_ring;
+    uint8_t* m_cq_ring;
+    size_t m_sq_ring_size;
+    size_t m_cq_ring_size;
+    struct io_uring_sqe* m_sqes;
+    size_t m_sqes_size;
+    uint32_t* m_sq_head;
+    uint32_t* m_sq_tail;
+    uint32_t* m_sq_mask;
+    uint32_t* m_sq_array;
+    uint32_t* m_cq_head;
+    uint32_t* m_cq_tail;
+    uint32_t* m_cq_mask;
+    struct io_uring_cqe* m_cqes;
+    int m_ring_error;  // errno of the io_uring_enter that failed for good, 0 while the ring works
+#endif
+
+    // Thread backend, m_queue holds slot indices in submission order
+    pthread_t m_thread;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond;
+    size_t m_queue[ASYNC_IO_DEPTH];
+    size_t m_queue_head;
+    size_t m_queue_tail;
+    int m_stop;
+} AsyncIo;
+
+// Blocking transfer of 'length' bytes, retried until done, the end of the file
+// or an error. Returns the amount of bytes or -errno when nothing was transferred
+static ssize_t async_io_transfer(int fd, int is_write, uint8_t* data, size_t length, uint64_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t result = is_write ? pwrite(fd, data + done, length - done, (off_t)(offset + done))
+                                  : pread(fd, data + done, length - done, (off_t)(offset + done));
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return done ? (ssize_t)done : -errno;
+        }
+        if (result == 0) {
+            break;
+        }
+        done += result;
+    }
+
+    return done;
+}
+
+#ifdef ASYNC_IO_HAS_URING
+
+static int async_io_uring_init(AsyncIo* io) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = (int)syscall(__NR_io_uring_setup, ASYNC_IO_DEPTH, &params);
+    if (fd < 0) {
+        return 1;
+    }
+    io->m_ring_fd = fd;
+
+    io->m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    io->m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Newer kernels map both rings with a single mapping
+    int single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && io->m_cq_ring_size > io->m_sq_ring_size) {
+        io->m_sq_ring_size = io->m_cq_ring_size;
+    }
+
+    io->m_sq_ring = (uint8_t*)mmap(NULL, io->m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (io->m_sq_ring == MAP_FAILED) {
+        close(fd);
+        return 1;
+    }
+
+    io->m_cq_ring = io->m_sq_ring;
+    if (!single) {
+        io->m_cq_ring =
+            (uint8_t*)mmap(NULL, io->m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (io->m_cq_ring == MAP_FAILED) {
+            munmap(io->m_sq_ring, io->m_sq_ring_size);
+            close(fd);
+            return 1;
+        }
+    }
+
+    io->m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    io->m_sqes = (struct io_uring_sqe*)mmap(NULL, io->m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                            IORING_OFF_SQES);
+    if (io->m_sqes == MAP_FAILED) {
+        if (!single) {
+            munmap(io->m_cq_ring, io->m_cq_ring_size);
+        }
+        munmap(io->m_sq_ring, io->m_sq_ring_size);
+        close(fd);
+        return 1;
+    }
+
+    io->m_sq_head = (uint32_t*)(io->m_sq_ring + params.sq_off.head);
+    io->m_sq_tail = (uint32_t*)(io->m_sq_ring + params.sq_off.tail);
+    io->m_sq_mask = (uint32_t*)(io->m_sq_ring + params.sq_off.ring_mask);
+    io->m_sq_array = (uint32_t*)(io->m_sq_ring + params.sq_off.array);
+    io->m_cq_head = (uint32_t*)(io->m_cq_ring + params.cq_off.head);
+    io->m_cq_tail = (uint32_t*)(io->m_cq_ring + params.cq_off.tail);
+    io->m_cq_mask = (uint32_t*)(io->m_cq_ring + params.cq_off.ring_mask);
+    io->m_cqes = (struct io_uring_cqe*)(io->m_cq_ring + params.cq_off.cqes);
+
+    return 0;
+}
+
+static void async_io_uring_close(AsyncIo* io) {
+    munmap(io->m_sqes, io->m_sqes_size);
+    if (io->m_cq_ring != io->m_sq_ring) {
+        munmap(io->m_cq_ring, io->m_cq_ring_size);
+    }
+    munmap(io->m_sq_ring, io->m_sq_ring_size);
+    close(io->m_ring_fd);
+}
+
+// Hand the kernel every published request it did not take yet and, with
+// 'wait', wait for a completion. Returns 0 or -errno, a request that was not
+// taken stays in the queue for the next call
+static int async_io_uring_enter(AsyncIo* io, int wait) {
+    uint32_t waiting = *io->m_sq_tail - __atomic_load_n(io->m_sq_head, __ATOMIC_ACQUIRE);
+    if (syscall(__NR_io_uring_enter, io->m_ring_fd, waiting, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+// Out of resources or completions, entering again later can still succeed
+static int async_io_uring_is_transient(int error) {
+    return error == -EINTR || error == -EAGAIN || error == -EBUSY;
+}
+
+// Stop entering the ring. Requests the kernel did not take are never run, they
+// are finished synchronously. The ones it took keep their slots pending until
+// their completions arrive
+static void async_io_uring_fail(AsyncIo* io, int error) {
+    fprintf(stderr, "[AsyncIo] io_uring failed (%s), finishing the requests synchronously\n", strerror(-error));
+    io->m_ring_error = -error;
+
+    uint32_t head = __atomic_load_n(io->m_sq_head, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < ASYNC_IO_DEPTH; i++) {
+        AsyncIoSlot* slot = &io->m_slots[i];
+        if (slot->state == SLOT_PENDING && (int32_t)(slot->m_sq_position - head) >= 0) {
+            slot->result = error;
+            slot->state = SLOT_DONE;
+        }
+    }
+}
+
+static void async_io_uring_submit(AsyncIo* io, size_t index) {
+    AsyncIoSlot* slot = &io->m_slots[index];
+
+    // A ring that failed is not used anymore, the request is finished synchronously
+    if (io->m_ring_error) {
+        slot->result = -io->m_ring_error;
+        slot->state = SLOT_DONE;
+        return;
+    }
+
+    // This thread is the only producer, the kernel only reads the tail
+    uint32_t tail = *io->m_sq_tail;
+    uint32_t entry = tail & *io->m_sq_mask;
+    struct io_uring_sqe* sqe = &io->m_sqes[entry];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = io->is_write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = io->fd;
+    sqe->addr = (uint64_t)(uintptr_t)slot->data;
+    sqe->len = (uint32_t)slot->length;
+    sqe->off = slot->offset;
+    sqe->user_data = index;
+    io->m_sq_array[entry] = entry;
+    slot->m_sq_position = tail;
+    __atomic_store_n(io->m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    // The request is published, when the kernel does not take it now the next
+    // enter in async_io_uring_wait submits it
+    int error;
+    do {
+        error = async_io_uring_enter(io, 0);
+    } while (error == -EINTR);
+    if (error && !async_io_uring_is_transient(error)) {
+        async_io_uring_fail(io, error);
+    }
+}
+
+// Reap completions until the given slot is done
+static void async_io_uring_wait(AsyncIo* io, AsyncIoSlot* slot) {
+    while (slot->state == SLOT_PENDING) {
+        uint32_t head = *io->m_cq_head;
+        if (head != __atomic_load_n(io->m_cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &io->m_cqes[head & *io->m_cq_mask];
+            AsyncIoSlot* done = &io->m_slots[cqe->user_data];
+            done->result = cqe->res;
+            done->state = SLOT_DONE;
+            __atomic_store_n(io->m_cq_head, head + 1, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        // Requests the kernel took before the ring failed still complete without entering it
+        if (io->m_ring_error) {
+            usleep(1000);
+            continue;
+        }
+
+        int error = async_io_uring_enter(io, 1);
+        if (error && !async_io_uring_is_transient(error)) {
+            async_io_uring_fail(io, error);
+        }
+    }
+}
+
+#endif
+
+static void* async_io_thread(void* arg) {
+    AsyncIo* io = (AsyncIo*)arg;
+
+    pthread_mutex_lock(&io->m_mutex);
+    for (;;) {
+        while (io->m_queue_head == io->m_queue_tail && !io->m_stop) {
+            pthread_cond_wait(&io->m_cond, &io->m_mutex);
+        }
+        if (io->m_queue_head == io->m_queue_tail) {
+            break;
+        }
+
+        AsyncIoSlot* slot = &io->m_slots[io->m_queue[io->m_queue_head++ % ASYNC_IO_DEPTH]];
+        pthread_mutex_unlock(&io->m_mutex);
+
+        ssize_t result = async_io_transfer(io->fd, io->is_write, slot->data, slot->length, slot->offset);
+
+        pthread_mutex_lock(&io->m_mutex);
+        slot->result = result;
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&io->m_cond);
+    }
+    pthread_mutex_unlock(&io->m_mutex);
+
+    return NULL;
+}
+
+static void async_io_submit(AsyncIo* io, AsyncIoSlot* slot) {
+    size_t index = (size_t)(slot - io->m_slots);
+    slot->state = SLOT_PENDING;
+
+#ifdef ASYNC_IO_HAS_URING
+    if (io->backend == ASYNC_IO_URING) {
+        async_io_uring_submit(io, index);
+        return;
+    }
+#endif
+
+    pthread_mutex_lock(&io->m_mutex);
+    io->m_queue[io->m_queue_tail++ % ASYNC_IO_DEPTH] = index;
+    pthread_cond_broadcast(&io->m_cond);
+    pthread_mutex_unlock(&io->m_mutex);
+}
+
+// Wait until the request of the slot completed, without checking its result
+static void async_io_wait_done(AsyncIo* io, AsyncIoSlot* slot) {
+#ifdef ASYNC_IO_HAS_URING
+    if (io->backend == ASYNC_IO_URING) {
+        async_io_uring_wait(io, slot);
+        return;
+    }
+#endif
+
+    pthread_mutex_lock(&io->m_mutex);
+    while (slot->state == SLOT_PENDING) {
+        pthread_cond_wait(&io->m_cond, &io->m_mutex);
+    }
+    pthread_mutex_unlock(&io->m_mutex);
+}
+
+// Wait for the slot and finish a short or failed transfer synchronously. A read
+// that stays short ended at the end of the file. Returns 0 on success
+static int async_io_wait(AsyncIo* io, AsyncIoSlot* slot) {
+    if (slot->state == SLOT_IDLE || slot->state == SLOT_READY) {
+        return 0;
+    }
+
+    async_io_wait_done(io, slot);
+    slot->state = SLOT_READY;
+
+    if (slot->result < 0 || (size_t)slot->result < slot->length) {
+        size_t done = slot->result > 0 ? (size_t)slot->result : 0;
+        ssize_t rest = async_io_transfer(io->fd, io->is_write, slot->data + done, slot->length - done, slot->offset + done);
+        if (rest < 0 || (io->is_write && done + rest < slot->length)) {
+            fprintf(stderr, "[AsyncIo] Unable to %s %zu bytes at offset %llu\n", io->is_write ? "write" : "read", slot->length,
+                    (unsigned long long)slot->offset);
+            slot->result = done;
+            io->m_failed = 1;
+            return 1;
+        }
+        slot->result = done + rest;
+    }
+
+    return 0;
+}
+
+static void async_io_submit_read(AsyncIo* io, AsyncIoSlot* slot) {
+    slot->length = ASYNC_IO_BLOCK_SIZE;
+    slot->offset = io->m_submitted;
+    io->m_submitted += ASYNC_IO_BLOCK_SIZE;
+    async_io_submit(io, slot);
+}
+
+// Request the blocks from m_position on, in the order they are handed out
+static void async_io_prefetch(AsyncIo* io) {
+    io->m_next = 0;
+    io->m_consumed = 0;
+    io->m_submitted = io->m_position;
+    io->m_eof = 0;
+    for (size_t i = 0; i < ASYNC_IO_DEPTH; i++) {
+        async_io_submit_read(io, &io->m_slots[i]);
+    }
+}
+
+// Wait for every request in flight, the results of reads are dropped
+static int async_io_drain(AsyncIo* io) {
+    for (size_t i = 0; i < ASYNC_IO_DEPTH; i++) {
+        AsyncIoSlot* slot = &io->m_slots[(io->m_next + i) % ASYNC_IO_DEPTH];
+        if (io->is_write) {
+            async_io_wait(io, slot);
+        } else if (slot->state == SLOT_PENDING) {
+            async_io_wait_done(io, slot);
+        }
+        slot->state = SLOT_IDLE;
+    }
+
+    return io->m_failed;
+}
+
+// Start reading (prefetching) or writing the open descriptor at 'position'.
+// The descriptor stays owned by the caller
+static inline int async_io_open(AsyncIo* io, int fd, int is_write, uint64_t position, enum AsyncIoBackend backend) {
+    memset(io, 0, sizeof(AsyncIo));
+    io->fd = fd;
+    io->is_write = is_write;
+    io->m_position = position;
+
+    io->backend = ASYNC_IO_THREAD;
+#ifdef ASYNC_IO_HAS_URING
+    if (backend != ASYNC_IO_THREAD && async_io_uring_init(io) == 0) {
+        io->backend = ASYNC_IO_URING;
+    } else if (backend == ASYNC_IO_URING) {
+        fprintf(stderr, "[AsyncIo] io_uring is not available, using a thread\n");
+    }
+#else
+    (void)backend;
+#endif
+
+    if (io->backend == ASYNC_IO_THREAD) {
+        pthread_mutex_init(&io->m_mutex, NULL);
+        pthread_cond_init(&io->m_cond, NULL);
+        if (pthread_create(&io->m_thread, NULL, async_io_thread, io)) {
+            fprintf(stderr, "[AsyncIo] Unable to start the I/O thread\n");
+            pthread_mutex_destroy(&io->m_mutex);
+            pthread_cond_destroy(&io->m_cond);
+            io->backend = ASYNC_IO_NONE;
+            return 1;
+        }
+    }
+
+    // Read blocks are allocated here, write blocks are handed over by the caller
+    if (!is_write) {
+        for (size_t i = 0; i < ASYNC_IO_DEPTH; i++) {
+            io->m_slots[i].data = (uint8_t*)malloc(ASYNC_IO_BLOCK_SIZE);
+            io->m_slots[i].capacity = ASYNC_IO_BLOCK_SIZE;
+            INSTRUMENT_COUNT(INSTRUMENT_ALLOCATIONS, 1);
+            if (io->m_slots[i].data == NULL) {
+                fprintf(stderr, "[AsyncIo] Unable to allocate memory for the read blocks\n");
+                io->m_failed = 1;
+                return 1;
+            }
+        }
+        async_io_prefetch(io);
+    }
+
+    return 0;
+}
+
+// Wait for all requests and release everything but the descriptor, pending
+// writes should be flushed with async_io_flush first to see their errors
+static inline void async_io_close(AsyncIo* io) {
+    if (io->backend == ASYNC_IO_NONE) {
+        return;
+    }
+
+    async_io_drain(io);
+
+#ifdef ASYNC_IO_HAS_URING
+    if (io->backend == ASYNC_IO_URING) {
+        async_io_uring_close(io);
+    }
+#endif
+
+    if (io->backend == ASYNC_IO_THREAD) {
+        pthread_mutex_lock(&io->m_mutex);
+        io->m_stop = 1;
+        pthread_cond_broadcast(&io->m_cond);
+        pthread_mutex_unlock(&io->m_mutex);
+        pthread_join(io->m_thread, NULL);
+        pthread_mutex_destroy(&io->m_mutex);
+        pthread_cond_destroy(&io->m_cond);
+    }
+
+    for (size_t i = 0; i < ASYNC_IO_DEPTH; i++) {
+        free(io->m_slots[i].data);
+        io->m_slots[i].data = NULL;
+    }
+    io->backend = ASYNC_IO_NONE;
+}
+
+// Copy the next (at most) 'size' bytes of the file into 'out', only waits when
+// the next block has not arrived yet. Returns the amount of bytes, 0 at the end
+// of the file or -1 on failure
+static inline ssize_t async_io_read(AsyncIo* io, uint8_t* out, size_t size) {
+    size_t total = 0;
+
+    while (total < size && !io->m_eof) {
+        AsyncIoSlot* slot = &io->m_slots[io->m_next];
+        if (async_io_wait(io, slot)) {
+            return -1;
+        }
+
+        size_t available = (size_t)slot->result - io->m_consumed;
+        size_t length = available < size - total ? available : size - total;
+        memcpy(out + total, slot->data + io->m_consumed, length);
+        total += length;
+        io->m_consumed += length;
+        io->m_position += length;
+
+        if (io->m_consumed == (size_t)slot->result) {
+            // A short block is the end of the file
+            if ((size_t)slot->result < slot->length) {
+                io->m_eof = 1;
+                break;
+            }
+
+            // The block is handed out, it goes to the end of the line again
+            async_io_submit_read(io, slot);
+            io->m_next = (io->m_next + 1) % ASYNC_IO_DEPTH;
+            io->m_consumed = 0;
+        }
+    }
+
+    return total;
+}
+
+// Offset of the next byte async_io_read hands out or of the next write
+static inline uint64_t async_io_position(const AsyncIo* io) {
+    return io->m_position;
+}
+
+// Continue reading or writing at 'position', everything in flight is waited for
+static inline int async_io_seek(AsyncIo* io, uint64_t position) {
+    if (async_io_drain(io)) {
+        return 1;
+    }
+
+    io->m_position = position;
+    if (!io->is_write) {
+        async_io_prefetch(io);
+    }
+
+    return 0;
+}
+
+// Queue the first 'length' bytes of *data for writing at the current position.
+// The buffer is taken over and *data is replaced with a free buffer of at least
+// 'capacity' bytes, this only waits when every request is still in flight
+static inline int async_io_write(AsyncIo* io, uint8_t** data, size_t capacity, size_t length) {
+    AsyncIoSlot* slot = &io->m_slots[io->m_next];
+    if (async_io_wait(io, slot)) {
+        return 1;
+    }
+
+    uint8_t* free_block = slot->data;
+    if (slot->capacity < capacity) {
+        free_block = (uint8_t*)realloc(slot->data, capacity);
+        INSTRUMENT_COUNT(INSTRUMENT_ALLOCATIONS, 1);
+        if (free_block == NULL) {
+            fprintf(stderr, "[AsyncIo] Unable to allocate a %zu byte write buffer\n", capacity);
+            return 1;
+        }
+    }
+
+    slot->data = *data;
+    slot->capacity = capacity;
+    slot->length = length;
+    slot->offset = io->m_position;
+    io->m_position += length;
+    async_io_submit(io, slot);
+    io->m_next = (io->m_next + 1) % ASYNC_IO_DEPTH;
+
+    *data = free_block;
+
+    return 0;
+}
+
+// Wait until every queued write is on its way to the disk. Returns 0 when all of them succeeded
+static inline int async_io_flush(AsyncIo* io) {
+    for (size_t i = 0; i < ASYNC_IO_DEPTH; i++) {
+        async_io_wait(io, &io->m_slots[i]);
+    }
+
+    return io->m_failed;
+}
@@ -4,7 +4,13 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "async_io.h"
+#include "instrument.h"
 
 enum EndianType {
     BE,  // Big Endian
@@ -13,6 +19,8 @@ enum EndianType {
 
 enum HasFinished { Yes, No };
 
+#define BYTE_BUFFER_UNKNOWN_SIZE SIZE_MAX  // Remaining bytes of a stream that has not ended yet
+
 typedef struct {
     uint8_t *m_buffer;
     size_t m_offset;
@@ -22,12 +30,74 @@ typedef struct {
 
     FILE *m_file;
 
+    // Non-zero when m_buffer is a read only mapping of the whole file
+    size_t m_mapped_size;
+
+    // Non-zero when reading a pipe or socket, m_buffer then has this size
+    size_t m_capacity;
+
+    size_t m_allocated;  // Size of m_buffer for buffered file reads, it only grows
+
+    // Reads or writes go through asynchronous I/O, reads then work like a stream
+    AsyncIo *m_async;
+
     enum HasFinished m_finished;
 } ByteBuffer;
 
+// Move the unread bytes to the front and append whatever the stream has
+// available. The buffer only grows when a single read asks for more than it holds
+static int load_stream_into_buffer(ByteBuffer *buffer) {
+    INSTRUMENT_START(start);
+    size_t unread = buffer->m_size - buffer->m_offset;
+    memmove(buffer->m_buffer, buffer->m_buffer + buffer->m_offset, unread);
+    buffer->m_size = unread;
+    buffer->m_offset = 0;
+
+    if (unread == buffer->m_capacity) {
+        uint8_t *grown = (uint8_t *)realloc(buffer->m_buffer, buffer->m_capacity * 2);
+        INSTRUMENT_COUNT(INSTRUMENT_ALLOCATIONS, 1);
+        if (grown == NULL) {
+            fprintf(stderr, "[ByteBuffer] Unable to grow stream buffer to %zu bytes\n", buffer->m_capacity * 2);
+            buffer->m_finished = Yes;
+            return 0;
+        }
+        buffer->m_buffer = grown;
+        buffer->m_capacity *= 2;
+    }
+
+    ssize_t len;
+    if (buffer->m_async) {
+        len = async_io_read(buffer->m_async, buffer->m_buffer + unread, buffer->m_capacity - unread);
+    } else {
+        do {
+            len = read(fileno(buffer->m_file), buffer->m_buffer + unread, buffer->m_capacity - unread);
+        } while (len < 0 && errno == EINTR);
+    }
+
+    // The writer closed its end, nothing will follow
+    if (len <= 0) {
+        if (len < 0) {
+            fprintf(stderr, "[ByteBuffer] Unable to read from stream\n");
+        }
+        buffer->m_remaining = 0;
+        buffer->m_finished = Yes;
+        return 0;
+    }
+
+    buffer->m_size += len;
+    INSTRUMENT_STOP(INSTRUMENT_REFILL, start);
+
+    return len;
+}
+
 // Try loading the given amount (m_read_size) of data from given file (m_file)
 // into the given buffer
 static int load_data_into_buffer(ByteBuffer *buffer) {
+    if (buffer->m_capacity) {
+        return load_stream_into_buffer(buffer);
+    }
+
+    INSTRUMENT_START(start);
     size_t read = buffer->m_read_size;
     if (buffer->m_remaining < read) {
         read = buffer->m_remaining;
@@ -36,21 +106,31 @@ static int load_data_into_buffer(ByteBuffer *buffer) {
     // First ever read
     if (buffer->m_buffer == NULL) {
         buffer->m_buffer = (uint8_t *)malloc(sizeof(uint8_t) * read);
+        INSTRUMENT_COUNT(INSTRUMENT_ALLOCATIONS, 1);
         if (buffer->m_buffer == NULL) {
             fprintf(stderr, "[ByteBuffer] Unable to allocate data for first file read\n");
             return 0;
         }
+        buffer->m_allocated = read;
         buffer->m_size = 0;
-    } else if (buffer->m_offset < buffer->m_size) {  // There is still unread data
+    } else {
+        // Put the unread bytes in front, the buffer only grows when a single read
+        // needs more than it ever held
         size_t remaining = buffer->m_size - buffer->m_offset;
-
-        // Put the last bytes in front
         memmove(buffer->m_buffer, buffer->m_buffer + buffer->m_offset, remaining);
-        buffer->m_buffer = (uint8_t *)realloc(buffer->m_buffer, read + remaining);
-
         buffer->m_size = remaining;
-    } else if (buffer->m_offset == buffer->m_size) {  // There is no data left
-        buffer->m_size = 0;
+
+        if (read + remaining > buffer->m_allocated) {
+            uint8_t *grown = (uint8_t *)realloc(buffer->m_buffer, read + remaining);
+            INSTRUMENT_COUNT(INSTRUMENT_ALLOCATIONS, 1);
+            if (grown == NULL) {
+                fprintf(stderr, "[ByteBuffer] Unable to grow the read buffer to %zu bytes\n", read + remaining);
+                buffer->m_finished = Yes;
+                return 0;
+            }
+            buffer->m_buffer = grown;
+            buffer->m_allocated = read + remaining;
+        }
     }
 
     size_t len = fread(buffer->m_buffer + buffer->m_size, sizeof(uint8_t), read, buffer->m_file);
@@ -65,6 +145,8 @@ static int load_data_into_buffer(ByteBuffer *buffer) {
     buffer->m_remaining -= len;
     buffer->m_offset = 0;
 
+    INSTRUMENT_STOP(INSTRUMENT_REFILL, start);
+
     return len;
 }
 
@@ -82,6 +164,12 @@ static inline int byte_buffer_init(ByteBuffer **buffer, FILE *fp, size_t size, s
     (*buffer)->m_file = fp;
     (*buffer)->m_offset = 0;
     (*buffer)->m_read_size = read_size;
+    (*buffer)->m_buffer = NULL;
+    (*buffer)->m_size = 0;
+    (*buffer)->m_mapped_size = 0;
+    (*buffer)->m_capacity = 0;
+    (*buffer)->m_allocated = 0;
+    (*buffer)->m_async = NULL;
 
     // This is a buffer made for writing
     if (read_size == 0) {
@@ -94,10 +182,110 @@ static inline int byte_buffer_init(ByteBuffer **buffer, FILE *fp, size_t size, s
     return 0;
 }
 
+// Initialize a byte buffer that reads directly from a memory mapping of the
+// given file, there are no refills and no copies. The file is read sequentially
+// so the kernel is asked to read ahead aggressively and drop pages behind us
+static inline int byte_buffer_init_mmap(ByteBuffer **buffer, FILE *fp, size_t size) {
+    if (size == 0) {
+        fprintf(stderr, "[ByteBuffer] Unable to map an empty file\n");
+        return 1;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "[ByteBuffer] Unable to map file into memory\n");
+        return 1;
+    }
+
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    if (byte_buffer_init(buffer, fp, 0, size)) {
+        munmap(map, size);
+        return 1;
+    }
+
+    (*buffer)->m_buffer = (uint8_t *)map;
+    (*buffer)->m_size = size;
+    (*buffer)->m_mapped_size = size;
+
+    return 0;
+}
+
+// Initialize a byte buffer that reads a pipe, socket or terminal whose length
+// is not known. The stream ends when a read returns no data
+static inline int byte_buffer_init_stream(ByteBuffer **buffer, FILE *fp, size_t size) {
+    if (byte_buffer_init(buffer, fp, BYTE_BUFFER_UNKNOWN_SIZE, size)) {
+        return 1;
+    }
+
+    (*buffer)->m_buffer = (uint8_t *)malloc(sizeof(uint8_t) * size);
+    if ((*buffer)->m_buffer == NULL) {
+        fprintf(stderr, "[ByteBuffer] Unable to allocate %zu bytes for the stream buffer\n", size);
+        free(*buffer);
+        *buffer = NULL;
+        return 1;
+    }
+    (*buffer)->m_capacity = size;
+
+    return 0;
+}
+
+// Read (a stream buffer) or write the file of the buffer asynchronously from the
+// current file position on, see async_io.h. Returns 0 on success
+static inline int byte_buffer_attach_async(ByteBuffer *buffer, enum AsyncIoBackend backend) {
+    int is_write = buffer->m_read_size == 0;
+    if (is_write && fflush(buffer->m_file)) {
+        return 1;
+    }
+
+    off_t position = ftello(buffer->m_file);
+    if (position < 0) {
+        fprintf(stderr, "[ByteBuffer] Asynchronous I/O needs a seekable file\n");
+        return 1;
+    }
+
+    buffer->m_async = (AsyncIo *)malloc(sizeof(AsyncIo));
+    if (buffer->m_async == NULL) {
+        fprintf(stderr, "[ByteBuffer] Unable to allocate memory for AsyncIo\n");
+        return 1;
+    }
+
+    if (async_io_open(buffer->m_async, fileno(buffer->m_file), is_write, (uint64_t)position, backend)) {
+        async_io_close(buffer->m_async);
+        free(buffer->m_async);
+        buffer->m_async = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Wait for all asynchronous writes and go back to synchronous I/O. The file
+// position is not moved by asynchronous writes, it is set to their end
+static inline int byte_buffer_detach_async(ByteBuffer *buffer) {
+    if (buffer->m_async == NULL) {
+        return 0;
+    }
+
+    int failed = async_io_flush(buffer->m_async);
+    uint64_t position = async_io_position(buffer->m_async);
+    async_io_close(buffer->m_async);
+    free(buffer->m_async);
+    buffer->m_async = NULL;
+
+    return failed || fseeko(buffer->m_file, (off_t)position, SEEK_SET);
+}
+
 // Close and free the ByteBuffer
 static inline int byte_buffer_close(ByteBuffer *buffer) {
     if (buffer) {
-        if (buffer->m_buffer) {
+        if (buffer->m_async) {
+            async_io_close(buffer->m_async);
+            free(buffer->m_async);
+        }
+        if (buffer->m_mapped_size) {
+            munmap(buffer->m_buffer, buffer->m_mapped_size);
+        } else if (buffer->m_buffer) {
             free(buffer->m_buffer);
         }
 
@@ -111,24 +299,150 @@ static inline int byte_buffer_close(ByteBuffer *buffer) {
 // if not try loading more data.
 // If no data can be read the m_finished flag is set accordingly
 static inline int byte_buffer_has_remaining(ByteBuffer *buffer, uint8_t remaining) {
-    if (buffer->m_size - buffer->m_offset >= remaining) {
-        return 1;
+    // A stream can hand out less than was asked for, so load until there is enough
+    while (buffer->m_size - buffer->m_offset < remaining) {
+        // Buffer made for writing does not need to load data
+        if (buffer->m_read_size == 0) {
+            return 0;
+        }
+
+        if (!buffer->m_remaining) {
+            buffer->m_finished = Yes;
+            return 0;
+        }
+
+        if (!load_data_into_buffer(buffer)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Get a pointer to the next (at most) 'size' contiguous bytes and advance past
+// them, more data is loaded when needed. The amount of bytes available is
+// stored in 'available', the pointer is valid until the next read
+static inline const uint8_t *byte_buffer_read_bytes(ByteBuffer *buffer, size_t size, size_t *available) {
+    while (buffer->m_size - buffer->m_offset < size && buffer->m_read_size != 0 && buffer->m_remaining) {
+        if (!load_data_into_buffer(buffer)) {
+            break;
+        }
+    }
+
+    size_t length = buffer->m_size - buffer->m_offset;
+    if (length > size) {
+        length = size;
+    }
+
+    const uint8_t *data = buffer->m_buffer + buffer->m_offset;
+    buffer->m_offset += length;
+    *available = length;
+    INSTRUMENT_COUNT(INSTRUMENT_BYTES_READ, length);
+
+    if (length < size) {
+        buffer->m_finished = Yes;
     }
 
-    // Buffer made for writing does not need to load data
-    if (buffer->m_read_size == 0) {
+    return data;
+}
+
+// Skip 'size' bytes without reading them, the file is seeked past whatever is not
+// buffered yet. Returns 0 when all bytes could be skipped
+static inline int byte_buffer_skip(ByteBuffer *buffer, uint64_t size) {
+    size_t buffered = buffer->m_size - buffer->m_offset;
+    if (size <= buffered) {
+        buffer->m_offset += size;
         return 0;
     }
 
-    if (!buffer->m_remaining) {
+    buffer->m_offset = buffer->m_size;
+    size -= buffered;
+
+    if (buffer->m_async) {
+        buffer->m_remaining = BYTE_BUFFER_UNKNOWN_SIZE;
+        return async_io_seek(buffer->m_async, async_io_position(buffer->m_async) + size);
+    }
+
+    // Streams can not seek, the bytes are read and dropped
+    while (buffer->m_capacity && size > 0) {
+        if (!load_data_into_buffer(buffer)) {
+            return 1;
+        }
+        size_t length = buffer->m_size < size ? buffer->m_size : (size_t)size;
+        buffer->m_offset = length;
+        size -= length;
+    }
+    if (buffer->m_capacity) {
+        return 0;
+    }
+
+    if (buffer->m_mapped_size || size > buffer->m_remaining || fseeko(buffer->m_file, (off_t)size, SEEK_CUR)) {
         buffer->m_finished = Yes;
+        return 1;
+    }
+
+    // Nothing that is buffered lines up with the file position anymore
+    buffer->m_remaining -= size;
+    buffer->m_offset = 0;
+    buffer->m_size = 0;
+
+    return 0;
+}
+
+// Continue reading at byte 'position' of the file. Bytes that are still
+// buffered are reused, otherwise the file is seeked and the next read refills
+// the buffer. Streams can not seek, returns 0 on success
+static inline int byte_buffer_seek(ByteBuffer *buffer, uint64_t position) {
+    // The buffered bytes end where the asynchronous reads continue
+    if (buffer->m_async) {
+        uint64_t end = async_io_position(buffer->m_async);
+        uint64_t start = end - buffer->m_size;
+        if (position >= start && position <= end) {
+            buffer->m_offset = position - start;
+        } else if (async_io_seek(buffer->m_async, position) == 0) {
+            buffer->m_offset = 0;
+            buffer->m_size = 0;
+        } else {
+            return 1;
+        }
+        buffer->m_remaining = BYTE_BUFFER_UNKNOWN_SIZE;
+        buffer->m_finished = No;
         return 0;
     }
 
-    if (load_data_into_buffer(buffer)) {
+    if (buffer->m_capacity || buffer->m_read_size == 0) {
         return 1;
     }
 
+    if (buffer->m_mapped_size) {
+        if (position > buffer->m_mapped_size) {
+            return 1;
+        }
+        buffer->m_offset = position;
+        buffer->m_finished = No;
+        return 0;
+    }
+
+    // The buffered bytes end at the current position of the file
+    off_t end = ftello(buffer->m_file);
+    if (end < 0) {
+        return 1;
+    }
+
+    uint64_t start = (uint64_t)end - buffer->m_size;
+    uint64_t total = (uint64_t)end + buffer->m_remaining;
+    if (position >= start && position <= (uint64_t)end) {
+        buffer->m_offset = position - start;
+    } else if (position <= total && fseeko(buffer->m_file, (off_t)position, SEEK_SET) == 0) {
+        buffer->m_remaining = total - position;
+        buffer->m_offset = 0;
+        buffer->m_size = 0;
+    } else {
+        return 1;
+    }
+
+    buffer->m_finished = No;
+
     return 0;
 }
 
@@ -173,10 +487,10 @@ static inline int32_t byte_buffer_read_int32(ByteBuffer *buffer, enum EndianType
     int32_t ret;
 
     if (type == BE) {
-        ret = buffer->m_buffer[buffer->m_offset + 0] << 24 | buffer->m_buffer[buffer->m_offset + 1] << 16 |
+        ret = (uint32_t)buffer->m_buffer[buffer->m_offset + 0] << 24 | buffer->m_buffer[buffer->m_offset + 1] << 16 |
               buffer->m_buffer[buffer->m_offset + 2] << 8 | buffer->m_buffer[buffer->m_offset + 3];
     } else {
-        ret = buffer->m_buffer[buffer->m_offset + 3] << 24 | buffer->m_buffer[buffer->m_offset + 2] << 16 |
+        ret = (uint32_t)buffer->m_buffer[buffer->m_offset + 3] << 24 | buffer->m_buffer[buffer->m_offset + 2] << 16 |
               buffer->m_buffer[buffer->m_offset + 1] << 8 | buffer->m_buffer[buffer->m_offset + 0];
     }
 
@@ -237,8 +551,48 @@ static inline int byte_buffer_write_int32(ByteBuffer *buffer, int32_t num, enum
     return 1;
 }
 
-static inline void byte_buffer_write_buffer(ByteBuffer *buffer) {
-    for (size_t i = 0; i < buffer->m_remaining; i++) {
-        fputc(buffer->m_buffer[i], buffer->m_file);
+// Make sure a buffer made for writing can hold 'size' more bytes, the bytes
+// already in the buffer are kept
+static inline int byte_buffer_reserve(ByteBuffer *buffer, size_t size) {
+    if (buffer->m_size - buffer->m_offset >= size) {
+        return 0;
     }
-}
\ No newline at end of file
+
+    uint8_t *data = (uint8_t *)realloc(buffer->m_buffer, buffer->m_offset + size);
+    INSTRUMENT_COUNT(INSTRUMENT_ALLOCATIONS, 1);
+    if (data == NULL) {
+        fprintf(stderr, "[ByteBuffer] Unable to grow write buffer to %zu bytes\n", buffer->m_offset + size);
+        return 1;
+    }
+
+    buffer->m_buffer = data;
+    buffer->m_size = buffer->m_offset + size;
+    buffer->m_remaining = buffer->m_size;
+
+    return 0;
+}
+
+// Write the bytes in the buffer (up to m_offset) to the file with a single call
+// and empty the buffer so it can be filled again
+static inline int byte_buffer_write_buffer(ByteBuffer *buffer) {
+    size_t size = buffer->m_offset;
+    buffer->m_offset = 0;
+    if (size == 0) {
+        return 0;
+    }
+
+    INSTRUMENT_START(start);
+    if (buffer->m_async) {
+        // The filled buffer is queued as is and a free one takes its place
+        if (async_io_write(buffer->m_async, &buffer->m_buffer, buffer->m_size, size)) {
+            return 1;
+        }
+    } else if (fwrite(buffer->m_buffer, sizeof(uint8_t), size, buffer->m_file) != size) {
+        fprintf(stderr, "[ByteBuffer] Unable to write to file\n");
+        return 1;
+    }
+    INSTRUMENT_COUNT(INSTRUMENT_BYTES_WRITTEN, size);
+    INSTRUMENT_STOP(INSTRUMENT_WRITE, start);
+
+    return 0;
+}
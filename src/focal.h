@@ -0,0 +1,278 @@
+#pragma once
+
+#include <limits.h>
+
+#include "wav_decoder.h"
+#include "wav_resampler.h"
+
+// Embeddable pull API
+//
+// A stream is opened once and then pulled from: every focal_read resamples just
+// enough of the input to fill the caller's buffer with the requested amount of
+// frames, interleaved or planar. Once a stream is open all of its memory is
+// sized (the decoder block, the filter history and one chunk of output), so
+// reading allocates nothing and prints nothing.
+//
+// When the caller asks for at least a whole chunk of interleaved frames the
+// resampler writes straight into the caller's buffer. Otherwise a chunk is
+// resampled into the stream and handed out over as many reads as it takes.
+//
+// Every function returns FOCAL_OK or a negative FocalError. The lower layers
+// also describe what went wrong on standard error, but only on those failures.
+
+enum FocalError {
+    FOCAL_OK = 0,
+    FOCAL_ERROR_ARGUMENT = -1,  // Invalid configuration, buffer or position
+    FOCAL_ERROR_OPEN = -2,      // The input could not be opened
+    FOCAL_ERROR_FORMAT = -3,    // Not a WAV file, or a sample format that is not supported
+    FOCAL_ERROR_MEMORY = -4,    // Opening the stream ran out of memory
+    FOCAL_ERROR_READ = -5,      // Decoding or resampling failed in the middle of the stream
+};
+
+typedef struct {
+    uint32_t sample_rate;      // Of the frames that are read, 0 keeps the rate of the input
+    uint16_t num_of_channels;  // Of the frames that are read, 0 keeps the channels of the input
+    const WavMixer* mixer;     // NULL for the default channel mapping, has to outlive the stream
+    enum AsyncIoBackend io;    // ASYNC_IO_NONE maps the input
+} FocalConfig;
+
+typedef struct {
+    // Set by focal_open
+    uint32_t in_sample_rate;
+    uint16_t in_channels;
+    uint32_t sample_rate;
+    uint16_t num_of_channels;
+    uint64_t frames;  // Frames the whole stream resamples to, 0 for a stream of unknown length
+
+    WavDecoder m_decoder;
+    WavResampler m_resampler;
+    WavData m_pending;        // Resampled frames that were not read yet
+    size_t m_pending_offset;  // Frames of m_pending that were already read
+    size_t m_chunk_frames;    // Most frames one decoded chunk or the flush resamples to
+    int m_flushed;
+} FocalStream;
+
+static inline void focal_config_init(FocalConfig* config) {
+    config->sample_rate = 0;
+    config->num_of_channels = 0;
+    config->mixer = NULL;
+    config->io = ASYNC_IO_NONE;
+}
+
+static inline const char* focal_error_string(int error) {
+    switch (error) {
+        case FOCAL_OK:
+            return "no error";
+        case FOCAL_ERROR_ARGUMENT:
+            return "invalid argument";
+        case FOCAL_ERROR_OPEN:
+            return "unable to open the input";
+        case FOCAL_ERROR_FORMAT:
+            return "unsupported input format";
+        case FOCAL_ERROR_MEMORY:
+            return "out of memory";
+        case FOCAL_ERROR_READ:
+            return "unable to read the input";
+        default:
+            return "unknown error";
+    }
+}
+
+static inline void focal_close(FocalStream* stream) {
+    wav_decoder_close(&stream->m_decoder);
+    wav_resampler_close(&stream->m_resampler);
+    wav_data_free(&stream->m_pending);
+}
+
+// Everything besides the decoder, which is already open
+static int focal_start(FocalStream* stream, const FocalConfig* config) {
+    WavDecoder* decoder = &stream->m_decoder;
+    WavResampler* resampler = &stream->m_resampler;
+
+    if (wav_decoder_get_header(decoder)) {
+        wav_decoder_close(decoder);
+        return FOCAL_ERROR_FORMAT;
+    }
+
+    stream->in_sample_rate = decoder->header->sample_rate;
+    stream->in_channels = decoder->header->num_of_channels;
+    stream->sample_rate = config->sample_rate ? config->sample_rate : stream->in_sample_rate;
+    stream->num_of_channels = config->num_of_channels ? config->num_of_channels : stream->in_channels;
+    if (stream->num_of_channels > MIXER_MAX_CHANNELS || stream->in_channels > MIXER_MAX_CHANNELS) {
+        wav_decoder_close(decoder);
+        return FOCAL_ERROR_ARGUMENT;
+    }
+
+    wav_data_init(&stream->m_pending);
+    if (wav_resampler_init(resampler, stream->in_sample_rate, stream->sample_rate, (uint8_t)stream->num_of_channels)) {
+        focal_close(stream);
+        return FOCAL_ERROR_MEMORY;
+    }
+    if (config->mixer && wav_resampler_set_mixer(resampler, config->mixer)) {
+        focal_close(stream);
+        return FOCAL_ERROR_ARGUMENT;
+    }
+
+    // A chunk covers at most DECODER_SAMPLE_SIZE more input, the flush at most
+    // the half of the filter that reaches past the end. The history keeps less
+    // than a filter length between chunks
+    stream->m_chunk_frames = wav_resampler_output_size(resampler, DECODER_SAMPLE_SIZE + resampler->taps) + 1;
+    if (wav_resampler_reserve(resampler, DECODER_SAMPLE_SIZE + resampler->taps) ||
+        wav_data_reserve(&stream->m_pending, stream->m_chunk_frames, (uint8_t)stream->num_of_channels)) {
+        focal_close(stream);
+        return FOCAL_ERROR_MEMORY;
+    }
+
+    stream->frames = wav_decoder_is_unbounded(decoder) ? 0 : wav_resampler_output_size(resampler, decoder->nr_of_samples);
+    stream->m_pending_offset = 0;
+    stream->m_flushed = 0;
+
+    return FOCAL_OK;
+}
+
+// Open the WAV file at 'path', "-" is not special. Returns FOCAL_OK or a FocalError,
+// the stream only has to be closed when it was opened
+static inline int focal_open(FocalStream* stream, const char* path, const FocalConfig* config) {
+    if (stream == NULL || path == NULL || config == NULL) {
+        return FOCAL_ERROR_ARGUMENT;
+    }
+
+    WavDecoder* decoder = &stream->m_decoder;
+    if (config->io != ASYNC_IO_NONE ? wav_decoder_init_async(decoder, path, config->io) : wav_decoder_init_mmap(decoder, path)) {
+        int error = decoder->fp == NULL ? FOCAL_ERROR_OPEN : FOCAL_ERROR_MEMORY;
+        wav_decoder_close(decoder);
+        return error;
+    }
+
+    return focal_start(stream, config);
+}
+
+// Open a stream on a descriptor, like a pipe or a socket. The stream takes over
+// the descriptor, see wav_decoder_init_fd
+static inline int focal_open_fd(FocalStream* stream, int fd, const FocalConfig* config) {
+    if (stream == NULL || fd < 0 || config == NULL) {
+        return FOCAL_ERROR_ARGUMENT;
+    }
+
+    WavDecoder* decoder = &stream->m_decoder;
+    if (wav_decoder_init_fd(decoder, fd)) {
+        int error = decoder->fp == NULL ? FOCAL_ERROR_OPEN : FOCAL_ERROR_MEMORY;
+        wav_decoder_close(decoder);
+        return error;
+    }
+
+    return focal_start(stream, config);
+}
+
+// Resample the next chunk into 'out', which holds at least m_chunk_frames.
+// Returns the amount of frames, which can be 0 before the end, or a FocalError
+static int focal_resample_chunk(FocalStream* stream, WavData* out) {
+    int result;
+    int samples = wav_decoder_get_next_samples(&stream->m_decoder);
+    if (samples > 0) {
+        result = wav_resampler_process(&stream->m_resampler, stream->m_decoder.data, out);
+    } else if (samples == 0) {
+        result = wav_resampler_flush(&stream->m_resampler, out);
+        stream->m_flushed = 1;
+    } else {
+        return FOCAL_ERROR_READ;
+    }
+
+    return result < 0 ? FOCAL_ERROR_READ : result;
+}
+
+// Copy frames [offset, offset + count) of the pending chunk to frame 'position'
+// of a caller buffer that holds 'frames' frames in 'layout'
+static void focal_copy(const FocalStream* stream, size_t offset, size_t count, float* out, size_t position, size_t frames,
+                       enum WavDataLayout layout) {
+    const uint16_t channels = stream->num_of_channels;
+    const float* in = stream->m_pending.m_data + offset * channels;
+
+    if (layout == LAYOUT_INTERLEAVED) {
+        memcpy(out + position * channels, in, sizeof(float) * count * channels);
+        return;
+    }
+
+    for (uint16_t c = 0; c < channels; c++) {
+        float* channel = out + c * frames + position;
+        for (size_t i = 0; i < count; i++) {
+            channel[i] = in[i * channels + c];
+        }
+    }
+}
+
+// Read up to 'frames' frames into 'out'. Interleaved frame i of channel c is
+// out[i * num_of_channels + c], planar it is out[c * frames + i] like WavData.
+// Returns the amount of frames read, fewer only at the end of the stream, 0
+// once it ended, or a FocalError
+static inline long focal_read(FocalStream* stream, float* out, size_t frames, enum WavDataLayout layout) {
+    if (stream == NULL || (out == NULL && frames) || frames > LONG_MAX) {
+        return FOCAL_ERROR_ARGUMENT;
+    }
+
+    const uint16_t channels = stream->num_of_channels;
+    size_t done = 0;
+
+    while (done < frames) {
+        size_t pending = stream->m_pending.nr_of_samples - stream->m_pending_offset;
+        if (pending) {
+            size_t count = pending < frames - done ? pending : frames - done;
+            focal_copy(stream, stream->m_pending_offset, count, out, done, frames, layout);
+            stream->m_pending_offset += count;
+            done += count;
+            continue;
+        }
+        if (stream->m_flushed) {
+            break;
+        }
+
+        // Without anything pending, a chunk that fits goes straight into the caller's buffer
+        int result;
+        if (layout == LAYOUT_INTERLEAVED && frames - done >= stream->m_chunk_frames) {
+            WavData direct;
+            wav_data_init(&direct);
+            direct.m_data = out + done * channels;
+            direct.capacity = frames - done;
+            direct.nr_of_channels = (uint8_t)channels;
+            direct.m_borrowed = 1;
+
+            result = focal_resample_chunk(stream, &direct);
+            if (result > 0) {
+                done += result;
+            }
+        } else {
+            stream->m_pending_offset = 0;
+            result = focal_resample_chunk(stream, &stream->m_pending);
+        }
+
+        if (result < 0) {
+            return result;
+        }
+    }
+
+    return (long)done;
+}
+
+// Continue reading at output frame 'frame'. Only the input under the filter of
+// that frame is decoded again, the frames read afterwards are identical to
+// reading the whole stream. Streams can only move forward
+static inline int focal_seek(FocalStream* stream, uint64_t frame) {
+    if (stream == NULL || (stream->frames && frame > stream->frames)) {
+        return FOCAL_ERROR_ARGUMENT;
+    }
+
+    uint64_t first_input, end_input;
+    wav_resampler_input_range(&stream->m_resampler, frame, frame + 1, &first_input, &end_input);
+
+    wav_resampler_reset(&stream->m_resampler);
+    wav_resampler_seek(&stream->m_resampler, frame);
+    if (wav_decoder_seek(&stream->m_decoder, first_input)) {
+        return FOCAL_ERROR_ARGUMENT;
+    }
+
+    stream->m_pending.nr_of_samples = 0;
+    stream->m_pending_offset = 0;
+    stream->m_flushed = 0;
+
+    return FOCAL_OK;
+}
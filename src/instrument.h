@@ -0,0 +1,175 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// Stage timers and counters
+//
+// Compiled in with -DFOCAL_INSTRUMENT (make INSTRUMENT=1), with
+// -DFOCAL_INSTRUMENT=2 every stage also gets a latency histogram of its calls.
+// Without it the macros expand to nothing and the dump functions fail.
+//
+// Every call of a stage processes one chunk, its duration is measured with the
+// monotonic clock and added with relaxed atomics. Times are summed over all
+// threads, so with several workers a stage can take longer than the run.
+
+enum InstrumentStage {
+    INSTRUMENT_REFILL,    // Reading the input file into the byte buffer
+    INSTRUMENT_DECODE,    // PCM to float
+    INSTRUMENT_RESAMPLE,  // Mixing and filtering, including the flush
+    INSTRUMENT_ENCODE,    // Float to PCM
+    INSTRUMENT_WRITE,     // Writing the output buffer to the file
+    INSTRUMENT_NR_OF_STAGES
+};
+
+enum InstrumentCounter {
+    INSTRUMENT_BYTES_READ,
+    INSTRUMENT_SAMPLES_DECODED,
+    INSTRUMENT_SAMPLES_RESAMPLED,
+    INSTRUMENT_SAMPLES_ENCODED,
+    INSTRUMENT_BYTES_WRITTEN,
+    INSTRUMENT_ALLOCATIONS,  // Sample blocks and I/O buffers that were allocated or grown
+    INSTRUMENT_NR_OF_COUNTERS
+};
+
+#ifdef FOCAL_INSTRUMENT
+
+#define INSTRUMENT_ENABLED 1
+#define INSTRUMENT_HISTOGRAM_BUCKETS 40  // Bucket b counts the calls that took less than 2^b ns
+
+static const char* const instrument_stage_names[INSTRUMENT_NR_OF_STAGES] = {"refill", "decode", "resample", "encode", "write"};
+static const char* const instrument_counter_names[INSTRUMENT_NR_OF_COUNTERS] = {
+    "bytes_read", "samples_decoded", "samples_resampled", "samples_encoded", "bytes_written", "allocations"};
+
+typedef struct {
+    uint64_t calls;
+    uint64_t nanoseconds;
+    uint64_t histogram[INSTRUMENT_HISTOGRAM_BUCKETS];
+} InstrumentStageStats;
+
+typedef struct {
+    InstrumentStageStats stages[INSTRUMENT_NR_OF_STAGES];
+    uint64_t counters[INSTRUMENT_NR_OF_COUNTERS];
+} InstrumentStats;
+
+static InstrumentStats instrument_stats;
+
+static inline uint64_t instrument_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline void instrument_stage(enum InstrumentStage stage, uint64_t start) {
+    uint64_t elapsed = instrument_now() - start;
+    InstrumentStageStats* stats = &instrument_stats.stages[stage];
+    __atomic_add_fetch(&stats->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->nanoseconds, elapsed, __ATOMIC_RELAXED);
+
+#if FOCAL_INSTRUMENT >= 2
+    uint32_t bucket = elapsed ? 64 - __builtin_clzll(elapsed) : 0;
+    if (bucket >= INSTRUMENT_HISTOGRAM_BUCKETS) {
+        bucket = INSTRUMENT_HISTOGRAM_BUCKETS - 1;
+    }
+    __atomic_add_fetch(&stats->histogram[bucket], 1, __ATOMIC_RELAXED);
+#endif
+}
+
+#define INSTRUMENT_START(timer) const uint64_t timer = instrument_now()
+#define INSTRUMENT_STOP(stage, timer) instrument_stage(stage, timer)
+#define INSTRUMENT_COUNT(counter, n) __atomic_add_fetch(&instrument_stats.counters[counter], (uint64_t)(n), __ATOMIC_RELAXED)
+
+static inline int instrument_dump_json(FILE* fp) {
+    fprintf(fp, "{\n  \"stages\": {");
+    for (int s = 0; s < INSTRUMENT_NR_OF_STAGES; s++) {
+        const InstrumentStageStats* stats = &instrument_stats.stages[s];
+        fprintf(fp, "%s\n    \"%s\": {\"calls\": %llu, \"seconds\": %.9f", s ? "," : "", instrument_stage_names[s],
+                (unsigned long long)stats->calls, stats->nanoseconds * 1e-9);
+
+#if FOCAL_INSTRUMENT >= 2
+        // Only the buckets that were hit, as [upper bound in ns, calls] pairs
+        fprintf(fp, ", \"histogram\": [");
+        int first = 1;
+        for (int b = 0; b < INSTRUMENT_HISTOGRAM_BUCKETS; b++) {
+            if (stats->histogram[b]) {
+                fprintf(fp, "%s[%llu, %llu]", first ? "" : ", ", 1ULL << b, (unsigned long long)stats->histogram[b]);
+                first = 0;
+            }
+        }
+        fprintf(fp, "]");
+#endif
+        fprintf(fp, "}");
+    }
+
+    fprintf(fp, "\n  },\n  \"counters\": {");
+    for (int c = 0; c < INSTRUMENT_NR_OF_COUNTERS; c++) {
+        fprintf(fp, "%s\n    \"%s\": %llu", c ? "," : "", instrument_counter_names[c],
+                (unsigned long long)instrument_stats.counters[c]);
+    }
+    fprintf(fp, "\n  }\n}\n");
+
+    return ferror(fp);
+}
+
+// Prometheus text exposition format
+static inline int instrument_dump_prometheus(FILE* fp) {
+    fprintf(fp, "# HELP focal_stage_seconds_total Time spent in a stage, summed over all threads\n");
+    fprintf(fp, "# TYPE focal_stage_seconds_total counter\n");
+    for (int s = 0; s < INSTRUMENT_NR_OF_STAGES; s++) {
+        fprintf(fp, "focal_stage_seconds_total{stage=\"%s\"} %.9f\n", instrument_stage_names[s],
+                instrument_stats.stages[s].nanoseconds * 1e-9);
+    }
+
+    fprintf(fp, "# HELP focal_stage_calls_total Chunks processed by a stage\n");
+    fprintf(fp, "# TYPE focal_stage_calls_total counter\n");
+    for (int s = 0; s < INSTRUMENT_NR_OF_STAGES; s++) {
+        fprintf(fp, "focal_stage_calls_total{stage=\"%s\"} %llu\n", instrument_stage_names[s],
+                (unsigned long long)instrument_stats.stages[s].calls);
+    }
+
+#if FOCAL_INSTRUMENT >= 2
+    fprintf(fp, "# HELP focal_stage_latency_seconds Duration of a single call of a stage\n");
+    fprintf(fp, "# TYPE focal_stage_latency_seconds histogram\n");
+    for (int s = 0; s < INSTRUMENT_NR_OF_STAGES; s++) {
+        const InstrumentStageStats* stats = &instrument_stats.stages[s];
+        uint64_t cumulative = 0;
+        for (int b = 0; b < INSTRUMENT_HISTOGRAM_BUCKETS; b++) {
+            cumulative += stats->histogram[b];
+            fprintf(fp, "focal_stage_latency_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n", instrument_stage_names[s],
+                    (double)(1ULL << b) * 1e-9, (unsigned long long)cumulative);
+        }
+        fprintf(fp, "focal_stage_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", instrument_stage_names[s],
+                (unsigned long long)stats->calls);
+        fprintf(fp, "focal_stage_latency_seconds_sum{stage=\"%s\"} %.9f\n", instrument_stage_names[s], stats->nanoseconds * 1e-9);
+        fprintf(fp, "focal_stage_latency_seconds_count{stage=\"%s\"} %llu\n", instrument_stage_names[s],
+                (unsigned long long)stats->calls);
+    }
+#endif
+
+    for (int c = 0; c < INSTRUMENT_NR_OF_COUNTERS; c++) {
+        fprintf(fp, "# TYPE focal_%s_total counter\n", instrument_counter_names[c]);
+        fprintf(fp, "focal_%s_total %llu\n", instrument_counter_names[c], (unsigned long long)instrument_stats.counters[c]);
+    }
+
+    return ferror(fp);
+}
+
+#else
+
+#define INSTRUMENT_ENABLED 0
+#define INSTRUMENT_START(timer)
+#define INSTRUMENT_STOP(stage, timer)
+#define INSTRUMENT_COUNT(counter, n)
+
+static inline int instrument_dump_json(FILE* fp) {
+    (void)fp;
+    fprintf(stderr, "[Instrument] Built without FOCAL_INSTRUMENT, there is nothing to dump\n");
+    return 1;
+}
+
+static inline int instrument_dump_prometheus(FILE* fp) {
+    return instrument_dump_json(fp);
+}
+
+#endif
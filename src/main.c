@@ -1,5 +1,10 @@
 #include <stdio.h>
+#include <unistd.h>
 
+#include "wav_batch.h"
+#include "wav_fingerprint.h"
+#include "wav_index.h"
+#include "wav_pipeline.h"
 #include "wav_sampling.h"
 
 size_t get_file_size(FILE* fp) {
@@ -11,29 +16,532 @@ size_t get_file_size(FILE* fp) {
     return file_size;
 }
 
-int main() {
+static void print_usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [input.wav output.wav] [options]\n"
+            "       %s --batch <directory|manifest> [--out-dir <directory>] [options]\n"
+            "       %s input.wav --spectrogram <file> [--fft-size <n>] [--hop <n>] [options]\n"
+            "       %s input.wav --fingerprint <file> [--fft-size <n>] [--hop <n>] [options]\n"
+            "       %s --index <file> --build <directory|manifest> [--fft-size <n>] [--hop <n>] [options]\n"
+            "       %s --index <file> clip.wav... [options]\n"
+            "\n"
+            "An input or output of - is standard input or output. Pipes and sockets\n"
+            "are streamed, their length does not have to be known up front.\n"
+            "\n"
+            "A manifest lists one \"input [output]\" pair per line, inputs without an\n"
+            "output are written to --out-dir with the name of the input.\n"
+            "\n"
+            "A spectrogram is resampled to mono and written as little endian float32\n"
+            "magnitude frames of fft-size / 2 + 1 bins. A fingerprint holds the sorted\n"
+            "(hash, frame) landmarks of the spectral peaks.\n"
+            "\n"
+            "An index maps the landmarks of every track to the tracks and times they\n"
+            "occur at, clips are matched against it with the settings it was built with.\n"
+            "\n"
+            "Options:\n"
+            "\t--rate <Hz>       Output sample rate (default 5512)\n"
+            "\t--channels <n>    Output channels (default 1)\n"
+            "\t--bits <n>        Output bits per sample (default 16)\n"
+            "\t--float           Write IEEE float samples, with --bits 32 or 64\n"
+            "\t--fixed           Resample 16 bit input to 16 bit output in Q15 fixed point\n"
+            "\t                  on one thread, other formats go through float\n"
+            "\t--mix <gains>     Channel mix matrix, comma separated input gains for\n"
+            "\t                  every output channel (default: downmix by averaging)\n"
+            "\t--start <seconds> Only convert the input from this time on (default 0)\n"
+            "\t--duration <seconds>  Only convert this much of the input (default: up to the end)\n"
+            "\t--threads <n>     Worker threads (default: one per core)\n"
+            "\t--cache <dir>     Reuse outputs of earlier conversions of the same input with\n"
+            "\t                  the same settings, stored in this directory\n"
+            "\t--cache-size <MB> Size the cache is kept under, least recently used outputs\n"
+            "\t                  are removed first (default 1024)\n"
+            "\t--analyze <file>  Write the peak, RMS, DC offset, clipping, loudness (BS.1770)\n"
+            "\t                  and silence of every channel of the input as JSON, - for\n"
+            "\t                  standard error. With --batch this is a directory, every\n"
+            "\t                  input gets <output name>.json in it\n"
+            "\t--silence <dBFS>  Threshold of the silence map (default -60)\n"
+            "\t--silence-min <seconds>  Shortest silence in the map (default 0.5)\n"
+            "\t--io <mmap|async|thread>  How files are read and written: memory mapped input\n"
+            "\t                  and direct writes, asynchronous I/O with io_uring (a thread\n"
+            "\t                  when it is not available) or always a thread (default mmap)\n"
+            "\t--fft-size <n>    Spectrogram FFT and window size, a power of two (default 1024)\n"
+            "\t--hop <n>         Spectrogram hop in samples (default 256)\n"
+            "\t--stats <file>    Write stage timings and counters at the end, - for standard\n"
+            "\t                  error (needs a build with make INSTRUMENT=1)\n"
+            "\t--stats-format <json|prometheus>  Format of --stats (default json)\n",
+            program, program, program, program, program, program);
+}
+
+// Parse a comma separated list of gains, returns the amount of gains or 0 when invalid
+static size_t parse_gains(const char* text, float* gains, size_t capacity) {
+    size_t count = 0;
+    char* end;
+
+    while (count < capacity) {
+        gains[count++] = strtof(text, &end);
+        if (end == text) {
+            return 0;
+        }
+        if (*end == '\0') {
+            return count;
+        }
+        if (*end != ',') {
+            return 0;
+        }
+        text = end + 1;
+    }
+
+    return 0;
+}
+
+static int run_batch(const char* source, const char* output_directory, const WavBatchOptions* options) {
+    // Both are created up front, otherwise every file would fail on its own
+    if ((output_directory && wav_batch_make_directory(output_directory)) ||
+        (options->stats_directory && wav_batch_make_directory(options->stats_directory))) {
+        return 1;
+    }
+
+    WavBatchFile* files;
+    size_t count;
+    if (wav_batch_collect(source, output_directory, &files, &count)) {
+        return 1;
+    }
+
+    size_t failed = wav_batch_run(files, count, options);
+    free(files);
+
+    return failed != 0;
+}
+
+static int run_index_build(const char* index, const char* source, const WavBatchOptions* options, size_t fft_size, size_t hop) {
+    WavBatchFile* files;
+    size_t count;
+    // Only the inputs are used, the outputs of the batch are never written
+    if (wav_batch_collect(source, ".", &files, &count)) {
+        return 1;
+    }
+
+    long failed = wav_index_build(index, files, count, options->sample_rate, fft_size, hop, options->nr_of_threads);
+    free(files);
+
+    if (failed >= 0) {
+        printf("Index: %zu tracks (%ld failed) written to %s\n", count, failed, index);
+    }
+    return failed != 0;
+}
+
+static int run_index_query(const char* path, const char** clips, size_t count, size_t threads) {
+    WavIndex index;
+    if (wav_index_open(&index, path)) {
+        return 1;
+    }
+
+    WavIndexQuery* queries = (WavIndexQuery*)calloc(count, sizeof(WavIndexQuery));
+    if (queries == NULL) {
+        wav_index_close(&index);
+        return 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        queries[i].clip = clips[i];
+    }
+
+    size_t failed = wav_index_search(&index, queries, count, threads);
+
+    const double seconds_per_frame = (double)index.header->hop / index.header->sample_rate;
+    for (size_t i = 0; i < count; i++) {
+        const WavIndexQuery* query = &queries[i];
+        if (query->result < 0) {
+            printf("%s: failed\n", query->clip);
+        } else if (query->result == 0) {
+            printf("%s: no match\n", query->clip);
+        } else {
+            printf("%s: %s at %.2f s (%u landmarks)\n", query->clip, wav_index_track_name(&index, query->match.track),
+                   query->match.offset * seconds_per_frame, query->match.votes);
+        }
+    }
+
+    free(queries);
+    wav_index_close(&index);
+
+    return failed != 0;
+}
+
+// "-" reads standard input
+static int open_input(WavDecoder* decoder, const char* input, enum AsyncIoBackend io) {
+    if (strcmp(input, "-") == 0) {
+        return wav_decoder_init_fd(decoder, dup(STDIN_FILENO));
+    }
+    if (io != ASYNC_IO_NONE) {
+        return wav_decoder_init_async(decoder, input, io);
+    }
+    return wav_decoder_init_mmap(decoder, input);
+}
+
+// Standard output becomes the output file, the progress that is normally printed
+// there moves to standard error. Returns the descriptor of the output or -1
+static int take_stdout(void) {
+    fflush(stdout);
+    int fd = dup(STDOUT_FILENO);
+    if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        fprintf(stderr, "Unable to redirect standard output\n");
+        return -1;
+    }
+    return fd;
+}
+
+// Dump the instrumentation to 'path', "-" is standard error
+static int write_stats(const char* path, const char* format) {
+    FILE* fp = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Unable to open file %s for writing\n", path);
+        return 1;
+    }
+
+    int failed = strcmp(format, "prometheus") == 0 ? instrument_dump_prometheus(fp) : instrument_dump_json(fp);
+    if (fp != stderr && fclose(fp)) {
+        failed = 1;
+    }
+    return failed;
+}
+
+// Finish the statistics and write them to 'path', "-" is standard error
+static int write_analysis(WavStats* stats, const char* path) {
+    FILE* fp = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Unable to open file %s for writing\n", path);
+        return 1;
+    }
+
+    int failed = wav_stats_finish(stats) || wav_stats_write_json(stats, fp);
+    if (fp != stderr && fclose(fp)) {
+        failed = 1;
+    }
+    return failed;
+}
+
+static int run_single(const char* input, const char* output, const char* analysis, const WavBatchOptions* options) {
+    // "-" writes standard output, it has to be taken before anything is printed
+    int output_fd = strcmp(output, "-") == 0 ? take_stdout() : STDOUT_FILENO;
+    if (output_fd < 0) {
+        return 1;
+    }
+
     WavDecoder decoder;
     // Initialize the decoder
-    if (wav_decoder_init(&decoder, "wav_audio_48000_stereo.wav")) {
+    if (open_input(&decoder, input, options->io)) {
         return 1;
     }
 
-    wav_decoder_get_header(&decoder);
+    if (wav_decoder_get_header(&decoder)) {
+        wav_decoder_close(&decoder);
+        return 1;
+    }
     wav_print_header(decoder.header);
 
+    // The statistics are gathered while decoding, an analyzed input is never taken from the cache
+    WavStats stats;
+    wav_stats_init(&stats);
+    wav_stats_set_silence(&stats, options->silence_threshold, options->silence_seconds);
+    if (analysis && wav_decoder_set_stats(&decoder, &stats)) {
+        wav_decoder_close(&decoder);
+        wav_stats_free(&stats);
+        return 1;
+    }
+
+    // A time range or a fixed point stream is resampled on this thread, only the range is decoded
+    int extract = options->start_seconds > 0 || options->duration_seconds > 0 || options->fixed_point;
+
+    uint64_t key;
+    int has_key = options->cache && !analysis && wav_batch_cache_key(&decoder, options, !extract, &key) == 0;
+    if (has_key) {
+        int missed = output_fd != STDOUT_FILENO ? wav_cache_fetch_fd(options->cache, key, output_fd)
+                                                : wav_cache_fetch(options->cache, key, output);
+        if (!missed) {
+            printf("Output copied from cache entry %016llx\n", (unsigned long long)key);
+            if (output_fd != STDOUT_FILENO) {
+                close(output_fd);
+            }
+            wav_decoder_close(&decoder);
+            return 0;
+        }
+    }
+
     WavEncoder encoder;
     // Initialize the encoder
-    if (wav_encoder_init(&encoder, "wav_audio_5512_mono.wav")) {
+    if (output_fd != STDOUT_FILENO ? wav_encoder_init_fd(&encoder, output_fd) : wav_encoder_init(&encoder, output)) {
+        wav_decoder_close(&decoder);
+        wav_stats_free(&stats);
         return 1;
     }
 
-    wav_encoder_set_header(&encoder, 5512, BITS_PER_SAMPLE_16, AUDIO_FORMAT_PCM, MONO, 60);
+    wav_encoder_set_async_io(&encoder, options->io);
+    wav_encoder_set_header(&encoder, options->sample_rate, options->bits_per_sample, options->audio_format,
+                           options->num_of_channels, 0);
     wav_print_header(encoder.header);
 
-    wav_resample(&decoder, &encoder, DOWNSAMPLE_AVERAGE);
+    int result;
+    if (extract) {
+        result = wav_extract(&decoder, &encoder, options->mixer, options->start_seconds, options->duration_seconds,
+                             options->fixed_point);
+    } else {
+        result = wav_resample_parallel(&decoder, &encoder, options->mixer, options->nr_of_threads);
+    }
 
+    // The last buffered block is only written now, a full disk usually shows up here
     wav_decoder_close(&decoder);
-    wav_encoder_close(&encoder);
+    if (wav_encoder_close(&encoder)) {
+        result = 1;
+    }
 
-    return 0;
+    if (result == 0 && analysis) {
+        result = write_analysis(&stats, analysis);
+    }
+    wav_stats_free(&stats);
+
+    // Standard output can not be read back, only files that were finished are stored
+    if (result == 0 && has_key && output_fd == STDOUT_FILENO) {
+        wav_cache_store(options->cache, key, output);
+    }
+
+    return result;
+}
+
+static int write_frame(const float* magnitudes, size_t bins, uint64_t frame, void* context) {
+    (void)frame;
+    return fwrite(magnitudes, sizeof(float), bins, (FILE*)context) != bins ? -1 : 0;
+}
+
+// Resample the input to mono and write its spectrogram or its fingerprint
+static int run_analysis(const char* input, const char* spectrogram, const char* fingerprint, const WavBatchOptions* options,
+                        size_t fft_size, size_t hop) {
+    WavStft stft;
+    if (wav_stft_init(&stft, fft_size, fft_size, hop, STFT_WINDOW_HANN)) {
+        return 1;
+    }
+
+    WavFingerprint landmarks;
+    if (fingerprint && wav_fingerprint_init(&landmarks, stft.bins)) {
+        wav_stft_close(&stft);
+        return 1;
+    }
+
+    WavDecoder decoder;
+    WavResampler resampler;
+    long result = -1;
+
+    if (open_input(&decoder, input, options->io) == 0 && wav_decoder_get_header(&decoder) == 0 &&
+        wav_resampler_init(&resampler, decoder.header->sample_rate, options->sample_rate, MONO) == 0) {
+        if (fingerprint) {
+            result = wav_fingerprint_analyze(&decoder, &resampler, &stft, &landmarks);
+            if (result >= 0 && wav_fingerprint_write(&landmarks, fingerprint, options->sample_rate, (uint32_t)hop)) {
+                result = -1;
+            }
+            if (result >= 0) {
+                printf("Fingerprint: %ld landmarks from %llu frames written to %s\n", result, (unsigned long long)stft.frames,
+                       fingerprint);
+            }
+        } else {
+            FILE* fp = fopen(spectrogram, "wb");
+            if (fp == NULL) {
+                fprintf(stderr, "Unable to open file %s for writing\n", spectrogram);
+            } else {
+                result = wav_stft_analyze(&decoder, &resampler, &stft, write_frame, fp);
+                if (fclose(fp)) {
+                    result = -1;
+                }
+            }
+            if (result >= 0) {
+                printf("Spectrogram: %ld frames of %zu bins at %u Hz written to %s\n", result, stft.bins, options->sample_rate,
+                       spectrogram);
+            }
+        }
+        wav_resampler_close(&resampler);
+    }
+
+    wav_decoder_close(&decoder);
+    wav_stft_close(&stft);
+    if (fingerprint) {
+        wav_fingerprint_close(&landmarks);
+    }
+
+    return result < 0;
+}
+
+int main(int argc, char** argv) {
+    // One worker per core, the reader and writer threads mostly wait on I/O
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    WavBatchOptions options;
+    options.sample_rate = 5512;
+    options.bits_per_sample = BITS_PER_SAMPLE_16;
+    options.audio_format = AUDIO_FORMAT_PCM;
+    options.num_of_channels = MONO;
+    options.nr_of_threads = cores > 0 ? (size_t)cores : 1;
+    options.mixer = NULL;
+    options.start_seconds = 0;
+    options.duration_seconds = 0;
+    options.io = ASYNC_IO_NONE;
+    options.fixed_point = 0;
+    options.cache = NULL;
+    options.stats_directory = NULL;
+    options.silence_threshold = STATS_SILENCE_THRESHOLD;
+    options.silence_seconds = STATS_SILENCE_SECONDS;
+
+    WavCache cache;
+    const char* cache_directory = NULL;
+    uint64_t cache_budget = CACHE_DEFAULT_BUDGET;
+
+    WavMixer mixer;
+    float gains[MIXER_MAX_CHANNELS * MIXER_MAX_CHANNELS];
+    size_t nr_of_gains = 0;
+
+    const char* batch = NULL;
+    const char* spectrogram = NULL;
+    const char* fingerprint = NULL;
+    const char* index = NULL;
+    const char* index_source = NULL;
+    const char* stats = NULL;
+    const char* analysis = NULL;
+    const char* stats_format = "json";
+    size_t fft_size = STFT_FFT_SIZE;
+    size_t hop = STFT_HOP_SIZE;
+    const char* output_directory = NULL;
+    const char* files[argc + 2];
+    files[0] = "wav_audio_48000_stereo.wav";
+    files[1] = "wav_audio_5512_mono.wav";
+    int nr_of_files = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        int has_value = i + 1 < argc;
+
+        if (strcmp(arg, "--batch") == 0 && has_value) {
+            batch = argv[++i];
+        } else if (strcmp(arg, "--out-dir") == 0 && has_value) {
+            output_directory = argv[++i];
+        } else if (strcmp(arg, "--rate") == 0 && has_value) {
+            options.sample_rate = (uint32_t)atol(argv[++i]);
+        } else if (strcmp(arg, "--channels") == 0 && has_value) {
+            options.num_of_channels = (uint16_t)atoi(argv[++i]);
+        } else if (strcmp(arg, "--bits") == 0 && has_value) {
+            options.bits_per_sample = (uint16_t)atoi(argv[++i]);
+        } else if (strcmp(arg, "--float") == 0) {
+            options.audio_format = AUDIO_FORMAT_IEEE_FLOAT;
+        } else if (strcmp(arg, "--fixed") == 0) {
+            options.fixed_point = 1;
+        } else if (strcmp(arg, "--start") == 0 && has_value) {
+            options.start_seconds = atof(argv[++i]);
+        } else if (strcmp(arg, "--duration") == 0 && has_value) {
+            options.duration_seconds = atof(argv[++i]);
+        } else if (strcmp(arg, "--threads") == 0 && has_value) {
+            options.nr_of_threads = (size_t)atol(argv[++i]);
+        } else if (strcmp(arg, "--cache") == 0 && has_value) {
+            cache_directory = argv[++i];
+        } else if (strcmp(arg, "--cache-size") == 0 && has_value) {
+            cache_budget = (uint64_t)(atof(argv[++i]) * (1 << 20));
+        } else if (strcmp(arg, "--analyze") == 0 && has_value) {
+            analysis = argv[++i];
+        } else if (strcmp(arg, "--silence") == 0 && has_value) {
+            options.silence_threshold = (float)atof(argv[++i]);
+        } else if (strcmp(arg, "--silence-min") == 0 && has_value) {
+            options.silence_seconds = atof(argv[++i]);
+        } else if (strcmp(arg, "--io") == 0 && has_value) {
+            const char* io = argv[++i];
+            if (strcmp(io, "mmap") == 0) {
+                options.io = ASYNC_IO_NONE;
+            } else if (strcmp(io, "async") == 0) {
+                options.io = ASYNC_IO_AUTO;
+            } else if (strcmp(io, "thread") == 0) {
+                options.io = ASYNC_IO_THREAD;
+            } else {
+                fprintf(stderr, "Invalid I/O mode: %s\n", io);
+                return 1;
+            }
+        } else if (strcmp(arg, "--spectrogram") == 0 && has_value) {
+            spectrogram = argv[++i];
+        } else if (strcmp(arg, "--fingerprint") == 0 && has_value) {
+            fingerprint = argv[++i];
+        } else if (strcmp(arg, "--index") == 0 && has_value) {
+            index = argv[++i];
+        } else if (strcmp(arg, "--build") == 0 && has_value) {
+            index_source = argv[++i];
+        } else if (strcmp(arg, "--stats") == 0 && has_value) {
+            stats = argv[++i];
+        } else if (strcmp(arg, "--stats-format") == 0 && has_value) {
+            stats_format = argv[++i];
+            if (strcmp(stats_format, "json") != 0 && strcmp(stats_format, "prometheus") != 0) {
+                fprintf(stderr, "Invalid stats format: %s\n", stats_format);
+                return 1;
+            }
+        } else if (strcmp(arg, "--fft-size") == 0 && has_value) {
+            fft_size = (size_t)atol(argv[++i]);
+        } else if (strcmp(arg, "--hop") == 0 && has_value) {
+            hop = (size_t)atol(argv[++i]);
+        } else if (strcmp(arg, "--mix") == 0 && has_value) {
+            nr_of_gains = parse_gains(argv[++i], gains, MIXER_MAX_CHANNELS * MIXER_MAX_CHANNELS);
+            if (nr_of_gains == 0) {
+                fprintf(stderr, "Invalid mix matrix: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (arg[0] != '-' || strcmp(arg, "-") == 0) {
+            files[nr_of_files++] = arg;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (options.start_seconds < 0 || options.duration_seconds < 0) {
+        fprintf(stderr, "Invalid time range: start %g s, duration %g s\n", options.start_seconds, options.duration_seconds);
+        return 1;
+    }
+
+    if (options.sample_rate == 0 || options.num_of_channels == 0 || options.num_of_channels > MIXER_MAX_CHANNELS ||
+        pcm_encode_kernel(options.audio_format == AUDIO_FORMAT_IEEE_FLOAT, options.bits_per_sample) == NULL) {
+        fprintf(stderr, "Invalid output format: %u Hz, %d channels, %d bits%s\n", options.sample_rate, options.num_of_channels,
+                options.bits_per_sample, options.audio_format == AUDIO_FORMAT_IEEE_FLOAT ? " float" : "");
+        return 1;
+    }
+
+    // The matrix can only be built once the amount of output channels is known
+    if (nr_of_gains) {
+        if (wav_mixer_init_matrix(&mixer, (uint8_t)options.num_of_channels, gains, nr_of_gains)) {
+            return 1;
+        }
+        options.mixer = &mixer;
+    }
+
+    if (cache_directory) {
+        if (wav_cache_open(&cache, cache_directory, cache_budget)) {
+            return 1;
+        }
+        options.cache = &cache;
+    }
+
+    if (stats && !INSTRUMENT_ENABLED) {
+        fprintf(stderr, "--stats needs a build with instrumentation (make INSTRUMENT=1)\n");
+        return 1;
+    }
+
+    int result;
+    if (batch) {
+        options.stats_directory = analysis;
+        result = run_batch(batch, output_directory, &options);
+    } else if (index && index_source) {
+        result = run_index_build(index, index_source, &options, fft_size, hop);
+    } else if (index && nr_of_files > 0) {
+        result = run_index_query(index, files, (size_t)nr_of_files, options.nr_of_threads);
+    } else if (spectrogram || fingerprint) {
+        result = run_analysis(files[0], spectrogram, fingerprint, &options, fft_size, hop);
+    } else if (index || index_source || nr_of_files == 1 || nr_of_files > 2) {
+        print_usage(argv[0]);
+        return 1;
+    } else {
+        result = run_single(files[0], files[1], analysis, &options);
+    }
+
+    if (stats && write_stats(stats, stats_format)) {
+        return 1;
+    }
+
+    return result;
 }
@@ -0,0 +1,566 @@
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PCM_X86 1
+#include <immintrin.h>
+#endif
+
+// Bulk conversion between PCM and normalized float
+//
+// Samples are scaled by the maximum positive value of the integer type (so
+// INT16_MAX becomes 1.0), conversion back rounds to nearest and saturates.
+// 8 bit PCM is unsigned (offset by 128) as specified by the WAV format. IEEE
+// float samples are copied as they are, they are not clamped to [-1, 1].
+//
+// Every kernel has a scalar version, the SSE2 and AVX2 versions produce exactly
+// the same output. A stream looks up its kernel once, by sample format, bit
+// depth and byte order, the kernels themselves do not branch on the format.
+// Samples are converted as one run of values, so the amount of channels does
+// not matter to them. Big endian (RIFX) input is only decoded.
+
+#define PCM_SCALE_8 127.0f
+#define PCM_SCALE_16 32767.0f
+#define PCM_SCALE_24 8388607.0f
+#define PCM_SCALE_32 2147483647.0f
+
+// Largest float below 2^31, anything above would overflow the conversion
+#define PCM_MAX_32 2147483520.0f
+
+#define PCM_DITHER_LANES 8
+
+// TPDF (triangular) dither state, every lane is an independent xorshift32
+// generator so the SIMD kernels can produce the same noise as the scalar one
+typedef struct {
+    uint32_t m_state[PCM_DITHER_LANES];
+    uint32_t m_lane;  // Lane used for the next sample
+} PcmDither;
+
+typedef void (*PcmDecodeKernel)(const uint8_t* in, float* out, size_t n);
+typedef void (*PcmEncodeKernel)(const float* in, uint8_t* out, size_t n, PcmDither* dither);
+
+static inline void pcm_dither_init(PcmDither* dither, uint32_t seed) {
+    for (int i = 0; i < PCM_DITHER_LANES; i++) {
+        // Any non-zero state works, spread the seed so the lanes are uncorrelated
+        uint32_t x = seed + 0x9E3779B9u * (i + 1);
+        x ^= x >> 16;
+        x *= 0x85EBCA6Bu;
+        x ^= x >> 13;
+        dither->m_state[i] = x ? x : 1;
+    }
+    dither->m_lane = 0;
+}
+
+static inline uint32_t pcm_xorshift32(uint32_t x) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+// Triangular noise in (-1, 1) LSB for the next sample
+static inline float pcm_dither_next(PcmDither* dither) {
+    uint32_t* state = &dither->m_state[dither->m_lane];
+    uint32_t a = pcm_xorshift32(*state);
+    uint32_t b = pcm_xorshift32(a);
+    *state = b;
+    dither->m_lane = (dither->m_lane + 1) % PCM_DITHER_LANES;
+    return ((float)(a >> 8) - (float)(b >> 8)) * (1.0f / 16777216.0f);
+}
+
+// NaN clamps to the minimum, which is what the SIMD min/max sequence does
+static inline float pcm_clamp(float value, float min, float max) {
+    return value >= min ? (value <= max ? value : max) : min;
+}
+
+// Scalar kernels
+
+static inline void pcm_u8_to_float_scalar(const uint8_t* in, float* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (float)((int)in[i] - 128) * (1.0f / PCM_SCALE_8);
+    }
+}
+
+static inline void pcm_s16_to_float_scalar(const uint8_t* in, float* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (float)(int16_t)(in[2 * i + 1] << 8 | in[2 * i]) * (1.0f / PCM_SCALE_16);
+    }
+}
+
+static inline void pcm_s24_to_float_scalar(const uint8_t* in, float* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        int32_t value = (int32_t)((uint32_t)in[3 * i + 2] << 24 | (uint32_t)in[3 * i + 1] << 16 | (uint32_t)in[3 * i] << 8) >> 8;
+        out[i] = (float)value * (1.0f / PCM_SCALE_24);
+    }
+}
+
+static inline void pcm_s32_to_float_scalar(const uint8_t* in, float* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        int32_t value = (int32_t)((uint32_t)in[4 * i + 3] << 24 | (uint32_t)in[4 * i + 2] << 16 | (uint32_t)in[4 * i + 1] << 8 |
+                                  (uint32_t)in[4 * i]);
+        out[i] = (float)value * (1.0f / PCM_SCALE_32);
+    }
+}
+
+static inline void pcm_float_to_u8_scalar(const float* in, uint8_t* out, size_t n, PcmDither* dither) {
+    for (size_t i = 0; i < n; i++) {
+        float value = in[i] * PCM_SCALE_8;
+        if (dither) {
+            value += pcm_dither_next(dither);
+        }
+        out[i] = (uint8_t)(lrintf(pcm_clamp(value, -128.0f, 127.0f)) + 128);
+    }
+}
+
+static inline void pcm_float_to_s16_scalar(const float* in, uint8_t* out, size_t n, PcmDither* dither) {
+    for (size_t i = 0; i < n; i++) {
+        float value = in[i] * PCM_SCALE_16;
+        if (dither) {
+            value += pcm_dither_next(dither);
+        }
+        int16_t sample = (int16_t)lrintf(pcm_clamp(value, -32768.0f, 32767.0f));
+        out[2 * i] = (uint8_t)sample;
+        out[2 * i + 1] = (uint8_t)(sample >> 8);
+    }
+}
+
+static inline void pcm_float_to_s24_scalar(const float* in, uint8_t* out, size_t n, PcmDither* dither) {
+    for (size_t i = 0; i < n; i++) {
+        float value = in[i] * PCM_SCALE_24;
+        if (dither) {
+            value += pcm_dither_next(dither);
+        }
+        int32_t sample = (int32_t)lrintf(pcm_clamp(value, -8388608.0f, 8388607.0f));
+        out[3 * i] = (uint8_t)sample;
+        out[3 * i + 1] = (uint8_t)(sample >> 8);
+        out[3 * i + 2] = (uint8_t)(sample >> 16);
+    }
+}
+
+// 32 bit output has more resolution than a float, dither is never applied
+static inline void pcm_float_to_s32_scalar(const float* in, uint8_t* out, size_t n, PcmDither* dither) {
+    for (size_t i = 0; i < n; i++) {
+        int32_t sample = (int32_t)lrintf(pcm_clamp(in[i] * PCM_SCALE_32, -2147483648.0f, PCM_MAX_32));
+        out[4 * i] = (uint8_t)sample;
+        out[4 * i + 1] = (uint8_t)(sample >> 8);
+        out[4 * i + 2] = (uint8_t)(sample >> 16);
+        out[4 * i + 3] = (uint8_t)(sample >> 24);
+    }
+}
+
+// IEEE float and big endian kernels
+
+static inline uint32_t pcm_load_le32(const uint8_t* in) {
+    return (uint32_t)in[3] << 24 | (uint32_t)in[2] << 16 | (uint32_t)in[1] << 8 | (uint32_t)in[0];
+}
+
+static inline uint32_t pcm_load_be32(const uint8_t* in) {
+    return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 8 | (uint32_t)in[3];
+}
+
+static inline void pcm_store_le32(uint8_t* out, uint32_t value) {
+    out[0] = (uint8_t)value;
+    out[1] = (uint8_t)(value >> 8);
+    out[2] = (uint8_t)(value >> 16);
+    out[3] = (uint8_t)(value >> 24);
+}
+
+static inline float pcm_bits_to_float(uint32_t bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static inline double pcm_bits_to_double(uint64_t bits) {
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static inline void pcm_f32_to_float_scalar(const uint8_t* in, float* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = pcm_bits_to_float(pcm_load_le32(in + 4 * i));
+    }
+}
+
+static inline void pcm_f64_to_float_scalar(const uint8_t* in, float* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (float)pcm_bits_to_double((uint64_t)pcm_load_le32(in + 8 * i + 4) << 32 | pcm_load_le32(in + 8 * i));
+    }
+}
+
+static inline void pcm_s16be_to_float_scalar(const uint8_t* in, float* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (float)(int16_t)(in[2 * i] << 8 | in[2 * i + 1]) * (1.0f / PCM_SCALE_16);
+    }
+}
+
+static inline void pcm_s24be_to_float_scalar(const uint8_t* in, float* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        int32_t value = (int32_t)((uint32_t)in[3 * i] << 24 | (uint32_t)in[3 * i + 1] << 16 | (uint32_t)in[3 * i + 2] << 8) >> 8;
+        out[i] = (float)value * (1.0f / PCM_SCALE_24);
+    }
+}
+
+static inline void pcm_s32be_to_float_scalar(const uint8_t* in, float* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (float)(int32_t)pcm_load_be32(in + 4 * i) * (1.0f / PCM_SCALE_32);
+    }
+}
+
+static inline void pcm_f32be_to_float_scalar(const uint8_t* in, float* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = pcm_bits_to_float(pcm_load_be32(in + 4 * i));
+    }
+}
+
+static inline void pcm_f64be_to_float_scalar(const uint8_t* in, float* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (float)pcm_bits_to_double((uint64_t)pcm_load_be32(in + 8 * i) << 32 | pcm_load_be32(in + 8 * i + 4));
+    }
+}
+
+// Float output keeps all of the resolution, dither is never applied
+static inline void pcm_float_to_f32_scalar(const float* in, uint8_t* out, size_t n, PcmDither* dither) {
+    (void)dither;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t bits;
+        memcpy(&bits, &in[i], sizeof(bits));
+        pcm_store_le32(out + 4 * i, bits);
+    }
+}
+
+static inline void pcm_float_to_f64_scalar(const float* in, uint8_t* out, size_t n, PcmDither* dither) {
+    (void)dither;
+    for (size_t i = 0; i < n; i++) {
+        double value = in[i];
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        pcm_store_le32(out + 8 * i, (uint32_t)bits);
+        pcm_store_le32(out + 8 * i + 4, (uint32_t)(bits >> 32));
+    }
+}
+
+#ifdef PCM_X86
+
+// SSE2 kernels, SSE2 is part of the x86-64 baseline
+
+static inline __m128i pcm_xorshift32_sse2(__m128i x) {
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+    return x;
+}
+
+// Triangular noise for the 4 lanes starting at 'lane', matches pcm_dither_next
+static inline __m128 pcm_dither_next_sse2(PcmDither* dither, int lane) {
+    __m128i* state = (__m128i*)&dither->m_state[lane];
+    __m128i a = pcm_xorshift32_sse2(_mm_loadu_si128(state));
+    __m128i b = pcm_xorshift32_sse2(a);
+    _mm_storeu_si128(state, b);
+    __m128 noise = _mm_sub_ps(_mm_cvtepi32_ps(_mm_srli_epi32(a, 8)), _mm_cvtepi32_ps(_mm_srli_epi32(b, 8)));
+    return _mm_mul_ps(noise, _mm_set1_ps(1.0f / 16777216.0f));
+}
+
+static inline void pcm_s16_to_float_sse2(const uint8_t* in, float* out, size_t n) {
+    const __m128 scale = _mm_set1_ps(1.0f / PCM_SCALE_16);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(in + 2 * i));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+    pcm_s16_to_float_scalar(in + 2 * i, out + i, n - i);
+}
+
+static inline void pcm_s32_to_float_sse2(const uint8_t* in, float* out, size_t n) {
+    const __m128 scale = _mm_set1_ps(1.0f / PCM_SCALE_32);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(in + 4 * i));
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+    }
+    pcm_s32_to_float_scalar(in + 4 * i, out + i, n - i);
+}
+
+static inline void pcm_float_to_s16_sse2(const float* in, uint8_t* out, size_t n, PcmDither* dither) {
+    const __m128 scale = _mm_set1_ps(PCM_SCALE_16);
+    const __m128 min = _mm_set1_ps(-32768.0f);
+    const __m128 max = _mm_set1_ps(32767.0f);
+    size_t i = 0;
+
+    // The vector loop uses all dither lanes in order, line them up first
+    while (dither && dither->m_lane != 0 && i < n) {
+        pcm_float_to_s16_scalar(in + i, out + 2 * i, 1, dither);
+        i++;
+    }
+
+    for (; i + 8 <= n; i += 8) {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(in + i), scale);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(in + i + 4), scale);
+        if (dither) {
+            a = _mm_add_ps(a, pcm_dither_next_sse2(dither, 0));
+            b = _mm_add_ps(b, pcm_dither_next_sse2(dither, 4));
+        }
+        a = _mm_min_ps(_mm_max_ps(a, min), max);
+        b = _mm_min_ps(_mm_max_ps(b, min), max);
+        __m128i x = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+        _mm_storeu_si128((__m128i*)(out + 2 * i), x);
+    }
+    pcm_float_to_s16_scalar(in + i, out + 2 * i, n - i, dither);
+}
+
+static inline void pcm_float_to_s32_sse2(const float* in, uint8_t* out, size_t n, PcmDither* dither) {
+    const __m128 scale = _mm_set1_ps(PCM_SCALE_32);
+    const __m128 min = _mm_set1_ps(-2147483648.0f);
+    const __m128 max = _mm_set1_ps(PCM_MAX_32);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + i), scale), min), max);
+        _mm_storeu_si128((__m128i*)(out + 4 * i), _mm_cvtps_epi32(x));
+    }
+    pcm_float_to_s32_scalar(in + i, out + 4 * i, n - i, dither);
+}
+
+// AVX2 kernels, only used when the CPU reports AVX2 support
+
+__attribute__((target("avx2"))) static inline void pcm_s16_to_float_avx2(const uint8_t* in, float* out, size_t n) {
+    const __m256 scale = _mm256_set1_ps(1.0f / PCM_SCALE_16);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(in + 2 * i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(in + 2 * i + 16));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(a)), scale));
+        _mm256_storeu_ps(out + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(b)), scale));
+    }
+    pcm_s16_to_float_scalar(in + 2 * i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static inline void pcm_s32_to_float_avx2(const uint8_t* in, float* out, size_t n) {
+    const __m256 scale = _mm256_set1_ps(1.0f / PCM_SCALE_32);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(in + 4 * i));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+    }
+    pcm_s32_to_float_scalar(in + 4 * i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static inline void pcm_float_to_s16_avx2(const float* in, uint8_t* out, size_t n, PcmDither* dither) {
+    const __m256 scale = _mm256_set1_ps(PCM_SCALE_16);
+    const __m256 min = _mm256_set1_ps(-32768.0f);
+    const __m256 max = _mm256_set1_ps(32767.0f);
+    const __m256 dither_scale = _mm256_set1_ps(1.0f / 16777216.0f);
+    size_t i = 0;
+
+    while (dither && dither->m_lane != 0 && i < n) {
+        pcm_float_to_s16_scalar(in + i, out + 2 * i, 1, dither);
+        i++;
+    }
+
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_mul_ps(_mm256_loadu_ps(in + i), scale);
+        if (dither) {
+            __m256i state = _mm256_loadu_si256((const __m256i*)dither->m_state);
+            __m256i a = _mm256_xor_si256(state, _mm256_slli_epi32(state, 13));
+            a = _mm256_xor_si256(a, _mm256_srli_epi32(a, 17));
+            a = _mm256_xor_si256(a, _mm256_slli_epi32(a, 5));
+            __m256i b = _mm256_xor_si256(a, _mm256_slli_epi32(a, 13));
+            b = _mm256_xor_si256(b, _mm256_srli_epi32(b, 17));
+            b = _mm256_xor_si256(b, _mm256_slli_epi32(b, 5));
+            _mm256_storeu_si256((__m256i*)dither->m_state, b);
+            __m256 noise = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(a, 8)), _mm256_cvtepi32_ps(_mm256_srli_epi32(b, 8)));
+            x = _mm256_add_ps(x, _mm256_mul_ps(noise, dither_scale));
+        }
+        x = _mm256_min_ps(_mm256_max_ps(x, min), max);
+        __m256i y = _mm256_cvtps_epi32(x);
+        // Packing works per 128 bit lane, both halves end up in the low lane
+        __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(y), _mm256_extracti128_si256(y, 1));
+        _mm_storeu_si128((__m128i*)(out + 2 * i), packed);
+    }
+    pcm_float_to_s16_scalar(in + i, out + 2 * i, n - i, dither);
+}
+
+#endif
+
+enum PcmCpuLevel { PCM_CPU_SCALAR, PCM_CPU_SSE2, PCM_CPU_AVX2 };
+
+static inline enum PcmCpuLevel pcm_cpu_level(void) {
+#ifdef PCM_X86
+    static int level = -1;
+    if (level < 0) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            level = PCM_CPU_AVX2;
+        } else if (__builtin_cpu_supports("sse2")) {
+            level = PCM_CPU_SSE2;
+        } else {
+            level = PCM_CPU_SCALAR;
+        }
+    }
+    return (enum PcmCpuLevel)level;
+#else
+    return PCM_CPU_SCALAR;
+#endif
+}
+
+// Kernels of one sample format, indexed by PcmCpuLevel. A NULL entry falls back
+// to the level below, the scalar kernel is always there
+#ifdef PCM_X86
+#define PCM_SIMD(sse2, avx2) sse2, avx2
+#else
+#define PCM_SIMD(sse2, avx2) NULL, NULL
+#endif
+
+typedef struct {
+    uint8_t is_float;
+    uint8_t big_endian;
+    uint16_t bits_per_sample;
+    PcmDecodeKernel kernels[3];
+} PcmDecodeEntry;
+
+typedef struct {
+    uint8_t is_float;
+    uint16_t bits_per_sample;
+    PcmEncodeKernel kernels[3];
+} PcmEncodeEntry;
+
+static const PcmDecodeEntry pcm_decode_table[] = {
+    {0, 0, 8, {pcm_u8_to_float_scalar, NULL, NULL}},
+    {0, 0, 16, {pcm_s16_to_float_scalar, PCM_SIMD(pcm_s16_to_float_sse2, pcm_s16_to_float_avx2)}},
+    {0, 0, 24, {pcm_s24_to_float_scalar, NULL, NULL}},
+    {0, 0, 32, {pcm_s32_to_float_scalar, PCM_SIMD(pcm_s32_to_float_sse2, pcm_s32_to_float_avx2)}},
+    {1, 0, 32, {pcm_f32_to_float_scalar, NULL, NULL}},
+    {1, 0, 64, {pcm_f64_to_float_scalar, NULL, NULL}},
+    {0, 1, 8, {pcm_u8_to_float_scalar, NULL, NULL}},
+    {0, 1, 16, {pcm_s16be_to_float_scalar, NULL, NULL}},
+    {0, 1, 24, {pcm_s24be_to_float_scalar, NULL, NULL}},
+    {0, 1, 32, {pcm_s32be_to_float_scalar, NULL, NULL}},
+    {1, 1, 32, {pcm_f32be_to_float_scalar, NULL, NULL}},
+    {1, 1, 64, {pcm_f64be_to_float_scalar, NULL, NULL}},
+};
+
+static const PcmEncodeEntry pcm_encode_table[] = {
+    {0, 8, {pcm_float_to_u8_scalar, NULL, NULL}},
+    {0, 16, {pcm_float_to_s16_scalar, PCM_SIMD(pcm_float_to_s16_sse2, pcm_float_to_s16_avx2)}},
+    {0, 24, {pcm_float_to_s24_scalar, NULL, NULL}},
+    {0, 32, {pcm_float_to_s32_scalar, PCM_SIMD(pcm_float_to_s32_sse2, NULL)}},
+    {1, 32, {pcm_float_to_f32_scalar, NULL, NULL}},
+    {1, 64, {pcm_float_to_f64_scalar, NULL, NULL}},
+};
+
+// Best kernel for converting samples of the given format to float, NULL when
+// the format is not supported
+static inline PcmDecodeKernel pcm_decode_kernel(int is_float, uint16_t bits_per_sample, int big_endian) {
+    const size_t count = sizeof(pcm_decode_table) / sizeof(pcm_decode_table[0]);
+    for (size_t i = 0; i < count; i++) {
+        const PcmDecodeEntry* entry = &pcm_decode_table[i];
+        if (entry->is_float == !!is_float && entry->big_endian == !!big_endian && entry->bits_per_sample == bits_per_sample) {
+            int level = pcm_cpu_level();
+            while (entry->kernels[level] == NULL) {
+                level--;
+            }
+            return entry->kernels[level];
+        }
+    }
+
+    return NULL;
+}
+
+// Best kernel for converting float to little endian samples of the given
+// format, NULL when the format is not supported
+static inline PcmEncodeKernel pcm_encode_kernel(int is_float, uint16_t bits_per_sample) {
+    const size_t count = sizeof(pcm_encode_table) / sizeof(pcm_encode_table[0]);
+    for (size_t i = 0; i < count; i++) {
+        const PcmEncodeEntry* entry = &pcm_encode_table[i];
+        if (entry->is_float == !!is_float && entry->bits_per_sample == bits_per_sample) {
+            int level = pcm_cpu_level();
+            while (entry->kernels[level] == NULL) {
+                level--;
+            }
+            return entry->kernels[level];
+        }
+    }
+
+    return NULL;
+}
+
+// Q15 kernels of the fixed point path, 16 bit samples stay integers from the
+// decoder to the encoder. Little endian 16 bit PCM already is Q15 in memory on a
+// little endian host, so only big endian input has to be converted
+
+typedef void (*PcmQ15DecodeKernel)(const uint8_t* in, int16_t* out, size_t n);
+typedef void (*PcmQ15EncodeKernel)(const int16_t* in, uint8_t* out, size_t n);
+
+static inline int16_t pcm_saturate_q15(int32_t value) {
+    return value < INT16_MIN ? INT16_MIN : (value > INT16_MAX ? INT16_MAX : (int16_t)value);
+}
+
+static inline void pcm_s16_to_q15_scalar(const uint8_t* in, int16_t* out, size_t n) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(out, in, sizeof(int16_t) * n);
+#else
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (int16_t)(in[2 * i] | in[2 * i + 1] << 8);
+    }
+#endif
+}
+
+static inline void pcm_s16be_to_q15_scalar(const uint8_t* in, int16_t* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (int16_t)(in[2 * i] << 8 | in[2 * i + 1]);
+    }
+}
+
+static inline void pcm_q15_to_s16_scalar(const int16_t* in, uint8_t* out, size_t n) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(out, in, sizeof(int16_t) * n);
+#else
+    for (size_t i = 0; i < n; i++) {
+        out[2 * i] = (uint8_t)in[i];
+        out[2 * i + 1] = (uint8_t)((uint16_t)in[i] >> 8);
+    }
+#endif
+}
+
+#ifdef PCM_X86
+
+static inline void pcm_s16be_to_q15_sse2(const uint8_t* in, int16_t* out, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(in + 2 * i));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8)));
+    }
+    pcm_s16be_to_q15_scalar(in + 2 * i, out + i, n - i);
+}
+
+#endif
+
+// Kernel for reading samples of the given format as Q15, NULL when the format
+// has to go through float
+static inline PcmQ15DecodeKernel pcm_q15_decode_kernel(int is_float, uint16_t bits_per_sample, int big_endian) {
+    if (is_float || bits_per_sample != 16) {
+        return NULL;
+    }
+    if (!big_endian) {
+        return pcm_s16_to_q15_scalar;
+    }
+#ifdef PCM_X86
+    if (pcm_cpu_level() >= PCM_CPU_SSE2) {
+        return pcm_s16be_to_q15_sse2;
+    }
+#endif
+    return pcm_s16be_to_q15_scalar;
+}
+
+// Kernel for writing Q15 samples as little endian samples of the given format,
+// NULL when the format has to go through float
+static inline PcmQ15EncodeKernel pcm_q15_encode_kernel(int is_float, uint16_t bits_per_sample) {
+    return !is_float && bits_per_sample == 16 ? pcm_q15_to_s16_scalar : NULL;
+}
@@ -4,14 +4,25 @@
 #include <stdint.h>
 
 #include "byte_buffer.h"
+#include "wav_arena.h"
 
 // Header constants
 #define HEADER_CHUNK_ID 0x52494646       // riff
+#define HEADER_RF64 0x52463634           // rf64, riff with 64 bit sizes
+#define HEADER_RIFX 0x52494658           // rifx, riff with big endian sizes and samples
+#define HEADER_BW64 0x42573634           // bw64, same layout as rf64
 #define HEADER_FORMAT 0x57415645         // wave
 #define HEADER_SUBCHUNK_1_ID 0x666d7420  // fmt
 #define HEADER_SUBCHUNK_2_ID 0x64617461  // data
+#define HEADER_DS64 0x64733634           // ds64, the 64 bit sizes of rf64
 #define HEADER_LIST 0x4c495354           // list
-#define HEADER_LENGTH_1 44               // TODO: support multiple header lengths
+#define HEADER_LENGTH_1 44               // Canonical header, as written by the encoder
+
+// A 32 bit size with this value means the real size is in the ds64 chunk
+#define HEADER_SIZE_IN_DS64 0xFFFFFFFF
+
+// Size written for streams whose length is not known, the data runs up to the end
+#define HEADER_SIZE_UNKNOWN 0xFFFFFFFF
 
 // Bits per sample
 #define BITS_PER_SAMPLE_16 16
@@ -19,6 +30,8 @@
 
 // Audio format
 #define AUDIO_FORMAT_PCM 1
+#define AUDIO_FORMAT_IEEE_FLOAT 3
+#define AUDIO_FORMAT_EXTENSIBLE 0xFFFE  // The real format is in the sub format of the fmt chunk
 
 // Number of channels
 #define MONO 1
@@ -37,18 +50,213 @@ typedef struct {
     uint16_t bits_per_sample;
     uint16_t audio_format;
     uint16_t num_of_channels;
+
+    // Only set by the decoder
+    uint16_t valid_bits_per_sample;  // From WAVE_FORMAT_EXTENSIBLE, otherwise bits_per_sample
+    uint32_t channel_mask;           // From WAVE_FORMAT_EXTENSIBLE, otherwise 0
+    uint64_t data_size;              // Size of the data chunk, can exceed 4 GB for rf64
+    uint64_t data_offset;            // Offset of the first sample in the file
 } WavHeader;
 
-// Channel 0: data[0], Channel 1: data[1], etc
+enum WavDataLayout {
+    LAYOUT_INTERLEAVED,  // Frame i, channel c: m_data[i * nr_of_channels + c]
+    LAYOUT_PLANAR        // Channel c, frame i: m_data[c * capacity + i]
+};
+
+// All samples of a chunk live in one contiguous block which is reused between
+// chunks, it only grows when a bigger chunk is requested
 typedef struct {
+    size_t nr_of_samples;
+    size_t capacity;
+    uint8_t nr_of_channels;
+    enum WavDataLayout layout;
     float* m_data;
-} WavSample;
+    float* m_scratch;  // Used when converting between layouts
+    int m_borrowed;    // m_data belongs to an arena and is not freed
+} WavData;
+
+static inline void wav_data_init(WavData* data) {
+    data->nr_of_samples = 0;
+    data->capacity = 0;
+    data->nr_of_channels = 0;
+    data->layout = LAYOUT_INTERLEAVED;
+    data->m_data = NULL;
+    data->m_scratch = NULL;
+    data->m_borrowed = 0;
+}
+
+// Back the data with a block of the arena for 'samples' samples (frames) of
+// 'channels'. Reserving up to that size never allocates, a bigger reservation
+// moves the data to the heap
+static inline int wav_data_init_arena(WavData* data, WavArena* arena, size_t samples, uint8_t channels) {
+    wav_data_init(data);
+
+    data->m_data = (float*)wav_arena_alloc(arena, sizeof(float) * samples * channels);
+    if (data->m_data == NULL) {
+        return 1;
+    }
+    data->capacity = samples;
+    data->nr_of_channels = channels;
+    data->m_borrowed = 1;
+
+    return 0;
+}
+
+static inline void wav_data_free(WavData* data) {
+    if (!data->m_borrowed) {
+        free(data->m_data);
+    }
+    free(data->m_scratch);
+    wav_data_init(data);
+}
+
+// Make sure the data can hold the given amount of samples (frames) for the given
+// amount of channels. Existing samples are not kept when the block has to grow
+static inline int wav_data_reserve(WavData* data, size_t samples, uint8_t channels) {
+    if (samples > data->capacity || channels != data->nr_of_channels) {
+        size_t capacity = samples > data->capacity ? samples : data->capacity;
+
+        if (capacity * channels > data->capacity * data->nr_of_channels) {
+            if (!data->m_borrowed) {
+                free(data->m_data);
+            }
+            free(data->m_scratch);
+            data->m_scratch = NULL;
+            data->m_borrowed = 0;
+
+            data->m_data = (float*)malloc(sizeof(float) * capacity * channels);
+            INSTRUMENT_COUNT(INSTRUMENT_ALLOCATIONS, 1);
+            if (data->m_data == NULL) {
+                fprintf(stderr, "[WavData] Unable to allocate memory for samples\n");
+                wav_data_init(data);
+                return 1;
+            }
+        }
+
+        data->capacity = capacity;
+        data->nr_of_channels = channels;
+    }
+
+    data->nr_of_samples = 0;
+
+    return 0;
+}
 
+// Pointer to all channels of sample (frame) i, only valid for interleaved data
+static inline float* wav_data_frame(WavData* data, size_t i) {
+    return data->m_data + i * data->nr_of_channels;
+}
+
+// Pointer to all samples of channel c, only valid for planar data
+static inline float* wav_data_channel(WavData* data, uint8_t c) {
+    return data->m_data + c * data->capacity;
+}
+
+// Sample i of channel c regardless of the layout
+static inline float wav_data_get(const WavData* data, size_t i, uint8_t c) {
+    if (data->layout == LAYOUT_INTERLEAVED) {
+        return data->m_data[i * data->nr_of_channels + c];
+    }
+
+    return data->m_data[c * data->capacity + i];
+}
+
+// Convert the samples to the given layout, the scratch block is allocated on the
+// first conversion and reused afterwards
+static inline int wav_data_set_layout(WavData* data, enum WavDataLayout layout) {
+    if (data->layout == layout) {
+        return 0;
+    }
+
+    if (data->nr_of_channels <= 1) {
+        data->layout = layout;
+        return 0;
+    }
+
+    if (data->m_scratch == NULL) {
+        data->m_scratch = (float*)malloc(sizeof(float) * data->capacity * data->nr_of_channels);
+        INSTRUMENT_COUNT(INSTRUMENT_ALLOCATIONS, 1);
+        if (data->m_scratch == NULL) {
+            fprintf(stderr, "[WavData] Unable to allocate memory for layout conversion\n");
+            return 1;
+        }
+    }
+
+    const size_t samples = data->nr_of_samples;
+    const size_t capacity = data->capacity;
+    const uint8_t channels = data->nr_of_channels;
+    const float* src = data->m_data;
+    float* dst = data->m_scratch;
+
+    if (layout == LAYOUT_PLANAR) {
+        for (uint8_t c = 0; c < channels; c++) {
+            for (size_t i = 0; i < samples; i++) {
+                dst[c * capacity + i] = src[i * channels + c];
+            }
+        }
+    } else {
+        for (size_t i = 0; i < samples; i++) {
+            for (uint8_t c = 0; c < channels; c++) {
+                dst[i * channels + c] = src[c * capacity + i];
+            }
+        }
+    }
+
+    // The arena block stays in place, the converted samples are copied back into it
+    if (data->m_borrowed) {
+        memcpy(data->m_data, dst, sizeof(float) * capacity * channels);
+    } else {
+        data->m_scratch = data->m_data;
+        data->m_data = dst;
+    }
+    data->layout = layout;
+
+    return 0;
+}
+
+// Interleaved 16 bit samples of the fixed point path, in Q15 (INT16_MAX is just
+// below 1.0). Like WavData the block is reused between chunks
 typedef struct {
     size_t nr_of_samples;
+    size_t capacity;
     uint8_t nr_of_channels;
-    WavSample* m_samples;
-} WavData;
+    int16_t* m_data;
+} WavFixedData;
+
+static inline void wav_fixed_data_init(WavFixedData* data) {
+    data->nr_of_samples = 0;
+    data->capacity = 0;
+    data->nr_of_channels = 0;
+    data->m_data = NULL;
+}
+
+static inline void wav_fixed_data_free(WavFixedData* data) {
+    free(data->m_data);
+    wav_fixed_data_init(data);
+}
+
+// Make sure the data can hold the given amount of samples (frames) for the given
+// amount of channels. Existing samples are not kept when the block has to grow
+static inline int wav_fixed_data_reserve(WavFixedData* data, size_t samples, uint8_t channels) {
+    if (samples * channels > data->capacity * data->nr_of_channels) {
+        free(data->m_data);
+        data->m_data = (int16_t*)malloc(sizeof(int16_t) * samples * channels);
+        INSTRUMENT_COUNT(INSTRUMENT_ALLOCATIONS, 1);
+        if (data->m_data == NULL) {
+            fprintf(stderr, "[WavFixedData] Unable to allocate memory for samples\n");
+            wav_fixed_data_init(data);
+            return 1;
+        }
+        data->capacity = samples;
+    } else if (samples > data->capacity || channels != data->nr_of_channels) {
+        data->capacity = data->capacity * data->nr_of_channels / channels;
+    }
+
+    data->nr_of_channels = channels;
+    data->nr_of_samples = 0;
+
+    return 0;
+}
 
 static inline void wav_print_header(WavHeader* header) {
     printf("\nWAV Header\n");
@@ -61,5 +269,8 @@ static inline void wav_print_header(WavHeader* header) {
     printf("\tBlock align: %d byte(s) per sample\n", header->block_align);
     printf("\tBits per sample: %d bits per sample for one channel\n", header->bits_per_sample);
     printf("\tSubchunk2Size: %d bytes\n", header->subchunk_2_size);
+    if (header->channel_mask) {
+        printf("\tChannel mask: 0x%x\n", header->channel_mask);
+    }
     printf("\n");
 }
\ No newline at end of file
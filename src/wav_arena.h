@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "instrument.h"
+
+#define ARENA_ALIGNMENT 64  // A cache line, also enough for any SIMD load
+
+// Bump allocator for the working memory of a stream
+//
+// All buffers a stream needs are sized up front, once the format is known, and
+// carved out of one block. Nothing is freed on its own, the whole block goes
+// away with wav_arena_close. Blocks are cache line aligned, so buffers of
+// different threads never share a line.
+typedef struct {
+    uint8_t* m_block;
+    size_t m_size;
+    size_t m_used;
+} WavArena;
+
+// Size a buffer of 'size' bytes takes up in the arena
+static inline size_t wav_arena_size(size_t size) {
+    return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+static inline int wav_arena_init(WavArena* arena, size_t size) {
+    arena->m_block = NULL;
+    arena->m_size = wav_arena_size(size);
+    arena->m_used = 0;
+
+    if (arena->m_size && posix_memalign((void**)&arena->m_block, ARENA_ALIGNMENT, arena->m_size)) {
+        fprintf(stderr, "[WavArena] Unable to allocate %zu bytes\n", arena->m_size);
+        arena->m_block = NULL;
+        arena->m_size = 0;
+        return 1;
+    }
+    INSTRUMENT_COUNT(INSTRUMENT_ALLOCATIONS, 1);
+
+    return 0;
+}
+
+// Carve 'size' bytes out of the arena, NULL when it is used up
+static inline void* wav_arena_alloc(WavArena* arena, size_t size) {
+    size = wav_arena_size(size);
+    if (size > arena->m_size - arena->m_used) {
+        fprintf(stderr, "[WavArena] Unable to take %zu bytes, %zu of %zu are left\n", size, arena->m_size - arena->m_used,
+                arena->m_size);
+        return NULL;
+    }
+
+    void* pointer = arena->m_block + arena->m_used;
+    arena->m_used += size;
+    return pointer;
+}
+
+// Hand out the whole block again, everything taken so far becomes invalid
+static inline void wav_arena_reset(WavArena* arena) {
+    arena->m_used = 0;
+}
+
+static inline void wav_arena_close(WavArena* arena) {
+    free(arena->m_block);
+    arena->m_block = NULL;
+    arena->m_size = 0;
+    arena->m_used = 0;
+}
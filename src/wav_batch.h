@@ -0,0 +1,471 @@
+#pragma once
+
+#include <dirent.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "wav_cache.h"
+#include "wav_sampling.h"
+#include "work_pool.h"
+
+#define BATCH_PATH_SIZE 4096
+
+// Batch transcoding of many files
+//
+// Every file is one task on a work-stealing pool. Each worker thread keeps its
+// own decoder, encoder and resampler and reuses them for all the files it
+// processes, so after the first file a worker only allocates when a file needs
+// bigger buffers or different rates.
+
+typedef struct {
+    uint32_t sample_rate;
+    uint16_t bits_per_sample;
+    uint16_t audio_format;  // AUDIO_FORMAT_PCM or AUDIO_FORMAT_IEEE_FLOAT
+    uint16_t num_of_channels;
+    size_t nr_of_threads;
+    const WavMixer* mixer;  // NULL for the default channel mapping of every file
+
+    // Only this time range of every input is converted, a duration of 0 runs to the end
+    double start_seconds;
+    double duration_seconds;
+
+    enum AsyncIoBackend io;  // ASYNC_IO_NONE maps the inputs and writes the outputs directly
+    int fixed_point;         // Resample 16 bit files in Q15, see wav_extract_fixed_with
+    WavCache* cache;         // Outputs that were converted before are copied from here, NULL to always convert
+
+    // The signal statistics of every input are written to <stats_directory>/<output name>.json, NULL to skip them
+    const char* stats_directory;
+    float silence_threshold;  // In dBFS, see wav_stats_set_silence
+    double silence_seconds;
+} WavBatchOptions;
+
+typedef struct {
+    char input[BATCH_PATH_SIZE];
+    char output[BATCH_PATH_SIZE];
+
+    // Filled in when the file is processed
+    int failed;
+    int cached;  // The output was copied from the cache
+    size_t input_samples;
+    size_t output_samples;
+    uint64_t input_bytes;
+    double audio_seconds;
+    double seconds;
+} WavBatchFile;
+
+typedef struct {
+    WavDecoder decoder;
+    WavEncoder encoder;
+    WavResampler resampler;
+    WavStats stats;
+    int has_decoder;
+    int has_encoder;
+    int has_resampler;
+} BatchWorker;
+
+typedef struct {
+    const WavBatchOptions* options;
+    BatchWorker* workers;
+} WavBatch;
+
+static double batch_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int batch_is_wav(const char* name) {
+    size_t length = strlen(name);
+    return length > 4 && strcasecmp(name + length - 4, ".wav") == 0;
+}
+
+static int batch_compare_files(const void* a, const void* b) {
+    return strcmp(((const WavBatchFile*)a)->input, ((const WavBatchFile*)b)->input);
+}
+
+// Add a file, the output goes to output_directory with the name of the input
+// unless an output path is given
+static int batch_add_file(WavBatchFile** files, size_t* count, size_t* capacity, const char* input, const char* output,
+                          const char* output_directory) {
+    if (*count == *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 64;
+        WavBatchFile* resized = (WavBatchFile*)realloc(*files, sizeof(WavBatchFile) * grown);
+        if (resized == NULL) {
+            fprintf(stderr, "[WavBatch] Unable to allocate memory for %zu files\n", grown);
+            return 1;
+        }
+        *files = resized;
+        *capacity = grown;
+    }
+
+    WavBatchFile* file = &(*files)[*count];
+    memset(file, 0, sizeof(WavBatchFile));
+    snprintf(file->input, BATCH_PATH_SIZE, "%s", input);
+
+    if (output) {
+        snprintf(file->output, BATCH_PATH_SIZE, "%s", output);
+    } else if (output_directory) {
+        const char* name = strrchr(input, '/');
+        snprintf(file->output, BATCH_PATH_SIZE, "%s/%s", output_directory, name ? name + 1 : input);
+    } else {
+        fprintf(stderr, "[WavBatch] No output given for %s and no output directory set\n", input);
+        return 1;
+    }
+
+    (*count)++;
+    return 0;
+}
+
+// Create a directory the batch writes to, like --out-dir, when it does not exist
+// yet. Returns 0 on success
+static inline int wav_batch_make_directory(const char* directory) {
+    if (mkdir(directory, 0755) && errno != EEXIST) {
+        fprintf(stderr, "[WavBatch] Unable to create directory %s\n", directory);
+        return 1;
+    }
+    return 0;
+}
+
+// Collect the files to transcode from 'source', which is either a directory (all
+// .wav files in it) or a manifest with one "input [output]" pair per line.
+// Empty lines and lines starting with '#' are skipped
+static inline int wav_batch_collect(const char* source, const char* output_directory, WavBatchFile** files, size_t* count) {
+    size_t capacity = 0;
+    *files = NULL;
+    *count = 0;
+
+    struct stat st;
+    if (stat(source, &st)) {
+        fprintf(stderr, "[WavBatch] Unable to find %s\n", source);
+        return 1;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        DIR* directory = opendir(source);
+        if (directory == NULL) {
+            fprintf(stderr, "[WavBatch] Unable to open directory %s\n", source);
+            return 1;
+        }
+
+        struct dirent* entry;
+        char path[BATCH_PATH_SIZE];
+        while ((entry = readdir(directory)) != NULL) {
+            if (!batch_is_wav(entry->d_name)) {
+                continue;
+            }
+            snprintf(path, BATCH_PATH_SIZE, "%s/%s", source, entry->d_name);
+            if (batch_add_file(files, count, &capacity, path, NULL, output_directory)) {
+                closedir(directory);
+                return 1;
+            }
+        }
+        closedir(directory);
+
+        qsort(*files, *count, sizeof(WavBatchFile), batch_compare_files);
+        return 0;
+    }
+
+    FILE* manifest = fopen(source, "r");
+    if (manifest == NULL) {
+        fprintf(stderr, "[WavBatch] Unable to open manifest %s\n", source);
+        return 1;
+    }
+
+    char line[2 * BATCH_PATH_SIZE];
+    while (fgets(line, sizeof(line), manifest)) {
+        char input[BATCH_PATH_SIZE], output[BATCH_PATH_SIZE];
+        int fields = sscanf(line, "%4095s %4095s", input, output);
+        if (fields < 1 || input[0] == '#') {
+            continue;
+        }
+        if (batch_add_file(files, count, &capacity, input, fields == 2 ? output : NULL, output_directory)) {
+            fclose(manifest);
+            return 1;
+        }
+    }
+    fclose(manifest);
+
+    return 0;
+}
+
+// Bump when a change to the conversion changes its output, older cache entries are then never hit
+#define BATCH_CACHE_VERSION 1
+
+// Everything besides the input samples that goes into an output. The struct is
+// zeroed before it is filled so the padding hashes the same every time
+typedef struct {
+    uint32_t version;
+    uint32_t in_sample_rate;
+    uint16_t in_bits_per_sample;
+    uint16_t in_audio_format;
+    uint16_t in_num_of_channels;
+    uint16_t in_big_endian;
+    uint32_t sample_rate;
+    uint16_t bits_per_sample;
+    uint16_t audio_format;
+    uint16_t num_of_channels;
+    uint16_t fixed_point;
+    uint16_t parallel;  // Converted by wav_resample_parallel instead of wav_extract
+    uint16_t has_mixer;
+    double start_seconds;
+    double duration_seconds;
+    WavMixer mixer;
+
+    // The resampling method and its filter design, see wav_resampler_init
+    uint32_t method;
+    uint32_t zero_crossings;
+    double cutoff;
+    double kaiser_beta;
+} BatchCacheSettings;
+
+// The cache key of converting the input of 'decoder' (the header has to be read)
+// with 'options'. Returns 0 on success, inputs that are streamed have no key
+static inline int wav_batch_cache_key(const WavDecoder* decoder, const WavBatchOptions* options, int parallel, uint64_t* key) {
+    if (decoder->is_stream) {
+        return 1;
+    }
+
+    BatchCacheSettings settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.version = BATCH_CACHE_VERSION;
+    settings.in_sample_rate = decoder->header->sample_rate;
+    settings.in_bits_per_sample = decoder->header->bits_per_sample;
+    settings.in_audio_format = decoder->header->audio_format;
+    settings.in_num_of_channels = decoder->header->num_of_channels;
+    settings.in_big_endian = decoder->m_endian == BE;
+    settings.sample_rate = options->sample_rate;
+    settings.bits_per_sample = options->bits_per_sample;
+    settings.audio_format = options->audio_format;
+    settings.num_of_channels = options->num_of_channels;
+    settings.fixed_point = (uint16_t)options->fixed_point;
+    settings.parallel = (uint16_t)parallel;
+    settings.start_seconds = options->start_seconds;
+    settings.duration_seconds = options->duration_seconds;
+    if (options->mixer) {
+        settings.has_mixer = 1;
+        settings.mixer.in_channels = options->mixer->in_channels;
+        settings.mixer.out_channels = options->mixer->out_channels;
+        memcpy(settings.mixer.matrix, options->mixer->matrix, sizeof(settings.mixer.matrix));
+    }
+    settings.method = RESAMPLE_POLYPHASE;
+    settings.zero_crossings = RESAMPLER_ZERO_CROSSINGS;
+    settings.cutoff = RESAMPLER_CUTOFF;
+    settings.kaiser_beta = RESAMPLER_KAISER_BETA;
+
+    return wav_cache_hash_input(decoder, wav_hash(&settings, sizeof(settings), 0), key);
+}
+
+// Write the statistics of a file to <directory>/<output name>.json
+static int batch_write_stats(const char* directory, const WavBatchFile* file, WavStats* stats) {
+    const char* name = strrchr(file->output, '/');
+    name = name ? name + 1 : file->output;
+    int length = batch_is_wav(name) ? (int)strlen(name) - 4 : (int)strlen(name);
+
+    char path[BATCH_PATH_SIZE + 16];
+    snprintf(path, sizeof(path), "%s/%.*s.json", directory, length, name);
+
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "[WavBatch] Unable to open file %s for writing\n", path);
+        return 1;
+    }
+
+    int failed = wav_stats_finish(stats) || wav_stats_write_json(stats, fp);
+    if (fclose(fp)) {
+        failed = 1;
+    }
+    return failed;
+}
+
+static int batch_transcode(WavBatch* batch, BatchWorker* worker, WavBatchFile* file) {
+    const WavBatchOptions* options = batch->options;
+    WavDecoder* decoder = &worker->decoder;
+    WavEncoder* encoder = &worker->encoder;
+
+    int failed;
+    if (worker->has_decoder) {
+        failed = wav_decoder_reopen(decoder, file->input);
+    } else if (options->io != ASYNC_IO_NONE) {
+        failed = wav_decoder_init_async(decoder, file->input, options->io);
+    } else {
+        failed = wav_decoder_init_mmap(decoder, file->input);
+    }
+    worker->has_decoder = 1;
+    if (failed || wav_decoder_get_header(decoder)) {
+        return 1;
+    }
+
+    // The statistics are gathered while decoding, so a file that is analyzed is never taken from the cache
+    wav_stats_set_silence(&worker->stats, options->silence_threshold, options->silence_seconds);
+    if (wav_decoder_set_stats(decoder, options->stats_directory ? &worker->stats : NULL)) {
+        return 1;
+    }
+
+    uint64_t key;
+    int has_key = options->cache && !options->stats_directory && wav_batch_cache_key(decoder, options, 0, &key) == 0;
+    if (has_key && wav_cache_fetch(options->cache, key, file->output) == 0) {
+        file->cached = 1;
+        file->input_samples = decoder->nr_of_samples;
+        file->input_bytes = decoder->header->data_size;
+        file->audio_seconds = (double)decoder->nr_of_samples / decoder->header->sample_rate;
+        return 0;
+    }
+
+    // The filter bank only has to be designed again when the rates change
+    WavResampler* resampler = &worker->resampler;
+    if (worker->has_resampler && (resampler->in_rate != decoder->header->sample_rate || resampler->channels != options->num_of_channels)) {
+        wav_resampler_close(resampler);
+        worker->has_resampler = 0;
+    }
+    if (!worker->has_resampler) {
+        if (wav_resampler_init(resampler, decoder->header->sample_rate, options->sample_rate, options->num_of_channels)) {
+            return 1;
+        }
+        worker->has_resampler = 1;
+
+        if (options->mixer && wav_resampler_set_mixer(resampler, options->mixer)) {
+            return 1;
+        }
+    }
+
+    failed = worker->has_encoder ? wav_encoder_reopen(encoder, file->output) : wav_encoder_init(encoder, file->output);
+    worker->has_encoder = encoder->buffer != NULL;
+    if (worker->has_encoder) {
+        wav_encoder_set_async_io(encoder, options->io);
+    }
+    if (failed || wav_encoder_set_header(encoder, options->sample_rate, options->bits_per_sample, options->audio_format,
+                                         options->num_of_channels, 0)) {
+        return 1;
+    }
+
+    uint64_t first_output, end_output;
+    wav_extract_range(decoder, resampler, options->start_seconds, options->duration_seconds, &first_output, &end_output);
+    wav_encoder_set_nr_of_samples(encoder, end_output - first_output);
+
+    if (wav_encoder_write_header(encoder)) {
+        return 1;
+    }
+
+    // The Q15 filter bank is kept with the resampler like the float one
+    long written;
+    if (options->fixed_point && wav_supports_fixed(decoder, encoder)) {
+        if (wav_resampler_init_fixed(resampler)) {
+            return 1;
+        }
+        written = wav_extract_fixed_with(decoder, encoder, resampler, first_output, end_output, &file->input_samples);
+    } else {
+        written = wav_extract_with(decoder, encoder, resampler, first_output, end_output, &file->input_samples);
+    }
+    if (written < 0) {
+        return 1;
+    }
+
+    // The output is finished with its file, a failure of the last writes fails the file
+    if (wav_encoder_finish(encoder)) {
+        return 1;
+    }
+
+    // Only an output that was finished is stored, a failure to store it does not fail the file
+    if (has_key) {
+        wav_cache_store(options->cache, key, file->output);
+    }
+
+    file->output_samples = written;
+    file->input_bytes = (uint64_t)file->input_samples * decoder->header->block_align;
+    file->audio_seconds = (double)file->input_samples / decoder->header->sample_rate;
+
+    if (options->stats_directory) {
+        return batch_write_stats(options->stats_directory, file, &worker->stats);
+    }
+
+    return 0;
+}
+
+static void batch_run_file(void* task, size_t index, void* context) {
+    WavBatch* batch = (WavBatch*)context;
+    WavBatchFile* file = (WavBatchFile*)task;
+
+    double start = batch_now();
+    file->failed = batch_transcode(batch, &batch->workers[index], file);
+
+    // An output that failed halfway is closed here, so the next file of the worker does not finish it
+    if (file->failed && batch->workers[index].has_encoder) {
+        wav_encoder_finish(&batch->workers[index].encoder);
+    }
+    file->seconds = batch_now() - start;
+
+    if (file->failed) {
+        printf("[failed] %s\n", file->input);
+        return;
+    }
+
+    if (file->cached) {
+        printf("[cached] %s -> %s: %.2f s of audio in %.3f s\n", file->input, file->output, file->audio_seconds, file->seconds);
+        return;
+    }
+
+    printf("[ok] %s -> %s: %.2f s of audio in %.3f s (%.0fx realtime, %.1f MB/s)\n", file->input, file->output, file->audio_seconds,
+           file->seconds, file->audio_seconds / file->seconds, file->input_bytes / file->seconds / 1e6);
+}
+
+// Transcode all files on options->nr_of_threads threads and print a per file
+// and an aggregate report. Returns the amount of files that failed
+static inline size_t wav_batch_run(WavBatchFile* files, size_t count, const WavBatchOptions* options) {
+    size_t threads = options->nr_of_threads ? options->nr_of_threads : 1;
+
+    WavBatch batch;
+    batch.options = options;
+    batch.workers = (BatchWorker*)calloc(threads, sizeof(BatchWorker));
+    void** tasks = (void**)malloc(sizeof(void*) * (count + 1));
+    if (batch.workers == NULL || tasks == NULL) {
+        fprintf(stderr, "[WavBatch] Unable to allocate memory for %zu workers\n", threads);
+        free(batch.workers);
+        free(tasks);
+        return count;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        tasks[i] = &files[i];
+        files[i].failed = 1;
+    }
+
+    double start = batch_now();
+    work_pool_run(threads, tasks, count, batch_run_file, &batch);
+    double seconds = batch_now() - start;
+
+    for (size_t i = 0; i < threads; i++) {
+        BatchWorker* worker = &batch.workers[i];
+        if (worker->has_decoder) {
+            wav_decoder_close(&worker->decoder);
+        }
+        if (worker->has_encoder && wav_encoder_close(&worker->encoder)) {
+            fprintf(stderr, "[WavBatch] Unable to finish the last output of worker %zu\n", i);
+        }
+        if (worker->has_resampler) {
+            wav_resampler_close(&worker->resampler);
+        }
+        wav_stats_free(&worker->stats);
+    }
+    free(batch.workers);
+    free(tasks);
+
+    size_t failed = 0, cached = 0;
+    double audio_seconds = 0;
+    uint64_t input_bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (files[i].failed) {
+            failed++;
+            continue;
+        }
+        cached += files[i].cached;
+        audio_seconds += files[i].audio_seconds;
+        input_bytes += files[i].input_bytes;
+    }
+
+    printf("\nBatch: %zu files (%zu failed, %zu cached) on %zu threads in %.3f s\n", count, failed, cached, threads, seconds);
+    printf("\t%.1f files/s, %.1f s of audio (%.0fx realtime), %.1f MB/s\n", count / seconds, audio_seconds, audio_seconds / seconds,
+           input_bytes / seconds / 1e6);
+
+    return failed;
+}
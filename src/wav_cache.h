@@ -0,0 +1,488 @@
+#pragma once
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+#include "wav_decoder.h"
+
+#define CACHE_PATH_SIZE 4096
+#define CACHE_DIRECTORY_SIZE (CACHE_PATH_SIZE - 512)  // Leaves room for the names of the entries
+#define CACHE_HASH_BLOCK (1024 * 1024)         // Bytes hashed per read when the input is not mapped
+#define CACHE_DEFAULT_BUDGET (1024ULL << 20)   // In bytes
+#define CACHE_STALE_SECONDS 3600               // Temporary files of writers that died are removed after this
+#define CACHE_EVICT_HEADROOM 10                // Percent of the budget an eviction frees beyond what is needed
+
+// Content-addressed cache of converted outputs
+//
+// An output is stored under a 64 bit key: the XXH64 hash of the samples in the
+// data chunk of the input, seeded with a hash of everything else that changes
+// the output (input format and conversion settings, see wav_batch_cache_key).
+// Every entry is a finished WAV file <directory>/<key>.wav.
+//
+// Entries are written to a temporary file and renamed into place, so other
+// processes only ever see complete entries. A reader opens the entry before
+// copying it, an eviction that unlinks it in between does not disturb the copy.
+// Copies stay in the kernel: a clone (reflink) where the file system supports
+// it, otherwise copy_file_range or sendfile.
+//
+// The modification time of an entry is its last use, a hit touches it. Every
+// store adds to an estimate of the size of the cache, only once that passes the
+// budget the directory is scanned and the least recently used entries are
+// removed, down to CACHE_EVICT_HEADROOM percent below the budget so the next
+// scan is many stores away. A lock file makes sure only one thread or process
+// evicts at a time, the scan also brings in what other processes stored.
+
+typedef struct {
+    char directory[CACHE_DIRECTORY_SIZE];
+    uint64_t budget;  // In bytes
+    _Atomic uint64_t m_size;  // Estimated bytes in the cache, set by every scan
+} WavCache;
+
+// Streaming XXH64
+
+#define HASH_PRIME_1 11400714785074694791ULL
+#define HASH_PRIME_2 14029467366897019727ULL
+#define HASH_PRIME_3 1609587929392839161ULL
+#define HASH_PRIME_4 9650029242287828579ULL
+#define HASH_PRIME_5 2870177450012600261ULL
+
+typedef struct {
+    uint64_t m_lanes[4];
+    uint64_t m_seed;
+    uint64_t m_length;
+    uint8_t m_buffer[32];  // Bytes that do not make a whole stripe yet
+    size_t m_buffered;
+} WavHash;
+
+static inline uint64_t hash_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_read64(const uint8_t* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash_read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input) {
+    acc += input * HASH_PRIME_2;
+    return hash_rotl(acc, 31) * HASH_PRIME_1;
+}
+
+static inline uint64_t hash_merge(uint64_t acc, uint64_t lane) {
+    acc ^= hash_round(0, lane);
+    return acc * HASH_PRIME_1 + HASH_PRIME_4;
+}
+
+static inline void wav_hash_init(WavHash* hash, uint64_t seed) {
+    hash->m_lanes[0] = seed + HASH_PRIME_1 + HASH_PRIME_2;
+    hash->m_lanes[1] = seed + HASH_PRIME_2;
+    hash->m_lanes[2] = seed;
+    hash->m_lanes[3] = seed - HASH_PRIME_1;
+    hash->m_seed = seed;
+    hash->m_length = 0;
+    hash->m_buffered = 0;
+}
+
+static inline void hash_stripe(WavHash* hash, const uint8_t* p) {
+    for (int i = 0; i < 4; i++) {
+        hash->m_lanes[i] = hash_round(hash->m_lanes[i], hash_read64(p + 8 * i));
+    }
+}
+
+static inline void wav_hash_update(WavHash* hash, const uint8_t* data, size_t size) {
+    hash->m_length += size;
+
+    if (hash->m_buffered) {
+        size_t length = 32 - hash->m_buffered < size ? 32 - hash->m_buffered : size;
+        memcpy(hash->m_buffer + hash->m_buffered, data, length);
+        hash->m_buffered += length;
+        data += length;
+        size -= length;
+        if (hash->m_buffered < 32) {
+            return;
+        }
+        hash_stripe(hash, hash->m_buffer);
+        hash->m_buffered = 0;
+    }
+
+    for (; size >= 32; data += 32, size -= 32) {
+        hash_stripe(hash, data);
+    }
+
+    memcpy(hash->m_buffer, data, size);
+    hash->m_buffered = size;
+}
+
+static inline uint64_t wav_hash_digest(const WavHash* hash) {
+    uint64_t h;
+    if (hash->m_length >= 32) {
+        const uint64_t* v = hash->m_lanes;
+        h = hash_rotl(v[0], 1) + hash_rotl(v[1], 7) + hash_rotl(v[2], 12) + hash_rotl(v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = hash_merge(h, v[i]);
+        }
+    } else {
+        h = hash->m_seed + HASH_PRIME_5;
+    }
+    h += hash->m_length;
+
+    const uint8_t* p = hash->m_buffer;
+    size_t size = hash->m_buffered;
+    for (; size >= 8; p += 8, size -= 8) {
+        h ^= hash_round(0, hash_read64(p));
+        h = hash_rotl(h, 27) * HASH_PRIME_1 + HASH_PRIME_4;
+    }
+    if (size >= 4) {
+        h ^= hash_read32(p) * HASH_PRIME_1;
+        h = hash_rotl(h, 23) * HASH_PRIME_2 + HASH_PRIME_3;
+        p += 4;
+        size -= 4;
+    }
+    for (; size > 0; p++, size--) {
+        h ^= *p * HASH_PRIME_5;
+        h = hash_rotl(h, 11) * HASH_PRIME_1;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_PRIME_2;
+    h ^= h >> 29;
+    h *= HASH_PRIME_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t wav_hash(const void* data, size_t size, uint64_t seed) {
+    WavHash hash;
+    wav_hash_init(&hash, seed);
+    wav_hash_update(&hash, (const uint8_t*)data, size);
+    return wav_hash_digest(&hash);
+}
+
+// Hash the samples in the data chunk of a regular file, straight from the
+// mapping when the decoder has one. The header has to be read, the read
+// position of the decoder is not touched. Returns 0 on success
+static inline int wav_cache_hash_input(const WavDecoder* decoder, uint64_t seed, uint64_t* key) {
+    if (decoder->is_stream || decoder->header == NULL) {
+        return 1;
+    }
+
+    const uint64_t offset = decoder->header->data_offset;
+    const uint64_t size = decoder->header->data_size;
+    const ByteBuffer* buffer = decoder->buffer;
+
+    WavHash hash;
+    wav_hash_init(&hash, seed);
+
+    if (buffer->m_mapped_size) {
+        if (offset + size > buffer->m_mapped_size) {
+            return 1;
+        }
+        wav_hash_update(&hash, buffer->m_buffer + offset, size);
+        *key = wav_hash_digest(&hash);
+        return 0;
+    }
+
+    uint8_t* block = (uint8_t*)malloc(CACHE_HASH_BLOCK);
+    if (block == NULL) {
+        fprintf(stderr, "[WavCache] Unable to allocate memory for hashing\n");
+        return 1;
+    }
+
+    for (uint64_t done = 0; done < size;) {
+        size_t length = size - done < CACHE_HASH_BLOCK ? (size_t)(size - done) : CACHE_HASH_BLOCK;
+        ssize_t result = pread(fileno(decoder->fp), block, length, (off_t)(offset + done));
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            fprintf(stderr, "[WavCache] Unable to read the input for hashing\n");
+            free(block);
+            return 1;
+        }
+        wav_hash_update(&hash, block, (size_t)result);
+        done += result;
+    }
+    free(block);
+
+    *key = wav_hash_digest(&hash);
+    return 0;
+}
+
+// Cache
+
+static inline void cache_entry_path(const WavCache* cache, uint64_t key, char* path) {
+    snprintf(path, CACHE_PATH_SIZE, "%s/%016llx.wav", cache->directory, (unsigned long long)key);
+}
+
+// Copy the rest of 'from' into 'to' without going through user space. A clone
+// shares the blocks of the file, copy_file_range copies them in the kernel and
+// sendfile also works for outputs that are not regular files, like a pipe
+static int cache_copy(int from, int to, uint64_t size) {
+#ifdef FICLONE
+    if (ioctl(to, FICLONE, from) == 0) {
+        return 0;
+    }
+#endif
+
+#ifdef __NR_copy_file_range
+    while (size > 0) {
+        ssize_t result = syscall(__NR_copy_file_range, from, NULL, to, NULL, (size_t)size, 0);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            break;
+        }
+        size -= result;
+    }
+#endif
+
+    // Both calls continue at the file offsets the other one left
+    while (size > 0) {
+        ssize_t result = sendfile(to, from, NULL, (size_t)size);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return 1;
+        }
+        size -= result;
+    }
+
+    return 0;
+}
+
+typedef struct {
+    char name[32];
+    int64_t used;  // Modification time in nanoseconds
+    uint64_t size;
+} CacheEntry;
+
+static int cache_compare_entries(const void* a, const void* b) {
+    int64_t x = ((const CacheEntry*)a)->used;
+    int64_t y = ((const CacheEntry*)b)->used;
+    return x < y ? -1 : x > y;
+}
+
+// Scan the cache: remove the least recently used entries when it does not fit
+// its budget, and temporary files that were left behind. The estimate of the
+// size is set to what is left. Unless 'always' is set the scan is skipped when
+// an eviction that was waited for already brought the estimate within budget
+static inline int wav_cache_evict(WavCache* cache, int always) {
+    char path[CACHE_PATH_SIZE];
+    snprintf(path, CACHE_PATH_SIZE, "%s/lock", cache->directory);
+
+    int lock = open(path, O_RDWR | O_CREAT, 0644);
+    if (lock < 0) {
+        fprintf(stderr, "[WavCache] Unable to open the lock file in %s\n", cache->directory);
+        return 1;
+    }
+    if (flock(lock, LOCK_EX)) {
+        fprintf(stderr, "[WavCache] Unable to lock %s\n", cache->directory);
+        close(lock);
+        return 1;
+    }
+    if (!always && atomic_load(&cache->m_size) <= cache->budget) {
+        close(lock);
+        return 0;
+    }
+
+    DIR* directory = opendir(cache->directory);
+    if (directory == NULL) {
+        close(lock);
+        return 1;
+    }
+
+    // Stores of other threads during the scan stay in the estimate
+    const uint64_t estimate = atomic_load(&cache->m_size);
+
+    CacheEntry* entries = NULL;
+    size_t count = 0, capacity = 0;
+    uint64_t total = 0;
+    time_t now = time(NULL);
+    struct dirent* dirent;
+    struct stat st;
+
+    while ((dirent = readdir(directory)) != NULL) {
+        const char* name = dirent->d_name;
+        snprintf(path, CACHE_PATH_SIZE, "%s/%s", cache->directory, name);
+
+        if (strncmp(name, ".tmp.", 5) == 0) {
+            if (stat(path, &st) == 0 && now - st.st_mtime > CACHE_STALE_SECONDS) {
+                unlink(path);
+            }
+            continue;
+        }
+        if (strlen(name) != 20 || strcmp(name + 16, ".wav") != 0 || stat(path, &st)) {
+            continue;
+        }
+
+        if (count == capacity) {
+            size_t grown = capacity ? capacity * 2 : 256;
+            CacheEntry* resized = (CacheEntry*)realloc(entries, sizeof(CacheEntry) * grown);
+            if (resized == NULL) {
+                fprintf(stderr, "[WavCache] Unable to allocate memory for %zu entries\n", grown);
+                break;
+            }
+            entries = resized;
+            capacity = grown;
+        }
+
+        CacheEntry* entry = &entries[count++];
+        memcpy(entry->name, name, 21);  // <key>.wav and its terminator
+        entry->used = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        entry->size = (uint64_t)st.st_size;
+        total += entry->size;
+    }
+    closedir(directory);
+
+    if (total > cache->budget) {
+        const uint64_t target = cache->budget - cache->budget / 100 * CACHE_EVICT_HEADROOM;
+        qsort(entries, count, sizeof(CacheEntry), cache_compare_entries);
+        for (size_t i = 0; i < count && total > target; i++) {
+            snprintf(path, CACHE_PATH_SIZE, "%s/%s", cache->directory, entries[i].name);
+            if (unlink(path) == 0) {
+                total -= entries[i].size;
+            }
+        }
+    }
+
+    atomic_fetch_add(&cache->m_size, total - estimate);
+
+    free(entries);
+    close(lock);
+
+    return 0;
+}
+
+// Use (and create when needed) the cache in 'directory', limited to 'budget'
+// bytes. Returns 0 on success
+static inline int wav_cache_open(WavCache* cache, const char* directory, uint64_t budget) {
+    if (strlen(directory) >= CACHE_DIRECTORY_SIZE) {
+        fprintf(stderr, "[WavCache] The path %s is too long\n", directory);
+        return 1;
+    }
+
+    if (mkdir(directory, 0755) && errno != EEXIST) {
+        fprintf(stderr, "[WavCache] Unable to create directory %s\n", directory);
+        return 1;
+    }
+
+    snprintf(cache->directory, CACHE_DIRECTORY_SIZE, "%s", directory);
+    cache->budget = budget;
+    atomic_init(&cache->m_size, 0);
+
+    // The estimate starts out with what is already in the cache, a cache that
+    // can not be scanned (read only, for example) can still be fetched from
+    wav_cache_evict(cache, 1);
+
+    return 0;
+}
+
+// Copy the entry of 'key' to the descriptor 'to' and mark it as used. Returns
+// 0 on a hit, 1 when there is no entry or it could not be copied
+static inline int wav_cache_fetch_fd(const WavCache* cache, uint64_t key, int to) {
+    char path[CACHE_PATH_SIZE];
+    cache_entry_path(cache, key, path);
+
+    int from = open(path, O_RDONLY);
+    if (from < 0) {
+        return 1;
+    }
+
+    struct stat st;
+    int failed = fstat(from, &st) || st.st_size < HEADER_LENGTH_1 || cache_copy(from, to, (uint64_t)st.st_size);
+    if (!failed) {
+        futimens(from, NULL);
+    } else {
+        fprintf(stderr, "[WavCache] Unable to copy entry %016llx\n", (unsigned long long)key);
+    }
+
+    close(from);
+    return failed;
+}
+
+// Copy the entry of 'key' to the file 'output', see wav_cache_fetch_fd
+static inline int wav_cache_fetch(const WavCache* cache, uint64_t key, const char* output) {
+    char path[CACHE_PATH_SIZE];
+    cache_entry_path(cache, key, path);
+    if (access(path, R_OK)) {
+        return 1;
+    }
+
+    int to = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (to < 0) {
+        fprintf(stderr, "[WavCache] Unable to open file %s for writing\n", output);
+        return 1;
+    }
+
+    int failed = wav_cache_fetch_fd(cache, key, to);
+    if (close(to)) {
+        failed = 1;
+    }
+    return failed;
+}
+
+// Store the finished WAV file 'output' as the entry of 'key', and evict once the
+// estimated size passes the budget. Returns 0 on success
+static inline int wav_cache_store(WavCache* cache, uint64_t key, const char* output) {
+    int from = open(output, O_RDONLY);
+    if (from < 0) {
+        fprintf(stderr, "[WavCache] Unable to open %s for storing\n", output);
+        return 1;
+    }
+
+    char temporary[CACHE_PATH_SIZE];
+    snprintf(temporary, CACHE_PATH_SIZE, "%s/.tmp.XXXXXX", cache->directory);
+    int to = mkstemp(temporary);
+    if (to < 0) {
+        fprintf(stderr, "[WavCache] Unable to create a temporary file in %s\n", cache->directory);
+        close(from);
+        return 1;
+    }
+
+    // The entry only becomes visible under its name once all of it is on disk
+    struct stat st;
+    int failed = fstat(from, &st) || cache_copy(from, to, (uint64_t)st.st_size) || fchmod(to, 0644) || fdatasync(to);
+    close(from);
+    failed |= close(to) != 0;
+
+    char path[CACHE_PATH_SIZE];
+    cache_entry_path(cache, key, path);
+    if (failed || rename(temporary, path)) {
+        fprintf(stderr, "[WavCache] Unable to store entry %016llx\n", (unsigned long long)key);
+        unlink(temporary);
+        return 1;
+    }
+
+    // Replacing an entry counts it twice, which only makes the next scan come sooner
+    uint64_t size = (uint64_t)st.st_size;
+    if (atomic_fetch_add(&cache->m_size, size) + size <= cache->budget) {
+        return 0;
+    }
+    return wav_cache_evict(cache, 0);
+}
@@ -1,9 +1,16 @@
 #pragma once
 
+#include <sys/stat.h>
+
+#include "pcm_convert.h"
 #include "wav.h"
+#include "wav_stats.h"
 
-#define DECODER_PROCESS_SIZE 1024  // In bytes
-#define DECODER_SAMPLE_SIZE 1000   // In samples
+#define DECODER_PROCESS_SIZE 1024          // In bytes
+#define DECODER_SAMPLE_SIZE 1000           // In samples
+#define DECODER_STREAM_SIZE (64 * 1024)    // Read buffer for pipes and sockets, in bytes
+#define DECODER_STREAM_LIMIT (1ULL << 40)  // Data size assumed for a stream that does not announce one, in bytes
+#define DECODER_MAX_CHANNELS UINT8_MAX     // The channels of a sample block are counted in a byte
 
 typedef struct {
     ByteBuffer* buffer;
@@ -13,30 +20,71 @@ typedef struct {
     WavHeader* header;
     size_t nr_of_samples;
     size_t remaining_samples;
+    int is_stream;  // Pipes and sockets are read until they end, their size is not known
+    enum AsyncIoBackend m_io;  // Regular files are prefetched asynchronously unless ASYNC_IO_NONE
+
+    // Selected once the header is parsed
+    enum EndianType m_endian;  // BE for RIFX files
+    PcmDecodeKernel m_decode;
+    PcmQ15DecodeKernel m_decode_q15;  // NULL when the samples can not be read in fixed point
+
+    WavFixedData fixed;  // Chunks of wav_decoder_get_next_fixed
+    WavStats* stats;     // Fed with every decoded chunk when set, see wav_decoder_set_stats
+    uint64_t m_position;     // Input frame the next chunk starts at
+    uint64_t m_stats_first;  // Input frames [m_stats_first, m_stats_end) are fed to the statistics
+    uint64_t m_stats_end;
 } WavDecoder;
 
-static void free_data(WavData* data) {
-    if (data->m_samples && data->nr_of_samples != 0) {
-        for (size_t i = 0; i < data->nr_of_samples; i++) {
-            free(data->m_samples[i].m_data);
+static void set_file_size(WavDecoder* decoder) {
+    struct stat st;
+    decoder->is_stream = fstat(fileno(decoder->fp), &st) != 0 || !S_ISREG(st.st_mode);
+    decoder->file_size = decoder->is_stream ? 0 : (size_t)st.st_size;
+}
+
+// Set up the byte buffer for the opened file: a stream buffer for pipes and
+// sockets, asynchronous reads when asked for, otherwise a memory mapping for
+// regular files or buffered reads when mapping fails
+static int decoder_open_buffer(WavDecoder* decoder, const char* name) {
+    set_file_size(decoder);
+
+    // Prefetched blocks are copied into a stream buffer, the file is read like a pipe
+    if (!decoder->is_stream && decoder->m_io != ASYNC_IO_NONE) {
+        if (byte_buffer_init_stream(&(decoder->buffer), decoder->fp, DECODER_STREAM_SIZE)) {
+            return 1;
+        }
+        if (byte_buffer_attach_async(decoder->buffer, decoder->m_io) == 0) {
+            decoder->nr_of_samples = 0;
+            decoder->remaining_samples = 0;
+            return 0;
         }
+        fprintf(stderr, "[WavDecoder] Falling back to synchronous reads for %s\n", name);
+        byte_buffer_close(decoder->buffer);
+        decoder->buffer = NULL;
+    }
 
-        free(data->m_samples);
+    if (decoder->is_stream) {
+        if (byte_buffer_init_stream(&(decoder->buffer), decoder->fp, DECODER_STREAM_SIZE)) {
+            return 1;
+        }
+    } else if (byte_buffer_init_mmap(&(decoder->buffer), decoder->fp, decoder->file_size)) {
+        fprintf(stderr, "[WavDecoder] Falling back to buffered reads for %s\n", name);
+        if (byte_buffer_init(&(decoder->buffer), decoder->fp, decoder->file_size, DECODER_PROCESS_SIZE)) {
+            return 1;
+        }
     }
 
-    data->nr_of_samples = 0;
-}
+    decoder->nr_of_samples = 0;
+    decoder->remaining_samples = 0;
 
-static void set_file_size(WavDecoder* decoder) {
-    fseek(decoder->fp, 0, SEEK_END);
-    decoder->file_size = ftell(decoder->fp);
-    rewind(decoder->fp);
+    return 0;
 }
 
 static inline void wav_decoder_close(WavDecoder* decoder) {
     byte_buffer_close(decoder->buffer);
+    decoder->buffer = NULL;
+    wav_fixed_data_free(&decoder->fixed);
     if (decoder->data) {
-        free_data(decoder->data);
+        wav_data_free(decoder->data);
         free(decoder->data);
     }
 
@@ -44,7 +92,9 @@ static inline void wav_decoder_close(WavDecoder* decoder) {
         free(decoder->header);
     }
 
-    fclose(decoder->fp);
+    if (decoder->fp) {
+        fclose(decoder->fp);
+    }
 }
 
 static inline int wav_decoder_init(WavDecoder* decoder, const char* filename) {
@@ -58,27 +108,228 @@ static inline int wav_decoder_init(WavDecoder* decoder, const char* filename) {
     set_file_size(decoder);
 
     // Initialize the ByteBuffer
-    byte_buffer_init(&(decoder->buffer), decoder->fp, decoder->file_size, DECODER_PROCESS_SIZE);
+    if (decoder->is_stream) {
+        byte_buffer_init_stream(&(decoder->buffer), decoder->fp, DECODER_STREAM_SIZE);
+    } else {
+        byte_buffer_init(&(decoder->buffer), decoder->fp, decoder->file_size, DECODER_PROCESS_SIZE);
+    }
 
     decoder->header = NULL;
+    decoder->m_decode = NULL;
+    decoder->m_io = ASYNC_IO_NONE;
+    wav_fixed_data_init(&decoder->fixed);
+    decoder->stats = NULL;
 
     decoder->data = (WavData*)malloc(sizeof(WavData));
     if (decoder->data == NULL) {
         fprintf(stderr, "[WavDecoder] Unable to allocate memory for decoder data\n");
         return 1;
     }
+    wav_data_init(decoder->data);
 
     return 0;
 }
 
+// Close the current file (if any) and continue with another one, read the same
+// way as the previous one (a memory mapping when possible). The header and the sample block of the decoder
+// are kept, so a decoder can be reused for many files without reallocating
+static inline int wav_decoder_reopen(WavDecoder* decoder, const char* filename) {
+    byte_buffer_close(decoder->buffer);
+    decoder->buffer = NULL;
+    if (decoder->fp) {
+        fclose(decoder->fp);
+    }
+
+    decoder->fp = fopen(filename, "rb");
+    if (decoder->fp == NULL) {
+        fprintf(stderr, "[WavDecoder] Unable to open file %s for reading\n", filename);
+        return 1;
+    }
+
+    return decoder_open_buffer(decoder, filename);
+}
+
+// Initialize a decoder that reads from a memory mapping of the file instead of
+// copying it through ByteBuffer refills. Falls back to the regular reader when
+// the file can not be mapped
+static inline int wav_decoder_init_mmap(WavDecoder* decoder, const char* filename) {
+    decoder->fp = NULL;
+    decoder->buffer = NULL;
+    decoder->header = NULL;
+    decoder->m_decode = NULL;
+    decoder->m_io = ASYNC_IO_NONE;
+    wav_fixed_data_init(&decoder->fixed);
+    decoder->stats = NULL;
+
+    decoder->data = (WavData*)malloc(sizeof(WavData));
+    if (decoder->data == NULL) {
+        fprintf(stderr, "[WavDecoder] Unable to allocate memory for decoder data\n");
+        return 1;
+    }
+    wav_data_init(decoder->data);
+
+    return wav_decoder_reopen(decoder, filename);
+}
+
+// Initialize a decoder that keeps several large reads of the file in flight
+// ahead of decoding, see async_io.h. Pipes and sockets are read as usual
+static inline int wav_decoder_init_async(WavDecoder* decoder, const char* filename, enum AsyncIoBackend backend) {
+    decoder->fp = NULL;
+    decoder->buffer = NULL;
+    decoder->header = NULL;
+    decoder->m_decode = NULL;
+    decoder->m_io = backend;
+    wav_fixed_data_init(&decoder->fixed);
+    decoder->stats = NULL;
+
+    decoder->data = (WavData*)malloc(sizeof(WavData));
+    if (decoder->data == NULL) {
+        fprintf(stderr, "[WavDecoder] Unable to allocate memory for decoder data\n");
+        return 1;
+    }
+    wav_data_init(decoder->data);
+
+    return wav_decoder_reopen(decoder, filename);
+}
+
+// Initialize a decoder on an open descriptor, like standard input, a pipe from
+// another process or a socket. The decoder takes over the descriptor and closes it
+static inline int wav_decoder_init_fd(WavDecoder* decoder, int fd) {
+    decoder->buffer = NULL;
+    decoder->header = NULL;
+    decoder->m_decode = NULL;
+    decoder->m_io = ASYNC_IO_NONE;
+    wav_fixed_data_init(&decoder->fixed);
+    decoder->stats = NULL;
+
+    decoder->fp = fdopen(fd, "rb");
+    if (decoder->fp == NULL) {
+        fprintf(stderr, "[WavDecoder] Unable to open descriptor %d for reading\n", fd);
+        decoder->data = NULL;
+        return 1;
+    }
+
+    decoder->data = (WavData*)malloc(sizeof(WavData));
+    if (decoder->data == NULL) {
+        fprintf(stderr, "[WavDecoder] Unable to allocate memory for decoder data\n");
+        return 1;
+    }
+    wav_data_init(decoder->data);
+
+    return decoder_open_buffer(decoder, "the descriptor");
+}
+
+// Returns 1 for a stream that did not announce its length, nr_of_samples is
+// then only an upper bound and the samples end with the stream
+static inline int wav_decoder_is_unbounded(const WavDecoder* decoder) {
+    return decoder->is_stream && decoder->header && decoder->header->data_size == DECODER_STREAM_LIMIT;
+}
+
+// Feed the part of the chunk that was just decoded that lies in the range of
+// the statistics, from 'fixed' or from 'data'
+static int decoder_feed_stats(WavDecoder* decoder, size_t samples, int fixed) {
+    const uint64_t position = decoder->m_position - samples;
+    const uint64_t first = position > decoder->m_stats_first ? position : decoder->m_stats_first;
+    const uint64_t end = decoder->m_position < decoder->m_stats_end ? decoder->m_position : decoder->m_stats_end;
+    if (first >= end) {
+        return 0;
+    }
+
+    return fixed ? wav_stats_process_fixed(decoder->stats, &decoder->fixed, first - position, end - first)
+                 : wav_stats_process(decoder->stats, decoder->data, first - position, end - first);
+}
+
 static inline int wav_decoder_get_next_samples(WavDecoder* decoder) {
     if (!decoder->remaining_samples) {
         return 0;
     }
 
-    // If the data already contains samples remove them
-    if (decoder->data->m_samples) {
-        free(decoder->data->m_samples);
+    size_t samples = DECODER_SAMPLE_SIZE;
+    if (decoder->remaining_samples < DECODER_SAMPLE_SIZE) {
+        samples = decoder->remaining_samples;
+    }
+
+    // The sample block was sized with the header, this only allocates when the
+    // data was shrunk or taken over in between
+    if (wav_data_reserve(decoder->data, DECODER_SAMPLE_SIZE, (uint8_t)decoder->header->num_of_channels)) {
+        return -1;
+    }
+    decoder->data->layout = LAYOUT_INTERLEAVED;
+
+    const uint16_t channels = decoder->header->num_of_channels;
+    float* out = decoder->data->m_data;
+
+    // The bytes of the whole chunk are bounds checked (and loaded) once, with a
+    // mapped file this points straight into the mapping
+    size_t available;
+    const uint8_t* in = byte_buffer_read_bytes(decoder->buffer, samples * decoder->header->block_align, &available);
+
+    // A truncated file ends the stream at the last complete sample
+    if (available < samples * decoder->header->block_align) {
+        samples = available / decoder->header->block_align;
+        decoder->remaining_samples = samples;
+    }
+
+    // Get the samples
+    INSTRUMENT_START(start);
+    decoder->m_decode(in, out, samples * channels);
+    INSTRUMENT_STOP(INSTRUMENT_DECODE, start);
+    INSTRUMENT_COUNT(INSTRUMENT_SAMPLES_DECODED, samples);
+
+    decoder->data->nr_of_samples = samples;
+    decoder->remaining_samples -= samples;
+    decoder->m_position += samples;
+
+    if (decoder->stats && decoder_feed_stats(decoder, samples, 0)) {
+        return -1;
+    }
+
+    return samples;
+}
+
+// Gather the signal statistics of the samples that are decoded from now on in
+// 'stats', NULL stops. The header has to be read. Returns 0 on success
+static inline int wav_decoder_set_stats(WavDecoder* decoder, WavStats* stats) {
+    decoder->stats = NULL;
+    decoder->m_stats_first = 0;
+    decoder->m_stats_end = UINT64_MAX;
+    if (stats == NULL) {
+        return 0;
+    }
+    if (decoder->header == NULL || wav_stats_start(stats, decoder->header->sample_rate, decoder->header->num_of_channels)) {
+        return 1;
+    }
+    decoder->stats = stats;
+    return 0;
+}
+
+// Only feed the input frames [first, end) to the statistics, for a range that is
+// decoded together with the input around it. The frames have to be decoded
+// from 'first' on, positions in the statistics stay in frames of the whole input
+static inline void wav_decoder_set_stats_range(WavDecoder* decoder, uint64_t first, uint64_t end) {
+    decoder->m_stats_first = first;
+    decoder->m_stats_end = end;
+    if (decoder->stats) {
+        decoder->stats->first_sample = first;
+    }
+}
+
+// Returns 1 when the samples can be read in fixed point with wav_decoder_get_next_fixed
+static inline int wav_decoder_supports_fixed(const WavDecoder* decoder) {
+    return decoder->header && decoder->m_decode_q15;
+}
+
+// Fixed point version of wav_decoder_get_next_samples: the next chunk of a 16 bit
+// stream as Q15 samples in decoder->fixed, without going through float. Returns
+// the amount of samples, 0 at the end or -1 on failure
+static inline int wav_decoder_get_next_fixed(WavDecoder* decoder) {
+    if (!decoder->remaining_samples) {
+        return 0;
+    }
+
+    if (!wav_decoder_supports_fixed(decoder)) {
+        fprintf(stderr, "[WavDecoder] The samples can not be read in fixed point\n");
+        return -1;
     }
 
     size_t samples = DECODER_SAMPLE_SIZE;
@@ -86,88 +337,261 @@ static inline int wav_decoder_get_next_samples(WavDecoder* decoder) {
         samples = decoder->remaining_samples;
     }
 
-    // Allocate memory for the samples
-    decoder->data->m_samples = (WavSample*)malloc(sizeof(WavSample) * samples);
-    if (decoder->data->m_samples == NULL) {
-        fprintf(stderr, "[WavDecoder] Unable to allocate memory for samples\n");
+    const uint16_t channels = decoder->header->num_of_channels;
+    if (wav_fixed_data_reserve(&decoder->fixed, DECODER_SAMPLE_SIZE, (uint8_t)channels)) {
+        return -1;
+    }
+
+    size_t available;
+    const uint8_t* in = byte_buffer_read_bytes(decoder->buffer, samples * decoder->header->block_align, &available);
+    if (available < samples * decoder->header->block_align) {
+        samples = available / decoder->header->block_align;
+        decoder->remaining_samples = samples;
+    }
+
+    INSTRUMENT_START(start);
+    decoder->m_decode_q15(in, decoder->fixed.m_data, samples * channels);
+    INSTRUMENT_STOP(INSTRUMENT_DECODE, start);
+    INSTRUMENT_COUNT(INSTRUMENT_SAMPLES_DECODED, samples);
+
+    decoder->fixed.nr_of_samples = samples;
+    decoder->remaining_samples -= samples;
+    decoder->m_position += samples;
+
+    if (decoder->stats && decoder_feed_stats(decoder, samples, 1)) {
+        return -1;
+    }
+
+    return samples;
+}
+
+// Continue decoding at input sample (frame) 'sample', so a range can be decoded
+// without the samples before it. The header has to be read first, streams can
+// only skip forward. Returns 0 on success
+static inline int wav_decoder_seek(WavDecoder* decoder, uint64_t sample) {
+    if (decoder->header == NULL) {
+        fprintf(stderr, "[WavDecoder] Unable to seek before the header is read\n");
         return 1;
     }
 
-    // Get the samples
-    for (size_t i = 0; i < samples; i++) {
-        // Allocate data for each sample
-        decoder->data->m_samples[i].m_data = (float*)malloc(sizeof(float) * decoder->header->num_of_channels);
-        if (decoder->data->m_samples[i].m_data == NULL) {
-            fprintf(stderr, "[WavDecoder] Unable to allocate memory for channel data\n");
+    if (sample > decoder->nr_of_samples) {
+        sample = decoder->nr_of_samples;
+    }
+
+    const uint64_t current = decoder->nr_of_samples - decoder->remaining_samples;
+    const uint16_t block_align = decoder->header->block_align;
+
+    if (decoder->is_stream) {
+        if (sample < current) {
+            fprintf(stderr, "[WavDecoder] Unable to seek backwards in a stream\n");
             return 1;
         }
 
-        for (uint8_t c = 0; c < decoder->header->num_of_channels; c++) {
-            if (decoder->header->bits_per_sample == 16) {
-                decoder->data->m_samples[i].m_data[c] = (float)byte_buffer_read_int16(decoder->buffer, LE) / INT16_MAX;
-            } else if (decoder->header->bits_per_sample == 8) {
-                decoder->data->m_samples[i].m_data[c] = (float)byte_buffer_read_int8(decoder->buffer, LE) / INT8_MAX;
-            }
+        // A stream that ends before the position has nothing left to decode
+        if (byte_buffer_skip(decoder->buffer, (sample - current) * block_align)) {
+            decoder->remaining_samples = 0;
+            decoder->m_position = sample;
+            return 0;
         }
+    } else if (byte_buffer_seek(decoder->buffer, decoder->header->data_offset + sample * block_align)) {
+        fprintf(stderr, "[WavDecoder] Unable to seek to sample %llu\n", (unsigned long long)sample);
+        return 1;
     }
 
-    decoder->data->nr_of_samples = samples;
-    decoder->remaining_samples -= samples;
+    decoder->remaining_samples = decoder->nr_of_samples - sample;
+    decoder->m_position = sample;
 
-    return samples;
+    return 0;
+}
+
+// Header fields are little endian, big endian in RIFX files
+static uint16_t decoder_read_uint16(WavDecoder* decoder) {
+    return (uint16_t)byte_buffer_read_int16(decoder->buffer, decoder->m_endian);
 }
 
+static uint32_t decoder_read_uint32(WavDecoder* decoder) {
+    return (uint32_t)byte_buffer_read_int32(decoder->buffer, decoder->m_endian);
+}
+
+static uint64_t decoder_read_uint64(WavDecoder* decoder) {
+    uint64_t first = decoder_read_uint32(decoder);
+    uint64_t second = decoder_read_uint32(decoder);
+    return decoder->m_endian == BE ? first << 32 | second : second << 32 | first;
+}
+
+// Parse the fmt chunk of the given size, including the WAVE_FORMAT_EXTENSIBLE
+// fields. Returns the amount of bytes read from the chunk
+static uint32_t decoder_parse_format(WavDecoder* decoder, uint32_t size) {
+    WavHeader* header = decoder->header;
+
+    header->subchunk_1_size = size;
+    header->audio_format = decoder_read_uint16(decoder);
+    header->num_of_channels = decoder_read_uint16(decoder);
+    header->sample_rate = decoder_read_uint32(decoder);
+    header->byte_rate = decoder_read_uint32(decoder);
+    header->block_align = decoder_read_uint16(decoder);
+    header->bits_per_sample = decoder_read_uint16(decoder);
+    header->valid_bits_per_sample = header->bits_per_sample;
+    header->channel_mask = 0;
+    uint32_t read = 16;
+
+    if (header->audio_format == AUDIO_FORMAT_EXTENSIBLE && size >= 40) {
+        uint16_t extension_size = decoder_read_uint16(decoder);
+        read += 2;
+
+        if (extension_size >= 22) {
+            header->valid_bits_per_sample = decoder_read_uint16(decoder);
+            header->channel_mask = decoder_read_uint32(decoder);
+
+            // The sub format is a GUID whose first two bytes hold the format code
+            header->audio_format = decoder_read_uint16(decoder);
+            read += 8;
+        }
+    }
+
+    return read;
+}
+
+// Walk the RIFF chunks until the data chunk is found. Chunks that are not needed
+// (LIST, fact, cue, ...) are skipped without reading them, sizes are taken from
+// the ds64 chunk for RF64/BW64 files
 static inline int wav_decoder_get_header(WavDecoder* decoder) {
-    decoder->header = (WavHeader*)malloc(sizeof(WavHeader));
+    // The header is kept when the decoder is reused for another file
+    if (decoder->header == NULL) {
+        decoder->header = (WavHeader*)malloc(sizeof(WavHeader));
+    }
 
     if (decoder->header == NULL) {
         fprintf(stderr, "[WavDecoder] Unable to allocate memory for header\n");
         return 1;
     }
 
-    printf("\nReading WAV header...\n");
-    if (byte_buffer_read_int32(decoder->buffer, BE) != HEADER_CHUNK_ID) {
+    WavHeader* header = decoder->header;
+    memset(header, 0, sizeof(WavHeader));
+
+    decoder->m_decode = NULL;
+    decoder->m_decode_q15 = NULL;
+    uint32_t id = (uint32_t)byte_buffer_read_int32(decoder->buffer, BE);
+    if (id != HEADER_CHUNK_ID && id != HEADER_RIFX && id != HEADER_RF64 && id != HEADER_BW64) {
         fprintf(stderr, "[WavDecoder] Unable to parse header: did not find ChunkID\n");
         goto ERROR;
     }
+    int is_rf64 = id == HEADER_RF64 || id == HEADER_BW64;
+    decoder->m_endian = id == HEADER_RIFX ? BE : LE;
 
-    decoder->header->chunk_size = byte_buffer_read_int32(decoder->buffer, LE);
+    header->chunk_size = decoder_read_uint32(decoder);
 
     if (byte_buffer_read_int32(decoder->buffer, BE) != HEADER_FORMAT) {
         fprintf(stderr, "[WavDecoder] Unable to parse header: did not find Format\n");
         goto ERROR;
     }
 
-    if (byte_buffer_read_int32(decoder->buffer, BE) != HEADER_SUBCHUNK_1_ID) {
-        fprintf(stderr, "[WavDecoder] Unable to parse header: did not find Subchunk1ID\n");
-        goto ERROR;
+    uint64_t position = 12;
+    uint64_t ds64_data_size = 0;
+    int has_format = 0;
+    uint32_t size;
+
+    for (;;) {
+        id = (uint32_t)byte_buffer_read_int32(decoder->buffer, BE);
+        size = decoder_read_uint32(decoder);
+        position += 8;
+
+        if (decoder->buffer->m_finished == Yes) {
+            fprintf(stderr, "[WavDecoder] Unable to parse header: did not find Subchunk2ID\n");
+            goto ERROR;
+        }
+
+        if (id == HEADER_SUBCHUNK_2_ID) {
+            break;
+        }
+
+        uint64_t skip = size;
+        if (id == HEADER_SUBCHUNK_1_ID) {
+            if (size < 16) {
+                fprintf(stderr, "[WavDecoder] Unable to parse header: fmt chunk of %u bytes is too small\n", size);
+                goto ERROR;
+            }
+            skip -= decoder_parse_format(decoder, size);
+            has_format = 1;
+        } else if (id == HEADER_DS64 && is_rf64 && size >= 24) {
+            decoder_read_uint64(decoder);  // RIFF size
+            ds64_data_size = decoder_read_uint64(decoder);
+            decoder_read_uint64(decoder);  // Sample count, only needed for compressed formats
+            skip -= 24;
+        }
+
+        // Chunks are word aligned, an odd sized chunk is followed by a pad byte
+        skip += size & 1;
+        if (byte_buffer_skip(decoder->buffer, skip)) {
+            fprintf(stderr, "[WavDecoder] Unable to parse header: chunk 0x%08x runs past the end of the file\n", id);
+            goto ERROR;
+        }
+        position += size + (size & 1);
     }
 
-    decoder->header->subchunk_1_size = byte_buffer_read_int32(decoder->buffer, LE);
+    if (!has_format) {
+        fprintf(stderr, "[WavDecoder] Unable to parse header: did not find Subchunk1ID before the data\n");
+        goto ERROR;
+    }
 
-    decoder->header->audio_format = byte_buffer_read_int16(decoder->buffer, LE);
-    decoder->header->num_of_channels = byte_buffer_read_int16(decoder->buffer, LE);
+    if (header->block_align == 0 || header->num_of_channels == 0) {
+        fprintf(stderr, "[WavDecoder] Unable to parse header: invalid block align (%d) or channels (%d)\n", header->block_align,
+                header->num_of_channels);
+        goto ERROR;
+    }
 
-    decoder->header->sample_rate = byte_buffer_read_int32(decoder->buffer, LE);
-    decoder->header->byte_rate = byte_buffer_read_int32(decoder->buffer, LE);
+    // Checked before any sample block is sized for the channels
+    if (header->num_of_channels > DECODER_MAX_CHANNELS) {
+        fprintf(stderr, "[WavDecoder] Unsupported amount of channels: %d, at most %d\n", header->num_of_channels,
+                DECODER_MAX_CHANNELS);
+        goto ERROR;
+    }
 
-    decoder->header->block_align = byte_buffer_read_int16(decoder->buffer, LE);
-    decoder->header->bits_per_sample = byte_buffer_read_int16(decoder->buffer, LE);
+    if (header->audio_format != AUDIO_FORMAT_PCM && header->audio_format != AUDIO_FORMAT_IEEE_FLOAT) {
+        fprintf(stderr, "[WavDecoder] Unsupported audio format %d\n", header->audio_format);
+        goto ERROR;
+    }
 
-    // TODO: Support other WAV specs
-    if (byte_buffer_read_int32(decoder->buffer, BE) != HEADER_SUBCHUNK_2_ID) {
-        fprintf(stderr, "[WavDecoder] Unable to parse header: did not find Subchunk2ID\n");
+    // Samples are packed, a container wider than the sample (24 bit in 32) is not supported
+    decoder->m_decode = pcm_decode_kernel(header->audio_format == AUDIO_FORMAT_IEEE_FLOAT, header->bits_per_sample,
+                                          decoder->m_endian == BE);
+    if (decoder->m_decode == NULL || header->block_align != header->num_of_channels * (header->bits_per_sample / 8)) {
+        fprintf(stderr, "[WavDecoder] Unsupported sample format: %s%d bits, %d channels, block align %d\n",
+                header->audio_format == AUDIO_FORMAT_IEEE_FLOAT ? "float " : "", header->bits_per_sample, header->num_of_channels,
+                header->block_align);
+        decoder->m_decode = NULL;
         goto ERROR;
     }
+    decoder->m_decode_q15 = pcm_q15_decode_kernel(header->audio_format == AUDIO_FORMAT_IEEE_FLOAT, header->bits_per_sample,
+                                                  decoder->m_endian == BE);
+
+    header->data_size = is_rf64 && size == HEADER_SIZE_IN_DS64 ? ds64_data_size : size;
+    header->data_offset = position;
 
-    decoder->header->subchunk_2_size = byte_buffer_read_int32(decoder->buffer, LE);
+    // Streamed files announce HEADER_SIZE_UNKNOWN, their data ends with the file.
+    // A pipe has no size to compare against, some writers put 0 in the header there
+    if (decoder->is_stream) {
+        if ((!is_rf64 && size == HEADER_SIZE_UNKNOWN) || header->data_size == 0 || header->data_size == UINT64_MAX) {
+            header->data_size = DECODER_STREAM_LIMIT;
+        }
+    } else if (decoder->file_size >= position && header->data_size > decoder->file_size - position) {
+        header->data_size = decoder->file_size - position;
+    }
+    header->subchunk_2_size = header->data_size > UINT32_MAX ? UINT32_MAX : (uint32_t)header->data_size;
 
-    decoder->nr_of_samples = decoder->header->subchunk_2_size / decoder->header->block_align;
+    decoder->nr_of_samples = header->data_size / header->block_align;
     decoder->remaining_samples = decoder->nr_of_samples;
+    decoder->m_position = 0;
+
+    // Size the sample block for the chunks now, so decoding does not allocate
+    if (wav_data_reserve(decoder->data, DECODER_SAMPLE_SIZE, (uint8_t)header->num_of_channels)) {
+        goto ERROR;
+    }
 
     return 0;
 
 ERROR:
     free(decoder->header);
+    decoder->header = NULL;
     return 1;
-}
\ No newline at end of file
+}
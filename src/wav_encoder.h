@@ -1,58 +1,277 @@
 #pragma once
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pcm_convert.h"
 #include "wav.h"
 
+#define ENCODER_WRITE_SIZE (256 * 1024)  // In bytes
+
 typedef struct {
     WavHeader* header;
     WavData* data;
     FILE* fp;
+
+    // Output is collected here and written with a single fwrite once the next
+    // chunk does not fit anymore, the stream itself is unbuffered
+    ByteBuffer* buffer;
+    uint64_t bytes_written;
+
+    // Samples announced by the header, 0 when the length is not known up front.
+    // The header is patched with the written amount when the file is closed
     uint32_t audio_length;
     size_t nr_of_samples;
+    size_t samples_written;
+
+    int m_seekable;        // Pipes and sockets can not be patched afterwards
+    int m_header_written;  // The header at the start of the file has to be patched
+
+    // TPDF dither applied when reducing float samples to 8, 16 or 24 bit
+    int use_dither;
+    PcmDither dither;
+
+    PcmEncodeKernel m_encode;  // Selected by wav_encoder_set_header
+    PcmQ15EncodeKernel m_encode_q15;  // NULL when the output can not be written in fixed point
+
+    WavFixedData fixed;  // Output of the fixed point path, see wav_encoder_write_fixed
+    enum AsyncIoBackend m_io;  // Writes to regular files are queued unless ASYNC_IO_NONE
 } WavEncoder;
 
 static void calculate_header_values(WavHeader* header, size_t samples) {
-    if (header->audio_format == AUDIO_FORMAT_PCM) {
+    if (header->audio_format == AUDIO_FORMAT_PCM || header->audio_format == AUDIO_FORMAT_IEEE_FLOAT) {
         header->subchunk_1_size = 16;
     } else {
         fprintf(stderr, "[WavEncoder] Unsupported audio format\n");
         return;
     }
 
-    header->subchunk_2_size = samples * header->num_of_channels * (header->bits_per_sample / 8);
     header->block_align = header->num_of_channels * (header->bits_per_sample / 8);
     header->byte_rate = header->sample_rate * header->num_of_channels * (header->bits_per_sample / 8);
-    header->chunk_size = 36 + header->subchunk_2_size;
+
+    // Without rf64 the sizes are 32 bit, larger files are marked as streams
+    uint64_t size = (uint64_t)samples * header->block_align;
+    if (size > UINT32_MAX - 36) {
+        header->subchunk_2_size = HEADER_SIZE_UNKNOWN;
+        header->chunk_size = HEADER_SIZE_UNKNOWN;
+    } else {
+        header->subchunk_2_size = (uint32_t)size;
+        header->chunk_size = 36 + header->subchunk_2_size;
+    }
+}
+
+// Serialize the header into the write buffer, which needs room for it
+static void encoder_put_header(WavEncoder* encoder) {
+    ByteBuffer* buffer = encoder->buffer;
+
+    byte_buffer_write_int32(buffer, HEADER_CHUNK_ID, BE);
+    byte_buffer_write_int32(buffer, encoder->header->chunk_size, LE);
+    byte_buffer_write_int32(buffer, HEADER_FORMAT, BE);
+
+    // The "fmt" subchunk describes the sound data's format:
+    byte_buffer_write_int32(buffer, HEADER_SUBCHUNK_1_ID, BE);
+    byte_buffer_write_int32(buffer, encoder->header->subchunk_1_size, LE);
+    byte_buffer_write_int16(buffer, encoder->header->audio_format, LE);
+    byte_buffer_write_int16(buffer, encoder->header->num_of_channels, LE);
+    byte_buffer_write_int32(buffer, encoder->header->sample_rate, LE);
+    byte_buffer_write_int32(buffer, encoder->header->byte_rate, LE);
+    byte_buffer_write_int16(buffer, encoder->header->block_align, LE);
+    byte_buffer_write_int16(buffer, encoder->header->bits_per_sample, LE);
+
+    // The "data" subchunk contains the size of the data and the actual data
+    byte_buffer_write_int32(buffer, HEADER_SUBCHUNK_2_ID, BE);
+    byte_buffer_write_int32(buffer, encoder->header->subchunk_2_size, LE);
+}
+
+// Rewrite the header with the amount of samples that was actually written.
+// Returns 0 on success
+static int encoder_patch_header(WavEncoder* encoder) {
+    uint32_t announced = encoder->header->subchunk_2_size;
+    calculate_header_values(encoder->header, encoder->samples_written);
+    if (encoder->header->subchunk_2_size == announced) {
+        return 0;
+    }
+
+    if (fseeko(encoder->fp, 0, SEEK_SET)) {
+        fprintf(stderr, "[WavEncoder] Unable to seek to the header\n");
+        return 1;
+    }
+
+    encoder_put_header(encoder);
+    return byte_buffer_write_buffer(encoder->buffer);
+}
+
+// Write out the remaining buffered output and close the current file. The file
+// is closed either way, returns 0 when all of it reached the file
+static int encoder_finish_file(WavEncoder* encoder) {
+    int failed = 0;
+
+    if (encoder->buffer) {
+        failed |= byte_buffer_write_buffer(encoder->buffer);
+
+        // The header is patched and the file truncated once all queued writes landed
+        if (byte_buffer_detach_async(encoder->buffer)) {
+            fprintf(stderr, "[WavEncoder] Unable to finish the asynchronous writes\n");
+            failed = 1;
+        }
+
+        if (encoder->m_header_written && encoder->m_seekable) {
+            failed |= encoder_patch_header(encoder);
+        }
+    }
+
+    // The file might have been preallocated for more samples than were written
+    struct stat st;
+    if (fstat(fileno(encoder->fp), &st) == 0 && S_ISREG(st.st_mode) && (uint64_t)st.st_size > encoder->bytes_written) {
+        if (ftruncate(fileno(encoder->fp), encoder->bytes_written)) {
+            fprintf(stderr, "[WavEncoder] Unable to truncate preallocated output\n");
+            failed = 1;
+        }
+    }
+
+    if (fclose(encoder->fp)) {
+        fprintf(stderr, "[WavEncoder] Unable to close the output\n");
+        failed = 1;
+    }
+    encoder->fp = NULL;
+
+    return failed;
+}
+
+// Reset the state for the newly opened encoder->fp
+static void encoder_start_file(WavEncoder* encoder) {
+    // All writes go through our own buffer, stdio buffering would only add a copy
+    setvbuf(encoder->fp, NULL, _IONBF, 0);
+    encoder->bytes_written = 0;
+    encoder->samples_written = 0;
+    encoder->m_header_written = 0;
+
+    struct stat st;
+    encoder->m_seekable = fstat(fileno(encoder->fp), &st) == 0 && S_ISREG(st.st_mode);
 }
 
-static inline void wav_encoder_close(WavEncoder* encoder) {
+static int encoder_open_file(WavEncoder* encoder, const char* filename) {
+    encoder->fp = fopen(filename, "wb");
+    if (encoder->fp == NULL) {
+        fprintf(stderr, "[WavEncoder] Unable to open file %s for writing\n", filename);
+        return 1;
+    }
+
+    encoder_start_file(encoder);
+    return 0;
+}
+
+// Finish the current file so it is complete on disk, the encoder can still be
+// reopened on another file afterwards. Most write errors only show up here, as
+// the last buffered block is written. Returns 0 on success
+static inline int wav_encoder_finish(WavEncoder* encoder) {
+    if (encoder->fp) {
+        return encoder_finish_file(encoder);
+    }
+    return 0;
+}
+
+// Finish the current file like wav_encoder_finish and free the encoder, which
+// is freed either way. Returns 0 when the file was finished
+static inline int wav_encoder_close(WavEncoder* encoder) {
+    int failed = wav_encoder_finish(encoder);
+
+    byte_buffer_close(encoder->buffer);
+    encoder->buffer = NULL;
+    wav_fixed_data_free(&encoder->fixed);
+
     if (encoder->data) {
-        free_data(encoder->data);
+        wav_data_free(encoder->data);
         free(encoder->data);
     }
 
     if (encoder->header) {
         free(encoder->header);
     }
-    fclose(encoder->fp);
+
+    return failed;
 }
 
-static inline int wav_encoder_init(WavEncoder* encoder, const char* filename) {
-    encoder->fp = fopen(filename, "wb");
-    if (encoder->fp == NULL) {
-        fprintf(stderr, "[WavEncoder] Unable to open file %s for reading\n", filename);
+static int encoder_init_buffers(WavEncoder* encoder) {
+    if (byte_buffer_init(&(encoder->buffer), encoder->fp, ENCODER_WRITE_SIZE, 0) || encoder->buffer->m_buffer == NULL) {
+        fprintf(stderr, "[WavEncoder] Unable to allocate memory for the write buffer\n");
         return 1;
     }
 
-    encoder->header = NULL;
     encoder->data = (WavData*)malloc(sizeof(WavData));
+    if (encoder->data == NULL) {
+        fprintf(stderr, "[WavEncoder] Unable to allocate memory for encoder data\n");
+        return 1;
+    }
+    wav_data_init(encoder->data);
     encoder->nr_of_samples = 0;
+    encoder->use_dither = 0;
+    encoder->m_encode = NULL;
+    encoder->m_encode_q15 = NULL;
+    encoder->m_io = ASYNC_IO_NONE;
 
     return 0;
 }
 
+static inline int wav_encoder_init(WavEncoder* encoder, const char* filename) {
+    encoder->buffer = NULL;
+    encoder->header = NULL;
+    encoder->data = NULL;
+    wav_fixed_data_init(&encoder->fixed);
+
+    if (encoder_open_file(encoder, filename)) {
+        return 1;
+    }
+
+    return encoder_init_buffers(encoder);
+}
+
+// Initialize an encoder on an open descriptor, like standard output, a pipe to
+// another process or a socket. The header of an output that can not seek is not
+// patched, it keeps announcing an unknown length unless one was set up front.
+// The encoder takes over the descriptor and closes it
+static inline int wav_encoder_init_fd(WavEncoder* encoder, int fd) {
+    encoder->buffer = NULL;
+    encoder->header = NULL;
+    encoder->data = NULL;
+    wav_fixed_data_init(&encoder->fixed);
+
+    encoder->fp = fdopen(fd, "wb");
+    if (encoder->fp == NULL) {
+        fprintf(stderr, "[WavEncoder] Unable to open descriptor %d for writing\n", fd);
+        return 1;
+    }
+    encoder_start_file(encoder);
+
+    return encoder_init_buffers(encoder);
+}
+
+// Finish the current file and continue writing to another one, the write
+// buffer, header and sample block are kept so the encoder can be reused.
+// Returns 1 when the previous file could not be finished or the new one opened,
+// finish files with wav_encoder_finish to tell them apart
+static inline int wav_encoder_reopen(WavEncoder* encoder, const char* filename) {
+    int failed = wav_encoder_finish(encoder);
+
+    if (encoder_open_file(encoder, filename)) {
+        return 1;
+    }
+    encoder->buffer->m_file = encoder->fp;
+    encoder->buffer->m_offset = 0;
+    encoder->nr_of_samples = 0;
+
+    return failed;
+}
+
+// Describe the output. With an audio length of 0 the length is not known, the
+// header then announces a stream and is patched when the encoder is closed
 static inline int wav_encoder_set_header(WavEncoder* encoder, uint32_t sample_rate, uint16_t bits_per_sample, uint16_t audio_format,
                                          uint16_t num_of_channels, uint32_t audio_length_in_seconds) {
-    encoder->header = (WavHeader*)malloc(sizeof(WavHeader));
+    // The header is kept when the encoder is reused for another file
+    if (encoder->header == NULL) {
+        encoder->header = (WavHeader*)malloc(sizeof(WavHeader));
+    }
     if (encoder->header == NULL) {
         fprintf(stderr, "[WavEncoder] Unable to allocate memory for header\n");
         return 1;
@@ -64,6 +283,14 @@ static inline int wav_encoder_set_header(WavEncoder* encoder, uint32_t sample_ra
     encoder->header->num_of_channels = num_of_channels;
     encoder->audio_length = audio_length_in_seconds;
 
+    encoder->m_encode = pcm_encode_kernel(audio_format == AUDIO_FORMAT_IEEE_FLOAT, bits_per_sample);
+    if (encoder->m_encode == NULL || (audio_format != AUDIO_FORMAT_PCM && audio_format != AUDIO_FORMAT_IEEE_FLOAT)) {
+        fprintf(stderr, "[WavEncoder] Unsupported sample format: audio format %d, %d bits\n", audio_format, bits_per_sample);
+        encoder->m_encode = NULL;
+        return 1;
+    }
+    encoder->m_encode_q15 = pcm_q15_encode_kernel(audio_format == AUDIO_FORMAT_IEEE_FLOAT, bits_per_sample);
+
     calculate_header_values(encoder->header, (sample_rate * audio_length_in_seconds));
 
     encoder->nr_of_samples = (encoder->header->sample_rate * audio_length_in_seconds);
@@ -71,56 +298,164 @@ static inline int wav_encoder_set_header(WavEncoder* encoder, uint32_t sample_ra
     return 0;
 }
 
+// Announce an exact amount of samples instead of a whole amount of seconds, 0
+// makes the length unknown
+static inline void wav_encoder_set_nr_of_samples(WavEncoder* encoder, size_t samples) {
+    calculate_header_values(encoder->header, samples);
+    encoder->nr_of_samples = samples;
+}
+
+// Enable or disable TPDF dither on the output, the seed makes the noise reproducible
+static inline void wav_encoder_set_dither(WavEncoder* encoder, int enabled, uint32_t seed) {
+    encoder->use_dither = enabled;
+    pcm_dither_init(&encoder->dither, seed);
+}
+
+// Queue the writes of regular files on 'backend' (see async_io.h) from the next
+// header on, so encoding does not wait for the disk. ASYNC_IO_NONE writes directly
+static inline void wav_encoder_set_async_io(WavEncoder* encoder, enum AsyncIoBackend backend) {
+    encoder->m_io = backend;
+}
+
+// Reserve the disk space for the whole output up front, so the file system can
+// allocate it in one go instead of growing the file on every write
+static inline void wav_encoder_preallocate(WavEncoder* encoder) {
+    if (!encoder->m_seekable || encoder->nr_of_samples == 0) {
+        return;
+    }
+
+    off_t size = HEADER_LENGTH_1 + (off_t)encoder->nr_of_samples * encoder->header->block_align;
+    if (posix_fallocate(fileno(encoder->fp), 0, size) != 0) {
+        fprintf(stderr, "[WavEncoder] Unable to preallocate %lld bytes for the output\n", (long long)size);
+    }
+}
+
 static inline int wav_encoder_write_header(WavEncoder* encoder) {
-    // Load header into ByteBuffer for writing
-    ByteBuffer* buffer;
-    byte_buffer_init(&buffer, encoder->fp, HEADER_LENGTH_1, 0);
+    ByteBuffer* buffer = encoder->buffer;
 
-    byte_buffer_write_int32(buffer, HEADER_CHUNK_ID, BE);
-    byte_buffer_write_int32(buffer, encoder->header->chunk_size, LE);
-    byte_buffer_write_int32(buffer, HEADER_FORMAT, BE);
+    // The header is written together with the first samples
+    if (byte_buffer_reserve(buffer, HEADER_LENGTH_1)) {
+        return 1;
+    }
 
-    // The "fmt" subchunk describes the sound data's format:
-    byte_buffer_write_int32(buffer, HEADER_SUBCHUNK_1_ID, BE);
-    byte_buffer_write_int32(buffer, encoder->header->subchunk_1_size, LE);
-    byte_buffer_write_int16(buffer, encoder->header->audio_format, LE);
-    byte_buffer_write_int16(buffer, encoder->header->num_of_channels, LE);
-    byte_buffer_write_int32(buffer, encoder->header->sample_rate, LE);
-    byte_buffer_write_int32(buffer, encoder->header->byte_rate, LE);
-    byte_buffer_write_int16(buffer, encoder->header->block_align, LE);
-    byte_buffer_write_int16(buffer, encoder->header->bits_per_sample, LE);
+    wav_encoder_preallocate(encoder);
 
-    // The "data" subchunk contains the size of the data and the actual data
-    byte_buffer_write_int32(buffer, HEADER_SUBCHUNK_2_ID, BE);
-    byte_buffer_write_int32(buffer, encoder->header->subchunk_2_size, LE);
+    // The writes of the file start with the header, a failure keeps writing directly
+    if (encoder->m_io != ASYNC_IO_NONE && encoder->m_seekable && buffer->m_async == NULL &&
+        byte_buffer_attach_async(buffer, encoder->m_io)) {
+        fprintf(stderr, "[WavEncoder] Falling back to synchronous writes\n");
+    }
+
+    // Without a known length the header announces a stream until it is patched
+    if (encoder->nr_of_samples == 0) {
+        encoder->header->subchunk_2_size = HEADER_SIZE_UNKNOWN;
+        encoder->header->chunk_size = HEADER_SIZE_UNKNOWN;
+    }
 
-    byte_buffer_write_buffer(buffer);
+    encoder_put_header(encoder);
+    encoder->bytes_written += HEADER_LENGTH_1;
+    encoder->m_header_written = 1;
 
-    byte_buffer_close(buffer);
     return 0;
 }
 
-static inline int wav_encoder_write_data(WavEncoder* encoder) {
-    ByteBuffer* buffer;
-    byte_buffer_init(&buffer, encoder->fp, encoder->data->nr_of_samples, 0);
-
-    for (size_t i = 0; i < encoder->data->nr_of_samples; i++) {
-        for (uint8_t c = 0; c < encoder->header->num_of_channels; c++) {
-            if (encoder->header->bits_per_sample == 16) {
-                byte_buffer_write_int16(buffer, encoder->data->m_samples[i].m_data[c] * INT16_MAX, LE);
-            } else if (encoder->header->bits_per_sample == 8) {
-                byte_buffer_write_int8(buffer, encoder->data->m_samples[i].m_data[c] * INT8_MAX, LE);
-            } else {
-                fprintf(stderr, "[WavEncoder] Unsupported bits per sample (not 8 or 16)\n");
-                break;
+// Returns 1 once all samples the header announced have been written
+static inline int wav_encoder_is_full(const WavEncoder* encoder) {
+    return encoder->nr_of_samples != 0 && encoder->samples_written >= encoder->nr_of_samples;
+}
+
+// Write the given samples, they need to have the channel count of the header.
+// When the length was announced the samples past it are dropped from 'data'
+static inline int wav_encoder_write_samples(WavEncoder* encoder, WavData* data) {
+    if (encoder->m_encode == NULL) {
+        fprintf(stderr, "[WavEncoder] No supported sample format was set\n");
+        return 1;
+    }
+
+    if (wav_data_set_layout(data, LAYOUT_INTERLEAVED)) {
+        return 1;
+    }
+
+    if (encoder->nr_of_samples != 0 && encoder->samples_written + data->nr_of_samples > encoder->nr_of_samples) {
+        data->nr_of_samples = encoder->nr_of_samples - encoder->samples_written;
+    }
+
+    ByteBuffer* buffer = encoder->buffer;
+    const uint16_t channels = encoder->header->num_of_channels;
+    const size_t frame = (size_t)channels * (encoder->header->bits_per_sample / 8);
+
+    // A chunk that does not fit is encoded in pieces, so the write buffer keeps its size
+    for (size_t done = 0; done < data->nr_of_samples;) {
+        size_t room = (buffer->m_size - buffer->m_offset) / frame;
+        if (room == 0) {
+            // Write out what was collected so far
+            if (byte_buffer_write_buffer(buffer) || byte_buffer_reserve(buffer, frame)) {
+                return 1;
             }
+            room = (buffer->m_size - buffer->m_offset) / frame;
         }
+
+        size_t samples = data->nr_of_samples - done < room ? data->nr_of_samples - done : room;
+        INSTRUMENT_START(start);
+        encoder->m_encode(data->m_data + done * channels, buffer->m_buffer + buffer->m_offset, samples * channels,
+                          encoder->use_dither ? &encoder->dither : NULL);
+        INSTRUMENT_STOP(INSTRUMENT_ENCODE, start);
+        buffer->m_offset += samples * frame;
+        encoder->bytes_written += samples * frame;
+        done += samples;
     }
 
-    // Write buffer to file
-    byte_buffer_write_buffer(buffer);
+    INSTRUMENT_COUNT(INSTRUMENT_SAMPLES_ENCODED, data->nr_of_samples);
+    encoder->samples_written += data->nr_of_samples;
+
+    return 0;
+}
 
-    byte_buffer_close(buffer);
+static inline int wav_encoder_write_data(WavEncoder* encoder) {
+    return wav_encoder_write_samples(encoder, encoder->data);
+}
+
+// Returns 1 when the output can be written in fixed point with wav_encoder_write_fixed
+static inline int wav_encoder_supports_fixed(const WavEncoder* encoder) {
+    return encoder->m_encode_q15 != NULL;
+}
+
+// Fixed point version of wav_encoder_write_samples for Q15 samples, they are
+// written as they are so there is nothing to dither
+static inline int wav_encoder_write_fixed(WavEncoder* encoder, WavFixedData* data) {
+    if (encoder->m_encode_q15 == NULL) {
+        fprintf(stderr, "[WavEncoder] The output can not be written in fixed point\n");
+        return 1;
+    }
+
+    if (encoder->nr_of_samples != 0 && encoder->samples_written + data->nr_of_samples > encoder->nr_of_samples) {
+        data->nr_of_samples = encoder->nr_of_samples - encoder->samples_written;
+    }
+
+    ByteBuffer* buffer = encoder->buffer;
+    const uint16_t channels = encoder->header->num_of_channels;
+    const size_t frame = (size_t)channels * sizeof(int16_t);
+
+    for (size_t done = 0; done < data->nr_of_samples;) {
+        size_t room = (buffer->m_size - buffer->m_offset) / frame;
+        if (room == 0) {
+            if (byte_buffer_write_buffer(buffer) || byte_buffer_reserve(buffer, frame)) {
+                return 1;
+            }
+            room = (buffer->m_size - buffer->m_offset) / frame;
+        }
+
+        size_t samples = data->nr_of_samples - done < room ? data->nr_of_samples - done : room;
+        INSTRUMENT_START(start);
+        encoder->m_encode_q15(data->m_data + done * channels, buffer->m_buffer + buffer->m_offset, samples * channels);
+        INSTRUMENT_STOP(INSTRUMENT_ENCODE, start);
+        buffer->m_offset += samples * frame;
+        encoder->bytes_written += samples * frame;
+        done += samples;
+    }
+
+    INSTRUMENT_COUNT(INSTRUMENT_SAMPLES_ENCODED, data->nr_of_samples);
+    encoder->samples_written += data->nr_of_samples;
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,437 @@
+#pragma once
+
+#include "wav_stft.h"
+
+#define FINGERPRINT_MAGIC 0x46434650        // fcfp
+#define FINGERPRINT_VERSION 1
+#define FINGERPRINT_WRITE_SIZE (64 * 1024)  // In bytes
+
+// Peak picking: a bin is a peak when it is the maximum of the neighborhood of
+// +-NEIGHBOR_BINS bins and +-NEIGHBOR_FRAMES frames around it
+#define FINGERPRINT_NEIGHBOR_BINS 16
+#define FINGERPRINT_NEIGHBOR_FRAMES 8
+#define FINGERPRINT_PEAKS_PER_FRAME 5   // Only the strongest peaks of a frame are kept
+#define FINGERPRINT_MIN_MAGNITUDE 1.0f  // About -48 dB of a full scale sine with the default STFT
+
+// Pairing: every anchor peak is paired with the first FAN_OUT peaks in its
+// target zone, 1 .. ZONE_FRAMES frames later and at most ZONE_BINS bins away
+#define FINGERPRINT_ZONE_FRAMES 64
+#define FINGERPRINT_ZONE_BINS 128
+#define FINGERPRINT_FAN_OUT 5
+
+// Hash layout: f1 (10 bits) | f2 (10 bits) | dt (12 bits)
+#define FINGERPRINT_FREQ_BITS 10
+#define FINGERPRINT_DT_BITS 12
+
+// Landmark (constellation) fingerprints
+//
+// STFT frames are pushed one at a time. The peak picker runs a sliding window
+// maximum over the bins of every frame and then one over time for every bin,
+// both with monotonic deques, so the maximum of a 2D neighborhood costs O(1)
+// per bin. A frame is decided NEIGHBOR_FRAMES frames after it arrived, only
+// the frames still in the neighborhood are kept.
+//
+// Peaks are paired with the peaks that follow them into (f1, f2, dt) hashes as
+// soon as their target zone is complete, so memory stays bounded by the zone.
+// Every landmark is stored as a 64 bit key, hash << 32 | anchor frame, which
+// sort into the (hash, time) order of the output file.
+typedef struct {
+    uint32_t frame;
+    uint16_t bin;
+} FingerprintPeak;
+
+typedef struct {
+    size_t bins;
+    uint32_t m_freq_shift;  // Bins are quantized to FINGERPRINT_FREQ_BITS bits
+
+    // Rows of the last 2 * NEIGHBOR_FRAMES + 1 frames, frame t at row t % m_rows
+    size_t m_rows;
+    float* m_magnitudes;
+    float* m_maxima;  // Maximum over the neighboring bins
+
+    // Per bin deque of frames with decreasing maxima, ring buffers of m_rows entries
+    uint32_t* m_deque;
+    uint32_t* m_deque_head;
+    uint32_t* m_deque_size;
+    uint32_t* m_bin_deque;  // Scratch deque for the maximum over bins
+
+    // Peaks waiting for their target zone to complete, ring buffer
+    FingerprintPeak* m_peaks;
+    size_t m_peaks_capacity;
+    size_t m_peaks_head;
+    size_t m_peaks_size;
+
+    uint64_t m_frames;   // Frames pushed so far
+    uint64_t m_decided;  // Frames whose peaks have been picked
+
+    // Landmarks of the stream, sorted and unique after wav_fingerprint_finish
+    uint64_t* landmarks;
+    size_t nr_of_landmarks;
+    size_t m_landmarks_capacity;
+    uint64_t* m_scratch;
+} WavFingerprint;
+
+static inline void wav_fingerprint_close(WavFingerprint* fingerprint) {
+    free(fingerprint->m_magnitudes);
+    free(fingerprint->m_maxima);
+    free(fingerprint->m_deque);
+    free(fingerprint->m_deque_head);
+    free(fingerprint->m_deque_size);
+    free(fingerprint->m_bin_deque);
+    free(fingerprint->m_peaks);
+    free(fingerprint->landmarks);
+    free(fingerprint->m_scratch);
+    memset(fingerprint, 0, sizeof(WavFingerprint));
+}
+
+// Forget the pushed frames and landmarks so a new stream can be fingerprinted,
+// the buffers are kept
+static inline void wav_fingerprint_reset(WavFingerprint* fingerprint) {
+    memset(fingerprint->m_deque_size, 0, sizeof(uint32_t) * fingerprint->bins);
+    memset(fingerprint->m_deque_head, 0, sizeof(uint32_t) * fingerprint->bins);
+    fingerprint->m_peaks_head = 0;
+    fingerprint->m_peaks_size = 0;
+    fingerprint->m_frames = 0;
+    fingerprint->m_decided = 0;
+    fingerprint->nr_of_landmarks = 0;
+}
+
+// Prepare for frames of 'bins' magnitudes (fft_size / 2 + 1)
+static inline int wav_fingerprint_init(WavFingerprint* fingerprint, size_t bins) {
+    memset(fingerprint, 0, sizeof(WavFingerprint));
+
+    if (bins < 2 || bins > UINT16_MAX) {
+        fprintf(stderr, "[WavFingerprint] Unsupported amount of bins %zu\n", bins);
+        return 1;
+    }
+
+    fingerprint->bins = bins;
+    while ((bins - 1) >> fingerprint->m_freq_shift >= (1u << FINGERPRINT_FREQ_BITS)) {
+        fingerprint->m_freq_shift++;
+    }
+
+    const size_t rows = 2 * FINGERPRINT_NEIGHBOR_FRAMES + 1;
+    fingerprint->m_rows = rows;
+    fingerprint->m_peaks_capacity = (FINGERPRINT_ZONE_FRAMES + 2) * FINGERPRINT_PEAKS_PER_FRAME;
+
+    fingerprint->m_magnitudes = (float*)malloc(sizeof(float) * rows * bins);
+    fingerprint->m_maxima = (float*)malloc(sizeof(float) * rows * bins);
+    fingerprint->m_deque = (uint32_t*)malloc(sizeof(uint32_t) * rows * bins);
+    fingerprint->m_deque_head = (uint32_t*)calloc(bins, sizeof(uint32_t));
+    fingerprint->m_deque_size = (uint32_t*)calloc(bins, sizeof(uint32_t));
+    fingerprint->m_bin_deque = (uint32_t*)malloc(sizeof(uint32_t) * bins);
+    fingerprint->m_peaks = (FingerprintPeak*)malloc(sizeof(FingerprintPeak) * fingerprint->m_peaks_capacity);
+    if (fingerprint->m_magnitudes == NULL || fingerprint->m_maxima == NULL || fingerprint->m_deque == NULL ||
+        fingerprint->m_deque_head == NULL || fingerprint->m_deque_size == NULL || fingerprint->m_bin_deque == NULL ||
+        fingerprint->m_peaks == NULL) {
+        fprintf(stderr, "[WavFingerprint] Unable to allocate memory for %zu bins\n", bins);
+        wav_fingerprint_close(fingerprint);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int fingerprint_add_landmark(WavFingerprint* fingerprint, uint64_t landmark) {
+    if (fingerprint->nr_of_landmarks == fingerprint->m_landmarks_capacity) {
+        size_t capacity = fingerprint->m_landmarks_capacity ? fingerprint->m_landmarks_capacity * 2 : 4096;
+        uint64_t* landmarks = (uint64_t*)realloc(fingerprint->landmarks, sizeof(uint64_t) * capacity);
+        if (landmarks == NULL) {
+            fprintf(stderr, "[WavFingerprint] Unable to allocate memory for %zu landmarks\n", capacity);
+            return 1;
+        }
+        fingerprint->landmarks = landmarks;
+        fingerprint->m_landmarks_capacity = capacity;
+    }
+
+    fingerprint->landmarks[fingerprint->nr_of_landmarks++] = landmark;
+    return 0;
+}
+
+// Pair the oldest peak with the peaks in its target zone and drop it
+static int fingerprint_pair_anchor(WavFingerprint* fingerprint) {
+    const size_t capacity = fingerprint->m_peaks_capacity;
+    const FingerprintPeak anchor = fingerprint->m_peaks[fingerprint->m_peaks_head];
+    const uint32_t f1 = anchor.bin >> fingerprint->m_freq_shift;
+
+    int paired = 0;
+    for (size_t i = 1; i < fingerprint->m_peaks_size && paired < FINGERPRINT_FAN_OUT; i++) {
+        const FingerprintPeak target = fingerprint->m_peaks[(fingerprint->m_peaks_head + i) % capacity];
+        uint32_t dt = target.frame - anchor.frame;
+        if (dt > FINGERPRINT_ZONE_FRAMES) {
+            break;
+        }
+
+        int df = (int)target.bin - (int)anchor.bin;
+        if (dt == 0 || df > FINGERPRINT_ZONE_BINS || df < -FINGERPRINT_ZONE_BINS) {
+            continue;
+        }
+
+        uint32_t f2 = target.bin >> fingerprint->m_freq_shift;
+        uint32_t hash = f1 << (FINGERPRINT_FREQ_BITS + FINGERPRINT_DT_BITS) | f2 << FINGERPRINT_DT_BITS | dt;
+        if (fingerprint_add_landmark(fingerprint, (uint64_t)hash << 32 | anchor.frame)) {
+            return 1;
+        }
+        paired++;
+    }
+
+    fingerprint->m_peaks_head = (fingerprint->m_peaks_head + 1) % capacity;
+    fingerprint->m_peaks_size--;
+    return 0;
+}
+
+// Pick the peaks of frame 'center', all frames up to center + NEIGHBOR_FRAMES
+// (or the end of the stream) have been pushed
+static int fingerprint_decide(WavFingerprint* fingerprint, uint64_t center) {
+    const size_t bins = fingerprint->bins;
+    const size_t rows = fingerprint->m_rows;
+    const float* magnitudes = fingerprint->m_magnitudes + (center % rows) * bins;
+
+    // Strongest peaks of the frame, sorted by decreasing magnitude
+    uint16_t peaks[FINGERPRINT_PEAKS_PER_FRAME];
+    int nr_of_peaks = 0;
+
+    for (size_t k = 0; k < bins; k++) {
+        uint32_t* deque = fingerprint->m_deque + k * rows;
+        uint32_t head = fingerprint->m_deque_head[k];
+
+        // Frames before the neighborhood of 'center' leave the deque
+        while (fingerprint->m_deque_size[k] > 0 && deque[head] + FINGERPRINT_NEIGHBOR_FRAMES < center) {
+            head = (head + 1) % rows;
+            fingerprint->m_deque_size[k]--;
+        }
+        fingerprint->m_deque_head[k] = head;
+
+        const float value = magnitudes[k];
+        if (value < FINGERPRINT_MIN_MAGNITUDE || value < fingerprint->m_maxima[(deque[head] % rows) * bins + k]) {
+            continue;
+        }
+
+        if (nr_of_peaks == FINGERPRINT_PEAKS_PER_FRAME && magnitudes[peaks[nr_of_peaks - 1]] >= value) {
+            continue;
+        }
+
+        int i = nr_of_peaks < FINGERPRINT_PEAKS_PER_FRAME ? nr_of_peaks++ : FINGERPRINT_PEAKS_PER_FRAME - 1;
+        for (; i > 0 && magnitudes[peaks[i - 1]] < value; i--) {
+            peaks[i] = peaks[i - 1];
+        }
+        peaks[i] = (uint16_t)k;
+    }
+
+    // Keep the peaks ordered by time and bin
+    for (int i = 1; i < nr_of_peaks; i++) {
+        for (int j = i; j > 0 && peaks[j - 1] > peaks[j]; j--) {
+            uint16_t t = peaks[j];
+            peaks[j] = peaks[j - 1];
+            peaks[j - 1] = t;
+        }
+    }
+
+    // Anchors whose zone ends before this frame have all their targets
+    while (fingerprint->m_peaks_size > 0 &&
+           fingerprint->m_peaks[fingerprint->m_peaks_head].frame + FINGERPRINT_ZONE_FRAMES < center) {
+        if (fingerprint_pair_anchor(fingerprint)) {
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < nr_of_peaks; i++) {
+        size_t index = (fingerprint->m_peaks_head + fingerprint->m_peaks_size++) % fingerprint->m_peaks_capacity;
+        fingerprint->m_peaks[index].frame = (uint32_t)center;
+        fingerprint->m_peaks[index].bin = peaks[i];
+    }
+
+    fingerprint->m_decided = center + 1;
+    return 0;
+}
+
+// Push the next STFT frame, matches WavStftFrameFunction so it can be passed to
+// wav_stft_analyze directly. Returns 0 or -1 on failure
+static inline int wav_fingerprint_frame(const float* magnitudes, size_t bins, uint64_t frame, void* context) {
+    WavFingerprint* fingerprint = (WavFingerprint*)context;
+    (void)frame;
+
+    if (bins != fingerprint->bins) {
+        fprintf(stderr, "[WavFingerprint] Expected frames of %zu bins, got %zu\n", fingerprint->bins, bins);
+        return -1;
+    }
+
+    const size_t rows = fingerprint->m_rows;
+    const uint64_t t = fingerprint->m_frames++;
+
+    // Frames that no future neighborhood reaches leave the deques before their row is reused
+    for (size_t k = 0; k < bins; k++) {
+        uint32_t* frames = fingerprint->m_deque + k * rows;
+        while (fingerprint->m_deque_size[k] > 0 && frames[fingerprint->m_deque_head[k]] + 2 * FINGERPRINT_NEIGHBOR_FRAMES < t) {
+            fingerprint->m_deque_head[k] = (fingerprint->m_deque_head[k] + 1) % rows;
+            fingerprint->m_deque_size[k]--;
+        }
+    }
+
+    float* row = fingerprint->m_magnitudes + (t % rows) * bins;
+    float* maxima = fingerprint->m_maxima + (t % rows) * bins;
+    memcpy(row, magnitudes, sizeof(float) * bins);
+
+    // Maximum over +-NEIGHBOR_BINS bins, the deque holds bins with decreasing magnitudes
+    uint32_t* deque = fingerprint->m_bin_deque;
+    size_t head = 0, tail = 0;
+    for (size_t k = 0; k < bins + FINGERPRINT_NEIGHBOR_BINS; k++) {
+        if (k < bins) {
+            while (tail > head && row[deque[tail - 1]] <= row[k]) {
+                tail--;
+            }
+            deque[tail++] = (uint32_t)k;
+        }
+        if (k >= FINGERPRINT_NEIGHBOR_BINS) {
+            size_t center = k - FINGERPRINT_NEIGHBOR_BINS;
+            while (deque[head] + FINGERPRINT_NEIGHBOR_BINS < center) {
+                head++;
+            }
+            maxima[center] = row[deque[head]];
+        }
+    }
+
+    // Add this frame to the maximum over time of every bin
+    for (size_t k = 0; k < bins; k++) {
+        uint32_t* frames = fingerprint->m_deque + k * rows;
+        uint32_t head = fingerprint->m_deque_head[k];
+        uint32_t size = fingerprint->m_deque_size[k];
+
+        while (size > 0 && fingerprint->m_maxima[(frames[(head + size - 1) % rows] % rows) * bins + k] <= maxima[k]) {
+            size--;
+        }
+        frames[(head + size) % rows] = (uint32_t)t;
+        fingerprint->m_deque_size[k] = size + 1;
+    }
+
+    if (t >= FINGERPRINT_NEIGHBOR_FRAMES && fingerprint_decide(fingerprint, t - FINGERPRINT_NEIGHBOR_FRAMES)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Sort 64 bit keys with a least significant digit radix sort, 8 bits per pass.
+// Passes where every key has the same digit are skipped
+static void fingerprint_sort(uint64_t* keys, uint64_t* scratch, size_t n) {
+    size_t counts[256];
+    uint64_t* in = keys;
+    uint64_t* out = scratch;
+
+    for (uint32_t shift = 0; shift < 64; shift += 8) {
+        memset(counts, 0, sizeof(counts));
+        for (size_t i = 0; i < n; i++) {
+            counts[(in[i] >> shift) & 0xFF]++;
+        }
+        if (n == 0 || counts[(in[0] >> shift) & 0xFF] == n) {
+            continue;
+        }
+
+        size_t offset = 0;
+        for (int d = 0; d < 256; d++) {
+            size_t count = counts[d];
+            counts[d] = offset;
+            offset += count;
+        }
+        for (size_t i = 0; i < n; i++) {
+            out[counts[(in[i] >> shift) & 0xFF]++] = in[i];
+        }
+
+        uint64_t* swap = in;
+        in = out;
+        out = swap;
+    }
+
+    if (in != keys) {
+        memcpy(keys, in, sizeof(uint64_t) * n);
+    }
+}
+
+// Decide the last frames, pair the remaining peaks and sort the landmarks
+static inline int wav_fingerprint_finish(WavFingerprint* fingerprint) {
+    for (uint64_t center = fingerprint->m_decided; center < fingerprint->m_frames; center++) {
+        if (fingerprint_decide(fingerprint, center)) {
+            return 1;
+        }
+    }
+    while (fingerprint->m_peaks_size > 0) {
+        if (fingerprint_pair_anchor(fingerprint)) {
+            return 1;
+        }
+    }
+
+    const size_t n = fingerprint->nr_of_landmarks;
+    uint64_t* scratch = (uint64_t*)realloc(fingerprint->m_scratch, sizeof(uint64_t) * (n + 1));
+    if (scratch == NULL) {
+        fprintf(stderr, "[WavFingerprint] Unable to allocate memory for sorting %zu landmarks\n", n);
+        return 1;
+    }
+    fingerprint->m_scratch = scratch;
+    fingerprint_sort(fingerprint->landmarks, scratch, n);
+
+    // Repeated tones give the same landmark more than once
+    size_t unique = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (unique == 0 || fingerprint->landmarks[unique - 1] != fingerprint->landmarks[i]) {
+            fingerprint->landmarks[unique++] = fingerprint->landmarks[i];
+        }
+    }
+    fingerprint->nr_of_landmarks = unique;
+
+    return 0;
+}
+
+// Fingerprint the decoder: resample to mono with 'resampler', analyze with
+// 'stft' and pick landmarks, all in one pass. Returns the amount of landmarks
+// or -1 on failure
+static inline long wav_fingerprint_analyze(WavDecoder* decoder, WavResampler* resampler, WavStft* stft, WavFingerprint* fingerprint) {
+    wav_fingerprint_reset(fingerprint);
+
+    if (wav_stft_analyze(decoder, resampler, stft, wav_fingerprint_frame, fingerprint) < 0 ||
+        wav_fingerprint_finish(fingerprint)) {
+        return -1;
+    }
+
+    return (long)fingerprint->nr_of_landmarks;
+}
+
+// Write the landmarks as a fingerprint file: the magic, version, sample rate,
+// hop and landmark count followed by (hash, frame) pairs, all little endian
+static inline int wav_fingerprint_write(const WavFingerprint* fingerprint, const char* filename, uint32_t sample_rate, uint32_t hop) {
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "[WavFingerprint] Unable to open file %s for writing\n", filename);
+        return 1;
+    }
+
+    ByteBuffer* buffer;
+    if (byte_buffer_init(&buffer, fp, FINGERPRINT_WRITE_SIZE, 0) || buffer->m_buffer == NULL) {
+        fprintf(stderr, "[WavFingerprint] Unable to allocate memory for the write buffer\n");
+        byte_buffer_close(buffer);
+        fclose(fp);
+        return 1;
+    }
+
+    byte_buffer_write_int32(buffer, FINGERPRINT_MAGIC, BE);
+    byte_buffer_write_int32(buffer, FINGERPRINT_VERSION, LE);
+    byte_buffer_write_int32(buffer, sample_rate, LE);
+    byte_buffer_write_int32(buffer, hop, LE);
+    byte_buffer_write_int32(buffer, (uint32_t)fingerprint->nr_of_landmarks, LE);
+
+    int failed = 0;
+    for (size_t i = 0; i < fingerprint->nr_of_landmarks && !failed; i++) {
+        if (buffer->m_size - buffer->m_offset < 8) {
+            failed = byte_buffer_write_buffer(buffer);
+        }
+        byte_buffer_write_int32(buffer, (uint32_t)(fingerprint->landmarks[i] >> 32), LE);
+        byte_buffer_write_int32(buffer, (uint32_t)fingerprint->landmarks[i], LE);
+    }
+    failed |= byte_buffer_write_buffer(buffer);
+
+    byte_buffer_close(buffer);
+    if (fclose(fp) || failed) {
+        fprintf(stderr, "[WavFingerprint] Unable to write %s\n", filename);
+        return 1;
+    }
+
+    return 0;
+}
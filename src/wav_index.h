@@ -0,0 +1,960 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "wav_batch.h"
+#include "wav_fingerprint.h"
+
+#define INDEX_MAGIC 0x46434958  // fcix
+#define INDEX_VERSION 1
+#define INDEX_BUCKET_BITS 16             // The top bits of a hash select a bucket of the directory
+#define INDEX_RUN_POSTINGS (1 << 20)     // Postings a build worker sorts in memory before spilling a run
+#define INDEX_MERGE_POSTINGS 8192        // Postings read at once from every run while merging
+#define INDEX_WRITE_SIZE (1024 * 1024)   // In bytes
+#define INDEX_MIN_VOTES 5                // Matches with fewer aligned landmarks are not reported
+
+// Inverted index of fingerprint hashes
+//
+// Building fingerprints the tracks on a work-stealing pool. Every worker
+// collects (hash, track, frame) postings, sorts them once INDEX_RUN_POSTINGS
+// are buffered and spills them as a sorted run to an unlinked temporary file
+// next to the index. The runs are then merged with a heap into the index, so
+// only one run buffer per worker and one read buffer per run are in memory.
+//
+// The index file is used in place through a memory mapping, all values are
+// little endian:
+// - WavIndexHeader
+// - postings: per hash its (track, frame) pairs sorted by track and frame, as
+//   varints of the track delta and of the frame (delta when the track repeats)
+// - entries: WavIndexEntry per distinct hash, sorted by hash
+// - buckets: 2^INDEX_BUCKET_BITS + 1 entry indices, bucket b starts at the
+//   first entry whose hash has b as its top bits
+// - tracks: nr_of_tracks + 1 offsets into the NUL terminated track names after it
+//
+// A query fingerprints the clip with the settings of the index, looks up every
+// hash and votes for (track, frame offset) pairs. The track whose landmarks
+// line up at one offset the most is the match.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sample_rate;
+    uint32_t fft_size;
+    uint32_t hop;
+    uint32_t nr_of_tracks;
+    uint64_t nr_of_hashes;
+    uint64_t nr_of_postings;
+    uint64_t postings_offset;
+    uint64_t entries_offset;
+    uint64_t buckets_offset;
+    uint64_t tracks_offset;
+    uint64_t file_size;
+} WavIndexHeader;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t nr_of_postings;
+    uint64_t offset;  // Of the first posting, relative to postings_offset
+} WavIndexEntry;
+
+typedef struct {
+    uint64_t key;  // hash << 32 | track
+    uint32_t frame;
+} IndexPosting;
+
+// Index opened for queries
+typedef struct {
+    const WavIndexHeader* header;
+    const uint8_t* postings;
+    const WavIndexEntry* entries;
+    const uint64_t* buckets;
+    const uint64_t* track_offsets;
+    const char* names;
+
+    uint8_t* m_data;
+    size_t m_size;
+} WavIndex;
+
+typedef struct {
+    uint32_t track;
+    int64_t offset;  // Frame of the track at the start of the clip
+    uint32_t votes;
+} WavIndexMatch;
+
+// Open addressing table of votes per (track, offset), reused between queries
+typedef struct {
+    uint64_t* m_keys;
+    uint32_t* m_votes;
+    size_t m_capacity;
+    size_t m_size;
+} WavIndexVotes;
+
+// Varints
+
+static inline uint8_t* index_put_varint(uint8_t* out, uint32_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+// Read a varint that has to end before 'end', returns NULL when it does not or
+// when it is longer than a 32 bit value can be
+static inline const uint8_t* index_get_varint(const uint8_t* in, const uint8_t* end, uint32_t* value) {
+    uint32_t result = 0;
+    for (uint32_t shift = 0;; shift += 7) {
+        if (in == end || shift >= 32) {
+            return NULL;
+        }
+        uint8_t byte = *in++;
+        result |= (uint32_t)(byte & 0x7F) << shift;
+        if (byte < 0x80) {
+            break;
+        }
+    }
+    *value = result;
+    return in;
+}
+
+// Building
+
+// Stable least significant digit radix sort on the key, 8 bits per pass.
+// Postings of a track are added in (hash, frame) order, so equal keys keep
+// their frames sorted
+static void index_sort_postings(IndexPosting* postings, IndexPosting* scratch, size_t n) {
+    size_t counts[256];
+    IndexPosting* in = postings;
+    IndexPosting* out = scratch;
+
+    for (uint32_t shift = 0; shift < 64 && n > 0; shift += 8) {
+        memset(counts, 0, sizeof(counts));
+        for (size_t i = 0; i < n; i++) {
+            counts[(in[i].key >> shift) & 0xFF]++;
+        }
+        if (counts[(in[0].key >> shift) & 0xFF] == n) {
+            continue;
+        }
+
+        size_t offset = 0;
+        for (int d = 0; d < 256; d++) {
+            size_t count = counts[d];
+            counts[d] = offset;
+            offset += count;
+        }
+        for (size_t i = 0; i < n; i++) {
+            out[counts[(in[i].key >> shift) & 0xFF]++] = in[i];
+        }
+
+        IndexPosting* swap = in;
+        in = out;
+        out = swap;
+    }
+
+    if (in != postings) {
+        memcpy(postings, in, sizeof(IndexPosting) * n);
+    }
+}
+
+// Create an unlinked temporary file next to 'path', it is removed on close
+static FILE* index_temporary_file(const char* path) {
+    char name[BATCH_PATH_SIZE + 8];
+    snprintf(name, sizeof(name), "%s.XXXXXX", path);
+
+    int fd = mkstemp(name);
+    if (fd < 0) {
+        fprintf(stderr, "[WavIndex] Unable to create a temporary file next to %s\n", path);
+        return NULL;
+    }
+    unlink(name);
+
+    FILE* fp = fdopen(fd, "w+b");
+    if (fp == NULL) {
+        close(fd);
+    }
+    return fp;
+}
+
+typedef struct {
+    WavDecoder decoder;
+    WavResampler resampler;
+    WavStft stft;
+    WavFingerprint fingerprint;
+    int has_decoder;
+    int has_resampler;
+    int has_fingerprint;
+
+    IndexPosting* postings;
+    IndexPosting* scratch;
+    size_t nr_of_postings;
+} IndexWorker;
+
+static void index_worker_close(IndexWorker* worker) {
+    if (worker->has_decoder) {
+        wav_decoder_close(&worker->decoder);
+    }
+    if (worker->has_resampler) {
+        wav_resampler_close(&worker->resampler);
+    }
+    if (worker->has_fingerprint) {
+        wav_stft_close(&worker->stft);
+        wav_fingerprint_close(&worker->fingerprint);
+    }
+    free(worker->postings);
+    free(worker->scratch);
+}
+
+typedef struct {
+    const char* path;
+    uint32_t sample_rate;
+    size_t fft_size;
+    size_t hop;
+
+    WavBatchFile* files;
+    IndexWorker* workers;
+
+    pthread_mutex_t m_lock;  // Guards the runs
+    FILE** m_runs;
+    size_t m_nr_of_runs;
+    size_t m_runs_capacity;
+    int m_failed;
+} WavIndexBuilder;
+
+// Sort the postings of a worker and spill them as a run
+static int index_spill(WavIndexBuilder* builder, IndexWorker* worker) {
+    if (worker->nr_of_postings == 0) {
+        return 0;
+    }
+
+    index_sort_postings(worker->postings, worker->scratch, worker->nr_of_postings);
+
+    FILE* run = index_temporary_file(builder->path);
+    if (run == NULL) {
+        return 1;
+    }
+    if (fwrite(worker->postings, sizeof(IndexPosting), worker->nr_of_postings, run) != worker->nr_of_postings) {
+        fprintf(stderr, "[WavIndex] Unable to write a run of %zu postings\n", worker->nr_of_postings);
+        fclose(run);
+        return 1;
+    }
+    rewind(run);
+    worker->nr_of_postings = 0;
+
+    pthread_mutex_lock(&builder->m_lock);
+    if (builder->m_nr_of_runs == builder->m_runs_capacity) {
+        size_t capacity = builder->m_runs_capacity ? builder->m_runs_capacity * 2 : 64;
+        FILE** runs = (FILE**)realloc(builder->m_runs, sizeof(FILE*) * capacity);
+        if (runs == NULL) {
+            pthread_mutex_unlock(&builder->m_lock);
+            fprintf(stderr, "[WavIndex] Unable to allocate memory for %zu runs\n", capacity);
+            fclose(run);
+            return 1;
+        }
+        builder->m_runs = runs;
+        builder->m_runs_capacity = capacity;
+    }
+    builder->m_runs[builder->m_nr_of_runs++] = run;
+    pthread_mutex_unlock(&builder->m_lock);
+
+    return 0;
+}
+
+// Fingerprint a file with the worker's reusable state, returns the amount of landmarks or -1
+static long index_fingerprint(IndexWorker* worker, const char* input, uint32_t sample_rate, size_t fft_size, size_t hop) {
+    WavDecoder* decoder = &worker->decoder;
+
+    int failed = worker->has_decoder ? wav_decoder_reopen(decoder, input) : wav_decoder_init_mmap(decoder, input);
+    worker->has_decoder = 1;
+    if (failed || wav_decoder_get_header(decoder)) {
+        return -1;
+    }
+
+    if (!worker->has_fingerprint) {
+        if (wav_stft_init(&worker->stft, fft_size, fft_size, hop, STFT_WINDOW_HANN)) {
+            return -1;
+        }
+        if (wav_fingerprint_init(&worker->fingerprint, worker->stft.bins)) {
+            wav_stft_close(&worker->stft);
+            return -1;
+        }
+        worker->has_fingerprint = 1;
+    }
+
+    // The filter bank only has to be designed again when the input rate changes
+    WavResampler* resampler = &worker->resampler;
+    if (worker->has_resampler && resampler->in_rate != decoder->header->sample_rate) {
+        wav_resampler_close(resampler);
+        worker->has_resampler = 0;
+    }
+    if (!worker->has_resampler) {
+        if (wav_resampler_init(resampler, decoder->header->sample_rate, sample_rate, MONO)) {
+            return -1;
+        }
+        worker->has_resampler = 1;
+    }
+
+    return wav_fingerprint_analyze(decoder, resampler, &worker->stft, &worker->fingerprint);
+}
+
+static void index_build_file(void* task, size_t index, void* context) {
+    WavIndexBuilder* builder = (WavIndexBuilder*)context;
+    WavBatchFile* file = (WavBatchFile*)task;
+    IndexWorker* worker = &builder->workers[index];
+    const uint32_t track = (uint32_t)(file - builder->files);
+
+    double start = batch_now();
+    long landmarks = index_fingerprint(worker, file->input, builder->sample_rate, builder->fft_size, builder->hop);
+    file->seconds = batch_now() - start;
+    file->failed = landmarks < 0;
+
+    if (file->failed) {
+        printf("[failed] %s\n", file->input);
+        return;
+    }
+
+    const uint64_t* keys = worker->fingerprint.landmarks;
+    for (long i = 0; i < landmarks; i++) {
+        if (worker->nr_of_postings == INDEX_RUN_POSTINGS && index_spill(builder, worker)) {
+            builder->m_failed = 1;
+            return;
+        }
+
+        IndexPosting* posting = &worker->postings[worker->nr_of_postings++];
+        posting->key = (keys[i] >> 32) << 32 | track;
+        posting->frame = (uint32_t)keys[i];
+    }
+    file->output_samples = (size_t)landmarks;
+}
+
+typedef struct {
+    FILE* fp;
+    IndexPosting* buffer;
+    size_t length;
+    size_t position;
+} IndexRun;
+
+// Move to the next posting of the run. Returns 1 when there is one, 0 at the
+// end of the run or -1 when reading the run failed
+static int index_run_next(IndexRun* run) {
+    if (++run->position < run->length) {
+        return 1;
+    }
+    run->length = fread(run->buffer, sizeof(IndexPosting), INDEX_MERGE_POSTINGS, run->fp);
+    run->position = 0;
+    if (ferror(run->fp)) {
+        fprintf(stderr, "[WavIndex] Unable to read a run of postings back\n");
+        return -1;
+    }
+    return run->length > 0;
+}
+
+static int index_posting_less(const IndexPosting* a, const IndexPosting* b) {
+    return a->key < b->key || (a->key == b->key && a->frame < b->frame);
+}
+
+static inline const IndexPosting* index_run_head(const IndexRun* run) {
+    return &run->buffer[run->position];
+}
+
+static void index_heap_down(IndexRun** heap, size_t size, size_t i) {
+    for (;;) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < size && index_posting_less(index_run_head(heap[left]), index_run_head(heap[smallest]))) {
+            smallest = left;
+        }
+        if (right < size && index_posting_less(index_run_head(heap[right]), index_run_head(heap[smallest]))) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        IndexRun* swap = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+// Copy 'size' bytes from the start of 'from' to the end of 'to'
+static int index_append_file(FILE* to, FILE* from, uint64_t size) {
+    uint8_t buffer[64 * 1024];
+    rewind(from);
+    while (size > 0) {
+        size_t length = size < sizeof(buffer) ? (size_t)size : sizeof(buffer);
+        if (fread(buffer, 1, length, from) != length || fwrite(buffer, 1, length, to) != length) {
+            return 1;
+        }
+        size -= length;
+    }
+    return 0;
+}
+
+// Pad the file at 'position' with zeros to a multiple of 8 bytes, so the
+// sections can be used in place. Returns 0 on success
+static int index_align(FILE* fp, uint64_t* position) {
+    static const uint8_t zeros[8] = {0};
+    size_t padding = (size_t)((8 - *position % 8) % 8);
+    *position += padding;
+    return fwrite(zeros, 1, padding, fp) != padding;
+}
+
+// Merge the runs into the index file
+static int index_merge(WavIndexBuilder* builder, size_t nr_of_tracks) {
+    const size_t nr_of_runs = builder->m_nr_of_runs;
+    const size_t nr_of_buckets = ((size_t)1 << INDEX_BUCKET_BITS) + 1;
+
+    FILE* fp = fopen(builder->path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "[WavIndex] Unable to open file %s for writing\n", builder->path);
+        return 1;
+    }
+    setvbuf(fp, NULL, _IOFBF, INDEX_WRITE_SIZE);
+
+    FILE* entries = index_temporary_file(builder->path);
+    IndexRun* runs = (IndexRun*)calloc(nr_of_runs + 1, sizeof(IndexRun));
+    IndexRun** heap = (IndexRun**)malloc(sizeof(IndexRun*) * (nr_of_runs + 1));
+    IndexPosting* buffers = (IndexPosting*)malloc(sizeof(IndexPosting) * INDEX_MERGE_POSTINGS * (nr_of_runs + 1));
+    uint64_t* buckets = (uint64_t*)malloc(sizeof(uint64_t) * nr_of_buckets);
+    size_t encoded_capacity = 4096;
+    uint8_t* encoded = (uint8_t*)malloc(encoded_capacity);
+
+    int failed = entries == NULL || runs == NULL || heap == NULL || buffers == NULL || buckets == NULL || encoded == NULL;
+    if (failed) {
+        fprintf(stderr, "[WavIndex] Unable to allocate memory for merging %zu runs\n", nr_of_runs);
+    }
+
+    WavIndexHeader header;
+    memset(&header, 0, sizeof(WavIndexHeader));
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    header.sample_rate = builder->sample_rate;
+    header.fft_size = (uint32_t)builder->fft_size;
+    header.hop = (uint32_t)builder->hop;
+    header.nr_of_tracks = (uint32_t)nr_of_tracks;
+    header.postings_offset = sizeof(WavIndexHeader);
+
+    // The header is written again once the section offsets are known
+    failed |= fwrite(&header, sizeof(WavIndexHeader), 1, fp) != 1;
+
+    size_t heap_size = 0;
+    for (size_t i = 0; i < nr_of_runs && !failed; i++) {
+        runs[i].fp = builder->m_runs[i];
+        runs[i].buffer = buffers + i * INDEX_MERGE_POSTINGS;
+        runs[i].position = SIZE_MAX;
+        runs[i].length = 0;
+        int next = index_run_next(&runs[i]);
+        if (next > 0) {
+            heap[heap_size++] = &runs[i];
+        }
+        failed |= next < 0;
+    }
+    for (size_t i = heap_size / 2; i-- > 0;) {
+        index_heap_down(heap, heap_size, i);
+    }
+
+    uint64_t postings_size = 0;
+    uint64_t bucket = 0;
+    WavIndexEntry entry = {0, 0, 0};
+    size_t encoded_size = 0;
+    uint32_t last_track = 0, last_frame = 0;
+    int has_entry = 0;
+
+    while (!failed && heap_size > 0) {
+        const IndexPosting posting = *index_run_head(heap[0]);
+        int next = index_run_next(heap[0]);
+        if (next < 0) {
+            failed = 1;
+            break;
+        }
+        if (next == 0) {
+            heap[0] = heap[--heap_size];
+        }
+        index_heap_down(heap, heap_size, 0);
+
+        uint32_t hash = (uint32_t)(posting.key >> 32);
+        uint32_t track = (uint32_t)posting.key;
+
+        if (!has_entry || hash != entry.hash) {
+            if (has_entry) {
+                entry.offset = postings_size;
+                failed |= fwrite(encoded, 1, encoded_size, fp) != encoded_size;
+                failed |= fwrite(&entry, sizeof(WavIndexEntry), 1, entries) != 1;
+                postings_size += encoded_size;
+                header.nr_of_hashes++;
+            }
+
+            for (; bucket <= (hash >> (32 - INDEX_BUCKET_BITS)); bucket++) {
+                buckets[bucket] = header.nr_of_hashes;
+            }
+
+            entry.hash = hash;
+            entry.nr_of_postings = 0;
+            encoded_size = 0;
+            has_entry = 1;
+        }
+
+        if (encoded_capacity - encoded_size < 10) {
+            encoded_capacity *= 2;
+            uint8_t* grown = (uint8_t*)realloc(encoded, encoded_capacity);
+            if (grown == NULL) {
+                fprintf(stderr, "[WavIndex] Unable to allocate memory for the postings of hash 0x%08x\n", hash);
+                failed = 1;
+                break;
+            }
+            encoded = grown;
+        }
+
+        // The first posting of a hash stores its track and frame as is
+        uint32_t track_delta = entry.nr_of_postings ? track - last_track : track;
+        uint32_t frame = track_delta == 0 && entry.nr_of_postings ? posting.frame - last_frame : posting.frame;
+        uint8_t* out = index_put_varint(encoded + encoded_size, track_delta);
+        out = index_put_varint(out, frame);
+        encoded_size = out - encoded;
+
+        last_track = track;
+        last_frame = posting.frame;
+        entry.nr_of_postings++;
+        header.nr_of_postings++;
+    }
+
+    if (!failed && has_entry) {
+        entry.offset = postings_size;
+        failed |= fwrite(encoded, 1, encoded_size, fp) != encoded_size;
+        failed |= fwrite(&entry, sizeof(WavIndexEntry), 1, entries) != 1;
+        postings_size += encoded_size;
+        header.nr_of_hashes++;
+    }
+
+    if (!failed) {
+        for (; bucket < nr_of_buckets; bucket++) {
+            buckets[bucket] = header.nr_of_hashes;
+        }
+
+        header.entries_offset = header.postings_offset + postings_size;
+        failed |= index_align(fp, &header.entries_offset);
+        failed |= fflush(entries) != 0 || index_append_file(fp, entries, header.nr_of_hashes * sizeof(WavIndexEntry));
+
+        header.buckets_offset = header.entries_offset + header.nr_of_hashes * sizeof(WavIndexEntry);
+        failed |= fwrite(buckets, sizeof(uint64_t), nr_of_buckets, fp) != nr_of_buckets;
+
+        header.tracks_offset = header.buckets_offset + nr_of_buckets * sizeof(uint64_t);
+        uint64_t name_offset = 0;
+        for (size_t i = 0; i <= nr_of_tracks && !failed; i++) {
+            failed |= fwrite(&name_offset, sizeof(uint64_t), 1, fp) != 1;
+            if (i < nr_of_tracks) {
+                name_offset += strlen(builder->files[i].input) + 1;
+            }
+        }
+        for (size_t i = 0; i < nr_of_tracks && !failed; i++) {
+            const char* name = builder->files[i].input;
+            failed |= fwrite(name, 1, strlen(name) + 1, fp) != strlen(name) + 1;
+        }
+        header.file_size = header.tracks_offset + (nr_of_tracks + 1) * sizeof(uint64_t) + name_offset;
+
+        failed |= fseeko(fp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(WavIndexHeader), 1, fp) != 1;
+    }
+
+    failed |= fclose(fp) != 0;
+    if (failed) {
+        fprintf(stderr, "[WavIndex] Unable to write %s\n", builder->path);
+        unlink(builder->path);
+    }
+
+    if (entries) {
+        fclose(entries);
+    }
+    free(runs);
+    free(heap);
+    free(buffers);
+    free(buckets);
+    free(encoded);
+
+    return failed;
+}
+
+// Build an index of 'files' at 'path' on 'threads' threads, tracks are numbered
+// in the order of 'files'. Tracks that fail are kept without postings.
+// Returns the amount of failed tracks or -1 when the index could not be written
+static inline long wav_index_build(const char* path, WavBatchFile* files, size_t count, uint32_t sample_rate, size_t fft_size,
+                                   size_t hop, size_t threads) {
+    if (count > UINT32_MAX) {
+        fprintf(stderr, "[WavIndex] Unable to index %zu tracks\n", count);
+        return -1;
+    }
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    WavIndexBuilder builder;
+    memset(&builder, 0, sizeof(WavIndexBuilder));
+    builder.path = path;
+    builder.sample_rate = sample_rate;
+    builder.fft_size = fft_size;
+    builder.hop = hop;
+    builder.files = files;
+    pthread_mutex_init(&builder.m_lock, NULL);
+
+    builder.workers = (IndexWorker*)calloc(threads, sizeof(IndexWorker));
+    void** tasks = (void**)malloc(sizeof(void*) * (count + 1));
+    int failed = builder.workers == NULL || tasks == NULL;
+
+    for (size_t i = 0; i < threads && !failed; i++) {
+        builder.workers[i].postings = (IndexPosting*)malloc(sizeof(IndexPosting) * INDEX_RUN_POSTINGS);
+        builder.workers[i].scratch = (IndexPosting*)malloc(sizeof(IndexPosting) * INDEX_RUN_POSTINGS);
+        failed = builder.workers[i].postings == NULL || builder.workers[i].scratch == NULL;
+    }
+
+    if (failed) {
+        fprintf(stderr, "[WavIndex] Unable to allocate memory for %zu workers\n", threads);
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            tasks[i] = &files[i];
+            files[i].failed = 1;
+        }
+        work_pool_run(threads, tasks, count, index_build_file, &builder);
+        failed = builder.m_failed;
+
+        for (size_t i = 0; i < threads && !failed; i++) {
+            failed = index_spill(&builder, &builder.workers[i]);
+        }
+    }
+
+    for (size_t i = 0; builder.workers && i < threads; i++) {
+        index_worker_close(&builder.workers[i]);
+    }
+    free(builder.workers);
+    free(tasks);
+
+    if (!failed) {
+        failed = index_merge(&builder, count);
+    }
+
+    for (size_t i = 0; i < builder.m_nr_of_runs; i++) {
+        fclose(builder.m_runs[i]);
+    }
+    free(builder.m_runs);
+    pthread_mutex_destroy(&builder.m_lock);
+
+    if (failed) {
+        return -1;
+    }
+
+    long failed_tracks = 0;
+    for (size_t i = 0; i < count; i++) {
+        failed_tracks += files[i].failed;
+    }
+    return failed_tracks;
+}
+
+// Querying
+
+static inline void wav_index_close(WavIndex* index) {
+    if (index->m_data) {
+        munmap(index->m_data, index->m_size);
+    }
+    index->m_data = NULL;
+}
+
+// Check that every section of the header lies within the file, in the order
+// they are written, and that the directory and the track names can be followed
+// without leaving it. Postings are checked while they are decoded. Returns 0
+// when the index can be used
+static int index_check(const WavIndex* index) {
+    const WavIndexHeader* header = (const WavIndexHeader*)index->m_data;
+    const uint64_t size = index->m_size;
+    const uint64_t nr_of_buckets = ((uint64_t)1 << INDEX_BUCKET_BITS) + 1;
+
+    // Each section starts where the previous one may end, counts are divided
+    // instead of multiplied so they can not overflow
+    if (header->postings_offset < sizeof(WavIndexHeader) || header->entries_offset < header->postings_offset ||
+        header->entries_offset > size || header->entries_offset % 8 != 0 ||
+        header->nr_of_hashes > (size - header->entries_offset) / sizeof(WavIndexEntry)) {
+        return 1;
+    }
+    if (header->buckets_offset < header->entries_offset + header->nr_of_hashes * sizeof(WavIndexEntry) ||
+        header->buckets_offset > size || header->buckets_offset % 8 != 0 ||
+        nr_of_buckets > (size - header->buckets_offset) / sizeof(uint64_t)) {
+        return 1;
+    }
+    if (header->tracks_offset < header->buckets_offset + nr_of_buckets * sizeof(uint64_t) || header->tracks_offset > size ||
+        header->tracks_offset % 8 != 0 || (uint64_t)header->nr_of_tracks + 1 > (size - header->tracks_offset) / sizeof(uint64_t)) {
+        return 1;
+    }
+
+    // A lookup searches between two buckets, they have to grow up to the amount of entries
+    const uint64_t* buckets = (const uint64_t*)(index->m_data + header->buckets_offset);
+    for (uint64_t b = 0; b < nr_of_buckets; b++) {
+        if (buckets[b] > header->nr_of_hashes || (b > 0 && buckets[b] < buckets[b - 1])) {
+            return 1;
+        }
+    }
+
+    // Every name has to start in the names and end before the end of the file
+    const uint64_t names_offset = header->tracks_offset + ((uint64_t)header->nr_of_tracks + 1) * sizeof(uint64_t);
+    const uint64_t* track_offsets = (const uint64_t*)(index->m_data + header->tracks_offset);
+    for (uint32_t t = 0; t < header->nr_of_tracks; t++) {
+        if (track_offsets[t] >= size - names_offset) {
+            return 1;
+        }
+    }
+    if (header->nr_of_tracks && index->m_data[size - 1] != 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static inline int wav_index_open(WavIndex* index, const char* path) {
+    memset(index, 0, sizeof(WavIndex));
+
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "[WavIndex] Unable to open file %s for reading\n", path);
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) || (size_t)st.st_size < sizeof(WavIndexHeader)) {
+        fprintf(stderr, "[WavIndex] %s is not an index\n", path);
+        fclose(fp);
+        return 1;
+    }
+
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    fclose(fp);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "[WavIndex] Unable to map %s\n", path);
+        return 1;
+    }
+    index->m_data = (uint8_t*)data;
+    index->m_size = (size_t)st.st_size;
+
+    const WavIndexHeader* header = (const WavIndexHeader*)data;
+    if (header->magic != INDEX_MAGIC || header->version != INDEX_VERSION || header->file_size != index->m_size) {
+        fprintf(stderr, "[WavIndex] %s is not a version %d index\n", path, INDEX_VERSION);
+        wav_index_close(index);
+        return 1;
+    }
+    if (index_check(index)) {
+        fprintf(stderr, "[WavIndex] %s is damaged, its sections do not fit in the file\n", path);
+        wav_index_close(index);
+        return 1;
+    }
+
+    index->header = header;
+    index->postings = index->m_data + header->postings_offset;
+    index->entries = (const WavIndexEntry*)(index->m_data + header->entries_offset);
+    index->buckets = (const uint64_t*)(index->m_data + header->buckets_offset);
+    index->track_offsets = (const uint64_t*)(index->m_data + header->tracks_offset);
+    index->names = (const char*)(index->track_offsets + header->nr_of_tracks + 1);
+
+    // Lookups jump around the file, let the kernel read ahead less
+    madvise(data, index->m_size, MADV_RANDOM);
+
+    return 0;
+}
+
+static inline const char* wav_index_track_name(const WavIndex* index, uint32_t track) {
+    return track < index->header->nr_of_tracks ? index->names + index->track_offsets[track] : NULL;
+}
+
+// The entry for 'hash', NULL when no track has it
+static inline const WavIndexEntry* wav_index_lookup(const WavIndex* index, uint32_t hash) {
+    uint32_t bucket = hash >> (32 - INDEX_BUCKET_BITS);
+    uint64_t low = index->buckets[bucket];
+    uint64_t high = index->buckets[bucket + 1];
+
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        if (index->entries[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low < index->buckets[bucket + 1] && index->entries[low].hash == hash ? &index->entries[low] : NULL;
+}
+
+static inline void wav_index_votes_free(WavIndexVotes* votes) {
+    free(votes->m_keys);
+    free(votes->m_votes);
+    memset(votes, 0, sizeof(WavIndexVotes));
+}
+
+static int index_votes_grow(WavIndexVotes* votes) {
+    size_t capacity = votes->m_capacity ? votes->m_capacity * 2 : 4096;
+    uint64_t* keys = (uint64_t*)malloc(sizeof(uint64_t) * capacity);
+    uint32_t* counts = (uint32_t*)calloc(capacity, sizeof(uint32_t));
+    if (keys == NULL || counts == NULL) {
+        fprintf(stderr, "[WavIndex] Unable to allocate memory for %zu votes\n", capacity);
+        free(keys);
+        free(counts);
+        return 1;
+    }
+
+    // Slots with zero votes are empty
+    for (size_t i = 0; i < votes->m_capacity; i++) {
+        if (votes->m_votes[i] == 0) {
+            continue;
+        }
+        size_t slot = (votes->m_keys[i] * 0x9E3779B97F4A7C15ULL) >> 20 & (capacity - 1);
+        while (counts[slot] != 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        keys[slot] = votes->m_keys[i];
+        counts[slot] = votes->m_votes[i];
+    }
+
+    free(votes->m_keys);
+    free(votes->m_votes);
+    votes->m_keys = keys;
+    votes->m_votes = counts;
+    votes->m_capacity = capacity;
+    return 0;
+}
+
+// Add a vote, returns the new amount of votes for 'key' or 0 on failure
+static inline uint32_t index_vote(WavIndexVotes* votes, uint64_t key) {
+    if (2 * (votes->m_size + 1) > votes->m_capacity && index_votes_grow(votes)) {
+        return 0;
+    }
+
+    size_t mask = votes->m_capacity - 1;
+    size_t slot = (key * 0x9E3779B97F4A7C15ULL) >> 20 & mask;
+    while (votes->m_votes[slot] != 0 && votes->m_keys[slot] != key) {
+        slot = (slot + 1) & mask;
+    }
+    if (votes->m_votes[slot] == 0) {
+        votes->m_keys[slot] = key;
+        votes->m_size++;
+    }
+    return ++votes->m_votes[slot];
+}
+
+// Match the landmarks of a clip (as produced by WavFingerprint) against the
+// index. Returns 1 and fills in 'match' when a track has at least
+// INDEX_MIN_VOTES landmarks at the same offset, 0 without a match or -1 on failure
+static inline int wav_index_query(const WavIndex* index, const uint64_t* landmarks, size_t count, WavIndexVotes* votes,
+                                  WavIndexMatch* match) {
+    if (votes->m_capacity) {
+        memset(votes->m_votes, 0, sizeof(uint32_t) * votes->m_capacity);
+    }
+    votes->m_size = 0;
+    memset(match, 0, sizeof(WavIndexMatch));
+
+    for (size_t i = 0; i < count; i++) {
+        const WavIndexEntry* entry = wav_index_lookup(index, (uint32_t)(landmarks[i] >> 32));
+        if (entry == NULL) {
+            continue;
+        }
+
+        // The postings of an entry have to stay within the postings of the index
+        const uint8_t* end = index->m_data + index->header->entries_offset;
+        if (entry->offset >= index->header->entries_offset - index->header->postings_offset) {
+            fprintf(stderr, "[WavIndex] Postings of hash %08x lie outside of the index\n", entry->hash);
+            return -1;
+        }
+
+        const uint32_t clip_frame = (uint32_t)landmarks[i];
+        const uint8_t* in = index->postings + entry->offset;
+        uint32_t track = 0, frame = 0;
+
+        for (uint32_t p = 0; p < entry->nr_of_postings; p++) {
+            uint32_t track_delta, value;
+            in = index_get_varint(in, end, &track_delta);
+            in = in ? index_get_varint(in, end, &value) : NULL;
+            track += track_delta;
+            if (in == NULL || track >= index->header->nr_of_tracks) {
+                fprintf(stderr, "[WavIndex] Postings of hash %08x are damaged\n", entry->hash);
+                return -1;
+            }
+            frame = track_delta == 0 && p > 0 ? frame + value : value;
+
+            // Offsets are biased by 2^31 so they fit in the low half of the key
+            int64_t offset = (int64_t)frame - clip_frame;
+            uint64_t key = (uint64_t)track << 32 | (uint32_t)(offset + 0x80000000LL);
+            uint32_t count_for_key = index_vote(votes, key);
+            if (count_for_key == 0) {
+                return -1;
+            }
+            if (count_for_key > match->votes) {
+                match->track = track;
+                match->offset = offset;
+                match->votes = count_for_key;
+            }
+        }
+    }
+
+    return match->votes >= INDEX_MIN_VOTES;
+}
+
+typedef struct {
+    const char* clip;
+    WavIndexMatch match;
+    int result;  // Of wav_index_query, -1 when the clip could not be fingerprinted
+} WavIndexQuery;
+
+typedef struct {
+    const WavIndex* index;
+    IndexWorker* workers;
+    WavIndexVotes* votes;
+} IndexSearch;
+
+static void index_search_clip(void* task, size_t index, void* context) {
+    IndexSearch* search = (IndexSearch*)context;
+    WavIndexQuery* query = (WavIndexQuery*)task;
+    const WavIndexHeader* header = search->index->header;
+    IndexWorker* worker = &search->workers[index];
+
+    long landmarks = index_fingerprint(worker, query->clip, header->sample_rate, header->fft_size, header->hop);
+    if (landmarks < 0) {
+        query->result = -1;
+        return;
+    }
+    query->result =
+        wav_index_query(search->index, worker->fingerprint.landmarks, (size_t)landmarks, &search->votes[index], &query->match);
+}
+
+// Fingerprint the clips with the settings of the index and match them on
+// 'threads' threads. Returns the amount of clips that failed
+static inline size_t wav_index_search(const WavIndex* index, WavIndexQuery* queries, size_t count, size_t threads) {
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    IndexSearch search;
+    search.index = index;
+    search.workers = (IndexWorker*)calloc(threads, sizeof(IndexWorker));
+    search.votes = (WavIndexVotes*)calloc(threads, sizeof(WavIndexVotes));
+    void** tasks = (void**)malloc(sizeof(void*) * (count + 1));
+
+    size_t failed = 0;
+    if (search.workers == NULL || search.votes == NULL || tasks == NULL) {
+        fprintf(stderr, "[WavIndex] Unable to allocate memory for %zu workers\n", threads);
+        failed = count;
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            tasks[i] = &queries[i];
+            queries[i].result = -1;
+        }
+        work_pool_run(threads, tasks, count, index_search_clip, &search);
+
+        for (size_t i = 0; i < threads; i++) {
+            index_worker_close(&search.workers[i]);
+            wav_index_votes_free(&search.votes[i]);
+        }
+        for (size_t i = 0; i < count; i++) {
+            failed += queries[i].result < 0;
+        }
+    }
+
+    free(search.workers);
+    free(search.votes);
+    free(tasks);
+
+    return failed;
+}
@@ -0,0 +1,353 @@
+#pragma once
+
+#include "pcm_convert.h"
+#include "wav.h"
+
+#define MIXER_MAX_CHANNELS 16
+#define MIXER_MINUS_3DB 0.70710678f
+
+// Channel mapping between the decoder and the resampler
+//
+// Every output channel is a weighted sum of the input channels, the gain of
+// input k in output o is matrix[o * MIXER_MAX_CHANNELS + k]. Only the non-zero
+// gains of an output are evaluated, so a plain channel copy stays exact. The
+// common stereo source has SSE2 and AVX2 kernels that produce exactly the same
+// output as the scalar one.
+typedef struct {
+    uint8_t in_channels;
+    uint8_t out_channels;
+    float matrix[MIXER_MAX_CHANNELS * MIXER_MAX_CHANNELS];
+} WavMixer;
+
+typedef void (*MixerStereoKernel)(const float* in, float a, float b, float* out, size_t n);
+
+// Set up the default mapping from in_channels to out_channels:
+// - the same amount of channels is copied
+// - 5.1 (FL FR FC LFE BL BR) to stereo uses the ITU-R BS.775 downmix without
+//   the LFE, normalized so a full scale input can not clip
+// - other downmixes average the inputs that fold onto an output (input k goes
+//   to output k % out_channels), so stereo to mono is (L + R) / 2
+// - upmixes copy the inputs to the first outputs, mono also goes to the right
+//   channel, the remaining outputs stay silent
+static inline int wav_mixer_init(WavMixer* mixer, uint8_t in_channels, uint8_t out_channels) {
+    if (in_channels == 0 || out_channels == 0 || in_channels > MIXER_MAX_CHANNELS || out_channels > MIXER_MAX_CHANNELS) {
+        fprintf(stderr, "[WavMixer] Unable to map %d channels to %d channels\n", in_channels, out_channels);
+        return 1;
+    }
+
+    mixer->in_channels = in_channels;
+    mixer->out_channels = out_channels;
+    memset(mixer->matrix, 0, sizeof(mixer->matrix));
+
+    float* matrix = mixer->matrix;
+    const size_t row = MIXER_MAX_CHANNELS;
+
+    if (in_channels == 6 && out_channels == 2) {
+        const float norm = 1.0f / (1.0f + 2.0f * MIXER_MINUS_3DB);
+        matrix[0 * row + 0] = norm;                    // FL
+        matrix[0 * row + 2] = MIXER_MINUS_3DB * norm;  // FC
+        matrix[0 * row + 4] = MIXER_MINUS_3DB * norm;  // BL
+        matrix[1 * row + 1] = norm;                    // FR
+        matrix[1 * row + 2] = MIXER_MINUS_3DB * norm;  // FC
+        matrix[1 * row + 5] = MIXER_MINUS_3DB * norm;  // BR
+    } else if (in_channels >= out_channels) {
+        for (uint8_t o = 0; o < out_channels; o++) {
+            uint8_t folded = (in_channels - o + out_channels - 1) / out_channels;
+            for (uint8_t k = o; k < in_channels; k += out_channels) {
+                matrix[o * row + k] = 1.0f / folded;
+            }
+        }
+    } else {
+        for (uint8_t k = 0; k < in_channels; k++) {
+            matrix[k * row + k] = 1.0f;
+        }
+        if (in_channels == 1) {
+            matrix[1 * row + 0] = 1.0f;
+        }
+    }
+
+    return 0;
+}
+
+// Set up a custom mapping from 'count' row major gains, one row of input gains
+// per output channel. The amount of input channels follows from 'count'
+static inline int wav_mixer_init_matrix(WavMixer* mixer, uint8_t out_channels, const float* gains, size_t count) {
+    if (out_channels == 0 || count == 0 || count % out_channels != 0) {
+        fprintf(stderr, "[WavMixer] %zu gains do not make a matrix with %d output channels\n", count, out_channels);
+        return 1;
+    }
+
+    size_t in_channels = count / out_channels;
+    if (in_channels > MIXER_MAX_CHANNELS || wav_mixer_init(mixer, (uint8_t)in_channels, out_channels)) {
+        fprintf(stderr, "[WavMixer] Unable to map %zu channels to %d channels\n", in_channels, out_channels);
+        return 1;
+    }
+
+    for (uint8_t o = 0; o < out_channels; o++) {
+        for (uint8_t k = 0; k < in_channels; k++) {
+            mixer->matrix[o * MIXER_MAX_CHANNELS + k] = gains[o * in_channels + k];
+        }
+    }
+
+    return 0;
+}
+
+static inline void wav_mixer_set_gain(WavMixer* mixer, uint8_t out_channel, uint8_t in_channel, float gain) {
+    mixer->matrix[out_channel * MIXER_MAX_CHANNELS + in_channel] = gain;
+}
+
+// Non-zero gains of output 'o', returns the amount of terms
+static inline uint8_t mixer_terms(const WavMixer* mixer, uint8_t o, uint8_t* inputs, float* gains) {
+    uint8_t terms = 0;
+    for (uint8_t k = 0; k < mixer->in_channels; k++) {
+        float gain = mixer->matrix[o * MIXER_MAX_CHANNELS + k];
+        if (gain != 0.0f) {
+            inputs[terms] = k;
+            gains[terms++] = gain;
+        }
+    }
+    return terms;
+}
+
+// Mix a single interleaved frame
+static inline void wav_mixer_frame(const WavMixer* mixer, const float* in, float* out) {
+    uint8_t inputs[MIXER_MAX_CHANNELS];
+    float gains[MIXER_MAX_CHANNELS];
+
+    for (uint8_t o = 0; o < mixer->out_channels; o++) {
+        uint8_t terms = mixer_terms(mixer, o, inputs, gains);
+        float sum = 0;
+        for (uint8_t t = 0; t < terms; t++) {
+            sum += gains[t] * in[inputs[t]];
+        }
+        out[o] = sum;
+    }
+}
+
+// Kernels for one output of an interleaved stereo input, out[i] = a * L + b * R
+
+static inline void mixer_stereo_scalar(const float* in, float a, float b, float* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = a * in[2 * i] + b * in[2 * i + 1];
+    }
+}
+
+#ifdef PCM_X86
+
+static inline void mixer_stereo_sse2(const float* in, float a, float b, float* out, size_t n) {
+    const __m128 ga = _mm_set1_ps(a);
+    const __m128 gb = _mm_set1_ps(b);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = _mm_loadu_ps(in + 2 * i);
+        __m128 y = _mm_loadu_ps(in + 2 * i + 4);
+        __m128 left = _mm_shuffle_ps(x, y, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 right = _mm_shuffle_ps(x, y, _MM_SHUFFLE(3, 1, 3, 1));
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(left, ga), _mm_mul_ps(right, gb)));
+    }
+    mixer_stereo_scalar(in + 2 * i, a, b, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static inline void mixer_stereo_avx2(const float* in, float a, float b, float* out, size_t n) {
+    const __m256 ga = _mm256_set1_ps(a);
+    const __m256 gb = _mm256_set1_ps(b);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_loadu_ps(in + 2 * i);
+        __m256 y = _mm256_loadu_ps(in + 2 * i + 8);
+        // Shuffles work per 128 bit lane, frames come out as 0 1 4 5 2 3 6 7
+        __m256 left = _mm256_shuffle_ps(x, y, _MM_SHUFFLE(2, 0, 2, 0));
+        __m256 right = _mm256_shuffle_ps(x, y, _MM_SHUFFLE(3, 1, 3, 1));
+        __m256 sum = _mm256_add_ps(_mm256_mul_ps(left, ga), _mm256_mul_ps(right, gb));
+        sum = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(sum), _MM_SHUFFLE(3, 1, 2, 0)));
+        _mm256_storeu_ps(out + i, sum);
+    }
+    mixer_stereo_scalar(in + 2 * i, a, b, out + i, n - i);
+}
+
+#endif
+
+static inline MixerStereoKernel mixer_stereo_kernel(void) {
+#ifdef PCM_X86
+    enum PcmCpuLevel level = pcm_cpu_level();
+    if (level == PCM_CPU_AVX2) {
+        return mixer_stereo_avx2;
+    }
+    if (level == PCM_CPU_SSE2) {
+        return mixer_stereo_sse2;
+    }
+#endif
+    return mixer_stereo_scalar;
+}
+
+// Mix all samples of 'in' into planar output, channel o at out + o * stride
+static inline int wav_mixer_process(const WavMixer* mixer, WavData* in, float* out, size_t stride) {
+    if (in->nr_of_channels != mixer->in_channels) {
+        fprintf(stderr, "[WavMixer] Expected %d input channels, got %d\n", mixer->in_channels, in->nr_of_channels);
+        return 1;
+    }
+
+    const size_t n = in->nr_of_samples;
+    const uint8_t channels = in->nr_of_channels;
+    uint8_t inputs[MIXER_MAX_CHANNELS];
+    float gains[MIXER_MAX_CHANNELS];
+
+    for (uint8_t o = 0; o < mixer->out_channels; o++) {
+        float* dst = out + o * stride;
+        uint8_t terms = mixer_terms(mixer, o, inputs, gains);
+
+        if (terms == 0) {
+            memset(dst, 0, sizeof(float) * n);
+            continue;
+        }
+
+        if (in->layout == LAYOUT_PLANAR) {
+            const float* src = wav_data_channel(in, inputs[0]);
+            for (size_t i = 0; i < n; i++) {
+                dst[i] = gains[0] * src[i];
+            }
+            for (uint8_t t = 1; t < terms; t++) {
+                src = wav_data_channel(in, inputs[t]);
+                for (size_t i = 0; i < n; i++) {
+                    dst[i] += gains[t] * src[i];
+                }
+            }
+            continue;
+        }
+
+        const float* src = in->m_data;
+        if (terms == 1) {
+            for (size_t i = 0; i < n; i++) {
+                dst[i] = gains[0] * src[i * channels + inputs[0]];
+            }
+        } else if (channels == 2) {
+            mixer_stereo_kernel()(src, gains[0], gains[1], dst, n);
+        } else {
+            for (size_t i = 0; i < n; i++) {
+                const float* frame = src + i * channels;
+                float sum = 0;
+                for (uint8_t t = 0; t < terms; t++) {
+                    sum += gains[t] * frame[inputs[t]];
+                }
+                dst[i] = sum;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Fixed point mixing of 16 bit samples
+//
+// Gains are rounded to Q15, every output is the sum of its terms rounded to
+// nearest and saturated. A gain of exactly one copies the channel. For a stereo
+// input madd multiplies a frame by both gains at once, so the SSE2 and AVX2
+// kernels produce exactly the same output as the scalar one.
+
+#define MIXER_Q15_ONE 32768
+
+typedef void (*MixerStereoQ15Kernel)(const int16_t* in, int16_t a, int16_t b, int16_t* out, size_t n);
+
+static inline int32_t mixer_gain_q15(float gain) {
+    return (int32_t)lrintf(gain * MIXER_Q15_ONE);
+}
+
+static inline void mixer_stereo_q15_scalar(const int16_t* in, int16_t a, int16_t b, int16_t* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = pcm_saturate_q15((a * in[2 * i] + b * in[2 * i + 1] + MIXER_Q15_ONE / 2) >> 15);
+    }
+}
+
+#ifdef PCM_X86
+
+static inline void mixer_stereo_q15_sse2(const int16_t* in, int16_t a, int16_t b, int16_t* out, size_t n) {
+    const __m128i gains = _mm_set1_epi32((int32_t)(uint16_t)a | (int32_t)b << 16);
+    const __m128i round = _mm_set1_epi32(MIXER_Q15_ONE / 2);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i sum = _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(in + 2 * i)), gains);
+        sum = _mm_srai_epi32(_mm_add_epi32(sum, round), 15);
+        _mm_storel_epi64((__m128i*)(out + i), _mm_packs_epi32(sum, sum));
+    }
+    mixer_stereo_q15_scalar(in + 2 * i, a, b, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static inline void mixer_stereo_q15_avx2(const int16_t* in, int16_t a, int16_t b, int16_t* out,
+                                                                         size_t n) {
+    const __m256i gains = _mm256_set1_epi32((int32_t)(uint16_t)a | (int32_t)b << 16);
+    const __m256i round = _mm256_set1_epi32(MIXER_Q15_ONE / 2);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i sum = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i*)(in + 2 * i)), gains);
+        sum = _mm256_srai_epi32(_mm256_add_epi32(sum, round), 15);
+        // Packing works per 128 bit lane, the results are in the 1st and 3rd quarter
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(sum, sum), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128((__m128i*)(out + i), _mm256_castsi256_si128(packed));
+    }
+    mixer_stereo_q15_scalar(in + 2 * i, a, b, out + i, n - i);
+}
+
+#endif
+
+static inline MixerStereoQ15Kernel mixer_stereo_q15_kernel(void) {
+#ifdef PCM_X86
+    enum PcmCpuLevel level = pcm_cpu_level();
+    if (level == PCM_CPU_AVX2) {
+        return mixer_stereo_q15_avx2;
+    }
+    if (level == PCM_CPU_SSE2) {
+        return mixer_stereo_q15_sse2;
+    }
+#endif
+    return mixer_stereo_q15_scalar;
+}
+
+// Mix all samples of the interleaved 'in' into planar Q15 output, channel o at
+// out + o * stride
+static inline int wav_mixer_process_fixed(const WavMixer* mixer, const WavFixedData* in, int16_t* out, size_t stride) {
+    if (in->nr_of_channels != mixer->in_channels) {
+        fprintf(stderr, "[WavMixer] Expected %d input channels, got %d\n", mixer->in_channels, in->nr_of_channels);
+        return 1;
+    }
+
+    const size_t n = in->nr_of_samples;
+    const uint8_t channels = in->nr_of_channels;
+    const int16_t* src = in->m_data;
+    uint8_t inputs[MIXER_MAX_CHANNELS];
+    float gains[MIXER_MAX_CHANNELS];
+    int32_t q15[MIXER_MAX_CHANNELS];
+
+    for (uint8_t o = 0; o < mixer->out_channels; o++) {
+        int16_t* dst = out + o * stride;
+        uint8_t terms = mixer_terms(mixer, o, inputs, gains);
+
+        // Gains of one or more than one are only handled by the generic loop
+        int fits = 1;
+        for (uint8_t t = 0; t < terms; t++) {
+            q15[t] = mixer_gain_q15(gains[t]);
+            fits &= q15[t] > INT16_MIN && q15[t] <= INT16_MAX;
+        }
+
+        if (terms == 0) {
+            memset(dst, 0, sizeof(int16_t) * n);
+        } else if (terms == 1 && q15[0] == MIXER_Q15_ONE) {
+            for (size_t i = 0; i < n; i++) {
+                dst[i] = src[i * channels + inputs[0]];
+            }
+        } else if (channels == 2 && terms == 2 && fits) {
+            mixer_stereo_q15_kernel()(src, (int16_t)q15[0], (int16_t)q15[1], dst, n);
+        } else {
+            for (size_t i = 0; i < n; i++) {
+                const int16_t* frame = src + i * channels;
+                int64_t sum = MIXER_Q15_ONE / 2;
+                for (uint8_t t = 0; t < terms; t++) {
+                    sum += (int64_t)q15[t] * frame[inputs[t]];
+                }
+                sum >>= 15;
+                dst[i] = sum < INT16_MIN ? INT16_MIN : (sum > INT16_MAX ? INT16_MAX : (int16_t)sum);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,481 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "wav_decoder.h"
+#include "wav_encoder.h"
+#include "wav_queue.h"
+#include "wav_resampler.h"
+
+#define PIPELINE_SEGMENT_SIZE (256 * 1024)  // Input samples per job
+#define PIPELINE_JOBS_PER_WORKER 2          // Jobs in flight per worker
+
+// Chunk-parallel resampling
+//
+// A reader thread decodes the input and cuts it into segments of output
+// samples. Every job carries the input samples its segment needs, including
+// the overlap with the neighbouring segments that falls under the filter. The
+// workers resample jobs independently, each with its own resampler positioned
+// at the start of the segment, and a writer thread puts the results back in
+// order. Every output sample sees exactly the same input as in the serial
+// path, so the output is byte identical to wav_resample.
+
+typedef struct {
+    size_t sequence;
+    uint64_t first_output;
+    uint64_t end_output;
+    int is_last;  // The segment runs to the end of the stream, flush the resampler
+
+    WavData input;   // Decoded samples starting at the first input sample of the segment
+    WavData output;  // Resampled samples starting at first_output
+    WavData tail;    // Samples flushed out of the resampler for the last segment
+} PipelineJob;
+
+typedef struct {
+    WavDecoder* decoder;
+    WavEncoder* encoder;
+    WavResampler filter;  // Owns the filter bank, the workers share it
+
+    size_t nr_of_workers;
+    size_t nr_of_jobs;
+    PipelineJob* m_jobs;
+
+    WavQueue m_free;     // Writer -> reader, jobs that can be reused
+    WavQueue m_pending;  // Reader -> workers
+    WavQueue m_done;     // Workers -> writer, in any order
+
+    _Atomic size_t m_jobs_total;  // Known once the reader reached the end of the input
+    _Atomic int m_abort;
+
+    size_t total_samples;
+    size_t total_sampled_samples;
+
+    // All job buffers and the input window are carved out of one arena when the
+    // pipeline is set up, so the stages do not allocate while running
+    WavArena m_arena;
+    uint64_t m_segment;        // Output samples per segment
+    size_t m_span;             // Most input samples a segment needs
+    float* m_window;           // Decoded input the reader cuts the segments from
+    size_t m_window_capacity;  // In samples (frames)
+} WavPipeline;
+
+typedef struct {
+    WavPipeline* pipeline;
+    WavResampler resampler;
+} PipelineWorker;
+
+// Stop every stage, including the ones that are parked on a queue
+static void pipeline_fail(WavPipeline* pipeline) {
+    atomic_store(&pipeline->m_abort, 1);
+    wav_queue_wake(&pipeline->m_free);
+    wav_queue_wake(&pipeline->m_pending);
+    wav_queue_wake(&pipeline->m_done);
+}
+
+static void* pipeline_reader(void* arg) {
+    WavPipeline* pipeline = (WavPipeline*)arg;
+    WavDecoder* decoder = pipeline->decoder;
+    const WavResampler* filter = &pipeline->filter;
+    const uint8_t channels = decoder->header->num_of_channels;
+
+    uint64_t total_input = decoder->nr_of_samples;
+    uint64_t total_output = wav_resampler_output_size(filter, total_input);
+    const uint64_t segment = pipeline->m_segment;
+
+    // Decoded samples [window_start, window_start + window_length), interleaved
+    float* window = pipeline->m_window;
+    size_t window_capacity = pipeline->m_window_capacity;
+    int window_owned = 0;
+    size_t window_length = 0;
+    uint64_t window_start = 0;
+    int eof = 0;
+
+    for (size_t k = 0;; k++) {
+        uint64_t first_output = k * segment;
+        uint64_t end_output = first_output + segment;
+        uint64_t first_input, end_input;
+        wav_resampler_input_range(filter, first_output, end_output, &first_input, &end_input);
+
+        // Decode until the whole segment is available
+        while (!eof && window_start + window_length < end_input) {
+            int samples = wav_decoder_get_next_samples(decoder);
+            if (samples < 0) {
+                pipeline_fail(pipeline);
+                break;
+            }
+            if (samples == 0) {
+                eof = 1;
+                total_input = window_start + window_length;
+                break;
+            }
+
+            // The window is sized for a whole segment and a chunk, it only moves to
+            // the heap when the decoder hands out bigger chunks than that
+            size_t length = window_length + decoder->data->nr_of_samples;
+            if (length > window_capacity) {
+                float* grown = (float*)realloc(window_owned ? window : NULL, sizeof(float) * length * channels);
+                INSTRUMENT_COUNT(INSTRUMENT_ALLOCATIONS, 1);
+                if (grown == NULL) {
+                    fprintf(stderr, "[WavPipeline] Unable to allocate memory for the input window\n");
+                    pipeline_fail(pipeline);
+                    break;
+                }
+                if (!window_owned) {
+                    memcpy(grown, window, sizeof(float) * window_length * channels);
+                }
+                window = grown;
+                window_capacity = length;
+                window_owned = 1;
+            }
+
+            memcpy(window + window_length * channels, decoder->data->m_data, sizeof(float) * decoder->data->nr_of_samples * channels);
+            window_length = length;
+            pipeline->total_samples += decoder->data->nr_of_samples;
+        }
+
+        if (atomic_load(&pipeline->m_abort)) {
+            break;
+        }
+
+        // A segment that needs input beyond the end of the stream is the last one,
+        // it takes all remaining output samples with it
+        int is_last = end_input >= total_input || end_output >= total_output || eof;
+        if (end_input > total_input) {
+            end_input = total_input;
+        }
+
+        PipelineJob* job;
+        if (wav_queue_pop(&pipeline->m_free, (void**)&job, &pipeline->m_abort)) {
+            break;
+        }
+
+        size_t length = end_input > first_input ? (size_t)(end_input - first_input) : 0;
+        if (wav_data_reserve(&job->input, length, channels)) {
+            pipeline_fail(pipeline);
+            break;
+        }
+        job->input.layout = LAYOUT_INTERLEAVED;
+        memcpy(job->input.m_data, window + (first_input - window_start) * channels, sizeof(float) * length * channels);
+        job->input.nr_of_samples = length;
+
+        job->sequence = k;
+        job->first_output = first_output;
+        job->end_output = end_output;
+        job->is_last = is_last;
+
+        if (is_last) {
+            atomic_store(&pipeline->m_jobs_total, k + 1);
+        }
+
+        if (wav_queue_push(&pipeline->m_pending, job, &pipeline->m_abort) || is_last) {
+            break;
+        }
+
+        // Drop the samples the next segment does not need anymore
+        uint64_t next_first, next_end;
+        wav_resampler_input_range(filter, end_output, end_output, &next_first, &next_end);
+        if (next_first > window_start) {
+            size_t drop = (size_t)(next_first - window_start);
+            if (drop > window_length) {
+                drop = window_length;
+            }
+            memmove(window, window + drop * channels, sizeof(float) * (window_length - drop) * channels);
+            window_length -= drop;
+            window_start += drop;
+        }
+    }
+
+    // Tell every worker to stop
+    for (size_t i = 0; i < pipeline->nr_of_workers; i++) {
+        if (wav_queue_push(&pipeline->m_pending, NULL, &pipeline->m_abort)) {
+            break;
+        }
+    }
+
+    if (window_owned) {
+        free(window);
+    }
+
+    return NULL;
+}
+
+static void* pipeline_worker(void* arg) {
+    PipelineWorker* worker = (PipelineWorker*)arg;
+    WavPipeline* pipeline = worker->pipeline;
+
+    for (;;) {
+        PipelineJob* job;
+        if (wav_queue_pop(&pipeline->m_pending, (void**)&job, &pipeline->m_abort) || job == NULL) {
+            break;
+        }
+
+        wav_resampler_seek(&worker->resampler, job->first_output);
+
+        if (wav_resampler_process(&worker->resampler, &job->input, &job->output) < 0) {
+            pipeline_fail(pipeline);
+            break;
+        }
+
+        job->tail.nr_of_samples = 0;
+        if (job->is_last) {
+            if (wav_resampler_flush(&worker->resampler, &job->tail) < 0) {
+                pipeline_fail(pipeline);
+                break;
+            }
+        } else if (job->output.nr_of_samples > job->end_output - job->first_output) {
+            // The overlap can make a few more samples available, they belong to the next segment
+            job->output.nr_of_samples = job->end_output - job->first_output;
+        }
+
+        if (wav_queue_push(&pipeline->m_done, job, &pipeline->m_abort)) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+// Write samples to the encoder, it drops what goes past an announced length
+static int pipeline_write(WavPipeline* pipeline, WavData* data) {
+    if (wav_encoder_write_samples(pipeline->encoder, data)) {
+        return 1;
+    }
+    pipeline->total_sampled_samples += data->nr_of_samples;
+
+    return 0;
+}
+
+static void* pipeline_writer(void* arg) {
+    WavPipeline* pipeline = (WavPipeline*)arg;
+
+    // Finished jobs wait here until all jobs before them are written, there are
+    // never more than nr_of_jobs jobs in flight so their slots never collide
+    PipelineJob** ready = (PipelineJob**)calloc(pipeline->nr_of_jobs, sizeof(PipelineJob*));
+    if (ready == NULL) {
+        fprintf(stderr, "[WavPipeline] Unable to allocate memory for the reorder buffer\n");
+        pipeline_fail(pipeline);
+        return NULL;
+    }
+
+    size_t next = 0;
+    while (next < atomic_load(&pipeline->m_jobs_total)) {
+        PipelineJob* job;
+        if (wav_queue_pop(&pipeline->m_done, (void**)&job, &pipeline->m_abort)) {
+            break;
+        }
+        ready[job->sequence % pipeline->nr_of_jobs] = job;
+
+        while ((job = ready[next % pipeline->nr_of_jobs]) != NULL && job->sequence == next) {
+            ready[next % pipeline->nr_of_jobs] = NULL;
+
+            if (pipeline_write(pipeline, &job->output) || pipeline_write(pipeline, &job->tail)) {
+                pipeline_fail(pipeline);
+                break;
+            }
+
+            next++;
+            if (wav_queue_push(&pipeline->m_free, job, &pipeline->m_abort)) {
+                break;
+            }
+        }
+
+        if (atomic_load(&pipeline->m_abort)) {
+            break;
+        }
+    }
+
+    free(ready);
+
+    return NULL;
+}
+
+static void pipeline_close(WavPipeline* pipeline) {
+    if (pipeline->m_jobs) {
+        for (size_t i = 0; i < pipeline->nr_of_jobs; i++) {
+            wav_data_free(&pipeline->m_jobs[i].input);
+            wav_data_free(&pipeline->m_jobs[i].output);
+            wav_data_free(&pipeline->m_jobs[i].tail);
+        }
+        free(pipeline->m_jobs);
+    }
+
+    wav_queue_close(&pipeline->m_free);
+    wav_queue_close(&pipeline->m_pending);
+    wav_queue_close(&pipeline->m_done);
+    wav_resampler_close(&pipeline->filter);
+    wav_arena_close(&pipeline->m_arena);
+}
+
+// Size the arena for the input window and the buffers of every job. A segment
+// of S output samples needs at most (S - 1) * M / L + taps + 2 input samples,
+// the window additionally holds the chunk that was decoded past the segment
+static int pipeline_init_arena(WavPipeline* pipeline, uint8_t in_channels, uint8_t out_channels) {
+    const WavResampler* filter = &pipeline->filter;
+
+    // Output samples per segment, so a segment consumes about PIPELINE_SEGMENT_SIZE input samples
+    pipeline->m_segment = ((uint64_t)PIPELINE_SEGMENT_SIZE * filter->L) / filter->M;
+    if (pipeline->m_segment == 0) {
+        pipeline->m_segment = 1;
+    }
+
+    const size_t span = (size_t)((pipeline->m_segment - 1) * filter->M / filter->L) + filter->taps + 2;
+    const size_t outputs = (size_t)((uint64_t)span * filter->L / filter->M) + 2;
+    const size_t tail = (size_t)((uint64_t)filter->taps * filter->L / filter->M) + 2;
+    pipeline->m_span = span;
+    pipeline->m_window_capacity = span + DECODER_SAMPLE_SIZE;
+
+    size_t size = wav_arena_size(sizeof(float) * pipeline->m_window_capacity * in_channels);
+    size += pipeline->nr_of_jobs * (wav_arena_size(sizeof(float) * span * in_channels) +
+                                    wav_arena_size(sizeof(float) * outputs * out_channels) +
+                                    wav_arena_size(sizeof(float) * tail * out_channels));
+    if (wav_arena_init(&pipeline->m_arena, size)) {
+        return 1;
+    }
+
+    pipeline->m_window = (float*)wav_arena_alloc(&pipeline->m_arena, sizeof(float) * pipeline->m_window_capacity * in_channels);
+    if (pipeline->m_window == NULL) {
+        return 1;
+    }
+
+    for (size_t i = 0; i < pipeline->nr_of_jobs; i++) {
+        PipelineJob* job = &pipeline->m_jobs[i];
+        if (wav_data_init_arena(&job->input, &pipeline->m_arena, span, in_channels) ||
+            wav_data_init_arena(&job->output, &pipeline->m_arena, outputs, out_channels) ||
+            wav_data_init_arena(&job->tail, &pipeline->m_arena, tail, out_channels)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int pipeline_init(WavPipeline* pipeline, WavDecoder* decoder, WavEncoder* encoder, const WavMixer* mixer, size_t workers) {
+    memset(pipeline, 0, sizeof(WavPipeline));
+    pipeline->decoder = decoder;
+    pipeline->encoder = encoder;
+    pipeline->nr_of_workers = workers;
+    pipeline->nr_of_jobs = workers * PIPELINE_JOBS_PER_WORKER + 2;
+    atomic_init(&pipeline->m_jobs_total, SIZE_MAX);
+    atomic_init(&pipeline->m_abort, 0);
+
+    if (wav_resampler_init(&pipeline->filter, decoder->header->sample_rate, encoder->header->sample_rate,
+                           encoder->header->num_of_channels)) {
+        return 1;
+    }
+
+    // The workers copy the mixer together with the filter bank
+    if (mixer && wav_resampler_set_mixer(&pipeline->filter, mixer)) {
+        return 1;
+    }
+
+    // The pending queue also holds a stop marker for every worker
+    if (wav_queue_init(&pipeline->m_free, pipeline->nr_of_jobs) ||
+        wav_queue_init(&pipeline->m_pending, pipeline->nr_of_jobs + workers) ||
+        wav_queue_init(&pipeline->m_done, pipeline->nr_of_jobs)) {
+        return 1;
+    }
+
+    pipeline->m_jobs = (PipelineJob*)malloc(sizeof(PipelineJob) * pipeline->nr_of_jobs);
+    if (pipeline->m_jobs == NULL) {
+        fprintf(stderr, "[WavPipeline] Unable to allocate memory for %zu jobs\n", pipeline->nr_of_jobs);
+        return 1;
+    }
+
+    for (size_t i = 0; i < pipeline->nr_of_jobs; i++) {
+        wav_data_init(&pipeline->m_jobs[i].input);
+        wav_data_init(&pipeline->m_jobs[i].output);
+        wav_data_init(&pipeline->m_jobs[i].tail);
+        wav_queue_try_push(&pipeline->m_free, &pipeline->m_jobs[i]);
+    }
+
+    return pipeline_init_arena(pipeline, (uint8_t)decoder->header->num_of_channels, (uint8_t)encoder->header->num_of_channels);
+}
+
+// Resample the decoder into the encoder like wav_resample with RESAMPLE_POLYPHASE,
+// using a reader, 'workers' worker threads and a writer thread. The channels
+// are mapped with 'mixer', or the default mapping when it is NULL
+static inline int wav_resample_parallel(WavDecoder* decoder, WavEncoder* encoder, const WavMixer* mixer, size_t workers) {
+    if (workers == 0) {
+        workers = 1;
+    }
+
+    WavPipeline pipeline;
+    if (pipeline_init(&pipeline, decoder, encoder, mixer, workers)) {
+        pipeline_close(&pipeline);
+        return 1;
+    }
+
+    // Write the header
+    if (wav_encoder_write_header(encoder)) {
+        pipeline_close(&pipeline);
+        return 1;
+    }
+
+    if (wav_decoder_is_unbounded(decoder)) {
+        printf("Reading samples until the stream ends\n");
+    } else {
+        printf("There are %zu samples to get\n", decoder->nr_of_samples);
+    }
+    printf("Resampling %u Hz to %u Hz on %zu worker threads (L = %u, M = %u, %u taps per phase)\n", pipeline.filter.in_rate,
+           pipeline.filter.out_rate, workers, pipeline.filter.L, pipeline.filter.M, pipeline.filter.taps);
+
+    PipelineWorker* states = (PipelineWorker*)calloc(workers, sizeof(PipelineWorker));
+    pthread_t* threads = (pthread_t*)calloc(workers + 2, sizeof(pthread_t));
+    if (states == NULL || threads == NULL) {
+        fprintf(stderr, "[WavPipeline] Unable to allocate memory for %zu workers\n", workers);
+        free(states);
+        free(threads);
+        pipeline_close(&pipeline);
+        return 1;
+    }
+
+    size_t started = 0;
+    for (size_t i = 0; i < workers; i++) {
+        states[i].pipeline = &pipeline;
+        if (wav_resampler_init_shared(&states[i].resampler, &pipeline.filter) ||
+            wav_resampler_reserve(&states[i].resampler, pipeline.m_span) ||
+            pthread_create(&threads[started], NULL, pipeline_worker, &states[i])) {
+            pipeline_fail(&pipeline);
+            break;
+        }
+        started++;
+    }
+
+    if (!atomic_load(&pipeline.m_abort) && pthread_create(&threads[started], NULL, pipeline_reader, &pipeline) == 0) {
+        started++;
+    } else {
+        pipeline_fail(&pipeline);
+    }
+
+    if (!atomic_load(&pipeline.m_abort) && pthread_create(&threads[started], NULL, pipeline_writer, &pipeline) == 0) {
+        started++;
+    } else {
+        pipeline_fail(&pipeline);
+    }
+
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (size_t i = 0; i < workers; i++) {
+        wav_resampler_close(&states[i].resampler);
+    }
+    free(states);
+    free(threads);
+
+    int failed = atomic_load(&pipeline.m_abort);
+    if (failed) {
+        fprintf(stderr, "[WavPipeline] Resampling failed\n");
+    }
+
+    if (wav_decoder_is_unbounded(decoder)) {
+        printf("Total samples processed: %zu\n", pipeline.total_samples);
+    } else {
+        printf("Total samples processed: %zu/%zu\n", pipeline.total_samples, decoder->nr_of_samples);
+    }
+    printf("Total sampled samples: %zu\n", pipeline.total_sampled_samples);
+
+    pipeline_close(&pipeline);
+
+    return failed;
+}
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define QUEUE_CACHE_LINE 64
+#define QUEUE_SPINS 64  // Busy tries before a waiting thread parks
+
+// Bounded lock-free multi producer / multi consumer queue of pointers
+//
+// Every cell carries a sequence number telling producers and consumers whose
+// turn it is, so a push or pop is a single compare-and-swap on the shared
+// position plus a store to the cell (D. Vyukov's bounded MPMC queue).
+//
+// A thread that has to wait spins a little and then parks on a condition
+// variable, so a pipeline that waits for slow input does not hold on to the
+// CPUs. The mutex is only taken when a thread is parked: a push or pop checks
+// the amount of parked threads and only then wakes them up.
+typedef struct {
+    _Atomic size_t m_sequence;
+    void* m_data;
+} WavQueueCell;
+
+typedef struct {
+    WavQueueCell* m_cells;
+    size_t m_mask;
+
+    _Alignas(QUEUE_CACHE_LINE) _Atomic size_t m_enqueue;
+    _Alignas(QUEUE_CACHE_LINE) _Atomic size_t m_dequeue;
+
+    // Producers waiting for room and consumers waiting for items park here
+    _Alignas(QUEUE_CACHE_LINE) _Atomic int m_waiters;
+    pthread_mutex_t m_lock;
+    pthread_cond_t m_changed;
+} WavQueue;
+
+// Initialize the queue, the capacity is rounded up to a power of two
+static inline int wav_queue_init(WavQueue* queue, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    queue->m_cells = (WavQueueCell*)malloc(sizeof(WavQueueCell) * size);
+    if (queue->m_cells == NULL) {
+        fprintf(stderr, "[WavQueue] Unable to allocate memory for %zu cells\n", size);
+        return 1;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&queue->m_cells[i].m_sequence, i);
+        queue->m_cells[i].m_data = NULL;
+    }
+
+    queue->m_mask = size - 1;
+    atomic_init(&queue->m_enqueue, 0);
+    atomic_init(&queue->m_dequeue, 0);
+    atomic_init(&queue->m_waiters, 0);
+    pthread_mutex_init(&queue->m_lock, NULL);
+    pthread_cond_init(&queue->m_changed, NULL);
+
+    return 0;
+}
+
+static inline void wav_queue_close(WavQueue* queue) {
+    if (queue->m_cells) {
+        pthread_mutex_destroy(&queue->m_lock);
+        pthread_cond_destroy(&queue->m_changed);
+    }
+    free(queue->m_cells);
+    queue->m_cells = NULL;
+}
+
+// Wake up every parked thread, so they see a change of the abort flag
+static inline void wav_queue_wake(WavQueue* queue) {
+    if (queue->m_cells == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&queue->m_lock);
+    pthread_cond_broadcast(&queue->m_changed);
+    pthread_mutex_unlock(&queue->m_lock);
+}
+
+// Wake up the parked threads after a push or pop. The fence orders the cell
+// that was just published before the check of the waiters, a waiter registers
+// before it tries again, so either it sees the change or it is woken up
+static inline void queue_notify(WavQueue* queue) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&queue->m_waiters, memory_order_relaxed)) {
+        wav_queue_wake(queue);
+    }
+}
+
+// Returns 1 when the item was added, 0 when the queue is full
+static inline int wav_queue_try_push(WavQueue* queue, void* data) {
+    size_t position = atomic_load_explicit(&queue->m_enqueue, memory_order_relaxed);
+
+    for (;;) {
+        WavQueueCell* cell = &queue->m_cells[position & queue->m_mask];
+        size_t sequence = atomic_load_explicit(&cell->m_sequence, memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t)sequence - (ptrdiff_t)position;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->m_enqueue, &position, position + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                cell->m_data = data;
+                atomic_store_explicit(&cell->m_sequence, position + 1, memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            position = atomic_load_explicit(&queue->m_enqueue, memory_order_relaxed);
+        }
+    }
+}
+
+// Returns 1 when an item was taken, 0 when the queue is empty
+static inline int wav_queue_try_pop(WavQueue* queue, void** data) {
+    size_t position = atomic_load_explicit(&queue->m_dequeue, memory_order_relaxed);
+
+    for (;;) {
+        WavQueueCell* cell = &queue->m_cells[position & queue->m_mask];
+        size_t sequence = atomic_load_explicit(&cell->m_sequence, memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t)sequence - (ptrdiff_t)(position + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->m_dequeue, &position, position + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                *data = cell->m_data;
+                atomic_store_explicit(&cell->m_sequence, position + queue->m_mask + 1, memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            position = atomic_load_explicit(&queue->m_dequeue, memory_order_relaxed);
+        }
+    }
+}
+
+// Push and wait while the queue is full, parking after QUEUE_SPINS tries.
+// Gives up (returns 1) when 'abort' is set, see wav_queue_wake
+static inline int wav_queue_push(WavQueue* queue, void* data, _Atomic int* abort) {
+    for (unsigned spins = 0; !wav_queue_try_push(queue, data); spins++) {
+        if (atomic_load_explicit(abort, memory_order_relaxed)) {
+            return 1;
+        }
+        if (spins < QUEUE_SPINS) {
+            continue;
+        }
+
+        int pushed;
+        atomic_fetch_add(&queue->m_waiters, 1);
+        pthread_mutex_lock(&queue->m_lock);
+        while (!(pushed = wav_queue_try_push(queue, data)) && !atomic_load(abort)) {
+            pthread_cond_wait(&queue->m_changed, &queue->m_lock);
+        }
+        pthread_mutex_unlock(&queue->m_lock);
+        atomic_fetch_sub(&queue->m_waiters, 1);
+
+        if (!pushed) {
+            return 1;
+        }
+        break;
+    }
+
+    queue_notify(queue);
+    return 0;
+}
+
+// Pop and wait while the queue is empty, parking after QUEUE_SPINS tries.
+// Gives up (returns 1) when 'abort' is set, see wav_queue_wake
+static inline int wav_queue_pop(WavQueue* queue, void** data, _Atomic int* abort) {
+    for (unsigned spins = 0; !wav_queue_try_pop(queue, data); spins++) {
+        if (atomic_load_explicit(abort, memory_order_relaxed)) {
+            return 1;
+        }
+        if (spins < QUEUE_SPINS) {
+            continue;
+        }
+
+        int popped;
+        atomic_fetch_add(&queue->m_waiters, 1);
+        pthread_mutex_lock(&queue->m_lock);
+        while (!(popped = wav_queue_try_pop(queue, data)) && !atomic_load(abort)) {
+            pthread_cond_wait(&queue->m_changed, &queue->m_lock);
+        }
+        pthread_mutex_unlock(&queue->m_lock);
+        atomic_fetch_sub(&queue->m_waiters, 1);
+
+        if (!popped) {
+            return 1;
+        }
+        break;
+    }
+
+    queue_notify(queue);
+    return 0;
+}
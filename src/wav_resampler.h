@@ -0,0 +1,671 @@
+#pragma once
+
+#include <math.h>
+
+#include "wav.h"
+#include "wav_mixer.h"
+
+// Zero crossings of the prototype filter on each side of its center, measured
+// at the lower of the two rates. More crossings give a steeper transition band
+#define RESAMPLER_ZERO_CROSSINGS 16
+// Cutoff as a fraction of the Nyquist frequency of the lower rate
+#define RESAMPLER_CUTOFF 0.95
+// Kaiser window shape, 8.6 gives roughly 90 dB of stopband attenuation
+#define RESAMPLER_KAISER_BETA 8.6
+
+// Polyphase FIR resampler for a rational ratio L/M
+//
+// Conceptually the input is upsampled by L (zero stuffing), low pass filtered and
+// decimated by M. Only the filter taps that hit non-zero input samples for the
+// output samples that are kept are evaluated, so every output sample costs
+// 'taps' multiply-adds and the upsampled signal is never materialized.
+//
+// The resampler is a streaming context: input is pushed chunk by chunk, the
+// samples still under the filter are kept in a history and the output position
+// carries over, so the output does not depend on how the input was chunked.
+//
+// Pushed input is mapped to the output channels by a WavMixer on the way into
+// the history, so a downmix costs no extra pass over the data.
+//
+// 16 bit streams can be resampled in fixed point instead, see
+// wav_resampler_init_fixed. The filter bank is quantized to Q15 and every
+// output sample is an integer dot product that is rounded and saturated.
+typedef int32_t (*ResamplerDotQ15)(const int16_t* coefficients, const int16_t* x, uint32_t taps);
+
+typedef struct {
+    uint32_t in_rate;
+    uint32_t out_rate;
+    uint32_t L;     // Interpolation factor
+    uint32_t M;     // Decimation factor
+    uint32_t taps;  // Taps per phase
+    uint8_t channels;
+
+    // L phases of 'taps' coefficients, phase p at m_coefficients[p * taps]. The
+    // taps of a phase are stored reversed so they line up with ascending input
+    float* m_coefficients;
+    int m_owns_coefficients;  // Zero when the filter bank is shared with another resampler
+
+    // Planar input history, channel c at m_history[c * m_history_capacity]
+    float* m_history;
+    size_t m_history_capacity;
+    size_t m_history_length;
+    uint64_t m_history_start;  // Input index of the first sample in the history
+    uint64_t m_input_total;    // Amount of input samples pushed so far
+    uint64_t m_output_total;   // Amount of output samples produced so far
+
+    float* m_window;  // Zero padded filter input at the start and end of the stream
+
+    // Without a custom mixer the default mapping for the input is set up on the first push
+    WavMixer mixer;
+    int m_custom_mixer;
+
+    // Fixed point path, laid out like the float filter bank, history and window
+    int16_t* m_coefficients_q15;
+    int16_t* m_history_q15;
+    size_t m_history_q15_capacity;
+    int16_t* m_window_q15;
+    uint8_t m_shift_q15;  // Fraction bits of the coefficients, below 15 when a phase could overflow 32 bits
+    ResamplerDotQ15 m_dot_q15;
+} WavResampler;
+
+static uint32_t resampler_gcd(uint32_t a, uint32_t b) {
+    while (b != 0) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Zeroth order modified Bessel function of the first kind, used by the Kaiser window
+static double resampler_bessel_i0(double x) {
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 50; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12) {
+            break;
+        }
+    }
+    return sum;
+}
+
+static inline void wav_resampler_close(WavResampler* resampler) {
+    if (resampler->m_owns_coefficients) {
+        free(resampler->m_coefficients);
+        free(resampler->m_coefficients_q15);
+    }
+    free(resampler->m_history);
+    free(resampler->m_window);
+    free(resampler->m_history_q15);
+    free(resampler->m_window_q15);
+    resampler->m_coefficients = NULL;
+    resampler->m_history = NULL;
+    resampler->m_window = NULL;
+    resampler->m_coefficients_q15 = NULL;
+    resampler->m_history_q15 = NULL;
+    resampler->m_window_q15 = NULL;
+}
+
+// Forget all pushed input so a new stream can be resampled with the same filter
+static inline void wav_resampler_reset(WavResampler* resampler) {
+    resampler->m_history_length = 0;
+    resampler->m_history_start = 0;
+    resampler->m_input_total = 0;
+    resampler->m_output_total = 0;
+}
+
+// Design the polyphase filter bank for converting in_rate to out_rate for the
+// given amount of channels
+static inline int wav_resampler_init(WavResampler* resampler, uint32_t in_rate, uint32_t out_rate, uint8_t channels) {
+    resampler->m_coefficients = NULL;
+    resampler->m_owns_coefficients = 1;
+    resampler->m_history = NULL;
+    resampler->m_history_capacity = 0;
+    resampler->m_window = NULL;
+    resampler->m_coefficients_q15 = NULL;
+    resampler->m_history_q15 = NULL;
+    resampler->m_history_q15_capacity = 0;
+    resampler->m_window_q15 = NULL;
+    resampler->channels = channels;
+    resampler->mixer.in_channels = 0;
+    resampler->m_custom_mixer = 0;
+    wav_resampler_reset(resampler);
+
+    if (in_rate == 0 || out_rate == 0) {
+        fprintf(stderr, "[WavResampler] Invalid sample rates %u -> %u\n", in_rate, out_rate);
+        return 1;
+    }
+
+    uint32_t gcd = resampler_gcd(in_rate, out_rate);
+    resampler->in_rate = in_rate;
+    resampler->out_rate = out_rate;
+    resampler->L = out_rate / gcd;
+    resampler->M = in_rate / gcd;
+
+    // When decimating the filter gets narrower, so more input samples are needed
+    // to cover the same amount of zero crossings
+    double ratio = in_rate > out_rate ? (double)in_rate / out_rate : 1.0;
+    uint32_t taps = (uint32_t)ceil(2.0 * RESAMPLER_ZERO_CROSSINGS * ratio);
+    taps += taps & 1;
+    resampler->taps = taps;
+
+    const uint32_t L = resampler->L;
+    const size_t length = (size_t)L * taps;
+
+    resampler->m_coefficients = (float*)malloc(sizeof(float) * length);
+    resampler->m_window = (float*)malloc(sizeof(float) * taps);
+    if (resampler->m_coefficients == NULL || resampler->m_window == NULL) {
+        fprintf(stderr, "[WavResampler] Unable to allocate memory for %zu filter coefficients\n", length);
+        return 1;
+    }
+
+    // Cutoff normalized to the upsampled rate (in_rate * L)
+    double lower = in_rate < out_rate ? in_rate : out_rate;
+    double fc = RESAMPLER_CUTOFF * 0.5 * lower / ((double)in_rate * L);
+    double center = length / 2.0;
+    double window_norm = resampler_bessel_i0(RESAMPLER_KAISER_BETA);
+
+    double* prototype = (double*)malloc(sizeof(double) * length);
+    if (prototype == NULL) {
+        fprintf(stderr, "[WavResampler] Unable to allocate memory for the prototype filter\n");
+        wav_resampler_close(resampler);
+        return 1;
+    }
+
+    double sum = 0;
+    for (size_t j = 0; j < length; j++) {
+        double x = j - center;
+        double sinc = x == 0 ? 1.0 : sin(2.0 * M_PI * fc * x) / (2.0 * M_PI * fc * x);
+        double r = x / center;
+        double window = r * r < 1.0 ? resampler_bessel_i0(RESAMPLER_KAISER_BETA * sqrt(1.0 - r * r)) / window_norm : 0.0;
+        prototype[j] = 2.0 * fc * sinc * window;
+        sum += prototype[j];
+    }
+
+    // Every phase sees one out of L taps, scale so the passband gain is one
+    for (uint32_t p = 0; p < L; p++) {
+        for (uint32_t k = 0; k < taps; k++) {
+            resampler->m_coefficients[(size_t)p * taps + (taps - 1 - k)] = (float)(prototype[p + (size_t)k * L] * L / sum);
+        }
+    }
+
+    free(prototype);
+
+    return 0;
+}
+
+static inline float resampler_dot(const float* coefficients, const float* x, uint32_t taps) {
+    float sum = 0;
+    for (uint32_t i = 0; i < taps; i++) {
+        sum += coefficients[i] * x[i];
+    }
+    return sum;
+}
+
+// Filter position of output sample n on the upsampled grid, the filter is
+// centered so output n lines up with input position n * M / L
+static inline uint64_t resampler_position(const WavResampler* resampler, uint64_t n) {
+    return n * resampler->M + (uint64_t)resampler->L * resampler->taps / 2;
+}
+
+// Input index of the first sample under the filter for output sample n, can be
+// negative at the start of the stream
+static inline int64_t resampler_first_input(const WavResampler* resampler, uint64_t n) {
+    return (int64_t)(resampler_position(resampler, n) / resampler->L) - resampler->taps + 1;
+}
+
+// Initialize a resampler that uses the filter bank of 'filter' without copying
+// it, 'filter' has to outlive the new resampler. Every thread needs its own
+// resampler for the history, the coefficients are only read
+static inline int wav_resampler_init_shared(WavResampler* resampler, const WavResampler* filter) {
+    *resampler = *filter;
+    resampler->m_owns_coefficients = 0;
+    resampler->m_history = NULL;
+    resampler->m_history_capacity = 0;
+    resampler->m_history_q15 = NULL;
+    resampler->m_history_q15_capacity = 0;
+    resampler->m_window_q15 = NULL;
+    wav_resampler_reset(resampler);
+
+    resampler->m_window = (float*)malloc(sizeof(float) * resampler->taps);
+    if (resampler->m_coefficients_q15) {
+        resampler->m_window_q15 = (int16_t*)malloc(sizeof(int16_t) * resampler->taps);
+    }
+    if (resampler->m_window == NULL || (resampler->m_coefficients_q15 && resampler->m_window_q15 == NULL)) {
+        fprintf(stderr, "[WavResampler] Unable to allocate memory for the filter window\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+// Map the input channels with 'mixer' instead of the default mapping, the
+// mixer needs to produce the channels of the resampler
+static inline int wav_resampler_set_mixer(WavResampler* resampler, const WavMixer* mixer) {
+    if (mixer->out_channels != resampler->channels) {
+        fprintf(stderr, "[WavResampler] The mixer produces %d channels instead of %d\n", mixer->out_channels, resampler->channels);
+        return 1;
+    }
+
+    resampler->mixer = *mixer;
+    resampler->m_custom_mixer = 1;
+
+    return 0;
+}
+
+// Input samples [first_input, end_input) are needed to compute the output
+// samples [first_output, end_output), not clamped to the end of the stream
+static inline void wav_resampler_input_range(const WavResampler* resampler, uint64_t first_output, uint64_t end_output,
+                                             uint64_t* first_input, uint64_t* end_input) {
+    int64_t first = resampler_first_input(resampler, first_output);
+    *first_input = first > 0 ? (uint64_t)first : 0;
+    *end_input = end_output > first_output ? resampler_position(resampler, end_output - 1) / resampler->L + 1 : *first_input;
+}
+
+// Continue the stream at output sample 'output', dropping the history. The
+// next pushed input sample has to be the first input sample of
+// wav_resampler_input_range for this output sample
+static inline void wav_resampler_seek(WavResampler* resampler, uint64_t output) {
+    uint64_t first, end;
+    wav_resampler_input_range(resampler, output, output, &first, &end);
+
+    resampler->m_history_length = 0;
+    resampler->m_history_start = first;
+    resampler->m_input_total = first;
+    resampler->m_output_total = output;
+}
+
+// Amount of output samples for a stream of the given amount of input samples
+static inline uint64_t wav_resampler_output_size(const WavResampler* resampler, uint64_t input_samples) {
+    return (input_samples * resampler->L + resampler->M - 1) / resampler->M;
+}
+
+// Compute output samples [m_output_total, end) into 'out' (interleaved), input
+// outside of [0, m_input_total) is treated as silence
+static inline void resampler_produce(WavResampler* resampler, uint64_t end, float* out) {
+    const uint32_t taps = resampler->taps;
+    const uint8_t channels = resampler->channels;
+    const int64_t history_start = (int64_t)resampler->m_history_start;
+    const int64_t history_end = history_start + (int64_t)resampler->m_history_length;
+
+    for (uint64_t n = resampler->m_output_total; n < end; n++, out += channels) {
+        const float* coefficients = resampler->m_coefficients + (resampler_position(resampler, n) % resampler->L) * taps;
+        int64_t first = resampler_first_input(resampler, n);
+
+        for (uint8_t c = 0; c < channels; c++) {
+            const float* history = resampler->m_history + c * resampler->m_history_capacity;
+
+            if (first >= history_start && first + taps <= history_end) {
+                out[c] = resampler_dot(coefficients, history + (first - history_start), taps);
+                continue;
+            }
+
+            // Partially outside of the stream, pad with silence. The same dot
+            // product is used so the result does not depend on the chunking
+            for (uint32_t i = 0; i < taps; i++) {
+                int64_t index = first + i;
+                resampler->m_window[i] = index >= history_start && index < history_end ? history[index - history_start] : 0.0f;
+            }
+            out[c] = resampler_dot(coefficients, resampler->m_window, taps);
+        }
+    }
+
+    resampler->m_output_total = end;
+}
+
+static inline int resampler_reserve_output(WavData* out, uint64_t outputs, uint8_t channels) {
+    if (wav_data_reserve(out, outputs, channels)) {
+        return 1;
+    }
+    out->layout = LAYOUT_INTERLEAVED;
+    out->nr_of_samples = outputs;
+    return 0;
+}
+
+// Forget the history that no future output sample needs, returns the amount of
+// samples that have to be dropped from the front of every history channel
+static inline size_t resampler_drop(WavResampler* resampler) {
+    int64_t keep = resampler_first_input(resampler, resampler->m_output_total);
+    if (keep <= (int64_t)resampler->m_history_start) {
+        return 0;
+    }
+
+    size_t drop = (size_t)(keep - (int64_t)resampler->m_history_start);
+    if (drop > resampler->m_history_length) {
+        drop = resampler->m_history_length;
+    }
+    resampler->m_history_length -= drop;
+    resampler->m_history_start += drop;
+
+    return drop;
+}
+
+// End of the output samples whose filter is completely covered by the pushed input
+static inline uint64_t resampler_covered_end(const WavResampler* resampler) {
+    uint64_t available = (uint64_t)resampler->m_input_total * resampler->L;
+    uint64_t center = (uint64_t)resampler->L * resampler->taps / 2;
+    uint64_t end = available > center ? (available - center + resampler->M - 1) / resampler->M : 0;
+    return end > resampler->m_output_total ? end : resampler->m_output_total;
+}
+
+// Make room in the history for pushing 'samples' input samples at once, the
+// history then never has to grow for chunks of up to that size
+static inline int wav_resampler_reserve(WavResampler* resampler, size_t samples) {
+    const uint8_t channels = resampler->channels;
+    size_t length = resampler->m_history_length + samples;
+    if (length <= resampler->m_history_capacity) {
+        return 0;
+    }
+
+    size_t capacity = length + resampler->taps;
+    float* history = (float*)malloc(sizeof(float) * capacity * channels);
+    INSTRUMENT_COUNT(INSTRUMENT_ALLOCATIONS, 1);
+    if (history == NULL) {
+        fprintf(stderr, "[WavResampler] Unable to allocate memory for the filter history\n");
+        return 1;
+    }
+
+    for (uint8_t c = 0; c < channels && resampler->m_history_length; c++) {
+        memcpy(history + c * capacity, resampler->m_history + c * resampler->m_history_capacity,
+               sizeof(float) * resampler->m_history_length);
+    }
+
+    free(resampler->m_history);
+    resampler->m_history = history;
+    resampler->m_history_capacity = capacity;
+
+    return 0;
+}
+
+// Push the samples in 'in' and write every output sample that can be computed
+// so far into 'out'. Returns the amount of output samples or -1 on failure
+static inline int wav_resampler_process(WavResampler* resampler, WavData* in, WavData* out) {
+    INSTRUMENT_START(start);
+    const uint8_t channels = resampler->channels;
+    if (resampler->mixer.in_channels != in->nr_of_channels && !resampler->m_custom_mixer &&
+        wav_mixer_init(&resampler->mixer, in->nr_of_channels, channels)) {
+        return -1;
+    }
+
+    // Drop the history that no future output sample needs
+    size_t drop = resampler_drop(resampler);
+    for (uint8_t c = 0; c < channels && drop; c++) {
+        float* history = resampler->m_history + c * resampler->m_history_capacity;
+        memmove(history, history + drop, sizeof(float) * resampler->m_history_length);
+    }
+
+    // Grow the history, this only happens for the first chunks
+    size_t length = resampler->m_history_length + in->nr_of_samples;
+    if (length > resampler->m_history_capacity && wav_resampler_reserve(resampler, in->nr_of_samples)) {
+        return -1;
+    }
+
+    // Append the new samples, mapped to the output channels
+    if (wav_mixer_process(&resampler->mixer, in, resampler->m_history + resampler->m_history_length, resampler->m_history_capacity)) {
+        return -1;
+    }
+    resampler->m_history_length = length;
+    resampler->m_input_total += in->nr_of_samples;
+
+    uint64_t end = resampler_covered_end(resampler);
+    if (resampler_reserve_output(out, end - resampler->m_output_total, channels)) {
+        return -1;
+    }
+    resampler_produce(resampler, end, out->m_data);
+
+    INSTRUMENT_STOP(INSTRUMENT_RESAMPLE, start);
+    INSTRUMENT_COUNT(INSTRUMENT_SAMPLES_RESAMPLED, out->nr_of_samples);
+    return out->nr_of_samples;
+}
+
+// Write the output samples that still depend on input after the end of the
+// stream into 'out'. Returns the amount of output samples or -1 on failure
+static inline int wav_resampler_flush(WavResampler* resampler, WavData* out) {
+    INSTRUMENT_START(start);
+    uint64_t end = wav_resampler_output_size(resampler, resampler->m_input_total);
+    if (end < resampler->m_output_total) {
+        end = resampler->m_output_total;
+    }
+
+    if (resampler_reserve_output(out, end - resampler->m_output_total, resampler->channels)) {
+        return -1;
+    }
+    resampler_produce(resampler, end, out->m_data);
+
+    INSTRUMENT_STOP(INSTRUMENT_RESAMPLE, start);
+    INSTRUMENT_COUNT(INSTRUMENT_SAMPLES_RESAMPLED, out->nr_of_samples);
+    return out->nr_of_samples;
+}
+
+// Fixed point path
+//
+// Products of Q15 coefficients and 16 bit samples are summed in 32 bits. The
+// coefficients get fewer fraction bits when the absolute sum of a phase could
+// overflow that, so no order of summation can overflow and the SIMD kernels
+// produce exactly the same output as the scalar one.
+
+static inline int32_t resampler_dot_q15_scalar(const int16_t* coefficients, const int16_t* x, uint32_t taps) {
+    int32_t sum = 0;
+    for (uint32_t i = 0; i < taps; i++) {
+        sum += coefficients[i] * x[i];
+    }
+    return sum;
+}
+
+#ifdef PCM_X86
+
+static inline int32_t resampler_dot_q15_sse2(const int16_t* coefficients, const int16_t* x, uint32_t taps) {
+    __m128i acc = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; i + 8 <= taps; i += 8) {
+        __m128i c = _mm_loadu_si128((const __m128i*)(coefficients + i));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(c, _mm_loadu_si128((const __m128i*)(x + i))));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(acc) + resampler_dot_q15_scalar(coefficients + i, x + i, taps - i);
+}
+
+__attribute__((target("avx2"))) static inline int32_t resampler_dot_q15_avx2(const int16_t* coefficients, const int16_t* x,
+                                                                             uint32_t taps) {
+    __m256i acc = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (; i + 16 <= taps; i += 16) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)(coefficients + i));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(c, _mm256_loadu_si256((const __m256i*)(x + i))));
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum) + resampler_dot_q15_scalar(coefficients + i, x + i, taps - i);
+}
+
+#endif
+
+static inline ResamplerDotQ15 resampler_dot_q15_kernel(void) {
+#ifdef PCM_X86
+    enum PcmCpuLevel level = pcm_cpu_level();
+    if (level == PCM_CPU_AVX2) {
+        return resampler_dot_q15_avx2;
+    }
+    if (level == PCM_CPU_SSE2) {
+        return resampler_dot_q15_sse2;
+    }
+#endif
+    return resampler_dot_q15_scalar;
+}
+
+// Quantize the filter bank for wav_resampler_process_fixed, this only does work
+// the first time. The float path keeps working on the same resampler
+static inline int wav_resampler_init_fixed(WavResampler* resampler) {
+    if (resampler->m_coefficients_q15) {
+        return 0;
+    }
+    if (!resampler->m_owns_coefficients) {
+        fprintf(stderr, "[WavResampler] The fixed point filter bank has to be set up on the resampler that owns it\n");
+        return 1;
+    }
+
+    const uint32_t taps = resampler->taps;
+    const size_t length = (size_t)resampler->L * taps;
+    resampler->m_coefficients_q15 = (int16_t*)malloc(sizeof(int16_t) * length);
+    resampler->m_window_q15 = (int16_t*)malloc(sizeof(int16_t) * taps);
+    if (resampler->m_coefficients_q15 == NULL || resampler->m_window_q15 == NULL) {
+        fprintf(stderr, "[WavResampler] Unable to allocate memory for %zu fixed point coefficients\n", length);
+        return 1;
+    }
+
+    // A full scale input times the absolute sum of a phase (plus the rounding of
+    // every coefficient and of the result) has to fit in 32 bits
+    double largest = 0;
+    for (size_t p = 0; p < resampler->L; p++) {
+        double sum = 0;
+        for (uint32_t k = 0; k < taps; k++) {
+            sum += fabs(resampler->m_coefficients[p * taps + k]);
+        }
+        largest = sum > largest ? sum : largest;
+    }
+
+    uint8_t shift = 15;
+    while (shift > 1 && (largest * (1 << shift) + taps + 1) * 32768.0 >= 2147483648.0) {
+        shift--;
+    }
+
+    for (size_t j = 0; j < length; j++) {
+        long q = lrint(resampler->m_coefficients[j] * (1 << shift));
+        resampler->m_coefficients_q15[j] = q < -INT16_MAX ? -INT16_MAX : (q > INT16_MAX ? INT16_MAX : (int16_t)q);
+    }
+
+    resampler->m_shift_q15 = shift;
+    resampler->m_dot_q15 = resampler_dot_q15_kernel();
+
+    return 0;
+}
+
+// Fixed point version of wav_resampler_reserve
+static inline int wav_resampler_reserve_fixed(WavResampler* resampler, size_t samples) {
+    const uint8_t channels = resampler->channels;
+    size_t length = resampler->m_history_length + samples;
+    if (length <= resampler->m_history_q15_capacity) {
+        return 0;
+    }
+
+    size_t capacity = length + resampler->taps;
+    int16_t* history = (int16_t*)malloc(sizeof(int16_t) * capacity * channels);
+    INSTRUMENT_COUNT(INSTRUMENT_ALLOCATIONS, 1);
+    if (history == NULL) {
+        fprintf(stderr, "[WavResampler] Unable to allocate memory for the filter history\n");
+        return 1;
+    }
+
+    for (uint8_t c = 0; c < channels && resampler->m_history_length; c++) {
+        memcpy(history + c * capacity, resampler->m_history_q15 + c * resampler->m_history_q15_capacity,
+               sizeof(int16_t) * resampler->m_history_length);
+    }
+
+    free(resampler->m_history_q15);
+    resampler->m_history_q15 = history;
+    resampler->m_history_q15_capacity = capacity;
+
+    return 0;
+}
+
+// Fixed point version of resampler_produce, the sums are rounded to nearest and saturated
+static inline void resampler_produce_fixed(WavResampler* resampler, uint64_t end, int16_t* out) {
+    const uint32_t taps = resampler->taps;
+    const uint8_t channels = resampler->channels;
+    const uint8_t shift = resampler->m_shift_q15;
+    const int32_t round = 1 << (shift - 1);
+    const int64_t history_start = (int64_t)resampler->m_history_start;
+    const int64_t history_end = history_start + (int64_t)resampler->m_history_length;
+
+    for (uint64_t n = resampler->m_output_total; n < end; n++, out += channels) {
+        const int16_t* coefficients = resampler->m_coefficients_q15 + (resampler_position(resampler, n) % resampler->L) * taps;
+        int64_t first = resampler_first_input(resampler, n);
+
+        for (uint8_t c = 0; c < channels; c++) {
+            const int16_t* history = resampler->m_history_q15 + c * resampler->m_history_q15_capacity;
+            const int16_t* x = resampler->m_window_q15;
+
+            if (first >= history_start && first + taps <= history_end) {
+                x = history + (first - history_start);
+            } else {
+                for (uint32_t i = 0; i < taps; i++) {
+                    int64_t index = first + i;
+                    resampler->m_window_q15[i] = index >= history_start && index < history_end ? history[index - history_start] : 0;
+                }
+            }
+
+            out[c] = pcm_saturate_q15((resampler->m_dot_q15(coefficients, x, taps) + round) >> shift);
+        }
+    }
+
+    resampler->m_output_total = end;
+}
+
+static inline int resampler_reserve_output_fixed(WavFixedData* out, uint64_t outputs, uint8_t channels) {
+    if (wav_fixed_data_reserve(out, outputs, channels)) {
+        return 1;
+    }
+    out->nr_of_samples = outputs;
+    return 0;
+}
+
+// Fixed point version of wav_resampler_process, the resampler needs
+// wav_resampler_init_fixed. Returns the amount of output samples or -1 on failure
+static inline int wav_resampler_process_fixed(WavResampler* resampler, const WavFixedData* in, WavFixedData* out) {
+    INSTRUMENT_START(start);
+    const uint8_t channels = resampler->channels;
+    if (resampler->mixer.in_channels != in->nr_of_channels && !resampler->m_custom_mixer &&
+        wav_mixer_init(&resampler->mixer, in->nr_of_channels, channels)) {
+        return -1;
+    }
+
+    size_t drop = resampler_drop(resampler);
+    for (uint8_t c = 0; c < channels && drop; c++) {
+        int16_t* history = resampler->m_history_q15 + c * resampler->m_history_q15_capacity;
+        memmove(history, history + drop, sizeof(int16_t) * resampler->m_history_length);
+    }
+
+    size_t length = resampler->m_history_length + in->nr_of_samples;
+    if (length > resampler->m_history_q15_capacity && wav_resampler_reserve_fixed(resampler, in->nr_of_samples)) {
+        return -1;
+    }
+
+    if (wav_mixer_process_fixed(&resampler->mixer, in, resampler->m_history_q15 + resampler->m_history_length,
+                                resampler->m_history_q15_capacity)) {
+        return -1;
+    }
+    resampler->m_history_length = length;
+    resampler->m_input_total += in->nr_of_samples;
+
+    uint64_t end = resampler_covered_end(resampler);
+    if (resampler_reserve_output_fixed(out, end - resampler->m_output_total, channels)) {
+        return -1;
+    }
+    resampler_produce_fixed(resampler, end, out->m_data);
+
+    INSTRUMENT_STOP(INSTRUMENT_RESAMPLE, start);
+    INSTRUMENT_COUNT(INSTRUMENT_SAMPLES_RESAMPLED, out->nr_of_samples);
+    return out->nr_of_samples;
+}
+
+// Fixed point version of wav_resampler_flush
+static inline int wav_resampler_flush_fixed(WavResampler* resampler, WavFixedData* out) {
+    INSTRUMENT_START(start);
+    uint64_t end = wav_resampler_output_size(resampler, resampler->m_input_total);
+    if (end < resampler->m_output_total) {
+        end = resampler->m_output_total;
+    }
+
+    if (resampler_reserve_output_fixed(out, end - resampler->m_output_total, resampler->channels)) {
+        return -1;
+    }
+    resampler_produce_fixed(resampler, end, out->m_data);
+
+    INSTRUMENT_STOP(INSTRUMENT_RESAMPLE, start);
+    INSTRUMENT_COUNT(INSTRUMENT_SAMPLES_RESAMPLED, out->nr_of_samples);
+    return out->nr_of_samples;
+}
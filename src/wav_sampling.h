@@ -2,72 +2,70 @@
 
 #include "wav_decoder.h"
 #include "wav_encoder.h"
+#include "wav_resampler.h"
 
-enum WavResamplingMethod { DOWNSAMPLE_AVERAGE, DOWNSAMPLE_M };
+// DOWNSAMPLE_* only convert 48000 Hz to 5512 Hz, RESAMPLE_POLYPHASE handles any pair of rates
+enum WavResamplingMethod { DOWNSAMPLE_AVERAGE, DOWNSAMPLE_M, RESAMPLE_POLYPHASE };
 
-static inline float wav_downsample_by_M(WavEncoder *encoder, size_t sample, uint8_t channel, uint8_t M) {
-    return encoder->data->m_samples[sample * M].m_data[channel];
+static inline float wav_downsample_by_M(const float *samples, size_t sample, uint8_t channel, uint8_t channels, uint8_t M) {
+    return samples[(sample * M) * channels + channel];
 }
 
-static inline float wav_downsample_by_average(WavEncoder *encoder, size_t sample, uint8_t channel, uint8_t M) {
+static inline float wav_downsample_by_average(const float *samples, size_t sample, uint8_t channel, uint8_t channels, uint8_t M) {
     float sum = 0;
     for (int j = 0; j < M; j++) {
-        sum += encoder->data->m_samples[(sample * M) + j].m_data[channel];
+        sum += samples[((sample * M) + j) * channels + channel];
     }
     return (sum / M);
 }
 
 // TODO: Make more generic
+// Downsampling is done in place: sample i only depends on samples i * M and later
 static inline int wav_downsample(WavDecoder *decoder, WavEncoder *encoder, uint8_t M, enum WavResamplingMethod method) {
     size_t samples = encoder->data->nr_of_samples / M;
-
-    WavSample *new_samples = (WavSample *)malloc(sizeof(WavSample) * samples);
-    if (new_samples == NULL) {
-        fprintf(stderr, "[WavSampling] Unable to allocate memory for downsampled samples\n");
-        return 0;
-    }
+    const uint8_t channels = encoder->data->nr_of_channels;
+    float *data = encoder->data->m_data;
 
     for (size_t i = 0; i < samples; i++) {
-        for (uint8_t c = 0; c < encoder->header->num_of_channels; c++) {
-            new_samples[i].m_data = (float *)malloc(sizeof(float) * encoder->header->num_of_channels);
-            if (new_samples[i].m_data == NULL) {
-                fprintf(stderr, "[WavSampling] Unable to allocate memory for downsamples samples channel\n");
-                break;
-            }
+        for (uint8_t c = 0; c < channels; c++) {
             if (method == DOWNSAMPLE_M) {
-                new_samples[i].m_data[c] = wav_downsample_by_M(encoder, i, c, M);
+                data[i * channels + c] = wav_downsample_by_M(data, i, c, channels, M);
             } else if (method == DOWNSAMPLE_AVERAGE) {
-                new_samples[i].m_data[c] = wav_downsample_by_average(encoder, i, c, M);
+                data[i * channels + c] = wav_downsample_by_average(data, i, c, channels, M);
             }
         }
     }
 
-    free_data(encoder->data);
-    encoder->data->m_samples = new_samples;
-
     encoder->data->nr_of_samples = samples;
 
     return samples;
 }
 
+// Every input frame is mapped to the encoder channels with the default mixer
+// and repeated M times
 static inline int wav_upsample(WavDecoder *decoder, WavEncoder *encoder, uint8_t M) {
     size_t samples = decoder->data->nr_of_samples * M;
+    const uint8_t in_channels = decoder->data->nr_of_channels;
+    const uint8_t channels = encoder->header->num_of_channels;
 
-    encoder->data->m_samples = (WavSample *)malloc(sizeof(WavSample) * samples);
-    if (encoder->data->m_samples == NULL) {
-        fprintf(stderr, "[WavSampling] Unable to allocate memory for samples to upsample\n");
+    WavMixer mixer;
+    if (wav_mixer_init(&mixer, in_channels, channels)) {
         return 0;
     }
 
-    for (size_t i = 0; i < samples; i++) {
-        encoder->data->m_samples[i].m_data = (float *)malloc(sizeof(float) * encoder->header->num_of_channels);
-        if (encoder->data->m_samples[i].m_data == NULL) {
-            fprintf(stderr, "[WavSampling] Unable to allocate memory for channel data to upsample\n");
-            return 0;
-        }
+    // The block is kept between chunks, so this only allocates for the first chunk
+    if (wav_data_reserve(encoder->data, samples, channels)) {
+        return 0;
+    }
+    encoder->data->layout = LAYOUT_INTERLEAVED;
+
+    const float *in = decoder->data->m_data;
+    float *out = encoder->data->m_data;
 
-        for (uint8_t c = 0; c < encoder->header->num_of_channels; c++) {
-            encoder->data->m_samples[i].m_data[c] = decoder->data->m_samples[i / M].m_data[c];
+    for (size_t i = 0; i < samples; i += M) {
+        wav_mixer_frame(&mixer, in + (i / M) * in_channels, out + i * channels);
+        for (uint8_t j = 1; j < M; j++) {
+            memcpy(out + (i + j) * channels, out + i * channels, sizeof(float) * channels);
         }
     }
 
@@ -76,43 +74,342 @@ static inline int wav_upsample(WavDecoder *decoder, WavEncoder *encoder, uint8_t
     return samples;
 }
 
+// Receives the resampled output chunk by chunk and in order. Returns 0 to
+// continue, 1 once no more output is needed or -1 on failure
+typedef int (*WavSampleSink)(WavData *data, void *context);
+
+// Resample the decoder with an already designed resampler and hand every chunk
+// of output in 'out' to 'sink'. The resampler is reset first so it can be
+// reused for many streams with the same rates. Returns the amount of samples
+// the sink took, it can shorten a chunk, or -1 on failure
+static inline long wav_resample_to(WavDecoder *decoder, WavResampler *resampler, WavData *out, WavSampleSink sink, void *context,
+                                   size_t *total_samples) {
+    wav_resampler_reset(resampler);
+
+    long total_sampled_samples = 0;
+    *total_samples = 0;
+
+    // The resampler keeps its history between chunks, after the last chunk it
+    // is flushed to get the output samples that overlap the end of the input
+    int finished = 0;
+    while (!finished) {
+        int result = wav_decoder_get_next_samples(decoder);
+        if (result > 0) {
+            *total_samples += decoder->data->nr_of_samples;
+            result = wav_resampler_process(resampler, decoder->data, out);
+        } else if (result == 0) {
+            result = wav_resampler_flush(resampler, out);
+            finished = 1;
+        }
+
+        if (result < 0) {
+            return -1;
+        }
+
+        result = sink(out, context);
+        if (result < 0) {
+            return -1;
+        }
+        total_sampled_samples += out->nr_of_samples;
+        finished |= result;
+    }
+
+    return total_sampled_samples;
+}
+
+static int resample_encoder_sink(WavData *data, void *context) {
+    WavEncoder *encoder = (WavEncoder *)context;
+    if (wav_encoder_write_samples(encoder, data)) {
+        return -1;
+    }
+    return wav_encoder_is_full(encoder);
+}
+
+// Resample the decoder into the encoder, see wav_resample_to. Returns the
+// amount of written samples or -1 on failure
+static inline long wav_resample_with(WavDecoder *decoder, WavEncoder *encoder, WavResampler *resampler, size_t *total_samples) {
+    return wav_resample_to(decoder, resampler, encoder->data, resample_encoder_sink, encoder, total_samples);
+}
+
+// Output samples [first_output, end_output) of the time range [start, start +
+// duration) of the input in seconds, clamped to the end of the input. A
+// duration of 0 runs to the end
+static inline void wav_extract_range(const WavDecoder *decoder, const WavResampler *resampler, double start, double duration,
+                                     uint64_t *first_output, uint64_t *end_output) {
+    const uint64_t total = wav_resampler_output_size(resampler, decoder->nr_of_samples);
+
+    *first_output = start > 0 ? (uint64_t)llround(start * resampler->out_rate) : 0;
+    *end_output = duration > 0 ? *first_output + (uint64_t)llround(duration * resampler->out_rate) : total;
+    if (*end_output > total) {
+        *end_output = total;
+    }
+    if (*first_output > *end_output) {
+        *first_output = *end_output;
+    }
+}
+
+// The statistics only see the input of the requested range, not what the
+// filter needs around it
+static void extract_stats_range(WavDecoder *decoder, const WavResampler *resampler, uint64_t first_output, uint64_t end_output) {
+    const uint64_t first = (first_output * resampler->in_rate + resampler->out_rate / 2) / resampler->out_rate;
+    const uint64_t end = (end_output * resampler->in_rate + resampler->out_rate / 2) / resampler->out_rate;
+    wav_decoder_set_stats_range(decoder, first, end);
+}
+
+// Resample only the output samples [first_output, end_output) and hand them to
+// 'sink' like wav_resample_to. The decoder is seeked to the first input sample
+// under the filter of first_output, so the history is warmed up with just the
+// samples the filter needs and nothing before or after the range is decoded.
+// The output is identical to the same samples of the whole stream
+static inline long wav_extract_to(WavDecoder *decoder, WavResampler *resampler, uint64_t first_output, uint64_t end_output,
+                                  WavData *out, WavSampleSink sink, void *context, size_t *total_samples) {
+    uint64_t first_input, end_input;
+    wav_resampler_input_range(resampler, first_output, end_output, &first_input, &end_input);
+
+    *total_samples = 0;
+    if (first_output >= end_output) {
+        return 0;
+    }
+
+    wav_resampler_reset(resampler);
+    wav_resampler_seek(resampler, first_output);
+    if (wav_decoder_seek(decoder, first_input)) {
+        return -1;
+    }
+    if (decoder->remaining_samples > end_input - first_input) {
+        decoder->remaining_samples = end_input - first_input;
+    }
+    extract_stats_range(decoder, resampler, first_output, end_output);
+
+    long total_sampled_samples = 0;
+    uint64_t remaining = end_output - first_output;
+    int finished = 0;
+    while (!finished) {
+        int result = wav_decoder_get_next_samples(decoder);
+        if (result > 0) {
+            *total_samples += decoder->data->nr_of_samples;
+            result = wav_resampler_process(resampler, decoder->data, out);
+        } else if (result == 0) {
+            // The range runs up to the end of the stream
+            result = wav_resampler_flush(resampler, out);
+            finished = 1;
+        }
+
+        if (result < 0) {
+            return -1;
+        }
+
+        // The last chunk can reach a few samples past the range
+        if (out->nr_of_samples > remaining) {
+            out->nr_of_samples = remaining;
+        }
+        remaining -= out->nr_of_samples;
+
+        result = sink(out, context);
+        if (result < 0) {
+            return -1;
+        }
+        total_sampled_samples += out->nr_of_samples;
+        finished |= result || remaining == 0;
+    }
+
+    return total_sampled_samples;
+}
+
+// Resample a range of the decoder into the encoder, see wav_extract_to
+static inline long wav_extract_with(WavDecoder *decoder, WavEncoder *encoder, WavResampler *resampler, uint64_t first_output,
+                                    uint64_t end_output, size_t *total_samples) {
+    return wav_extract_to(decoder, resampler, first_output, end_output, encoder->data, resample_encoder_sink, encoder, total_samples);
+}
+
+// Returns 1 when a stream can go from the decoder to the encoder in fixed point,
+// which needs 16 bit PCM on both sides
+static inline int wav_supports_fixed(const WavDecoder *decoder, const WavEncoder *encoder) {
+    return wav_decoder_supports_fixed(decoder) && wav_encoder_supports_fixed(encoder);
+}
+
+// Fixed point version of wav_extract_with: the samples stay Q15 from the decoder
+// to the encoder, see wav_supports_fixed. The resampler needs wav_resampler_init_fixed
+static inline long wav_extract_fixed_with(WavDecoder *decoder, WavEncoder *encoder, WavResampler *resampler, uint64_t first_output,
+                                          uint64_t end_output, size_t *total_samples) {
+    uint64_t first_input, end_input;
+    wav_resampler_input_range(resampler, first_output, end_output, &first_input, &end_input);
+
+    *total_samples = 0;
+    if (first_output >= end_output) {
+        return 0;
+    }
+
+    wav_resampler_reset(resampler);
+    wav_resampler_seek(resampler, first_output);
+    if (wav_decoder_seek(decoder, first_input)) {
+        return -1;
+    }
+    if (decoder->remaining_samples > end_input - first_input) {
+        decoder->remaining_samples = end_input - first_input;
+    }
+    extract_stats_range(decoder, resampler, first_output, end_output);
+
+    WavFixedData *out = &encoder->fixed;
+    long total_sampled_samples = 0;
+    uint64_t remaining = end_output - first_output;
+    int finished = 0;
+    while (!finished) {
+        int result = wav_decoder_get_next_fixed(decoder);
+        if (result > 0) {
+            *total_samples += decoder->fixed.nr_of_samples;
+            result = wav_resampler_process_fixed(resampler, &decoder->fixed, out);
+        } else if (result == 0) {
+            result = wav_resampler_flush_fixed(resampler, out);
+            finished = 1;
+        }
+
+        if (result < 0) {
+            return -1;
+        }
+
+        if (out->nr_of_samples > remaining) {
+            out->nr_of_samples = remaining;
+        }
+        remaining -= out->nr_of_samples;
+
+        if (wav_encoder_write_fixed(encoder, out)) {
+            return -1;
+        }
+        total_sampled_samples += out->nr_of_samples;
+        finished |= wav_encoder_is_full(encoder) || remaining == 0;
+    }
+
+    return total_sampled_samples;
+}
+
+// Resample the time range [start, start + duration) of the decoder in seconds
+// into the encoder, a duration of 0 runs to the end. The channels are mapped
+// with 'mixer', or the default mapping when it is NULL. With 'fixed_point' a
+// 16 bit stream is resampled in Q15 (see wav_extract_fixed_with), other formats
+// go through float
+static inline int wav_extract(WavDecoder *decoder, WavEncoder *encoder, const WavMixer *mixer, double start, double duration,
+                              int fixed_point) {
+    WavResampler resampler;
+    if (wav_resampler_init(&resampler, decoder->header->sample_rate, encoder->header->sample_rate, encoder->header->num_of_channels) ||
+        (mixer && wav_resampler_set_mixer(&resampler, mixer))) {
+        wav_resampler_close(&resampler);
+        return 1;
+    }
+
+    if (fixed_point && !wav_supports_fixed(decoder, encoder)) {
+        fprintf(stderr, "[WavSampling] Fixed point needs 16 bit PCM input and output, resampling in float\n");
+        fixed_point = 0;
+    }
+    if (fixed_point && wav_resampler_init_fixed(&resampler)) {
+        wav_resampler_close(&resampler);
+        return 1;
+    }
+
+    uint64_t first_output, end_output;
+    wav_extract_range(decoder, &resampler, start, duration, &first_output, &end_output);
+
+    // Without a duration the end of a stream is not known up front
+    if (duration > 0 || !wav_decoder_is_unbounded(decoder)) {
+        wav_encoder_set_nr_of_samples(encoder, end_output - first_output);
+    }
+    if (wav_encoder_write_header(encoder)) {
+        wav_resampler_close(&resampler);
+        return 1;
+    }
+
+    printf("Extracting output samples %llu to %llu (%.3f s to %.3f s)\n", (unsigned long long)first_output,
+           (unsigned long long)end_output, (double)first_output / resampler.out_rate, (double)end_output / resampler.out_rate);
+
+    size_t total_samples = 0;
+    long total_sampled_samples = fixed_point ? wav_extract_fixed_with(decoder, encoder, &resampler, first_output, end_output, &total_samples)
+                                             : wav_extract_with(decoder, encoder, &resampler, first_output, end_output, &total_samples);
+
+    wav_resampler_close(&resampler);
+
+    if (total_sampled_samples < 0) {
+        return 1;
+    }
+
+    printf("Total samples processed: %zu\n", total_samples);
+    printf("Total sampled samples: %ld\n", total_sampled_samples);
+
+    return 0;
+}
+
+static inline int wav_resample_polyphase(WavDecoder *decoder, WavEncoder *encoder) {
+    WavResampler resampler;
+    if (wav_resampler_init(&resampler, decoder->header->sample_rate, encoder->header->sample_rate, encoder->header->num_of_channels)) {
+        return 1;
+    }
+
+    printf("Resampling %u Hz to %u Hz (L = %u, M = %u, %u taps per phase)\n", resampler.in_rate, resampler.out_rate, resampler.L,
+           resampler.M, resampler.taps);
+
+    size_t total_samples = 0;
+    long total_sampled_samples = wav_resample_with(decoder, encoder, &resampler, &total_samples);
+
+    wav_resampler_close(&resampler);
+
+    if (total_sampled_samples < 0) {
+        return 1;
+    }
+
+    printf("Total samples processed: %zu/%zu\n", total_samples, decoder->nr_of_samples);
+    printf("Total sampled samples: %ld\n", total_sampled_samples);
+
+    return 0;
+}
+
 static inline int wav_resample(WavDecoder *decoder, WavEncoder *encoder, enum WavResamplingMethod method) {
     // Write the header
-    wav_encoder_write_header(encoder);
+    if (wav_encoder_write_header(encoder)) {
+        return 1;
+    }
 
     printf("There are %zu samples to get\n", decoder->nr_of_samples);
 
-    if (encoder->header->sample_rate != 5512) {
-        fprintf(stderr, "[WavSampling] Only resampling to 5512 Hz is supported for now\n");
+    if (method == RESAMPLE_POLYPHASE) {
+        return wav_resample_polyphase(decoder, encoder);
+    }
+
+    if (encoder->header->sample_rate != 5512 || decoder->header->sample_rate != 48000) {
+        fprintf(stderr, "[WavSampling] Downsampling only supports 48000 Hz to 5512 Hz, use RESAMPLE_POLYPHASE instead\n");
         return 1;
     }
 
     size_t total_samples = 0;
     size_t total_sampled_samples = 0;
 
-    while (total_sampled_samples < encoder->nr_of_samples) {
-        // Get new samples
-        wav_decoder_get_next_samples(decoder);
+    while (!wav_encoder_is_full(encoder)) {
+        // Get new samples, until the end of the input when the length is unknown
+        int samples = wav_decoder_get_next_samples(decoder);
+        if (samples < 0) {
+            return 1;
+        }
+        if (samples == 0) {
+            break;
+        }
 
         total_samples += decoder->data->nr_of_samples;
 
-        // Make sure there is no encoder data
-        if (encoder->data != NULL) {
-            free_data(encoder->data);
-        }
+        // Samples of the previous chunk are overwritten, the block itself is kept
+        encoder->data->nr_of_samples = 0;
 
         if (decoder->header->sample_rate == 48000) {
             // 48000 * 7 / 61 is close to 5512
             wav_upsample(decoder, encoder, 7);
             wav_downsample(decoder, encoder, 61, method);
-            total_sampled_samples += encoder->data->nr_of_samples;
         }
 
-        wav_encoder_write_data(encoder);
+        if (wav_encoder_write_data(encoder)) {
+            return 1;
+        }
+        total_sampled_samples += encoder->data->nr_of_samples;
     }
 
     printf("Total samples processed: %zu/%zu\n", total_samples, decoder->nr_of_samples);
-    printf("Total sampled samples: %zu/%zu\n", total_sampled_samples, encoder->nr_of_samples);
+    printf("Total sampled samples: %zu\n", total_sampled_samples);
 
     return 0;
 }
\ No newline at end of file
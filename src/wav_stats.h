@@ -0,0 +1,433 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wav.h"
+
+#define STATS_CLIP_LEVEL (1.0f - 1.0f / 32768)  // Samples within one 16 bit step of full scale count as clipped
+#define STATS_SILENCE_THRESHOLD -60.0f          // Default silence threshold, in dBFS
+#define STATS_SILENCE_SECONDS 0.5               // Default shortest silence in the map
+#define STATS_GATE_ABSOLUTE -70.0               // BS.1770 absolute gate, in LUFS
+#define STATS_GATE_RELATIVE -10.0               // BS.1770 relative gate, in LU below the ungated loudness
+
+// Signal statistics of a stream in a single pass
+//
+// The decoder feeds every chunk it decodes to the statistics attached with
+// wav_decoder_set_stats, so they are gathered on the samples while they are
+// still in cache instead of in another pass over the file. Per channel the
+// peak, RMS, DC offset and amount of clipped samples are kept, and for the
+// whole stream the integrated loudness of ITU-R BS.1770 and a map of the runs
+// of silence.
+//
+// For the loudness the samples go through the K-weighting filter and their
+// energy is summed in blocks of 100 ms. Every 400 ms window (four blocks, so
+// they overlap by 75%) becomes a gating block, and the integrated loudness is
+// the mean of the gating blocks that pass the absolute and the relative gate.
+// A frame is silent when all of its channels stay below the silence threshold,
+// runs of silent frames shorter than the minimum are not mapped.
+
+typedef struct {
+    // Results, set by wav_stats_finish
+    float peak;        // Largest absolute sample
+    double rms;        // Root mean square
+    double dc_offset;  // Mean of the samples
+    uint64_t clipped;  // Samples at or beyond full scale
+
+    double m_sum;
+    double m_sum_squares;
+
+    // K-weighting: a high shelf followed by a high pass, in direct form I
+    double m_shelf[4];  // x1, x2, y1, y2
+    double m_pass[4];   // Same for the high pass
+    double m_weight;  // Channel weight of BS.1770, 0 for the LFE
+} WavChannelStats;
+
+typedef struct {
+    uint64_t start;  // First silent frame
+    uint64_t end;    // One past the last silent frame
+} WavSilenceRun;
+
+typedef struct {
+    uint32_t sample_rate;
+    uint16_t nr_of_channels;
+    uint64_t first_sample;   // Frame of the input the first frame seen is at, 0 unless only a range is analyzed
+    uint64_t nr_of_samples;  // Frames seen so far
+
+    // Results, set by wav_stats_finish
+    WavChannelStats* channels;
+    double integrated_loudness;  // In LUFS, -INFINITY when no block passes the gates
+    WavSilenceRun* silence;  // In frames of the input, see first_sample
+    size_t nr_of_silence_runs;
+
+    float silence_threshold;  // In dBFS
+    double silence_seconds;   // Shortest run in the map
+
+    // Filter coefficients for the sample rate: b0 b1 b2 a1 a2 of each stage
+    double m_shelf[5];
+    double m_pass[5];
+
+    // Blocks of 100 ms, the last four make up the current gating block
+    uint32_t m_block_size;  // In frames
+    uint32_t m_block_position;
+    double m_block_energy;
+    double m_recent[4];
+    uint64_t m_nr_of_blocks;
+    double* m_gating;  // Mean square of every gating block
+    size_t m_gating_count;
+    size_t m_gating_capacity;
+
+    float m_silence_level;  // Linear threshold
+    uint64_t m_silence_start;
+    int m_in_silence;
+    size_t m_silence_capacity;
+
+    uint16_t m_channel_capacity;
+} WavStats;
+
+static inline void wav_stats_init(WavStats* stats) {
+    memset(stats, 0, sizeof(WavStats));
+    stats->silence_threshold = STATS_SILENCE_THRESHOLD;
+    stats->silence_seconds = STATS_SILENCE_SECONDS;
+}
+
+static inline void wav_stats_free(WavStats* stats) {
+    free(stats->channels);
+    free(stats->silence);
+    free(stats->m_gating);
+    wav_stats_init(stats);
+}
+
+// Set the silence threshold in dBFS and the shortest silence in seconds that is
+// mapped, takes effect with the next wav_stats_start
+static inline void wav_stats_set_silence(WavStats* stats, float threshold, double seconds) {
+    stats->silence_threshold = threshold;
+    stats->silence_seconds = seconds;
+}
+
+// Coefficients of the K-weighting filter of BS.1770 for any sample rate, derived
+// from the analog prototype of the 48 kHz coefficients in the standard
+static void stats_design_filter(WavStats* stats) {
+    const double rate = stats->sample_rate;
+
+    double K = tan(M_PI * 1681.974450955533 / rate);
+    double Q = 0.7071752369554196;
+    double Vh = pow(10.0, 3.999843853973347 / 20);
+    double Vb = pow(Vh, 0.4996667741545416);
+    double a0 = 1 + K / Q + K * K;
+    stats->m_shelf[0] = (Vh + Vb * K / Q + K * K) / a0;
+    stats->m_shelf[1] = 2 * (K * K - Vh) / a0;
+    stats->m_shelf[2] = (Vh - Vb * K / Q + K * K) / a0;
+    stats->m_shelf[3] = 2 * (K * K - 1) / a0;
+    stats->m_shelf[4] = (1 - K / Q + K * K) / a0;
+
+    K = tan(M_PI * 38.13547087602444 / rate);
+    Q = 0.5003270373238773;
+    a0 = 1 + K / Q + K * K;
+    stats->m_pass[0] = 1;
+    stats->m_pass[1] = -2;
+    stats->m_pass[2] = 1;
+    stats->m_pass[3] = 2 * (K * K - 1) / a0;
+    stats->m_pass[4] = (1 - K / Q + K * K) / a0;
+}
+
+// Start a new stream, the buffers of the previous one are reused. Returns 0 on success
+static inline int wav_stats_start(WavStats* stats, uint32_t sample_rate, uint16_t channels) {
+    if (sample_rate == 0 || channels == 0) {
+        fprintf(stderr, "[WavStats] Invalid stream: %u Hz, %u channels\n", sample_rate, channels);
+        return 1;
+    }
+
+    if (channels > stats->m_channel_capacity) {
+        free(stats->channels);
+        stats->channels = (WavChannelStats*)malloc(sizeof(WavChannelStats) * channels);
+        stats->m_channel_capacity = stats->channels ? channels : 0;
+        if (stats->channels == NULL) {
+            fprintf(stderr, "[WavStats] Unable to allocate memory for %u channels\n", channels);
+            return 1;
+        }
+    }
+
+    stats->sample_rate = sample_rate;
+    stats->nr_of_channels = channels;
+    stats->first_sample = 0;
+    stats->nr_of_samples = 0;
+    stats->integrated_loudness = -INFINITY;
+    stats->nr_of_silence_runs = 0;
+    stats_design_filter(stats);
+
+    memset(stats->channels, 0, sizeof(WavChannelStats) * channels);
+    for (uint16_t c = 0; c < channels; c++) {
+        // 5.1 is FL FR FC LFE BL BR, the surround channels get +1.5 dB and the LFE is left out
+        stats->channels[c].m_weight = channels == 6 && c == 3 ? 0.0 : channels == 6 && c >= 4 ? 1.41 : 1.0;
+    }
+
+    stats->m_block_size = (sample_rate + 5) / 10;
+    stats->m_block_position = 0;
+    stats->m_block_energy = 0;
+    stats->m_nr_of_blocks = 0;
+    stats->m_gating_count = 0;
+
+    stats->m_silence_level = powf(10.0f, stats->silence_threshold / 20);
+    stats->m_in_silence = 0;
+
+    return 0;
+}
+
+// A block of 100 ms is complete, every block from the fourth on closes a gating block
+static int stats_end_block(WavStats* stats) {
+    stats->m_recent[stats->m_nr_of_blocks % 4] = stats->m_block_energy / stats->m_block_size;
+    stats->m_nr_of_blocks++;
+    stats->m_block_energy = 0;
+    stats->m_block_position = 0;
+
+    if (stats->m_nr_of_blocks < 4) {
+        return 0;
+    }
+
+    if (stats->m_gating_count == stats->m_gating_capacity) {
+        size_t grown = stats->m_gating_capacity ? stats->m_gating_capacity * 2 : 1024;
+        double* resized = (double*)realloc(stats->m_gating, sizeof(double) * grown);
+        INSTRUMENT_COUNT(INSTRUMENT_ALLOCATIONS, 1);
+        if (resized == NULL) {
+            fprintf(stderr, "[WavStats] Unable to allocate memory for %zu gating blocks\n", grown);
+            return 1;
+        }
+        stats->m_gating = resized;
+        stats->m_gating_capacity = grown;
+    }
+
+    stats->m_gating[stats->m_gating_count++] = (stats->m_recent[0] + stats->m_recent[1] + stats->m_recent[2] + stats->m_recent[3]) / 4;
+    return 0;
+}
+
+static int stats_add_silence(WavStats* stats, uint64_t end) {
+    if ((double)(end - stats->m_silence_start) < stats->silence_seconds * stats->sample_rate) {
+        return 0;
+    }
+
+    if (stats->nr_of_silence_runs == stats->m_silence_capacity) {
+        size_t grown = stats->m_silence_capacity ? stats->m_silence_capacity * 2 : 64;
+        WavSilenceRun* resized = (WavSilenceRun*)realloc(stats->silence, sizeof(WavSilenceRun) * grown);
+        INSTRUMENT_COUNT(INSTRUMENT_ALLOCATIONS, 1);
+        if (resized == NULL) {
+            fprintf(stderr, "[WavStats] Unable to allocate memory for %zu silence runs\n", grown);
+            return 1;
+        }
+        stats->silence = resized;
+        stats->m_silence_capacity = grown;
+    }
+
+    WavSilenceRun* run = &stats->silence[stats->nr_of_silence_runs++];
+    run->start = stats->m_silence_start;
+    run->end = end;
+    return 0;
+}
+
+// Frames [begin, end) of channel c, the samples are read from 'f' or from the Q15
+// samples 'q' when it is NULL. The state is kept in locals for the whole run so
+// the two filters only wait on each other. Returns the weighted K-filtered energy
+static double stats_channel(const WavStats* stats, uint16_t c, const float* f, const int16_t* q, size_t begin, size_t end) {
+    WavChannelStats* s = &stats->channels[c];
+    const size_t stride = stats->nr_of_channels;
+    const double* h = stats->m_shelf;
+    const double* p = stats->m_pass;
+
+    float peak = s->peak;
+    uint64_t clipped = s->clipped;
+    double sum = s->m_sum, sum_squares = s->m_sum_squares, energy = 0;
+    double x1 = s->m_shelf[0], x2 = s->m_shelf[1], y1 = s->m_shelf[2], y2 = s->m_shelf[3];
+    double u1 = s->m_pass[0], u2 = s->m_pass[1], v1 = s->m_pass[2], v2 = s->m_pass[3];
+
+    for (size_t i = begin; i < end; i++) {
+        const size_t k = i * stride + c;
+        const float x = f ? f[k] : q[k] * (1.0f / 32768);
+        const float magnitude = fabsf(x);
+
+        peak = magnitude > peak ? magnitude : peak;
+        clipped += magnitude >= STATS_CLIP_LEVEL;
+        sum += x;
+        sum_squares += (double)x * x;
+
+        // High shelf, then high pass (its b coefficients are 1, -2, 1). The last
+        // output comes in last, it is the only term the next sample waits on
+        const double y = h[0] * x + h[1] * x1 + h[2] * x2 - h[4] * y2 - h[3] * y1;
+        x2 = x1;
+        x1 = x;
+        y2 = y1;
+        y1 = y;
+        const double v = y - 2 * u1 + u2 - p[4] * v2 - p[3] * v1;
+        u2 = u1;
+        u1 = y;
+        v2 = v1;
+        v1 = v;
+        energy += v * v;
+    }
+
+    s->peak = peak;
+    s->clipped = clipped;
+    s->m_sum = sum;
+    s->m_sum_squares = sum_squares;
+    s->m_shelf[0] = x1, s->m_shelf[1] = x2, s->m_shelf[2] = y1, s->m_shelf[3] = y2;
+    s->m_pass[0] = u1, s->m_pass[1] = u2, s->m_pass[2] = v1, s->m_pass[3] = v2;
+
+    return s->m_weight * energy;
+}
+
+static int stats_process(WavStats* stats, const float* f, const int16_t* q, size_t frames) {
+    const uint16_t channels = stats->nr_of_channels;
+
+    // Channel by channel, in runs that end where a block of 100 ms ends
+    for (size_t i = 0; i < frames;) {
+        size_t end = i + (stats->m_block_size - stats->m_block_position);
+        if (end > frames) {
+            end = frames;
+        }
+
+        for (uint16_t c = 0; c < channels; c++) {
+            stats->m_block_energy += stats_channel(stats, c, f, q, i, end);
+        }
+
+        stats->m_block_position += (uint32_t)(end - i);
+        if (stats->m_block_position == stats->m_block_size && stats_end_block(stats)) {
+            return 1;
+        }
+        i = end;
+    }
+
+    // A frame is silent when its loudest channel is below the threshold
+    const float level = stats->m_silence_level;
+    for (size_t i = 0; i < frames; i++) {
+        float loudest = 0;
+        for (uint16_t c = 0; c < channels; c++) {
+            const size_t k = i * channels + c;
+            const float magnitude = fabsf(f ? f[k] : q[k] * (1.0f / 32768));
+            loudest = magnitude > loudest ? magnitude : loudest;
+        }
+
+        const int silent = loudest < level;
+        if (silent == stats->m_in_silence) {
+            continue;
+        }
+
+        const uint64_t frame = stats->first_sample + stats->nr_of_samples + i;
+        stats->m_in_silence = silent;
+        if (silent) {
+            stats->m_silence_start = frame;
+        } else if (stats_add_silence(stats, frame)) {
+            return 1;
+        }
+    }
+
+    stats->nr_of_samples += frames;
+    return 0;
+}
+
+// Add the frames [first, first + count) of an interleaved chunk of float
+// samples. Returns 0 on success
+static inline int wav_stats_process(WavStats* stats, const WavData* data, size_t first, size_t count) {
+    if (data->layout != LAYOUT_INTERLEAVED || data->nr_of_channels != stats->nr_of_channels || first + count > data->nr_of_samples) {
+        fprintf(stderr, "[WavStats] Expected interleaved samples of %u channels\n", stats->nr_of_channels);
+        return 1;
+    }
+    return stats_process(stats, data->m_data + first * stats->nr_of_channels, NULL, count);
+}
+
+// Add the frames [first, first + count) of a chunk of Q15 samples. Returns 0 on success
+static inline int wav_stats_process_fixed(WavStats* stats, const WavFixedData* data, size_t first, size_t count) {
+    if (data->nr_of_channels != stats->nr_of_channels || first + count > data->nr_of_samples) {
+        fprintf(stderr, "[WavStats] Expected samples of %u channels\n", stats->nr_of_channels);
+        return 1;
+    }
+    return stats_process(stats, NULL, data->m_data + first * stats->nr_of_channels, count);
+}
+
+static inline double stats_loudness(double mean_square) {
+    return -0.691 + 10 * log10(mean_square);
+}
+
+// Compute the results once all samples are in. Returns 0 on success
+static inline int wav_stats_finish(WavStats* stats) {
+    if (stats->m_in_silence) {
+        stats->m_in_silence = 0;
+        if (stats_add_silence(stats, stats->first_sample + stats->nr_of_samples)) {
+            return 1;
+        }
+    }
+
+    const double n = stats->nr_of_samples ? (double)stats->nr_of_samples : 1;
+    for (uint16_t c = 0; c < stats->nr_of_channels; c++) {
+        WavChannelStats* s = &stats->channels[c];
+        s->rms = sqrt(s->m_sum_squares / n);
+        s->dc_offset = s->m_sum / n;
+    }
+
+    // The absolute gate, then the relative gate below the loudness of what passed it
+    double sum = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < stats->m_gating_count; i++) {
+        if (stats_loudness(stats->m_gating[i]) > STATS_GATE_ABSOLUTE) {
+            sum += stats->m_gating[i];
+            count++;
+        }
+    }
+    if (count == 0) {
+        stats->integrated_loudness = -INFINITY;
+        return 0;
+    }
+
+    const double relative = stats_loudness(sum / count) + STATS_GATE_RELATIVE;
+    sum = 0;
+    count = 0;
+    for (size_t i = 0; i < stats->m_gating_count; i++) {
+        double loudness = stats_loudness(stats->m_gating[i]);
+        if (loudness > STATS_GATE_ABSOLUTE && loudness > relative) {
+            sum += stats->m_gating[i];
+            count++;
+        }
+    }
+    stats->integrated_loudness = stats_loudness(sum / count);
+
+    return 0;
+}
+
+// Levels in dB are null when they are -inf, JSON has no infinity
+static void stats_print_db(FILE* fp, const char* name, double db) {
+    if (isfinite(db)) {
+        fprintf(fp, "\"%s\": %.2f", name, db);
+    } else {
+        fprintf(fp, "\"%s\": null", name);
+    }
+}
+
+// Write the results of wav_stats_finish as JSON. Returns 0 on success
+static inline int wav_stats_write_json(const WavStats* stats, FILE* fp) {
+    fprintf(fp, "{\n  \"sample_rate\": %u,\n  \"start\": %.3f,\n  \"samples\": %llu,\n  \"seconds\": %.3f,\n  ", stats->sample_rate,
+            (double)stats->first_sample / stats->sample_rate, (unsigned long long)stats->nr_of_samples,
+            (double)stats->nr_of_samples / stats->sample_rate);
+    stats_print_db(fp, "integrated_loudness", stats->integrated_loudness);
+
+    fprintf(fp, ",\n  \"channels\": [");
+    for (uint16_t c = 0; c < stats->nr_of_channels; c++) {
+        const WavChannelStats* s = &stats->channels[c];
+        fprintf(fp, "%s\n    {\"peak\": %.6f, ", c ? "," : "", s->peak);
+        stats_print_db(fp, "peak_dbfs", 20 * log10(s->peak));
+        fprintf(fp, ", \"rms\": %.6f, ", s->rms);
+        stats_print_db(fp, "rms_dbfs", 20 * log10(s->rms));
+        fprintf(fp, ", \"dc_offset\": %.6g, \"clipped\": %llu}", s->dc_offset, (unsigned long long)s->clipped);
+    }
+
+    fprintf(fp, "\n  ],\n  \"silence\": {\"threshold_dbfs\": %.1f, \"minimum_seconds\": %.3f, \"runs\": [", stats->silence_threshold,
+            stats->silence_seconds);
+    for (size_t i = 0; i < stats->nr_of_silence_runs; i++) {
+        const WavSilenceRun* run = &stats->silence[i];
+        fprintf(fp, "%s\n    {\"start\": %.3f, \"end\": %.3f}", i ? "," : "", (double)run->start / stats->sample_rate,
+                (double)run->end / stats->sample_rate);
+    }
+    fprintf(fp, "%s]}\n}\n", stats->nr_of_silence_runs ? "\n  " : "");
+
+    return ferror(fp);
+}
@@ -0,0 +1,290 @@
+#pragma once
+
+#include <math.h>
+
+#include "wav_sampling.h"
+
+#define STFT_FFT_SIZE 1024  // Default FFT size, 186 ms at 5512 Hz
+#define STFT_HOP_SIZE 256   // Default distance between frames, in samples
+
+enum WavStftWindow { STFT_WINDOW_HANN, STFT_WINDOW_HAMMING, STFT_WINDOW_RECTANGULAR };
+
+// Called for every magnitude frame, 'bins' is fft_size / 2 + 1. Returns 0 to
+// continue, 1 to stop or -1 on failure
+typedef int (*WavStftFrameFunction)(const float* magnitudes, size_t bins, uint64_t frame, void* context);
+
+// Short-time Fourier transform of a mono stream
+//
+// Input is pushed chunk by chunk, every 'hop' samples the last 'window_size'
+// samples are windowed, zero padded to 'fft_size' and transformed. Frames are
+// handed out as magnitudes |X[k]| for k = 0 .. fft_size / 2, unnormalized.
+//
+// The real FFT packs the fft_size real samples into fft_size / 2 complex ones,
+// runs an iterative radix-2 FFT on them and splits the result into the spectrum
+// of the real input. The window, the bit reversal permutation and the twiddles
+// are computed once at init.
+typedef struct {
+    size_t fft_size;
+    size_t window_size;
+    size_t hop;
+    size_t bins;
+    uint64_t frames;  // Amount of frames produced so far
+
+    float* m_window;      // window_size coefficients
+    float* m_twiddles;    // cos and sin of -2 pi k / fft_size for k < fft_size / 2, interleaved
+    uint32_t* m_reverse;  // Bit reversal permutation of fft_size / 2 indices
+    float* m_fft;         // fft_size / 2 complex values, interleaved
+    float* m_magnitudes;  // bins values
+
+    float* m_input;   // The last window_size samples
+    size_t m_length;  // Samples in m_input
+    size_t m_fresh;   // Samples in m_input that were not the newest hop of a frame yet
+} WavStft;
+
+static inline void wav_stft_close(WavStft* stft) {
+    free(stft->m_window);
+    free(stft->m_twiddles);
+    free(stft->m_reverse);
+    free(stft->m_fft);
+    free(stft->m_magnitudes);
+    free(stft->m_input);
+    stft->m_window = NULL;
+    stft->m_twiddles = NULL;
+    stft->m_reverse = NULL;
+    stft->m_fft = NULL;
+    stft->m_magnitudes = NULL;
+    stft->m_input = NULL;
+}
+
+// Forget the pushed samples so a new stream can be analyzed with the same tables
+static inline void wav_stft_reset(WavStft* stft) {
+    stft->frames = 0;
+    stft->m_length = 0;
+    stft->m_fresh = 0;
+}
+
+// The FFT size has to be a power of two of at least 4, the window can be
+// shorter than the FFT and the hop at most the window
+static inline int wav_stft_init(WavStft* stft, size_t fft_size, size_t window_size, size_t hop, enum WavStftWindow window) {
+    memset(stft, 0, sizeof(WavStft));
+
+    if (fft_size < 4 || (fft_size & (fft_size - 1)) != 0 || window_size == 0 || window_size > fft_size || hop == 0 ||
+        hop > window_size) {
+        fprintf(stderr, "[WavStft] Invalid FFT size %zu, window size %zu or hop %zu\n", fft_size, window_size, hop);
+        return 1;
+    }
+
+    const size_t half = fft_size / 2;
+    stft->fft_size = fft_size;
+    stft->window_size = window_size;
+    stft->hop = hop;
+    stft->bins = half + 1;
+
+    stft->m_window = (float*)malloc(sizeof(float) * window_size);
+    stft->m_twiddles = (float*)malloc(sizeof(float) * fft_size);
+    stft->m_reverse = (uint32_t*)malloc(sizeof(uint32_t) * half);
+    stft->m_fft = (float*)malloc(sizeof(float) * fft_size);
+    stft->m_magnitudes = (float*)malloc(sizeof(float) * stft->bins);
+    stft->m_input = (float*)malloc(sizeof(float) * window_size);
+    if (stft->m_window == NULL || stft->m_twiddles == NULL || stft->m_reverse == NULL || stft->m_fft == NULL ||
+        stft->m_magnitudes == NULL || stft->m_input == NULL) {
+        fprintf(stderr, "[WavStft] Unable to allocate memory for an FFT of size %zu\n", fft_size);
+        wav_stft_close(stft);
+        return 1;
+    }
+
+    // Periodic windows, so overlapping frames add up evenly
+    for (size_t i = 0; i < window_size; i++) {
+        double phase = 2.0 * M_PI * i / window_size;
+        if (window == STFT_WINDOW_HANN) {
+            stft->m_window[i] = (float)(0.5 - 0.5 * cos(phase));
+        } else if (window == STFT_WINDOW_HAMMING) {
+            stft->m_window[i] = (float)(0.54 - 0.46 * cos(phase));
+        } else {
+            stft->m_window[i] = 1.0f;
+        }
+    }
+
+    for (size_t k = 0; k < half; k++) {
+        stft->m_twiddles[2 * k] = (float)cos(-2.0 * M_PI * k / fft_size);
+        stft->m_twiddles[2 * k + 1] = (float)sin(-2.0 * M_PI * k / fft_size);
+    }
+
+    uint32_t bits = 0;
+    while (((size_t)1 << bits) < half) {
+        bits++;
+    }
+    for (size_t i = 0; i < half; i++) {
+        uint32_t reversed = 0;
+        for (uint32_t b = 0; b < bits; b++) {
+            reversed |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+        stft->m_reverse[i] = reversed;
+    }
+
+    return 0;
+}
+
+// In place radix-2 FFT of the fft_size / 2 complex values in m_fft, which are
+// already in bit reversed order
+static void stft_complex_fft(WavStft* stft) {
+    const size_t n = stft->fft_size / 2;
+    float* x = stft->m_fft;
+
+    for (size_t length = 2; length <= n; length <<= 1) {
+        const size_t half = length / 2;
+        // Twiddle j of this stage is exp(-2 pi i j / length), entry j * (fft_size / length) of the table
+        const size_t step = stft->fft_size / length;
+
+        for (size_t start = 0; start < n; start += length) {
+            for (size_t j = 0; j < half; j++) {
+                const float wr = stft->m_twiddles[2 * j * step];
+                const float wi = stft->m_twiddles[2 * j * step + 1];
+                float* a = x + 2 * (start + j);
+                float* b = x + 2 * (start + j + half);
+
+                float tr = b[0] * wr - b[1] * wi;
+                float ti = b[0] * wi + b[1] * wr;
+                b[0] = a[0] - tr;
+                b[1] = a[1] - ti;
+                a[0] += tr;
+                a[1] += ti;
+            }
+        }
+    }
+}
+
+// Window and transform the samples in m_input into m_magnitudes
+static void stft_transform(WavStft* stft) {
+    const size_t n = stft->fft_size / 2;
+    const float* input = stft->m_input;
+    float* z = stft->m_fft;
+
+    // Even samples go to the real parts, odd samples to the imaginary parts
+    for (size_t i = 0; i < n; i++) {
+        size_t even = 2 * i;
+        size_t odd = 2 * i + 1;
+        size_t r = stft->m_reverse[i];
+        z[2 * r] = even < stft->window_size ? input[even] * stft->m_window[even] : 0.0f;
+        z[2 * r + 1] = odd < stft->window_size ? input[odd] * stft->m_window[odd] : 0.0f;
+    }
+
+    stft_complex_fft(stft);
+
+    // X[k] = (Z[k] + conj(Z[n - k])) / 2 - i W^k (Z[k] - conj(Z[n - k])) / 2
+    stft->m_magnitudes[0] = fabsf(z[0] + z[1]);
+    stft->m_magnitudes[n] = fabsf(z[0] - z[1]);
+    for (size_t k = 1; k < n; k++) {
+        float ar = z[2 * k], ai = z[2 * k + 1];
+        float br = z[2 * (n - k)], bi = -z[2 * (n - k) + 1];
+
+        float er = 0.5f * (ar + br), ei = 0.5f * (ai + bi);
+        float dr = 0.5f * (ar - br), di = 0.5f * (ai - bi);
+        float wr = stft->m_twiddles[2 * k], wi = stft->m_twiddles[2 * k + 1];
+
+        // -i * W^k * d
+        float xr = wr * di + wi * dr;
+        float xi = wi * di - wr * dr;
+        stft->m_magnitudes[k] = hypotf(er + xr, ei + xi);
+    }
+}
+
+// Emit the frame for the window in m_input and drop the oldest hop of samples
+static int stft_emit(WavStft* stft, WavStftFrameFunction function, void* context) {
+    stft_transform(stft);
+    int result = function(stft->m_magnitudes, stft->bins, stft->frames++, context);
+
+    memmove(stft->m_input, stft->m_input + stft->hop, sizeof(float) * (stft->window_size - stft->hop));
+    stft->m_length = stft->window_size - stft->hop;
+    stft->m_fresh = 0;
+
+    return result;
+}
+
+// Push mono samples and call 'function' for every frame that is complete.
+// Returns 0, 1 when the function asked to stop or -1 when it failed
+static inline int wav_stft_push(WavStft* stft, const float* samples, size_t n, WavStftFrameFunction function, void* context) {
+    while (n > 0) {
+        size_t count = stft->window_size - stft->m_length;
+        if (count > n) {
+            count = n;
+        }
+
+        memcpy(stft->m_input + stft->m_length, samples, sizeof(float) * count);
+        stft->m_length += count;
+        stft->m_fresh += count;
+        samples += count;
+        n -= count;
+
+        if (stft->m_length == stft->window_size) {
+            int result = stft_emit(stft, function, context);
+            if (result) {
+                return result < 0 ? -1 : 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Emit a last, zero padded frame for the samples that did not end up in a frame
+// as the newest hop yet. Returns like the frame function
+static inline int wav_stft_flush(WavStft* stft, WavStftFrameFunction function, void* context) {
+    if (stft->m_fresh == 0) {
+        return 0;
+    }
+
+    memset(stft->m_input + stft->m_length, 0, sizeof(float) * (stft->window_size - stft->m_length));
+    return stft_emit(stft, function, context);
+}
+
+typedef struct {
+    WavStft* stft;
+    WavStftFrameFunction function;
+    void* context;
+    int stopped;
+} StftSink;
+
+static int stft_sink(WavData* data, void* context) {
+    StftSink* sink = (StftSink*)context;
+    if (data->nr_of_channels != 1) {
+        fprintf(stderr, "[WavStft] Expected mono samples, got %d channels\n", data->nr_of_channels);
+        return -1;
+    }
+    int result = wav_stft_push(sink->stft, data->m_data, data->nr_of_samples, sink->function, sink->context);
+    if (result < 0) {
+        return -1;
+    }
+    sink->stopped = result;
+    return result;
+}
+
+// Resample the decoder with a mono resampler and analyze the output with
+// 'stft' in the same pass, 'function' is called for every frame. Returns the
+// amount of frames or -1 on failure
+static inline long wav_stft_analyze(WavDecoder* decoder, WavResampler* resampler, WavStft* stft, WavStftFrameFunction function,
+                                    void* context) {
+    if (resampler->channels != 1) {
+        fprintf(stderr, "[WavStft] The resampler has to produce mono, not %d channels\n", resampler->channels);
+        return -1;
+    }
+
+    WavData out;
+    wav_data_init(&out);
+    wav_stft_reset(stft);
+
+    StftSink sink = {stft, function, context, 0};
+    size_t total_samples;
+    long result = wav_resample_to(decoder, resampler, &out, stft_sink, &sink, &total_samples);
+    wav_data_free(&out);
+
+    if (result < 0) {
+        return -1;
+    }
+
+    if (!sink.stopped && wav_stft_flush(stft, function, context) < 0) {
+        return -1;
+    }
+
+    return (long)stft->frames;
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Work-stealing thread pool for a fixed set of tasks
+//
+// Every worker owns a deque of tasks. A worker takes its own tasks from the
+// back and, once its deque is empty, steals from the front of another worker's
+// deque. Long and short tasks even out without a single shared queue every
+// worker has to contend on.
+
+typedef void (*WorkFunction)(void* task, size_t worker, void* context);
+
+typedef struct {
+    pthread_mutex_t m_lock;
+    void** m_tasks;
+    size_t m_head;  // Next task to steal
+    size_t m_tail;  // One past the next task the owner takes
+} WorkDeque;
+
+typedef struct {
+    size_t nr_of_workers;
+    WorkDeque* m_deques;
+    WorkFunction function;
+    void* context;
+} WorkPool;
+
+typedef struct {
+    WorkPool* pool;
+    size_t index;
+} WorkPoolWorker;
+
+static inline int work_deque_pop_back(WorkDeque* deque, void** task) {
+    int found = 0;
+    pthread_mutex_lock(&deque->m_lock);
+    if (deque->m_tail > deque->m_head) {
+        *task = deque->m_tasks[--deque->m_tail];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->m_lock);
+    return found;
+}
+
+static inline int work_deque_steal(WorkDeque* deque, void** task) {
+    int found = 0;
+    pthread_mutex_lock(&deque->m_lock);
+    if (deque->m_tail > deque->m_head) {
+        *task = deque->m_tasks[deque->m_head++];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->m_lock);
+    return found;
+}
+
+static void* work_pool_worker(void* arg) {
+    WorkPoolWorker* worker = (WorkPoolWorker*)arg;
+    WorkPool* pool = worker->pool;
+    const size_t workers = pool->nr_of_workers;
+
+    // Victims are visited starting at a different worker for every thread
+    size_t victim = worker->index;
+
+    for (;;) {
+        void* task;
+        if (work_deque_pop_back(&pool->m_deques[worker->index], &task)) {
+            pool->function(task, worker->index, pool->context);
+            continue;
+        }
+
+        // No tasks are added while running, so when every deque is empty we are done
+        int stolen = 0;
+        for (size_t i = 1; i < workers && !stolen; i++) {
+            victim = (victim + 1) % workers;
+            if (victim != worker->index && work_deque_steal(&pool->m_deques[victim], &task)) {
+                stolen = 1;
+            }
+        }
+
+        if (!stolen) {
+            break;
+        }
+
+        pool->function(task, worker->index, pool->context);
+    }
+
+    return NULL;
+}
+
+// Run 'function' for every task on 'workers' threads and wait until all tasks
+// are done. The worker index passed to the function can be used to look up
+// per thread state
+static inline int work_pool_run(size_t workers, void** tasks, size_t nr_of_tasks, WorkFunction function, void* context) {
+    if (workers == 0) {
+        workers = 1;
+    }
+
+    WorkPool pool;
+    pool.nr_of_workers = workers;
+    pool.function = function;
+    pool.context = context;
+    pool.m_deques = (WorkDeque*)calloc(workers, sizeof(WorkDeque));
+
+    WorkPoolWorker* states = (WorkPoolWorker*)calloc(workers, sizeof(WorkPoolWorker));
+    pthread_t* threads = (pthread_t*)calloc(workers, sizeof(pthread_t));
+    void** storage = (void**)malloc(sizeof(void*) * (nr_of_tasks + 1));
+
+    if (pool.m_deques == NULL || states == NULL || threads == NULL || storage == NULL) {
+        fprintf(stderr, "[WorkPool] Unable to allocate memory for %zu workers\n", workers);
+        free(pool.m_deques);
+        free(states);
+        free(threads);
+        free(storage);
+        return 1;
+    }
+
+    // Deal the tasks out in contiguous blocks, one block per worker
+    size_t offset = 0;
+    for (size_t w = 0; w < workers; w++) {
+        size_t count = nr_of_tasks / workers + (w < nr_of_tasks % workers ? 1 : 0);
+
+        WorkDeque* deque = &pool.m_deques[w];
+        pthread_mutex_init(&deque->m_lock, NULL);
+        deque->m_tasks = storage + offset;
+        deque->m_head = 0;
+        deque->m_tail = count;
+
+        // The owner takes tasks from the back, reverse them to keep the given order
+        for (size_t i = 0; i < count; i++) {
+            deque->m_tasks[i] = tasks[offset + count - 1 - i];
+        }
+        offset += count;
+    }
+
+    size_t started = 0;
+    for (size_t w = 0; w < workers; w++) {
+        states[w].pool = &pool;
+        states[w].index = w;
+        if (pthread_create(&threads[w], NULL, work_pool_worker, &states[w])) {
+            fprintf(stderr, "[WorkPool] Unable to start worker thread %zu\n", w);
+            break;
+        }
+        started++;
+    }
+
+    // Without any thread the tasks would never run, do them here instead
+    if (started == 0) {
+        work_pool_worker(&states[0]);
+    }
+
+    for (size_t w = 0; w < started; w++) {
+        pthread_join(threads[w], NULL);
+    }
+
+    for (size_t w = 0; w < workers; w++) {
+        pthread_mutex_destroy(&pool.m_deques[w].m_lock);
+    }
+
+    free(pool.m_deques);
+    free(states);
+    free(threads);
+    free(storage);
+
+    return 0;
+}